@@ -20,6 +20,10 @@
  * 02.22.2015- CC Hsiao <erichsiao815@gmail.com>
  * - act state default is 1 and backup act state.
  * - pwm_enable will change the act state to 0 and let pwm pin output low.
+ *
+ * - step pulse trains: pwm_pulse_train(), pwm_pulse_count(), pwm_pulse_train_stop().
+ * - sim=1 maps the timer and port io blocks to a register file in memory.
+ * - pwm_config() keeps ns resolution and uses the undivided 24 MHz clock.
 
  *
  * TODO:
@@ -62,6 +66,11 @@
 #include <linux/kdev_t.h> 
 #include <plat/system.h>
 #include <plat/sys_config.h>
+#include <linux/ktime.h>
+#include <linux/spinlock.h>
+#include <linux/pwm_pulse_train.h>
+#include <linux/math64.h>
+#include <asm/div64.h>
 
 #include "pwm-sunxi.h" 
 /* 
@@ -90,6 +99,38 @@ static struct class pwm_class;
 
 void *PWM_CTRL_REG_BASE = NULL; 
 
+static bool sim;
+module_param(sim, bool, S_IRUGO);
+MODULE_PARM_DESC(sim, "use a register file in memory instead of the timer and port io blocks");
+
+static u32 pwm_sim_timer_regs[0x400 / 4];
+static u32 pwm_sim_portc_regs[0x400 / 4];
+
+static void *pwm_ioremap(unsigned long phys, u32 *sim_regs)
+{
+	if (sim)
+		return sim_regs;
+	return ioremap(phys, 0x400);
+}
+
+/* settings of pwm_config(), used instead of the us fields while valid */
+struct sunxi_pwm_ns {
+	unsigned int	entire;		/* cycles, the register holds entire - 1 */
+	unsigned int	active;
+	bool		valid;
+};
+
+static struct sunxi_pwm_ns pwm_ns[SUN4I_MAX_HARDWARE_PWM_CHANNELS];
+
+/* sysfs wrote a us setting, go back to the prescaler table */
+static void pwm_ns_drop(struct sun4i_pwm_available_channel *chan)
+{
+	if(pwm_ns[chan->channel].valid) {
+		pwm_ns[chan->channel].valid = false;
+		chan->prescale = pwm_get_best_prescale(chan->period);
+	}
+}
+
 
 static struct class_attribute pwm_class_attrs[] = { 
 	__ATTR_NULL 
@@ -275,7 +316,7 @@ static int __init sunxi_pwm_init(void)
 
 void sunxi_pwm_exit(void) 
 { 
-	void *timer_base = ioremap(SW_PA_TIMERC_IO_BASE, 0x400); 
+	void *timer_base = pwm_ioremap(SW_PA_TIMERC_IO_BASE, pwm_sim_timer_regs); 
 	void *PWM_CTRL_REG_BASE = timer_base + 0x200; 
 
 	if (pwm0) {
@@ -414,6 +455,7 @@ static ssize_t pwm_period_store(struct device *dev,struct device_attribute *attr
 			chan->duty = period; 
 		} 
 		chan->period = period; 
+		pwm_ns[chan->channel].valid = false;
 		chan->prescale = pwm_get_best_prescale(period); 
 		fixup_duty(chan); 
 		if(chan->duty) { 
@@ -432,6 +474,7 @@ static ssize_t pwm_duty_store(struct device *dev,struct device_attribute *attr,
 	duty = duty > chan->period ? chan->period : duty; 
 	chan->duty_percent = -1; /* disable duty_percent if duty is set by hand */ 
 	chan->duty = duty; 
+	pwm_ns_drop(chan);
 	pwm_set_mode(NO_ENABLE_CHANGE,chan); 
 	return size; 
 }
@@ -628,6 +671,7 @@ static ssize_t pwm_duty_percent_store(struct device *dev,struct device_attribute
 		size = -EINVAL; 
 	} else { 
 		chan->duty_percent = duty_percent; 
+		pwm_ns_drop(chan);
 		if(chan->period) { 
 			fixup_duty(chan); 
 			pwm_set_mode(NO_ENABLE_CHANGE,chan); 
@@ -658,10 +702,75 @@ static ssize_t pwm_pulse_store(struct device *dev,struct device_attribute *attr,
 	return status; 
 } 
 
+/*
+ * ns resolution
+ *
+ * The us settings above step the finest prescaler, 5 us per cycle, so a
+ * 20 kHz pwm has 10 duty steps. The prescaler field also takes 0x0f, the
+ * undivided 24 MHz clock; pwm_config() and the pulse trains pick the
+ * finest clock whose counter holds the period, 41.7 ns steps up to 2.7 ms.
+ */
+
+#define PWM_PRESCALE_NONE	0x0f		/* 24 MHz input clock, no prescaler */
+
+/* tried from the finest to the coarsest clock, 5..7 are invalid */
+static const unsigned char pwm_clock_prescale[] = {PWM_PRESCALE_NONE, 0, 1, 2, 3, 4, 8, 9, 10, 11, 12};
+
+static unsigned int pwm_clock_divisor(unsigned int prescale)
+{
+	if(prescale == PWM_PRESCALE_NONE)
+		return 1;
+	return prescale_divisor[prescale];
+}
+
+/* ns of count cycles of the 24 MHz clock divided by divisor */
+static unsigned long pwm_cycles_to_ns(u64 cycles, unsigned int divisor)
+{
+	u64 ns = cycles * divisor * 1000;
+
+	do_div(ns, 24);
+	return (unsigned long)ns;
+}
+
+/* ns to the nearest cycle of the clock divided by divisor */
+static u64 pwm_ns_to_cycles(unsigned long ns, unsigned int divisor)
+{
+	u64 cycles = (u64)ns * 24 + divisor * 500;
+
+	do_div(cycles, divisor * 1000);
+	return cycles;
+}
+
+/* cycles of period_ns on the finest clock that holds it, 0 if none does */
+static u64 pwm_period_cycles(unsigned long period_ns, unsigned int *prescale, unsigned int *divisor)
+{
+	u64 cycles;
+	int i;
+
+	for(i = 0; i < ARRAY_SIZE(pwm_clock_prescale); i++) {
+		*prescale = pwm_clock_prescale[i];
+		*divisor = pwm_clock_divisor(*prescale);
+		cycles = pwm_ns_to_cycles(period_ns, *divisor);
+		if(cycles <= MAX_CYCLES + 1)
+			return cycles;
+	}
+	return 0;
+}
+
 int pwm_set_period_and_duty(struct sun4i_pwm_available_channel *chan) { 
 	int return_val = -EINVAL; 
-	unsigned int entire_cycles = get_entire_cycles(chan); 
-	unsigned int active_cycles = get_active_cycles(chan); 
+	unsigned int entire_cycles;
+	unsigned int active_cycles;
+
+	if(pwm_ns[chan->channel].valid) {
+		chan->period_reg.initializer = 0;
+		chan->period_reg.s.pwm_entire_cycles = pwm_ns[chan->channel].entire - 1;
+		chan->period_reg.s.pwm_active_cycles = pwm_ns[chan->channel].active;
+		writel(chan->period_reg.initializer, chan->period_reg_addr);
+		return 0;
+	}
+	entire_cycles = get_entire_cycles(chan); 
+	active_cycles = get_active_cycles(chan); 
 	chan->period_reg.initializer = 0; 
 	if(entire_cycles >= active_cycles && active_cycles) { 
 		chan->period_reg.s.pwm_entire_cycles = entire_cycles; 
@@ -675,6 +784,37 @@ int pwm_set_period_and_duty(struct sun4i_pwm_available_channel *chan) {
 } 
 
 
+/*
+ * Route the channel pin to the pwm, the caller writes pin_current.
+ */
+static void pwm_select_pin(struct sun4i_pwm_available_channel *chan) { 
+	chan->pin_current.initializer = readl(chan->pin_addr); 
+	if(chan->pin_mask.s0.pin0_select) { 
+		chan->pin_current.s0.pin0_select = SELECT_PWM; 
+	} 
+	if(chan->pin_mask.s0.pin1_select) { 
+		chan->pin_current.s0.pin1_select = SELECT_PWM; 
+	} 
+	if(chan->pin_mask.s0.pin2_select) { 
+		chan->pin_current.s0.pin2_select = SELECT_PWM; 
+	} 
+	if(chan->pin_mask.s0.pin3_select) { 
+		chan->pin_current.s0.pin3_select = SELECT_PWM; 
+	} 
+	if(chan->pin_mask.s0.pin4_select) { 
+		chan->pin_current.s0.pin4_select = SELECT_PWM; 
+	} 
+	if(chan->pin_mask.s0.pin5_select) { 
+		chan->pin_current.s0.pin5_select = SELECT_PWM; 
+	} 
+	if(chan->pin_mask.s0.pin6_select) { 
+		chan->pin_current.s0.pin6_select = SELECT_PWM; 
+	} 
+	if(chan->pin_mask.s0.pin7_select) { 
+		chan->pin_current.s0.pin7_select = SELECT_PWM; 
+	} 
+}
+
 ssize_t pwm_set_mode(unsigned int enable, struct sun4i_pwm_available_channel *chan) { 
 	ssize_t status = 0; 
 	if(enable == NO_ENABLE_CHANGE) { 
@@ -717,31 +857,7 @@ ssize_t pwm_set_mode(unsigned int enable, struct sun4i_pwm_available_channel *ch
 			return status; 
 		} 
 		//writel(chan->ctrl_current.initializer,chan->ctrl_addr); 
-		chan->pin_current.initializer = readl(chan->pin_addr); 
-		if(chan->pin_mask.s0.pin0_select) { 
-			chan->pin_current.s0.pin0_select = SELECT_PWM; 
-		} 
-		if(chan->pin_mask.s0.pin1_select) { 
-			chan->pin_current.s0.pin1_select = SELECT_PWM; 
-		} 
-		if(chan->pin_mask.s0.pin2_select) { 
-			chan->pin_current.s0.pin2_select = SELECT_PWM; 
-		} 
-		if(chan->pin_mask.s0.pin3_select) { 
-			chan->pin_current.s0.pin3_select = SELECT_PWM; 
-		} 
-		if(chan->pin_mask.s0.pin4_select) { 
-			chan->pin_current.s0.pin4_select = SELECT_PWM; 
-		} 
-		if(chan->pin_mask.s0.pin5_select) { 
-			chan->pin_current.s0.pin5_select = SELECT_PWM; 
-		} 
-		if(chan->pin_mask.s0.pin6_select) { 
-			chan->pin_current.s0.pin6_select = SELECT_PWM; 
-		} 
-		if(chan->pin_mask.s0.pin7_select) { 
-			chan->pin_current.s0.pin7_select = SELECT_PWM; 
-		} 
+		pwm_select_pin(chan);
 		if(chan->channel == 0) { 
 			chan->ctrl_current.s.ch0_prescaler = chan->prescale; 
 		} else { 
@@ -797,9 +913,9 @@ ssize_t pwm_set_mode(unsigned int enable, struct sun4i_pwm_available_channel *ch
 
 
 void pwm_setup_available_channels( void ) { 
-	void * timer_base = ioremap(SW_PA_TIMERC_IO_BASE, 0x400);  /* 0x01c20c00 */ 
+	void * timer_base = pwm_ioremap(SW_PA_TIMERC_IO_BASE, pwm_sim_timer_regs);  /* 0x01c20c00 */ 
 	void * PWM_CTRL_REG_BASE = timer_base + 0x200;	     /* 0x01c20e00 */ 
-	void * portc_io_base = ioremap(SW_PA_PORTC_IO_BASE,0x400); /* 0x01c20800 */ 
+	void * portc_io_base = pwm_ioremap(SW_PA_PORTC_IO_BASE, pwm_sim_portc_regs); /* 0x01c20800 */ 
 	void * PB_CFG0_REG = (portc_io_base + 0x24);	       /* 0x01C20824 */ 
 	void * PI_CFG0_REG = (portc_io_base + 0x120);	      /* 0x01c20920 */ 
 
@@ -893,25 +1009,49 @@ struct pwm_device *pwm_request(int pwm_id, const char *label)
 EXPORT_SYMBOL(pwm_request); 
 
 
+/**
+ * pwm_config - set the active time and the period
+ * @pwm: the pwm
+ * @duty_ns: active time, 0 keeps the pin at the inactive level
+ * @period_ns: pwm period
+ *
+ * Both are rounded to the nearest cycle of the finest clock that holds
+ * the period. The us period, duty and duty_percent in sysfs are kept as
+ * a view of the setting.
+ */
 int pwm_config(struct pwm_device *pwm, int duty_ns, int period_ns) 
 { 
-	unsigned long duty = duty_ns / 1000; 
-	unsigned long period = period_ns / 1000; 
+	struct sun4i_pwm_available_channel *chan;
+	struct sunxi_pwm_ns *ns;
+	unsigned int prescale = PWM_PRESCALE_NONE;
+	unsigned int divisor = 1;
+	u64 entire;
+	u64 active;
 
-	if (pwm == NULL || period_ns == 0 || duty_ns > period_ns) 
+	if (pwm == NULL || period_ns <= 0 || duty_ns < 0 || duty_ns > period_ns) 
 		return -EINVAL; 
+	chan = pwm->chan;
+	ns = &pwm_ns[chan->channel];
+
+	entire = pwm_period_cycles(period_ns, &prescale, &divisor);
+	if(entire < 2)
+		return -ERANGE;
+	active = pwm_ns_to_cycles(duty_ns, divisor);
+	if(active > entire)
+		active = entire;
+
+	ns->entire = entire;
+	ns->active = active;
+	ns->valid = true;
+	chan->period = period_ns / 1000;
+	chan->duty = duty_ns / 1000;
+	chan->duty_percent = (int)div_u64((u64)duty_ns * 100, period_ns);
+	chan->prescale = prescale;
+	pwm_set_mode(NO_ENABLE_CHANGE,chan); 
 
-	pwm->chan->period = period; 
-	duty = duty > ULONG_MAX ? ULONG_MAX : duty; 
-	duty = duty > period ? period : duty; 
-	pwm->chan->duty = duty; 
-	pwm->chan->prescale = pwm_get_best_prescale(pwm->chan->period); 
-	//pwm->chan->duty_percent = -1; /* disable duty_percent if duty is set by hand */ 
-	pwm->chan->duty_percent = (duty * 100) / period; 
-	//fixup_duty(pwm->chan); 
-	pwm_set_mode(NO_ENABLE_CHANGE,pwm->chan); 
-
-	printk("%s duty percent %d\n",__func__, pwm->chan->duty_percent);
+#ifdef SUNXI_PWM_DEBUG
+	printk("%s prescale %x, %u/%u cycles\n",__func__, prescale, (unsigned int)active, (unsigned int)entire);
+#endif
 	return 0; 
 } 
 EXPORT_SYMBOL(pwm_config); 
@@ -947,6 +1087,168 @@ void pwm_free(struct pwm_device *pwm)
 } 
 EXPORT_SYMBOL(pwm_free); 
 
+/*
+ * Step pulse trains
+ *
+ * Pulse mode (chX_mode = 1) emits a single pulse per write of
+ * chX_pulse_start, which is no cheaper than toggling a gpio per step. A
+ * train of step pulses is cycle mode with the active cycles set to the
+ * pulse width, so the pwm steps on its own until it is disabled. The
+ * controller has no pulse counter; pwm_pulse_count() derives the count
+ * from the period and prescaler registers and the time since the start.
+ */
+
+struct sunxi_pwm_train {
+	ktime_t		start;
+	unsigned long	pulses;		/* count when the train was stopped */
+	bool		running;
+};
+
+static struct sunxi_pwm_train pwm_train[SUN4I_MAX_HARDWARE_PWM_CHANNELS];
+static DEFINE_SPINLOCK(pwm_train_lock);
+
+static unsigned long pwm_train_count(struct sun4i_pwm_available_channel *chan)
+{
+	struct sunxi_pwm_train *train = &pwm_train[chan->channel];
+	union u_sun4i_pwm_ctrl ctrl;
+	unsigned int period_reg;
+	unsigned int prescale;
+	unsigned int entire;
+	unsigned long period_ns;
+	s64 elapsed;
+
+	if(!train->running)
+		return train->pulses;
+
+	ctrl.initializer = readl(chan->ctrl_addr);
+	if(chan->channel == 0) {
+		if(!ctrl.s.ch0_en)
+			return train->pulses;
+		prescale = ctrl.s.ch0_prescaler;
+	} else {
+		if(!ctrl.s.ch1_en)
+			return train->pulses;
+		prescale = ctrl.s.ch1_prescaler;
+	}
+	period_reg = readl(chan->period_reg_addr);
+	entire = (period_reg >> 16) + 1;		/* 0 is 1 cycle */
+	period_ns = pwm_cycles_to_ns(entire, pwm_clock_divisor(prescale));
+	if(period_ns == 0)
+		return train->pulses;
+
+	elapsed = ktime_to_ns(ktime_sub(ktime_get(), train->start));
+	if(elapsed < 0)
+		return 0;
+	/* the first pulse starts with the enable */
+	return (unsigned long)div64_u64((u64)elapsed, period_ns) + 1;
+}
+
+/**
+ * pwm_pulse_train - emit step pulses until pwm_pulse_train_stop()
+ * @pwm: the pwm, requested with pwm_request()
+ * @pulse_ns: minimum pulse width, rounded up to the pwm clock
+ * @period_ns: pulse period, rounded to the pwm clock
+ * @actual_ns: if not NULL, the period the pwm really runs at
+ *
+ * Does not sleep, it may be called from a hrtimer.
+ */
+int pwm_pulse_train(struct pwm_device *pwm, unsigned long pulse_ns, unsigned long period_ns,
+		unsigned long *actual_ns)
+{
+	struct sun4i_pwm_available_channel *chan;
+	struct sunxi_pwm_train *train;
+	unsigned int prescale = PWM_PRESCALE_NONE;
+	unsigned int divisor = 1;
+	u64 cycles;
+	u64 active;
+	unsigned long flags;
+
+	if (pwm == NULL || period_ns == 0 || pulse_ns >= period_ns)
+		return -EINVAL;
+	chan = pwm->chan;
+	train = &pwm_train[chan->channel];
+
+	cycles = pwm_period_cycles(period_ns, &prescale, &divisor);
+	active = (u64)pulse_ns * 24 + divisor * 1000 - 1;	/* round up */
+	do_div(active, divisor * 1000);
+	if(cycles < 2 || active == 0 || active >= cycles)
+		return -ERANGE;
+
+	spin_lock_irqsave(&pwm_train_lock, flags);
+	chan->period_reg.initializer = 0;
+	chan->period_reg.s.pwm_entire_cycles = cycles - 1;
+	chan->period_reg.s.pwm_active_cycles = active;
+	writel(chan->period_reg.initializer, chan->period_reg_addr);
+
+	pwm_select_pin(chan);
+	writel(chan->pin_current.initializer,chan->pin_addr);
+
+	switch (chan->channel) {
+	case 0:
+		chan->ctrl_current.s.ch0_prescaler = prescale;
+		chan->ctrl_current.s.ch0_act_state = chan->ctrl_backup.s.ch0_act_state;
+		chan->ctrl_current.s.ch0_mode = 0;		/* cycle mode */
+		chan->ctrl_current.s.ch0_pulse_start = 0;
+		chan->ctrl_current.s.ch0_en = 1;
+		chan->ctrl_current.s.ch0_clk_gating = 1;
+		break;
+	case 1:
+		chan->ctrl_current.s.ch1_prescaler = prescale;
+		chan->ctrl_current.s.ch1_act_state = chan->ctrl_backup.s.ch1_act_state;
+		chan->ctrl_current.s.ch1_mode = 0;
+		chan->ctrl_current.s.ch1_pulse_start = 0;
+		chan->ctrl_current.s.ch1_en = 1;
+		chan->ctrl_current.s.ch1_clk_gating = 1;
+		break;
+	}
+	writel(chan->ctrl_current.initializer,chan->ctrl_addr);
+	train->start = ktime_get();
+	train->pulses = 0;
+	train->running = true;
+	spin_unlock_irqrestore(&pwm_train_lock, flags);
+
+	if(actual_ns)
+		*actual_ns = pwm_cycles_to_ns(cycles, divisor);
+	return 0;
+}
+EXPORT_SYMBOL(pwm_pulse_train);
+
+/**
+ * pwm_pulse_count - pulses emitted by the current or last pulse train
+ * @pwm: the pwm
+ */
+unsigned long pwm_pulse_count(struct pwm_device *pwm)
+{
+	unsigned long flags;
+	unsigned long count;
+
+	spin_lock_irqsave(&pwm_train_lock, flags);
+	count = pwm_train_count(pwm->chan);
+	spin_unlock_irqrestore(&pwm_train_lock, flags);
+	return count;
+}
+EXPORT_SYMBOL(pwm_pulse_count);
+
+/**
+ * pwm_pulse_train_stop - stop a pulse train and freeze its count
+ * @pwm: the pwm
+ *
+ * Does not sleep. The pin is left on the pwm function.
+ */
+void pwm_pulse_train_stop(struct pwm_device *pwm)
+{
+	struct sun4i_pwm_available_channel *chan = pwm->chan;
+	struct sunxi_pwm_train *train = &pwm_train[chan->channel];
+	unsigned long flags;
+
+	spin_lock_irqsave(&pwm_train_lock, flags);
+	train->pulses = pwm_train_count(chan);
+	train->running = false;
+	pwm_set_mode(PWM_CTRL_DISABLE,chan);
+	spin_unlock_irqrestore(&pwm_train_lock, flags);
+}
+EXPORT_SYMBOL(pwm_pulse_train_stop);
+
 
 module_init(sunxi_pwm_init); 
 module_exit(sunxi_pwm_exit); 
@@ -15,182 +15,88 @@
 #include <linux/irq.h>
 #include <linux/delay.h>
 #include <mach/irqs.h>
-#include <linux/workqueue.h>
 #include <linux/hrtimer.h>
 #include <linux/platform_device.h>
 #include <linux/motor.h>
+#include <linux/motor_stepper.h>
 
 
 #define MOTOR_NAME		"28BYJ-48"
 
-#define		STEP_SEQ		4
-
 #define	MOTOR_AP_PIN			18
 #define	MOTOR_BP_PIN			23
 #define	MOTOR_AM_PIN			24
 #define	MOTOR_BM_PIN			25
 
-struct hrtimer motor_28byj_hrtimer;
-
-int motor_28byj_Step =0;
-
-int stepTable_2_phase[STEP_SEQ] =
-{
-	0x03,	// 0011
-	0x06,	// 0110
-	0x0c,	// 1100
-	0x09,	// 1001
-};
-	
-char motor_28byj_stepNum = 0;
-unsigned int motor_28byj_pps = 200;
-
-
-static void motor_28byj_StepSequence(int seq)
-{
-	if((seq < 0) || (seq >= STEP_SEQ))
-	{	//standby
-		gpio_direction_output(MOTOR_AP_PIN,0);
-		gpio_direction_output(MOTOR_BP_PIN,0);
-		gpio_direction_output(MOTOR_AM_PIN,0);
-		gpio_direction_output(MOTOR_BM_PIN,0);
-	}
-	else
-	{
-		gpio_direction_output(MOTOR_AP_PIN,stepTable_2_phase[seq]&0x01? 1:0);
-		gpio_direction_output(MOTOR_BP_PIN,stepTable_2_phase[seq]&0x02? 1:0);
-		gpio_direction_output(MOTOR_AM_PIN,stepTable_2_phase[seq]&0x04? 1:0);
-		gpio_direction_output(MOTOR_BM_PIN,stepTable_2_phase[seq]&0x08? 1:0);
-	}
-}
-
-struct work_struct motor_28byj_work;
-static void motor_28byj_handler(struct work_struct *work)
-{
-	if(motor_28byj_Step==0)
-	{
-		motor_28byj_StepSequence(-1);
-	}
-	else
-	{
-		motor_28byj_StepSequence(motor_28byj_stepNum & (STEP_SEQ-1));
-	}
-}
-
-
-enum hrtimer_restart motor_28byj_moving(struct hrtimer *timer)
-{
-	if(motor_28byj_Step>0){
-		if(motor_28byj_Step< 204000)	motor_28byj_Step--;
-		motor_28byj_stepNum--;
-	}
-	else if(motor_28byj_Step<0)
-	{
-		if(motor_28byj_Step> -204000)	motor_28byj_Step++;
-		motor_28byj_stepNum++;
-	}
-	schedule_work(&motor_28byj_work);	
-	//motor_handler(NULL);
-	if(motor_28byj_Step!=0)	
-	{
-		hrtimer_forward_now(&motor_28byj_hrtimer, ktime_set( 0, 1000000000/motor_28byj_pps ));
-		return HRTIMER_RESTART;
-	}
-	else
-	{
-		return HRTIMER_NORESTART;
-	}
-}
-
-
-#ifdef CONFIG_MOTOR_SYS_28BYJ_48
-static void motor_28byj_ctl(struct motor_classdev *motor_cdev,enum motor_state ctrl, int step)
-{
-	//int step=204000;
-
-	switch(ctrl)
-	{
-		case MOTOR_FORWARD:
-			motor_28byj_Step = step;
-			break;
-		case MOTOR_BACKWARD:
-			motor_28byj_Step = -step;
-			break;
-		default:
-		case MOTOR_STANDBY:
-			motor_28byj_Step = 0;
-			break;
-	}
-		
-	if(motor_28byj_Step!=0)
-	{
-		ktime_t itv_time = ktime_set( 1, 0 );
-		if(hrtimer_active(&motor_28byj_hrtimer) == HRTIMER_STATE_INACTIVE )
-		{
-			hrtimer_start(&motor_28byj_hrtimer, itv_time, HRTIMER_MODE_REL);
-			motor_28byj_handler(NULL);
-		}
-	}
-}
+static bool threaded;
+module_param(threaded, bool, S_IRUGO);
+MODULE_PARM_DESC(threaded, "drive the coils from the output thread even if the gpios do not sleep");
 
-static enum motor_state	 motor_28byj_getstate(struct motor_classdev *led_cdev)
+static inline void motor_28byj_gpio_set(struct motor_stepper *stp, unsigned gpio, int value)
 {
-	if(motor_28byj_Step > 0)
-		return MOTOR_FORWARD;
-	else if(motor_28byj_Step < 0)
-		return MOTOR_BACKWARD;
+	if(stp->cansleep)
+		gpio_set_value_cansleep(gpio, value);
 	else
-		return MOTOR_STANDBY;
+		gpio_set_value(gpio, value);
 }
 
-
-static void motor_28byj_setspeed(struct motor_classdev *motor_cdev,unsigned int speed)
+/* only the coils that changed since the last step are written */
+static void motor_28byj_set_phase_mask(struct motor_stepper *stp, unsigned int mask)
 {
-	if((speed >0) &&(speed <= 5000))
-	{
-		motor_28byj_pps = speed;
-	}
+	unsigned int changed = mask ^ stp->phase;
+
+	if(changed & MOTOR_COIL_A)
+		motor_28byj_gpio_set(stp, MOTOR_AP_PIN, mask & MOTOR_COIL_A ? 1:0);
+	if(changed & MOTOR_COIL_B)
+		motor_28byj_gpio_set(stp, MOTOR_BP_PIN, mask & MOTOR_COIL_B ? 1:0);
+	if(changed & MOTOR_COIL_AN)
+		motor_28byj_gpio_set(stp, MOTOR_AM_PIN, mask & MOTOR_COIL_AN ? 1:0);
+	if(changed & MOTOR_COIL_BN)
+		motor_28byj_gpio_set(stp, MOTOR_BM_PIN, mask & MOTOR_COIL_BN ? 1:0);
 }
 
-static unsigned int motor_28byj_getspeed(struct motor_classdev *motor_cdev)
+static const struct motor_stepper_ops motor_28byj_ops = {
+	.set_phase_mask	= motor_28byj_set_phase_mask,
+};
+	
+static struct motor_stepper motor_28byj_stepper =
 {
-	return motor_28byj_pps;
-}
-
-static struct motor_classdev		motor_28byj_classdev =
+	.cdev	=
 {
 	.name	= MOTOR_NAME,
 	.type	= MOTOR_TYPE_STEPPER,
 	.flags	= MOTOR_SUSPEND_SUPPORT,
-	.setspeed	= motor_28byj_setspeed,
-	.getspeed	= motor_28byj_getspeed,
-	.ctl		= motor_28byj_ctl,
-	.getstate	= motor_28byj_getstate,
+	},
+	.ops	= &motor_28byj_ops,
+	.mode	= MOTOR_STEPPER_FULL_STEP,
+	.pps	= 200,
 };
 
+
+#ifdef CONFIG_MOTOR_SYS_28BYJ_48
 static int __devinit motor_28byj_probe(struct platform_device *pdev)
 {
 	int ret =0;
 
-	ret = motor_classdev_register(&pdev->dev, &motor_28byj_classdev);
+	ret = motor_stepper_register(&pdev->dev, &motor_28byj_stepper);
 	if (ret) {
-		dev_err(&pdev->dev, "failed to register motor %s\n",motor_28byj_classdev.name);
+		dev_err(&pdev->dev, "failed to register motor %s\n",motor_28byj_stepper.cdev.name);
 		goto err;
 	}
-	platform_set_drvdata(pdev, &motor_28byj_classdev);
-	printk("register motor %s succeeded\r\n",motor_28byj_classdev.name);
+	platform_set_drvdata(pdev, &motor_28byj_stepper);
+	printk("register motor %s succeeded\r\n",motor_28byj_stepper.cdev.name);
 
 	return 0;
 err:
-	printk("register motor %s failed\r\n",motor_28byj_classdev.name);
+	printk("register motor %s failed\r\n",motor_28byj_stepper.cdev.name);
 	return ret;
 }
 
 static int __exit motor_28byj_remove(struct platform_device *pdev)
 {
-	struct motor_classdev	*motor = platform_get_drvdata(pdev);
+	struct motor_stepper	*stepper = platform_get_drvdata(pdev);
 
-	motor_classdev_unregister(motor);
+	motor_stepper_unregister(stepper);
 
 	printk(" motor removed\n");
 	return 0;
@@ -214,16 +120,7 @@ static ssize_t motor_28byj_ctl_store(struct class *class, struct class_attribute
 	
 	sscanf(buf, "%d", & step);
 
-	motor_28byj_Step = step;
-	if(motor_28byj_Step!=0)
-	{
-		ktime_t itv_time = ktime_set( 1, 0 );
-		if(hrtimer_active(&motor_28byj_hrtimer) == HRTIMER_STATE_INACTIVE )
-		{
-			hrtimer_start(&motor_28byj_hrtimer, itv_time, HRTIMER_MODE_REL);
-			motor_28byj_handler(NULL);
-		}
-	}
+	motor_stepper_move(&motor_28byj_stepper, step);
 	return count;
 }
 
@@ -232,11 +129,13 @@ static ssize_t motor_28byj_ctl_store(struct class *class, struct class_attribute
 static ssize_t motor_28byj_state_show(struct class *class, struct class_attribute *attr, 
 			char *buf)
 {
+	int step = motor_stepper_remaining(&motor_28byj_stepper);
+
 	//printk("In %s function\n",__func__);
-	if(motor_28byj_Step > 0)
-		sprintf(buf, "forward %d\n", (int)abs(motor_28byj_Step));
-	else if(motor_28byj_Step < 0)
-		sprintf(buf, "backward %d\n", (int)abs(motor_28byj_Step));
+	if(step > 0)
+		sprintf(buf, "forward %d\n", (int)abs(step));
+	else if(step < 0)
+		sprintf(buf, "backward %d\n", (int)abs(step));
 	else
 		sprintf(buf, "standby\n");
 	
@@ -251,7 +150,7 @@ static ssize_t motor_28byj_frequence_store(struct class *class, struct class_att
 	sscanf(buf, "%d", &hz);
 	if((hz >0) &&(hz <= 5000))
 	{
-		motor_28byj_pps = hz;
+		motor_stepper_setspeed(&motor_28byj_stepper, hz);
 	}
 	return count;
 }
@@ -261,7 +160,7 @@ static ssize_t motor_28byj_frequence_store(struct class *class, struct class_att
 static ssize_t motor_28byj_frequence_show(struct class *class, struct class_attribute *attr, 
 			char *buf)
 {
-	sprintf(buf, "%d\n", motor_28byj_pps);
+	sprintf(buf, "%d\n", motor_28byj_stepper.pps);
 	
 	return strlen(buf);
 }
@@ -287,6 +186,20 @@ static int motor_28byj_init(void)
 {
 	int status;
 	
+	gpio_request(MOTOR_AP_PIN, "motor A+ test");
+	gpio_request(MOTOR_BP_PIN, "motor B+ test");
+	gpio_request(MOTOR_AM_PIN, "motor A- test");
+	gpio_request(MOTOR_BM_PIN, "motor B- test");
+	gpio_direction_output(MOTOR_AP_PIN,0);
+	gpio_direction_output(MOTOR_BP_PIN,0);
+	gpio_direction_output(MOTOR_AM_PIN,0);
+	gpio_direction_output(MOTOR_BM_PIN,0);
+	motor_28byj_stepper.start_delay = ktime_set( 1, 0 );
+	// gpios behind a sleeping controller cannot be driven from the step timer
+	motor_28byj_stepper.cansleep = threaded ||
+		gpio_cansleep(MOTOR_AP_PIN) || gpio_cansleep(MOTOR_BP_PIN) ||
+		gpio_cansleep(MOTOR_AM_PIN) || gpio_cansleep(MOTOR_BM_PIN);
+
 #ifdef CONFIG_MOTOR_SYS_28BYJ_48
 	pmotor_28byj_dev = platform_device_register_simple(MOTOR_NAME, -1, NULL, 0); 
 	if (IS_ERR(pmotor_28byj_dev))
@@ -295,36 +208,33 @@ static int motor_28byj_init(void)
 	status = platform_driver_register(&motor_28byj_driver);
 	if (status) {
 		pr_err("Unable to register platform driver\n");
-		goto exit;
+		goto exit_unregister;
 	}
 #else
+	status = motor_stepper_init(&motor_28byj_stepper);
+	if (status < 0)
+		goto exit;
+
 	status = class_register(&motor_28byj_drv);
 	if (status < 0)
 	{
 		printk("Registering Class Failed\n");
-		goto exit;
+		goto exit_release;
 	}
 #endif
-
-	gpio_request(MOTOR_AP_PIN, "motor A+ test");
-	gpio_request(MOTOR_BP_PIN, "motor B+ test");
-	gpio_request(MOTOR_AM_PIN, "motor A- test");
-	gpio_request(MOTOR_BM_PIN, "motor B- test");
-	if (status < 0)
-	{
-		printk("gpio request Failed\n");
-		goto exit_unregister;
-	}
-	motor_28byj_StepSequence(-1);
-	INIT_WORK(&motor_28byj_work, motor_28byj_handler);
-	
-	hrtimer_init(&motor_28byj_hrtimer, CLOCK_REALTIME, HRTIMER_MODE_REL);
-	motor_28byj_hrtimer.function = motor_28byj_moving;
 	return 0;
+#ifdef CONFIG_MOTOR_SYS_28BYJ_48
 exit_unregister:
 	platform_device_unregister( pmotor_28byj_dev);
-	platform_driver_unregister(&motor_28byj_driver);
+#else
+exit_release:
+	motor_stepper_release(&motor_28byj_stepper);
+#endif
 exit:
+	gpio_free(MOTOR_AP_PIN);
+	gpio_free(MOTOR_BP_PIN);
+	gpio_free(MOTOR_AM_PIN);
+	gpio_free(MOTOR_BM_PIN);
 	return -1;
 
 }
@@ -332,19 +242,17 @@ exit:
 
 static void motor_28byj_exit(void)
 {
-	motor_28byj_StepSequence(-1);
-	gpio_free(MOTOR_AP_PIN);
-	gpio_free(MOTOR_BP_PIN);
-	gpio_free(MOTOR_AM_PIN);
-	gpio_free(MOTOR_BM_PIN);
-	hrtimer_cancel(&motor_28byj_hrtimer);
-	cancel_work_sync(&motor_28byj_work);
 #ifdef CONFIG_MOTOR_SYS_28BYJ_48
-	platform_device_unregister( pmotor_28byj_dev);
 	platform_driver_unregister(&motor_28byj_driver);
+	platform_device_unregister( pmotor_28byj_dev);
 #else
 	class_unregister(&motor_28byj_drv);
+	motor_stepper_release(&motor_28byj_stepper);
 #endif 
+	gpio_free(MOTOR_AP_PIN);
+	gpio_free(MOTOR_BP_PIN);
+	gpio_free(MOTOR_AM_PIN);
+	gpio_free(MOTOR_BM_PIN);
 	printk(" GoodBye, %s\n",MOTOR_NAME);
 }
 
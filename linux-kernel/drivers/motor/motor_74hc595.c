@@ -0,0 +1,468 @@
+/*
+ * 	motor_74hc595.c
+ *
+ * Copyright (C) 2015 Eric Hsiao <erichsiao815@gmail.com>
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ *
+ * Stepper fan-out on a chain of 74HC595 shift registers driven by spi:
+ *
+ *		MOSI : SER of the first register, QH' to SER of the next
+ *		SCLK : SRCLK of all registers
+ *		CS   : RCLK of all registers, the frame is latched on its rising edge
+ *		MISO : QH' of the last register (optional, for the loopback check)
+ *
+ * Every register drives two steppers through their coil drivers (ULN2003,
+ * L293D, ...): channel n uses pins 4n..4n+3 as A, B, /A, /B, where pin p is
+ * output Q(p % 8) of register p / 8, register 0 being next to the spi
+ * master. The chain is a step engine output port, so each tick the coil
+ * masks of all channels are composed into one frame and pushed with a
+ * single spi transfer.
+ *
+ * With sim=1 no spi device is used; the transfer is replaced by a model
+ * costing overhead_us + bits / spi clock, and the shifted out data is
+ * checked like a wired loopback. The stats attribute of the platform
+ * device reports frames per second and channels per frame:
+ *
+ *	modprobe motor_74hc595 sim=1
+ *	echo forward 204000 > /sys/class/motor/stepper0/ctrl
+ *	cat /sys/devices/platform/74HC595/stats
+ */
+
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/device.h>
+#include <linux/slab.h>
+#include <linux/delay.h>
+#include <linux/ktime.h>
+#include <linux/platform_device.h>
+#include <linux/spi/spi.h>
+#include <linux/motor.h>
+#include <linux/motor_stepper.h>
+#include <asm/div64.h>
+
+
+#define MOTOR_NAME		"74HC595"
+
+static bool sim;
+module_param(sim, bool, S_IRUGO);
+MODULE_PARM_DESC(sim, "use the simulated spi target instead of a spi device");
+
+static bool loopback;
+module_param(loopback, bool, S_IRUGO);
+MODULE_PARM_DESC(loopback, "QH' of the last register is wired to MISO, check every frame");
+
+static unsigned int overhead_us = 10;
+module_param(overhead_us, uint, S_IRUGO);
+MODULE_PARM_DESC(overhead_us, "fixed cost of one simulated transfer");
+
+static unsigned int tick_us = 500;
+module_param(tick_us, uint, S_IRUGO);
+MODULE_PARM_DESC(tick_us, "step tick of the chain");
+
+
+
+struct hc595_chdata {
+	int ch;
+	bool use;
+	const char *name;
+	enum motor_type type;
+	int flag;
+	unsigned int pps;
+	unsigned pin;			// first chain pin, A B /A /B follow
+	// step engine
+	struct motor_stepper stepper;
+};
+
+struct hc595_platdata {
+	int num_ch;
+	int num_regs;			// registers in the chain
+	u16 bus_num;
+	u16 chip_select;
+	u32 max_speed_hz;
+	struct hc595_chdata *data;
+};
+
+struct hc595_stats {
+	unsigned long	frames;
+	unsigned long	bytes;
+	unsigned long	loopback_errors;
+	u64		bus_ns;
+	ktime_t		since;
+};
+
+struct hc595_chain {
+	struct motor_stepper_port port;
+	struct hc595_platdata *pdata;
+	struct spi_device *spi;
+	u8		*tx;
+	u8		*rx;
+	u8		*last;			// frame pushed by the previous transfer
+	u8		*sim_regs;		// shift stages of the simulated chain
+	unsigned long	sim_ns;		// cost of one simulated transfer
+	struct hc595_stats stats;
+};
+
+
+static void _hc595_bus_delay(unsigned long ns)
+{
+	if(ns >= 10 * NSEC_PER_USEC)
+		usleep_range(ns / NSEC_PER_USEC, ns / NSEC_PER_USEC + 1);
+	else
+		ndelay(ns);
+}
+
+/* shift tx into the simulated chain, the stages falling off the end come back on rx */
+static void _hc595_sim_transfer(struct hc595_chain *chain, int len)
+{
+	memcpy(chain->rx, chain->sim_regs, len);
+	memcpy(chain->sim_regs, chain->tx, len);
+	_hc595_bus_delay(chain->sim_ns);
+}
+
+static int _hc595_spi_transfer(struct hc595_chain *chain, int len)
+{
+	struct spi_transfer t = {
+		.tx_buf	= chain->tx,
+		.rx_buf	= loopback ? chain->rx : NULL,
+		.len	= len,
+	};
+	struct spi_message m;
+
+	spi_message_init(&m);
+	spi_message_add_tail(&t, &m);
+	return spi_sync(chain->spi, &m);
+}
+
+static int hc595_write(struct motor_stepper_port *port, const unsigned long *value,
+			const unsigned long *changed)
+{
+	struct hc595_chain *chain = port->priv;
+	int len = chain->pdata->num_regs;
+	unsigned int pin;
+	int reg;
+	int ret = 0;
+	ktime_t start = ktime_get();
+
+	// the last register of the chain is shifted out first
+	for(reg = 0; reg < len; reg++)
+	{
+		pin = reg * 8;
+		chain->tx[len - 1 - reg] = (value[pin / BITS_PER_LONG] >> (pin % BITS_PER_LONG)) & 0xff;
+	}
+
+	if(sim)
+		_hc595_sim_transfer(chain, len);
+	else
+		ret = _hc595_spi_transfer(chain, len);
+	if(ret)
+		return ret;
+
+	if((sim || loopback) && (chain->stats.frames > 0) && memcmp(chain->rx, chain->last, len))
+		chain->stats.loopback_errors++;
+	memcpy(chain->last, chain->tx, len);
+
+	chain->stats.frames++;
+	chain->stats.bytes += len;
+	chain->stats.bus_ns += ktime_to_ns(ktime_sub(ktime_get(), start));
+	return 0;
+}
+
+static const struct motor_stepper_port_ops hc595_port_ops = {
+	.write	= hc595_write,
+};
+
+/* the coils are bits of the chain, written by the port; nothing to enable */
+static const struct motor_stepper_ops hc595_stepper_ops = {
+};
+
+static ssize_t hc595_stats_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct hc595_chain *chain = dev_get_drvdata(dev);
+	struct motor_stepper_port_stats *ps = &chain->port.stats;
+	u64 elapsed_us = ktime_to_us(ktime_sub(ktime_get(), chain->stats.since));
+	u64 fps = 0;
+	unsigned long cpf_x100 = 0;
+
+	if(elapsed_us)
+		fps = div64_u64((u64)chain->stats.frames * USEC_PER_SEC, elapsed_us);
+	if(ps->flushes)
+		cpf_x100 = ps->updates * 100 / ps->flushes;
+
+	return sprintf(buf, "mode %s\nregisters %d\nframes %lu\nbytes %lu\nbus_ns %llu\n"
+			"loopback_errors %lu\nframes_per_sec %llu\nchannels_per_frame %lu.%02lu\n",
+			sim ? "sim" : "spi", chain->pdata->num_regs,
+			chain->stats.frames, chain->stats.bytes,
+			(unsigned long long)chain->stats.bus_ns, chain->stats.loopback_errors,
+			(unsigned long long)fps, cpf_x100 / 100, cpf_x100 % 100);
+}
+
+static ssize_t hc595_stats_store(struct device *dev, struct device_attribute *attr,
+			const char *buf, size_t count)
+{
+	struct hc595_chain *chain = dev_get_drvdata(dev);
+
+	mutex_lock(&chain->port.io_lock);
+	chain->stats.frames = 0;
+	chain->stats.bytes = 0;
+	chain->stats.loopback_errors = 0;
+	chain->stats.bus_ns = 0;
+	chain->stats.since = ktime_get();
+	chain->port.stats.updates = 0;
+	chain->port.stats.flushes = 0;
+	mutex_unlock(&chain->port.io_lock);
+	return count;
+}
+
+static DEVICE_ATTR(stats, S_IRUGO | S_IWUSR, hc595_stats_show, hc595_stats_store);
+
+static int _hc595_spi_get(struct platform_device *pdev, struct hc595_chain *chain)
+{
+	struct hc595_platdata *pdata = chain->pdata;
+	struct spi_master *master;
+	struct spi_board_info info = {
+		.modalias	= "74hc595",
+		.max_speed_hz	= pdata->max_speed_hz,
+		.bus_num	= pdata->bus_num,
+		.chip_select	= pdata->chip_select,
+		.mode		= SPI_MODE_0,
+	};
+
+	master = spi_busnum_to_master(pdata->bus_num);
+	if (master == NULL) {
+		dev_err(&pdev->dev, "spi bus %d not found\n", pdata->bus_num);
+		return -ENODEV;
+	}
+	chain->spi = spi_new_device(master, &info);
+	spi_master_put(master);
+	if (chain->spi == NULL) {
+		dev_err(&pdev->dev, "cannot add spi device %d.%d\n", pdata->bus_num, pdata->chip_select);
+		return -EBUSY;
+	}
+	chain->spi->bits_per_word = 8;
+	return spi_setup(chain->spi);
+}
+
+static int __devinit hc595_probe(struct platform_device *pdev)
+{
+	int ret =0;
+	int i = 0;
+	struct hc595_platdata *pdata = pdev->dev.platform_data; //dev_get_platdata(&pdev->dev);
+	struct hc595_chdata *chdata;
+	struct hc595_chain *chain;
+	u64 ns;
+
+	if (pdata == NULL) {
+		dev_err(&pdev->dev, "missing platform data\n");
+		return -ENODEV;
+	}
+
+	if ((pdata->num_ch < 1) || (pdata->num_regs < 1) || (pdata->max_speed_hz == 0)) {
+		dev_err(&pdev->dev, "Invalid chain: %d channels, %d registers\n", pdata->num_ch, pdata->num_regs);
+		return -EINVAL;
+	}
+
+	chain = kzalloc(sizeof(*chain) + 4 * pdata->num_regs, GFP_KERNEL);
+	if (chain == NULL)
+		return -ENOMEM;
+	chain->pdata = pdata;
+	chain->tx = (u8 *)(chain + 1);
+	chain->rx = chain->tx + pdata->num_regs;
+	chain->last = chain->rx + pdata->num_regs;
+	chain->sim_regs = chain->last + pdata->num_regs;
+
+	// 8 clocks per register plus the setup of the transfer
+	ns = (u64)pdata->num_regs * 8 * NSEC_PER_SEC;
+	do_div(ns, pdata->max_speed_hz);
+	chain->sim_ns = (unsigned long)ns + overhead_us * NSEC_PER_USEC;
+
+	if (!sim) {
+		ret = _hc595_spi_get(pdev, chain);
+		if (ret)
+			goto err_spi;
+	}
+
+	chain->port.name = MOTOR_NAME;
+	chain->port.owner = THIS_MODULE;
+	chain->port.ops = &hc595_port_ops;
+	chain->port.tick_ns = tick_us * NSEC_PER_USEC;
+	chain->port.width = pdata->num_regs * 8;
+	chain->port.priv = chain;
+	chain->stats.since = ktime_get();
+	ret = motor_stepper_port_register(&chain->port);
+	if (ret) {
+		dev_err(&pdev->dev, "failed to register output port\n");
+		goto err_spi;
+	}
+	platform_set_drvdata(pdev, chain);
+
+	for (i = 0; i < pdata->num_ch; i++)
+	{
+		chdata = &pdata->data[i];
+		if(chdata->use == 0)
+			continue;
+
+		chdata->stepper.ops = &hc595_stepper_ops;
+		chdata->stepper.port = &chain->port;
+		chdata->stepper.port_pin[0] = chdata->pin;
+		chdata->stepper.port_pin[1] = chdata->pin + 1;
+		chdata->stepper.port_pin[2] = chdata->pin + 2;
+		chdata->stepper.port_pin[3] = chdata->pin + 3;
+		chdata->stepper.cdev.name = chdata->name;
+		chdata->stepper.cdev.type = chdata->type;
+		chdata->stepper.cdev.flags = chdata->flag;
+		chdata->stepper.mode = MOTOR_STEPPER_HALF_STEP;
+		chdata->stepper.pps = chdata->pps;
+		chdata->stepper.start_delay = ktime_set( 0, 50000000 );		//50msec
+		chdata->stepper.priv = chdata;
+		ret = motor_stepper_register(&pdev->dev, &chdata->stepper);
+		if (ret) {
+			dev_err(&pdev->dev, "failed to register motor %s\n",chdata->name);
+			goto err;
+		}
+		printk("register motor %s succeeded\r\n",chdata->name);
+	}
+
+	ret = device_create_file(&pdev->dev, &dev_attr_stats);
+	if (ret)
+		goto err;
+	printk("%s: %d registers, %s, %lu ns per simulated frame\r\n", MOTOR_NAME,
+			pdata->num_regs, sim ? "sim" : "spi", chain->sim_ns);
+	return 0;
+err:
+	for (i = i - 1; i >= 0; i--) {
+		if(pdata->data[i].use == 0)
+			continue;
+		motor_stepper_unregister(&pdata->data[i].stepper);
+	}
+	motor_stepper_port_unregister(&chain->port);
+err_spi:
+	if (chain->spi)
+		spi_unregister_device(chain->spi);
+	kfree(chain);
+	printk("register motor failed\r\n");
+	return ret;
+}
+
+static int __exit hc595_remove(struct platform_device *pdev)
+{
+	struct hc595_chain *chain = platform_get_drvdata(pdev);
+	struct hc595_platdata *pdata = chain->pdata;
+	int i = 0;
+
+	device_remove_file(&pdev->dev, &dev_attr_stats);
+	for (i = 0; i < pdata->num_ch; i++)
+	{
+		if(pdata->data[i].use == 0)
+			continue;
+		motor_stepper_unregister(&pdata->data[i].stepper);
+		printk("motor %s removed \r\n",pdata->data[i].name);
+	}
+	motor_stepper_port_unregister(&chain->port);
+	if (chain->spi)
+		spi_unregister_device(chain->spi);
+	kfree(chain);
+	return 0;
+}
+
+static struct hc595_chdata hc595_data[] =
+{
+	{
+		.ch = 0,
+		.use = 1,
+		.name = "stepper0",
+		.type = MOTOR_TYPE_STEPPER,
+		.flag = MOTOR_SUSPEND_SUPPORT,
+		.pps = 200,
+		.pin = 0,
+	},
+	{
+		.ch = 1,
+		.use = 1,
+		.name = "stepper1",
+		.type = MOTOR_TYPE_STEPPER,
+		.flag = MOTOR_SUSPEND_SUPPORT,
+		.pps = 200,
+		.pin = 4,
+	},
+	{
+		.ch = 2,
+		.use = 1,
+		.name = "stepper2",
+		.type = MOTOR_TYPE_STEPPER,
+		.flag = MOTOR_SUSPEND_SUPPORT,
+		.pps = 200,
+		.pin = 8,
+	},
+	{
+		.ch = 3,
+		.use = 1,
+		.name = "stepper3",
+		.type = MOTOR_TYPE_STEPPER,
+		.flag = MOTOR_SUSPEND_SUPPORT,
+		.pps = 200,
+		.pin = 12,
+	},
+};
+
+static struct hc595_platdata hc595_platform_data =
+{
+	.num_ch = ARRAY_SIZE(hc595_data),
+	.num_regs = 2,
+	.bus_num = 0,
+	.chip_select = 0,
+	.max_speed_hz = 1000000,
+	.data = hc595_data,
+};
+
+static struct platform_driver hc595_platform_driver = {
+	.driver = {
+		.name = MOTOR_NAME,
+		.owner =	THIS_MODULE,
+	},
+	.probe 	=	hc595_probe,
+	.remove	=	hc595_remove,
+};
+
+struct platform_device *phc595_platform_device;
+
+
+static int motor_74hc595_init(void)
+{
+	int status;
+
+	phc595_platform_device = platform_device_register_simple(MOTOR_NAME, -1, NULL, 0);
+	if (IS_ERR(phc595_platform_device))
+		return PTR_ERR(phc595_platform_device);
+
+	phc595_platform_device->dev.platform_data = &hc595_platform_data;
+	status = platform_driver_register(&hc595_platform_driver);
+	if (status) {
+		pr_err("Unable to register platform driver\n");
+		platform_device_unregister(phc595_platform_device);
+		return status;
+	}
+	return 0;
+}
+
+static void motor_74hc595_exit(void)
+{
+	platform_driver_unregister(&hc595_platform_driver);
+	phc595_platform_device->dev.platform_data = NULL;
+	platform_device_unregister( phc595_platform_device);
+	printk(" GoodBye, %s\n",MOTOR_NAME);
+}
+
+
+
+module_init( motor_74hc595_init);
+module_exit( motor_74hc595_exit);
+
+MODULE_AUTHOR("Eric Hsiao, erichsiao815@gmail.com");
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("74HC595 shift register chain for stepper motor fan-out");
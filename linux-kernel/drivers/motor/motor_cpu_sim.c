@@ -0,0 +1,312 @@
+/*
+ * 	motor_cpu_sim.c
+ *
+ * Copyright (C) 2015 Eric Hsiao <erichsiao815@gmail.com>
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ *
+ * Step jitter under interrupt load, with the step timers pinned or not
+ * ("cpu-sim"). A hrtimer on load_cpu stands in for a busy network irq: it
+ * fires every load_us and spins load_ns in hard irq context. N simulated
+ * coil steppers are started from load_cpu, like from a driver running
+ * there, and every coil write is timed against its step deadline:
+ *
+ *	run   : write "pinned" to spread the step timers over the other
+ *		online cpus (motor_stepper_set_cpu), or "unpinned" to leave
+ *		them where they are started
+ *	stats : per mode, the steps, how late they came and how many of
+ *		them were taken on load_cpu
+ *
+ *	modprobe motor_cpu_sim motors=4 load_cpu=0
+ *	echo unpinned > /sys/class/cpu-sim/run
+ *	echo pinned > /sys/class/cpu-sim/run
+ *	cat /sys/class/cpu-sim/stats
+ */
+
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/device.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/delay.h>
+#include <linux/cpumask.h>
+#include <linux/workqueue.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/motor_stepper.h>
+#include <asm/div64.h>
+
+
+#define MOTOR_NAME		"cpu-sim"
+
+#define CPU_SIM_MAX_MOTORS	64
+
+enum {
+	CPU_SIM_UNPINNED,
+	CPU_SIM_PINNED,
+	CPU_SIM_MODES,
+};
+
+static const char * const cpu_sim_modes[CPU_SIM_MODES] = {
+	[CPU_SIM_UNPINNED]	= "unpinned",
+	[CPU_SIM_PINNED]	= "pinned",
+};
+
+static unsigned int motors = 4;
+module_param(motors, uint, S_IRUGO);
+MODULE_PARM_DESC(motors, "simulated steppers");
+
+static unsigned int pps = 2000;
+module_param(pps, uint, S_IRUGO);
+MODULE_PARM_DESC(pps, "step rate");
+
+static unsigned int load_cpu;
+module_param(load_cpu, uint, S_IRUGO);
+MODULE_PARM_DESC(load_cpu, "cpu taking the interrupt load");
+
+static unsigned int load_us = 50;
+module_param(load_us, uint, S_IRUGO);
+MODULE_PARM_DESC(load_us, "period of the load interrupt");
+
+static unsigned int load_ns = 20000;
+module_param(load_ns, uint, S_IRUGO);
+MODULE_PARM_DESC(load_ns, "time spent in each load interrupt");
+
+static unsigned int run_ms = 2000;
+module_param(run_ms, uint, S_IRUGO);
+MODULE_PARM_DESC(run_ms, "length of a run");
+
+struct cpu_sim_stats {
+	unsigned long	steps;
+	u64		late_ns;
+	unsigned int	late_ns_max;
+	unsigned long	on_load;		// steps taken on load_cpu
+};
+
+struct cpu_sim_motor {
+	struct motor_stepper	stepper;
+	struct cpu_sim_stats	stats[CPU_SIM_MODES];	// timer side, one cpu at a time
+};
+
+static struct cpu_sim_motor *cpu_sim_motors;
+static DEFINE_MUTEX(cpu_sim_lock);
+static struct hrtimer cpu_sim_load;
+static unsigned int cpu_sim_mode;
+
+static enum hrtimer_restart cpu_sim_load_handler(struct hrtimer *timer)
+{
+	ndelay(load_ns);
+	hrtimer_forward_now(timer, ns_to_ktime((u64)load_us * NSEC_PER_USEC));
+	return HRTIMER_RESTART;
+}
+
+/* from the step timer, sched still holds the deadline of this step */
+static void cpu_sim_set_phase_mask(struct motor_stepper *stp, unsigned int mask)
+{
+	struct cpu_sim_motor *m = stp->priv;
+	struct cpu_sim_stats *st = &m->stats[cpu_sim_mode];
+	s64 late;
+
+	if((mask == 0) || stp->start_pending)
+		return;			// released, or energized ahead of the move
+	late = ktime_to_ns(ktime_sub(ktime_get(), motor_stepper_sched_due(&stp->sched)));
+	if(late < 0)
+		late = 0;
+	st->steps++;
+	st->late_ns += late;
+	if(late > st->late_ns_max)
+		st->late_ns_max = (unsigned int)late;
+	if(smp_processor_id() == load_cpu)
+		st->on_load++;
+}
+
+static const struct motor_stepper_ops cpu_sim_ops = {
+	.set_phase_mask	= cpu_sim_set_phase_mask,
+};
+
+/* on load_cpu: the load, then the moves from the busy cpu */
+static long cpu_sim_start(void *arg)
+{
+	unsigned int i;
+
+	hrtimer_start(&cpu_sim_load, ns_to_ktime((u64)load_us * NSEC_PER_USEC),
+			HRTIMER_MODE_REL_PINNED);
+	for(i = 0; i < motors; i++)
+		motor_stepper_move(&cpu_sim_motors[i].stepper, MOTOR_STEPPER_CONTINUOUS);
+	return 0;
+}
+
+/* called with cpu_sim_lock held */
+static void cpu_sim_round(unsigned int mode)
+{
+	unsigned int i;
+	int cpu = load_cpu;
+
+	for(i = 0; i < motors; i++)
+	{
+		if(mode == CPU_SIM_PINNED)
+		{	// round robin over the cpus but load_cpu
+			do {
+				cpu = cpumask_next(cpu, cpu_online_mask);
+				if(cpu >= nr_cpu_ids)
+					cpu = cpumask_first(cpu_online_mask);
+			} while(cpu == load_cpu);
+			motor_stepper_set_cpu(&cpu_sim_motors[i].stepper, cpu);
+		}
+		else
+			motor_stepper_set_cpu(&cpu_sim_motors[i].stepper, -1);
+	}
+	cpu_sim_mode = mode;
+	work_on_cpu(load_cpu, cpu_sim_start, NULL);
+	msleep(run_ms);
+	for(i = 0; i < motors; i++)
+		motor_stepper_stop(&cpu_sim_motors[i].stepper);
+	hrtimer_cancel(&cpu_sim_load);
+}
+
+static ssize_t cpu_sim_run_store(struct class *class, struct class_attribute *attr,
+			const char *buf, size_t count)
+{
+	unsigned int mode;
+
+	for(mode = 0; mode < CPU_SIM_MODES; mode++)
+		if(sysfs_streq(buf, cpu_sim_modes[mode]))
+			break;
+	if(mode == CPU_SIM_MODES)
+		return -EINVAL;
+	if((mode == CPU_SIM_PINNED) && (num_online_cpus() < 2))
+		return -ENODEV;		// nowhere to go but load_cpu
+	if(mutex_lock_interruptible(&cpu_sim_lock))
+		return -ERESTARTSYS;
+	cpu_sim_round(mode);
+	mutex_unlock(&cpu_sim_lock);
+	return count;
+}
+
+static ssize_t cpu_sim_stats_show(struct class *class, struct class_attribute *attr,
+			char *buf)
+{
+	struct cpu_sim_stats sum;
+	struct cpu_sim_stats *st;
+	unsigned int mode, i;
+	ssize_t len = 0;
+	u64 avg;
+
+	mutex_lock(&cpu_sim_lock);
+	for(mode = 0; mode < CPU_SIM_MODES; mode++)
+	{
+		memset(&sum, 0, sizeof(sum));
+		for(i = 0; i < motors; i++)
+		{
+			st = &cpu_sim_motors[i].stats[mode];
+			sum.steps += st->steps;
+			sum.late_ns += st->late_ns;
+			sum.late_ns_max = max(sum.late_ns_max, st->late_ns_max);
+			sum.on_load += st->on_load;
+		}
+		avg = sum.late_ns;
+		if(sum.steps)
+			do_div(avg, sum.steps);
+		len += sprintf(buf + len, "%s_steps %lu\n%s_late_ns_avg %llu\n%s_late_ns_max %u\n"
+				"%s_on_load_cpu %lu\n",
+				cpu_sim_modes[mode], sum.steps, cpu_sim_modes[mode], (unsigned long long)avg,
+				cpu_sim_modes[mode], sum.late_ns_max, cpu_sim_modes[mode], sum.on_load);
+	}
+	mutex_unlock(&cpu_sim_lock);
+	return len;
+}
+
+static ssize_t cpu_sim_stats_store(struct class *class, struct class_attribute *attr,
+			const char *buf, size_t count)
+{
+	unsigned int i;
+
+	mutex_lock(&cpu_sim_lock);
+	for(i = 0; i < motors; i++)
+		memset(cpu_sim_motors[i].stats, 0, sizeof(cpu_sim_motors[i].stats));
+	mutex_unlock(&cpu_sim_lock);
+	return count;
+}
+
+static struct class_attribute cpu_sim_class_attr[] =
+{
+	__ATTR(run, S_IWUSR, NULL, cpu_sim_run_store),
+	__ATTR(stats, S_IRUGO| S_IWUSR, cpu_sim_stats_show, cpu_sim_stats_store),
+	__ATTR_NULL,
+};
+
+static struct class cpu_sim_class =
+{
+	.name = MOTOR_NAME,
+	.owner = THIS_MODULE,
+	.class_attrs = (struct class_attribute *) &cpu_sim_class_attr,
+};
+
+static void cpu_sim_release(unsigned int n)
+{
+	while(n--)
+		motor_stepper_release(&cpu_sim_motors[n].stepper);
+	kfree(cpu_sim_motors);
+}
+
+static int cpu_sim_init(void)
+{
+	struct motor_stepper *stp;
+	unsigned int i;
+	int status;
+
+	if((motors == 0) || (motors > CPU_SIM_MAX_MOTORS) || (pps == 0) ||
+		(pps > MOTOR_STEPPER_MAX_PPS) || (load_cpu >= nr_cpu_ids) || !cpu_online(load_cpu) ||
+		(load_ns >= load_us * NSEC_PER_USEC) || (run_ms == 0))
+		return -EINVAL;
+	cpu_sim_motors = kcalloc(motors, sizeof(*cpu_sim_motors), GFP_KERNEL);
+	if(cpu_sim_motors == NULL)
+		return -ENOMEM;
+	for(i = 0; i < motors; i++)
+	{
+		stp = &cpu_sim_motors[i].stepper;
+		stp->cdev.name = MOTOR_NAME;
+		stp->ops = &cpu_sim_ops;
+		stp->mode = MOTOR_STEPPER_HALF_STEP;
+		stp->pps = pps;
+		stp->start_delay = ktime_set(0, 0);
+		stp->priv = &cpu_sim_motors[i];
+		status = motor_stepper_init(stp);
+		if(status)
+		{
+			cpu_sim_release(i);
+			return status;
+		}
+	}
+	hrtimer_init(&cpu_sim_load, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	cpu_sim_load.function = cpu_sim_load_handler;
+
+	status = class_register(&cpu_sim_class);
+	if (status < 0)
+	{
+		printk("Registering Class Failed\n");
+		cpu_sim_release(motors);
+		return status;
+	}
+	return 0;
+}
+
+static void cpu_sim_exit(void)
+{
+	class_unregister(&cpu_sim_class);
+	hrtimer_cancel(&cpu_sim_load);
+	cpu_sim_release(motors);
+	printk(" GoodBye, %s\n",MOTOR_NAME);
+}
+
+module_init( cpu_sim_init);
+module_exit( cpu_sim_exit);
+
+MODULE_AUTHOR("Eric Hsiao, erichsiao815@gmail.com");
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("step jitter under interrupt load, pinned against unpinned step timers");
@@ -19,6 +19,10 @@
 #include <linux/hrtimer.h>
 #include <linux/platform_device.h>
 #include <linux/motor.h>
+#include <linux/motor_softpwm.h>
+#include <linux/motor_encoder.h>
+#include <linux/motor_pid.h>
+#include <linux/math64.h>
 
 
 #define MOTOR_NAME		"DC"
@@ -30,8 +34,46 @@
 
 
 int motor_dc_Step =0;
-	
-unsigned int motor_dtuty= 100;
+
+static unsigned int pwm_hz = 1000;
+module_param(pwm_hz, uint, S_IRUGO);
+MODULE_PARM_DESC(pwm_hz, "software pwm frequency of the speed pin");
+
+static unsigned int enc_a;
+module_param(enc_a, uint, S_IRUGO);
+MODULE_PARM_DESC(enc_a, "encoder A gpio, 0 without encoder");
+
+static unsigned int enc_b;
+module_param(enc_b, uint, S_IRUGO);
+MODULE_PARM_DESC(enc_b, "encoder B gpio");
+
+static unsigned int enc_cpr;
+module_param(enc_cpr, uint, S_IRUGO);
+MODULE_PARM_DESC(enc_cpr, "encoder counts (x4) per revolution");
+
+static struct motor_encoder motor_dc_encoder;
+static struct motor_pid motor_dc_pid;
+
+// speed pin setting, speed and pwm_hz are views of these
+static unsigned long motor_dc_period_ns;
+static unsigned long motor_dc_duty_ns;
+
+static enum motor_state motor_dc_state = MOTOR_STANDBY;
+
+static struct motor_softpwm motor_dc_pwm =
+{
+	.gpio	= MOTOR_PWM_PIN,
+};
+
+/* speed pin duty, 0 in standby */
+static int _motor_dc_duty(void)
+{
+	unsigned long duty = 0;
+
+	if(motor_dc_state != MOTOR_STANDBY)
+		duty = motor_dc_duty_ns;
+	return motor_softpwm_config(&motor_dc_pwm, duty, motor_dc_period_ns);
+}
 
 struct work_struct motor_dc_work;
 static void _motor_dc_ctrl(enum motor_state ctrl)
@@ -41,20 +83,21 @@ static void _motor_dc_ctrl(enum motor_state ctrl)
 		case MOTOR_FORWARD:
 			gpio_direction_output(MOTOR_P_PIN,1);
 			gpio_direction_output(MOTOR_M_PIN,0);
-			gpio_direction_output(MOTOR_PWM_PIN,1);
+			motor_dc_state = MOTOR_FORWARD;
 			break;
 		case MOTOR_BACKWARD:
 			gpio_direction_output(MOTOR_P_PIN,0);
 			gpio_direction_output(MOTOR_M_PIN,1);
-			gpio_direction_output(MOTOR_PWM_PIN,1);
+			motor_dc_state = MOTOR_BACKWARD;
 			break;
 		default:
 		case MOTOR_STANDBY:
 			gpio_direction_output(MOTOR_P_PIN,0);
 			gpio_direction_output(MOTOR_M_PIN,0);
-			gpio_direction_output(MOTOR_PWM_PIN,0);
+			motor_dc_state = MOTOR_STANDBY;
 			break;
 	}
+	_motor_dc_duty();
 }
 
 static void motor_dc_ctl(struct motor_classdev *motor_cdev,enum motor_state ctrl)
@@ -62,29 +105,94 @@ static void motor_dc_ctl(struct motor_classdev *motor_cdev,enum motor_state ctrl
 	_motor_dc_ctrl(ctrl);
 }
 
+/* e-stop, any context: coast, with the speed pin low until a new ctrl */
+static void motor_dc_estop_kill(struct motor_estop *me)
+{
+	if(enc_a && enc_b)
+		motor_pid_kill(&motor_dc_pid);	// or a sign flip drives it again
+	motor_dc_state = MOTOR_STANDBY;
+	motor_softpwm_config(&motor_dc_pwm, 0, motor_dc_period_ns);
+	gpio_set_value(MOTOR_P_PIN, 0);
+	gpio_set_value(MOTOR_M_PIN, 0);
+}
+
+static struct motor_estop motor_dc_estop =
+{
+	.kill	= motor_dc_estop_kill,
+};
+
 static enum motor_state	 motor_dc_getstate(struct motor_classdev *led_cdev)
 {
-	if(__gpio_get_value(MOTOR_PWM_PIN) && __gpio_get_value(MOTOR_P_PIN))
-		return MOTOR_FORWARD;
-	else if(__gpio_get_value(MOTOR_PWM_PIN) && __gpio_get_value(MOTOR_M_PIN))
-		return MOTOR_BACKWARD;
-	else
-		return MOTOR_STANDBY;
+	// the speed pin toggles with the pwm, keep the state ourselves
+	return motor_dc_state;
 }
 
 static void motor_dc_setspeed(struct motor_classdev *motor_cdev,unsigned int speed)
 {
 	if((speed >0) &&(speed <= 100))
 	{
-		motor_dtuty = speed;
+		motor_dc_duty_ns = div_u64((u64)motor_dc_period_ns * speed, 100);
+		_motor_dc_duty();
 	}
 }
 
 static unsigned int motor_dc_getspeed(struct motor_classdev *motor_cdev)
 {
-	return motor_dtuty;
+	return div_u64((u64)motor_dc_duty_ns * 100 + motor_dc_period_ns / 2, motor_dc_period_ns);
+}
+
+static int motor_dc_setduty(struct motor_classdev *motor_cdev, unsigned long duty_ns)
+{
+	if(duty_ns > motor_dc_period_ns)
+		return -EINVAL;
+	motor_dc_duty_ns = duty_ns;
+	return _motor_dc_duty();
 }
 
+static unsigned long motor_dc_getduty(struct motor_classdev *motor_cdev)
+{
+	return motor_dc_duty_ns;
+}
+
+/* a new period keeps the duty ratio */
+static int _motor_dc_period(unsigned long period_ns)
+{
+	if(period_ns < MOTOR_SOFTPWM_MIN_PERIOD_NS)
+		return -EINVAL;
+	motor_dc_duty_ns = div_u64((u64)motor_dc_duty_ns * period_ns, motor_dc_period_ns);
+	motor_dc_period_ns = period_ns;
+	pwm_hz = NSEC_PER_SEC / period_ns;
+	return _motor_dc_duty();
+}
+
+static int motor_dc_setperiod(struct motor_classdev *motor_cdev, unsigned long period_ns)
+{
+	return _motor_dc_period(period_ns);
+}
+
+static unsigned long motor_dc_getperiod(struct motor_classdev *motor_cdev)
+{
+	return motor_dc_period_ns;
+}
+
+static ssize_t motor_dc_pwm_hz_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", pwm_hz);
+}
+
+static ssize_t motor_dc_pwm_hz_store(struct device *dev, struct device_attribute *attr,
+			const char *buf, size_t count)
+{
+	unsigned long hz = 0;
+
+	sscanf(buf, "%lu", &hz);
+	if((hz == 0) || (_motor_dc_period(NSEC_PER_SEC / hz) < 0))
+		return -EINVAL;
+	return count;
+}
+
+static DEVICE_ATTR(pwm_hz, S_IRUGO | S_IWUSR, motor_dc_pwm_hz_show, motor_dc_pwm_hz_store);
+
 static struct motor_classdev		motor_dc_classdev =
 {
 	.name	= MOTOR_NAME,
@@ -92,6 +200,10 @@ static struct motor_classdev		motor_dc_classdev =
 	.flags	= MOTOR_SUSPEND_SUPPORT,
 	.setspeed	= motor_dc_setspeed,
 	.getspeed	= motor_dc_getspeed,
+	.setduty	= motor_dc_setduty,
+	.getduty	= motor_dc_getduty,
+	.setperiod	= motor_dc_setperiod,
+	.getperiod	= motor_dc_getperiod,
 	.ctl		= motor_dc_ctl,
 	.getstate	= motor_dc_getstate,
 };
@@ -100,12 +212,24 @@ static int __devinit motor_dc_probe(struct platform_device *pdev)
 {
 	int ret =0;
 
+	if(enc_a && enc_b)
+		motor_pid_init(&motor_dc_classdev, &motor_dc_pid);
 	ret = motor_classdev_register(&pdev->dev, &motor_dc_classdev);
 	if (ret) {
 		dev_err(&pdev->dev, "failed to register motor %s\n",motor_dc_classdev.name);
 		goto err;
 	}
 	platform_set_drvdata(pdev, &motor_dc_classdev);
+	device_create_file(motor_dc_classdev.dev, &dev_attr_pwm_hz);
+	if(enc_a && enc_b)
+	{
+		motor_dc_encoder.pin_a = enc_a;
+		motor_dc_encoder.pin_b = enc_b;
+		motor_dc_encoder.cpr = enc_cpr;
+		ret = motor_encoder_register(&motor_dc_classdev, &motor_dc_encoder);
+		if (ret)
+			dev_err(&pdev->dev, "motor %s: no encoder (%d)\n", motor_dc_classdev.name, ret);
+	}
 	printk("register motor %s succeeded\r\n",motor_dc_classdev.name);
 
 	return 0;
@@ -117,7 +241,12 @@ err:
 static int __exit motor_dc_remove(struct platform_device *pdev)
 {
 	struct motor_classdev	*motor = platform_get_drvdata(pdev);
-
+
+	if(motor->pid)
+		motor_pid_release(motor->pid);
+	if(motor->encoder)
+		motor_encoder_unregister(motor->encoder);
+	device_remove_file(motor->dev, &dev_attr_pwm_hz);
 	motor_classdev_unregister(motor);
 
 	printk(" motor removed\n");
@@ -140,6 +269,11 @@ static int motor_dc_init(void)
 {
 	int status;
 	
+	if ((pwm_hz == 0) || (NSEC_PER_SEC / pwm_hz < MOTOR_SOFTPWM_MIN_PERIOD_NS))
+		pwm_hz = 1000;
+	motor_dc_period_ns = NSEC_PER_SEC / pwm_hz;
+	motor_dc_duty_ns = motor_dc_period_ns;		// 100%
+
 	pmotor_dc_dev = platform_device_register_simple(MOTOR_NAME, -1, NULL, 0); 
 	if (IS_ERR(pmotor_dc_dev))
 		goto exit;
@@ -153,12 +287,15 @@ static int motor_dc_init(void)
 	gpio_request(MOTOR_P_PIN, "dc motor +");
 	gpio_request(MOTOR_M_PIN, "dc motor -");
 	gpio_request(MOTOR_PWM_PIN, "dc motor speed");
+	gpio_direction_output(MOTOR_PWM_PIN,0);
+	status = motor_softpwm_add(&motor_dc_pwm);
 	_motor_dc_ctrl(MOTOR_STANDBY);
 	if (status < 0)
 	{
 		printk("gpio request Failed\n");
 		goto exit_unregister;
 	}
+	motor_estop_register(&motor_dc_estop);
 	//INIT_WORK(&motor_dc_work, motor_dc_handler);
 	
 	return 0;
@@ -172,7 +309,9 @@ exit:
 
 static void motor_dc_exit(void)
 {
+	motor_estop_unregister(&motor_dc_estop);
 	_motor_dc_ctrl(MOTOR_STANDBY);
+	motor_softpwm_remove(&motor_dc_pwm);
 	//gpio_free(MOTOR_P_PIN);
 	//gpio_free(MOTOR_M_PIN);
 	//gpio_free(MOTOR_PWM_PIN);
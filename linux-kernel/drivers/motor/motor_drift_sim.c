@@ -0,0 +1,288 @@
+/*
+ * 	motor_drift_sim.c
+ *
+ * Copyright (C) 2015 Eric Hsiao <erichsiao815@gmail.com>
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ *
+ * Step timing drift simulation ("drift-sim"). Where the step deadlines of
+ * a long move end up, for the ways a step timer can be re-armed:
+ *
+ *	rearm    : the next expiry at now + period from the handler, every
+ *		   handler latency is added to all the steps after it
+ *	forward  : hrtimer_forward_now() by the period in whole ns, a grid
+ *		   that slips by the truncation of 1s / pps every step
+ *	absolute : the step engine's schedule, step n due at n * 1s / pps
+ *		   from the start of the move
+ *
+ * The virtual run takes the steps on a simulated clock, with a random
+ * handler latency of up to jitter_ns per expiry and every late_every-th
+ * expiry two periods late on top. The absolute deadlines come from the
+ * step engine itself (motor_stepper_sim_step()), late ones through its
+ * overrun policy, and each is checked to lie on the ideal grid and to be
+ * the first slot after the expiry. It reports the drift of the last step
+ * from its ideal time, the largest grid error of the absolute schedule
+ * (both must be 0), the overruns the engine counted and the deadlines
+ * that failed the check. The live
+ * run moves a simulated coil stepper live_steps steps through the real
+ * step timer and reports the error of its coil writes against the same
+ * ideal times, which stays within the timer latency however long it runs:
+ *
+ *	run   : write "virtual" or "live"
+ *	stats : the results of the last runs
+ *
+ *	modprobe motor_drift_sim steps=1000000 pps=3000
+ *	echo virtual > /sys/class/drift-sim/run
+ *	cat /sys/class/drift-sim/stats
+ */
+
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/device.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/completion.h>
+#include <linux/mutex.h>
+#include <linux/motor_stepper.h>
+#include <asm/div64.h>
+
+
+#define MOTOR_NAME		"drift-sim"
+
+#define DRIFT_SIM_MAX_STEPS	100000000
+
+static unsigned int steps = 1000000;
+module_param(steps, uint, S_IRUGO);
+MODULE_PARM_DESC(steps, "steps of the virtual move");
+
+static unsigned int pps = 3000;
+module_param(pps, uint, S_IRUGO);
+MODULE_PARM_DESC(pps, "step rate, best one that does not divide a second");
+
+static unsigned int jitter_ns = 20000;
+module_param(jitter_ns, uint, S_IRUGO);
+MODULE_PARM_DESC(jitter_ns, "largest simulated handler latency, less than a step period");
+
+static unsigned int late_every = 1000;
+module_param(late_every, uint, S_IRUGO);
+MODULE_PARM_DESC(late_every, "every so many virtual expiries come two periods late, 0 never");
+
+static unsigned int live_steps = 10000;
+module_param(live_steps, uint, S_IRUGO);
+MODULE_PARM_DESC(live_steps, "steps of the live move");
+
+static struct motor_stepper drift_sim_stepper;
+static DEFINE_MUTEX(drift_sim_lock);
+static struct completion drift_sim_done;
+
+/* virtual run */
+static s64 drift_sim_rearm_ns;
+static s64 drift_sim_forward_ns;
+static s64 drift_sim_absolute_ns;
+static u64 drift_sim_absolute_max;
+static unsigned long drift_sim_late;
+static unsigned long drift_sim_overruns;
+static unsigned long drift_sim_bad;
+
+/* live run, timer side */
+static unsigned int drift_sim_writes;
+static ktime_t drift_sim_t0;
+static s64 drift_sim_live_ns;
+static u64 drift_sim_live_max;
+
+static inline u64 drift_sim_ideal(u64 k)
+{
+	return div_u64(k * NSEC_PER_SEC, pps);
+}
+
+/* called with drift_sim_lock held, the stepper at rest */
+static void drift_sim_virtual(void)
+{
+	struct motor_stepper *stp = &drift_sim_stepper;
+	u64 period = NSEC_PER_SEC / pps;
+	unsigned long overruns = stp->stats.overruns;
+	ktime_t t0 = ktime_set(1, 0);		// the virtual clock, 0 is no start
+	ktime_t due = t0;
+	ktime_t now, next;
+	u64 rearm = 0;
+	u64 forward = 0;
+	u64 lat, t, j;
+	u32 seed = 1;
+	s64 err = 0;
+	unsigned int k;
+
+	drift_sim_absolute_max = 0;
+	drift_sim_late = 0;
+	drift_sim_bad = 0;
+	for(k = 1; k <= steps; k++)
+	{
+		seed = seed * 1664525 + 1013904223;
+		lat = (seed >> 8) % (jitter_ns + 1);
+		if(late_every && (k % late_every == 0))
+		{
+			lat += 2 * period;
+			drift_sim_late++;
+		}
+		rearm += lat + period;
+		forward += period;
+
+		now = ktime_add_ns(due, lat);
+		next = motor_stepper_sim_step(stp, (k == 1) ? t0 : ktime_set(0, 0), now);
+		if(ktime_to_ns(next) == 0)
+		{	// the overrun policy ended the move
+			drift_sim_bad++;
+			break;
+		}
+		t = ktime_to_ns(ktime_sub(next, t0));
+		j = div_u64(t * pps + NSEC_PER_SEC / 2, NSEC_PER_SEC);	// nearest step of the grid
+		err = (s64)t - (s64)drift_sim_ideal(j);
+		if(abs64(err) > drift_sim_absolute_max)
+			drift_sim_absolute_max = abs64(err);
+		if(err || (ktime_to_ns(next) < ktime_to_ns(now)) ||
+			(ktime_to_ns(next) > ktime_to_ns(now) + (s64)period + 1))
+			drift_sim_bad++;
+		due = next;
+		if(!(k & 0xfff))
+			cond_resched();		// up to DRIFT_SIM_MAX_STEPS in a sysfs store
+	}
+	drift_sim_overruns = stp->stats.overruns - overruns;
+	drift_sim_rearm_ns = rearm - (s64)drift_sim_ideal(steps);
+	drift_sim_forward_ns = forward - (s64)drift_sim_ideal(steps);
+	drift_sim_absolute_ns = err;
+}
+
+/* the first write energizes the coils, the steps follow; 0 releases them */
+static void drift_sim_set_phase_mask(struct motor_stepper *stp, unsigned int mask)
+{
+	ktime_t now = ktime_get();
+	s64 err;
+
+	if(mask == 0)
+	{
+		complete(&drift_sim_done);
+		return;
+	}
+	if(drift_sim_writes++ == 0)
+		return;
+	if(drift_sim_writes == 2)
+		drift_sim_t0 = now;
+	err = ktime_to_ns(ktime_sub(now, drift_sim_t0)) - (s64)drift_sim_ideal(drift_sim_writes - 2);
+	drift_sim_live_ns = err;
+	if(abs64(err) > drift_sim_live_max)
+		drift_sim_live_max = abs64(err);
+}
+
+static const struct motor_stepper_ops drift_sim_ops = {
+	.set_phase_mask	= drift_sim_set_phase_mask,
+};
+
+/* called with drift_sim_lock held */
+static int drift_sim_live(void)
+{
+	unsigned long timeout = msecs_to_jiffies(div_u64((u64)live_steps * MSEC_PER_SEC, pps) +
+			MSEC_PER_SEC);
+
+	drift_sim_writes = 0;
+	drift_sim_live_ns = 0;
+	drift_sim_live_max = 0;
+	init_completion(&drift_sim_done);
+	motor_stepper_move(&drift_sim_stepper, live_steps);
+	if(wait_for_completion_interruptible_timeout(&drift_sim_done, timeout) <= 0)
+	{
+		motor_stepper_stop(&drift_sim_stepper);
+		return -EINTR;
+	}
+	return 0;
+}
+
+static ssize_t drift_sim_run_store(struct class *class, struct class_attribute *attr,
+			const char *buf, size_t count)
+{
+	int ret = 0;
+
+	if(mutex_lock_interruptible(&drift_sim_lock))
+		return -ERESTARTSYS;
+	if(sysfs_streq(buf, "virtual"))
+		drift_sim_virtual();
+	else if(sysfs_streq(buf, "live"))
+		ret = drift_sim_live();
+	else
+		ret = -EINVAL;
+	mutex_unlock(&drift_sim_lock);
+	return ret < 0 ? ret : count;
+}
+
+static ssize_t drift_sim_stats_show(struct class *class, struct class_attribute *attr,
+			char *buf)
+{
+	return sprintf(buf, "steps %u\npps %u\njitter_ns %u\nrearm_drift_ns %lld\n"
+			"forward_drift_ns %lld\nabsolute_drift_ns %lld\nabsolute_err_ns_max %llu\n"
+			"late_expiries %lu\noverruns %lu\nbad_deadlines %lu\n"
+			"live_steps %u\nlive_drift_ns %lld\nlive_err_ns_max %llu\n",
+			steps, pps, jitter_ns, drift_sim_rearm_ns, drift_sim_forward_ns,
+			drift_sim_absolute_ns, drift_sim_absolute_max,
+			drift_sim_late, drift_sim_overruns, drift_sim_bad,
+			drift_sim_writes ? drift_sim_writes - 1 : 0,
+			drift_sim_live_ns, drift_sim_live_max);
+}
+
+static struct class_attribute drift_sim_class_attr[] =
+{
+	__ATTR(run, S_IWUSR, NULL, drift_sim_run_store),
+	__ATTR(stats, S_IRUGO, drift_sim_stats_show, NULL),
+	__ATTR_NULL,
+};
+
+static struct class drift_sim_class =
+{
+	.name = MOTOR_NAME,
+	.owner = THIS_MODULE,
+	.class_attrs = (struct class_attribute *) &drift_sim_class_attr,
+};
+
+static int drift_sim_init(void)
+{
+	struct motor_stepper *stp = &drift_sim_stepper;
+	int status;
+
+	if((steps == 0) || (steps > DRIFT_SIM_MAX_STEPS) || (pps == 0) ||
+		(pps > MOTOR_STEPPER_MAX_PPS) || (jitter_ns >= NSEC_PER_SEC / pps) ||
+		(live_steps == 0) || (live_steps >= MOTOR_STEPPER_CONTINUOUS))
+		return -EINVAL;
+	stp->cdev.name = MOTOR_NAME;
+	stp->ops = &drift_sim_ops;
+	stp->mode = MOTOR_STEPPER_HALF_STEP;
+	stp->pps = pps;
+	stp->start_delay = ktime_set(0, 0);
+	status = motor_stepper_init(stp);
+	if(status)
+		return status;
+
+	status = class_register(&drift_sim_class);
+	if (status < 0)
+	{
+		printk("Registering Class Failed\n");
+		motor_stepper_release(stp);
+		return status;
+	}
+	return 0;
+}
+
+static void drift_sim_exit(void)
+{
+	class_unregister(&drift_sim_class);
+	motor_stepper_release(&drift_sim_stepper);
+	printk(" GoodBye, %s\n",MOTOR_NAME);
+}
+
+module_init( drift_sim_init);
+module_exit( drift_sim_exit);
+
+MODULE_AUTHOR("Eric Hsiao, erichsiao815@gmail.com");
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("step timing drift simulation, absolute schedule against re-armed timers");
@@ -0,0 +1,359 @@
+/*
+ * 	motor_encoder.c
+ *
+ * Copyright (C) 2015 Eric Hsiao <erichsiao815@gmail.com>
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ *
+ * Quadrature decoder for motor class devices. A and B each interrupt on
+ * both edges; the handler reads the pair and looks the transition from
+ * the previous pair up in a 16 entry table (x4 decoding):
+ *
+ *	forward : 00 -> 01 -> 11 -> 10 -> 00
+ *	backward: 00 -> 10 -> 11 -> 01 -> 00
+ *
+ * A transition where A and B both changed lost an edge and is counted
+ * as an error. The pin read and the swap of the previous pair go under
+ * a raw spinlock, so handlers of A and B on two cpus apply their pairs
+ * in the order they read them; the counters are atomic64_t and readers
+ * take no lock.
+ *
+ * Velocity combines the edge count and the edge period (M/T method):
+ * once per window it divides the counts since the last window by the
+ * time between the last edges of the two windows. At high speed that is
+ * the count over the window, at low speed it is the period of the edges.
+ * A window without edges bounds the velocity by 1 / time since the last
+ * edge, so a stopped shaft decays to 0.
+ *
+ * An encoder with sim set has no gpios, its edges come from
+ * motor_encoder_sim_edge() through the same decoder (motor_encoder_sim).
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/init.h>
+#include <linux/device.h>
+#include <linux/gpio.h>
+#include <linux/interrupt.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/motor_encoder.h>
+
+
+#define MOTOR_ENCODER_ERR	2
+
+/* count delta of [previous AB << 2 | AB] */
+static const signed char motor_encoder_table[16] = {
+	 0, +1, -1, MOTOR_ENCODER_ERR,
+	-1,  0, MOTOR_ENCODER_ERR, +1,
+	+1, MOTOR_ENCODER_ERR,  0, -1,
+	MOTOR_ENCODER_ERR, -1, +1,  0,
+};
+
+/* called with enc->irq_lock held */
+static inline void _motor_encoder_decode(struct motor_encoder *enc, unsigned int ab)
+{
+	int delta = motor_encoder_table[(enc->state << 2) | ab];
+
+	enc->state = ab;
+	if(delta == 0)
+		return;
+	if(delta == MOTOR_ENCODER_ERR)
+	{
+		atomic64_inc(&enc->errors);
+		return;
+	}
+	if(enc->reverse)
+		delta = -delta;
+	atomic64_add(delta, &enc->count);
+	atomic64_set(&enc->edge_ns, ktime_to_ns(ktime_get()));
+	atomic64_inc(&enc->edges);
+}
+
+static inline unsigned int _motor_encoder_read(struct motor_encoder *enc)
+{
+	return (gpio_get_value(enc->pin_a) ? 2 : 0) | (gpio_get_value(enc->pin_b) ? 1 : 0);
+}
+
+static irqreturn_t motor_encoder_irq(int irq, void *dev_id)
+{
+	struct motor_encoder *enc = dev_id;
+	unsigned long flags;
+
+	atomic64_inc(&enc->irqs);
+	raw_spin_lock_irqsave(&enc->irq_lock, flags);
+	_motor_encoder_decode(enc, _motor_encoder_read(enc));
+	raw_spin_unlock_irqrestore(&enc->irq_lock, flags);
+	return IRQ_HANDLED;
+}
+
+/**
+ * motor_encoder_count - position in counts (x4)
+ * @enc: the encoder
+ */
+s64 motor_encoder_count(struct motor_encoder *enc)
+{
+	return atomic64_read(&enc->count);
+}
+EXPORT_SYMBOL_GPL(motor_encoder_count);
+
+/**
+ * motor_encoder_set_count - set the position, e.g. 0 at the home switch
+ * @enc: the encoder
+ * @count: new position in counts
+ *
+ * Edges counted meanwhile are kept, the velocity is not disturbed.
+ */
+void motor_encoder_set_count(struct motor_encoder *enc, s64 count)
+{
+	unsigned long flags;
+	s64 prev;
+
+	spin_lock_irqsave(&enc->lock, flags);
+	prev = atomic64_xchg(&enc->count, count);
+	enc->win_count += count - prev;
+	spin_unlock_irqrestore(&enc->lock, flags);
+}
+EXPORT_SYMBOL_GPL(motor_encoder_set_count);
+
+/**
+ * motor_encoder_velocity - velocity in counts per second
+ * @enc: the encoder
+ *
+ * Takes a new estimate when the window has passed since the last one,
+ * otherwise returns the last estimate. The count and the edge time are
+ * read separately, an edge between the two reads moves one count to the
+ * next window.
+ */
+s64 motor_encoder_velocity(struct motor_encoder *enc)
+{
+	unsigned long window = enc->window_ns ? enc->window_ns : MOTOR_ENCODER_WINDOW_NS;
+	unsigned long flags;
+	s64 now, count, edge, bound, velocity;
+
+	spin_lock_irqsave(&enc->lock, flags);
+	now = ktime_to_ns(ktime_get());
+	if(now - enc->win_ns >= window)
+	{
+		count = atomic64_read(&enc->count);
+		edge = atomic64_read(&enc->edge_ns);
+		if((count != enc->win_count) && (edge > enc->win_edge_ns))
+		{
+			enc->velocity = div64_s64((count - enc->win_count) * NSEC_PER_SEC,
+						edge - enc->win_edge_ns);
+			enc->win_count = count;
+			enc->win_edge_ns = edge;
+		}
+		else if(now > enc->win_edge_ns)
+		{	// no edge, the next one is at least now - last edge away
+			bound = div64_s64(NSEC_PER_SEC, now - enc->win_edge_ns);
+			if(enc->velocity > bound)
+				enc->velocity = bound;
+			else if(enc->velocity < -bound)
+				enc->velocity = -bound;
+		}
+		enc->win_ns = now;
+	}
+	velocity = enc->velocity;
+	spin_unlock_irqrestore(&enc->lock, flags);
+	return velocity;
+}
+EXPORT_SYMBOL_GPL(motor_encoder_velocity);
+
+/**
+ * motor_encoder_sim_edge - feed one edge to a simulated encoder
+ * @enc: an encoder registered with sim set
+ * @dir: > 0 forward, otherwise backward
+ *
+ * One caller at a time per encoder.
+ */
+void motor_encoder_sim_edge(struct motor_encoder *enc, int dir)
+{
+	static const unsigned char gray[4] = {0, 1, 3, 2};
+	unsigned long flags;
+
+	raw_spin_lock_irqsave(&enc->irq_lock, flags);
+	enc->sim_phase = (enc->sim_phase + (dir > 0 ? 1 : 3)) & 3;
+	_motor_encoder_decode(enc, gray[enc->sim_phase]);
+	raw_spin_unlock_irqrestore(&enc->irq_lock, flags);
+}
+EXPORT_SYMBOL_GPL(motor_encoder_sim_edge);
+
+static ssize_t motor_encoder_count_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct motor_classdev *motor_cdev = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%lld\n", (long long)motor_encoder_count(motor_cdev->encoder));
+}
+
+static ssize_t motor_encoder_count_store(struct device *dev, struct device_attribute *attr,
+			const char *buf, size_t count)
+{
+	struct motor_classdev *motor_cdev = dev_get_drvdata(dev);
+	long long pos;
+
+	if(sscanf(buf, "%lld", &pos) != 1)
+		return -EINVAL;
+	motor_encoder_set_count(motor_cdev->encoder, pos);
+	return count;
+}
+
+static ssize_t motor_encoder_velocity_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct motor_classdev *motor_cdev = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%lld\n", (long long)motor_encoder_velocity(motor_cdev->encoder));
+}
+
+static ssize_t motor_encoder_stats_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct motor_classdev *motor_cdev = dev_get_drvdata(dev);
+	struct motor_encoder *enc = motor_cdev->encoder;
+	s64 velocity = motor_encoder_velocity(enc);
+	s64 rpm = 0;
+
+	if(enc->cpr)
+		rpm = div64_s64(velocity * 60, enc->cpr);
+	return sprintf(buf, "count %lld\nvelocity %lld\nrpm %lld\nedges %llu\nerrors %llu\nirqs %llu\n",
+			(long long)motor_encoder_count(enc), (long long)velocity, (long long)rpm,
+			(unsigned long long)atomic64_read(&enc->edges),
+			(unsigned long long)atomic64_read(&enc->errors),
+			(unsigned long long)atomic64_read(&enc->irqs));
+}
+
+static struct device_attribute motor_encoder_attrs_count =
+	__ATTR(encoder_count, S_IRUGO|S_IWUSR, motor_encoder_count_show, motor_encoder_count_store);
+
+static struct device_attribute motor_encoder_attrs_velocity =
+	__ATTR(encoder_velocity, S_IRUGO, motor_encoder_velocity_show, NULL);
+
+static struct device_attribute motor_encoder_attrs_stats =
+	__ATTR(encoder_stats, S_IRUGO, motor_encoder_stats_show, NULL);
+
+static void _motor_encoder_free(struct motor_encoder *enc)
+{
+	if(enc->irq_b >= 0)
+		free_irq(enc->irq_b, enc);
+	if(enc->irq_a >= 0)
+		free_irq(enc->irq_a, enc);
+	enc->irq_a = -1;
+	enc->irq_b = -1;
+	gpio_free(enc->pin_b);
+	gpio_free(enc->pin_a);
+}
+
+static int _motor_encoder_request(struct motor_encoder *enc, const char *name)
+{
+	int irq;
+	int ret;
+
+	ret = gpio_request_one(enc->pin_a, GPIOF_IN, "encoder A");
+	if(ret)
+		return ret;
+	ret = gpio_request_one(enc->pin_b, GPIOF_IN, "encoder B");
+	if(ret)
+	{
+		gpio_free(enc->pin_a);
+		return ret;
+	}
+	if(gpio_cansleep(enc->pin_a) || gpio_cansleep(enc->pin_b))
+	{
+		ret = -EINVAL;
+		goto err;
+	}
+
+	enc->state = _motor_encoder_read(enc);
+	irq = gpio_to_irq(enc->pin_a);
+	ret = irq < 0 ? irq : request_irq(irq, motor_encoder_irq,
+			IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING, name, enc);
+	if(ret)
+		goto err;
+	enc->irq_a = irq;
+
+	irq = gpio_to_irq(enc->pin_b);
+	ret = irq < 0 ? irq : request_irq(irq, motor_encoder_irq,
+			IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING, name, enc);
+	if(ret)
+		goto err;
+	enc->irq_b = irq;
+	return 0;
+err:
+	_motor_encoder_free(enc);
+	return ret;
+}
+
+/**
+ * motor_encoder_register - start decoding an encoder
+ * @cdev: the motor it measures, NULL for an encoder without sysfs
+ * @enc: the encoder, pins (or sim), reverse, cpr and window_ns set
+ *
+ * The motor gets encoder_count, encoder_velocity and encoder_stats
+ * attributes and cdev->encoder points to @enc.
+ */
+int motor_encoder_register(struct motor_classdev *cdev, struct motor_encoder *enc)
+{
+	s64 now = ktime_to_ns(ktime_get());
+	int ret;
+
+	spin_lock_init(&enc->lock);
+	raw_spin_lock_init(&enc->irq_lock);
+	enc->state = 0;
+	atomic64_set(&enc->count, 0);
+	atomic64_set(&enc->edge_ns, now);
+	atomic64_set(&enc->edges, 0);
+	atomic64_set(&enc->errors, 0);
+	atomic64_set(&enc->irqs, 0);
+	enc->sim_phase = 0;
+	enc->win_count = 0;
+	enc->win_edge_ns = now;
+	enc->win_ns = now;
+	enc->velocity = 0;
+	enc->irq_a = -1;
+	enc->irq_b = -1;
+	enc->cdev = cdev;
+
+	if(!enc->sim)
+	{
+		ret = _motor_encoder_request(enc, cdev ? cdev->name : "motor encoder");
+		if(ret)
+			return ret;
+	}
+
+	if(cdev)
+	{
+		cdev->encoder = enc;
+		device_create_file(cdev->dev, &motor_encoder_attrs_count);
+		device_create_file(cdev->dev, &motor_encoder_attrs_velocity);
+		device_create_file(cdev->dev, &motor_encoder_attrs_stats);
+	}
+	return 0;
+}
+EXPORT_SYMBOL_GPL(motor_encoder_register);
+
+void motor_encoder_unregister(struct motor_encoder *enc)
+{
+	struct motor_classdev *cdev = enc->cdev;
+
+	if(cdev)
+	{
+		device_remove_file(cdev->dev, &motor_encoder_attrs_stats);
+		device_remove_file(cdev->dev, &motor_encoder_attrs_velocity);
+		device_remove_file(cdev->dev, &motor_encoder_attrs_count);
+		cdev->encoder = NULL;
+	}
+	if(!enc->sim)
+		_motor_encoder_free(enc);
+	enc->cdev = NULL;
+}
+EXPORT_SYMBOL_GPL(motor_encoder_unregister);
+
+MODULE_AUTHOR("Eric Hsiao, erichsiao815@gmail.com");
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("quadrature encoder input for motors");
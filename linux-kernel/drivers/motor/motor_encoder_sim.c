@@ -0,0 +1,285 @@
+/*
+ * 	motor_encoder_sim.c
+ *
+ * Copyright (C) 2015 Eric Hsiao <erichsiao815@gmail.com>
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ *
+ * Simulated quadrature encoder ("encoder-sim") for the motor encoder
+ * decoder, no hardware needed:
+ *
+ *	rate  : shaft speed in counts per second (signed), the edges are
+ *		fed from a hrtimer every tick_us through the decoder
+ *	stats : decoded count and velocity against the simulated rate
+ *	bench : write N to decode N edges on every online cpu, one thread
+ *		and one encoder per cpu; read back the edges per second
+ *
+ *	modprobe motor_encoder_sim
+ *	echo 20000 > /sys/class/encoder-sim/rate
+ *	cat /sys/class/encoder-sim/stats
+ *	echo 10000000 > /sys/class/encoder-sim/bench
+ *	cat /sys/class/encoder-sim/bench
+ */
+
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/device.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/completion.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/cpu.h>
+#include <linux/math64.h>
+#include <linux/motor_encoder.h>
+
+
+#define MOTOR_NAME		"encoder-sim"
+
+#define ENCODER_SIM_MAX_RATE	2000000
+#define ENCODER_SIM_MAX_BENCH	100000000
+
+static unsigned int tick_us = 100;
+module_param(tick_us, uint, S_IRUGO);
+MODULE_PARM_DESC(tick_us, "edge feed period of the rate generator");
+
+static struct motor_encoder encoder_sim_enc = {
+	.sim	= 1,
+};
+
+static struct hrtimer encoder_sim_timer;
+static long encoder_sim_rate;			// counts per second
+static u64 encoder_sim_acc;			// edge fraction, in 1e-9 counts
+static ktime_t encoder_sim_last;
+
+struct encoder_sim_bench {
+	struct motor_encoder	enc;
+	struct task_struct	*thread;
+	struct completion	done;
+	unsigned long		edges;
+	u64			ns;
+	int			cpu;
+};
+
+static DEFINE_MUTEX(encoder_sim_bench_lock);
+static struct encoder_sim_bench *encoder_sim_bench;
+static int encoder_sim_bench_num;
+
+static enum hrtimer_restart encoder_sim_handler(struct hrtimer *timer)
+{
+	ktime_t now = ktime_get();
+	long rate = encoder_sim_rate;
+	u64 edges;
+
+	encoder_sim_acc += (u64)ABS(rate) * ktime_to_ns(ktime_sub(now, encoder_sim_last));
+	encoder_sim_last = now;
+	edges = div_u64(encoder_sim_acc, NSEC_PER_SEC);
+	encoder_sim_acc -= edges * NSEC_PER_SEC;
+	while(edges--)
+		motor_encoder_sim_edge(&encoder_sim_enc, rate > 0 ? 1 : -1);
+
+	hrtimer_forward_now(timer, ktime_set(0, tick_us * NSEC_PER_USEC));
+	return HRTIMER_RESTART;
+}
+
+static ssize_t encoder_sim_rate_show(struct class *class, struct class_attribute *attr,
+			char *buf)
+{
+	return sprintf(buf, "%ld\n", encoder_sim_rate);
+}
+
+static ssize_t encoder_sim_rate_store(struct class *class, struct class_attribute *attr,
+			const char *buf, size_t count)
+{
+	long rate;
+
+	if((sscanf(buf, "%ld", &rate) != 1) || (ABS(rate) > ENCODER_SIM_MAX_RATE))
+		return -EINVAL;
+
+	hrtimer_cancel(&encoder_sim_timer);
+	encoder_sim_rate = rate;
+	if(rate)
+	{
+		encoder_sim_last = ktime_get();
+		hrtimer_start(&encoder_sim_timer, ktime_set(0, tick_us * NSEC_PER_USEC), HRTIMER_MODE_REL);
+	}
+	return count;
+}
+
+static ssize_t encoder_sim_stats_show(struct class *class, struct class_attribute *attr,
+			char *buf)
+{
+	struct motor_encoder *enc = &encoder_sim_enc;
+
+	return sprintf(buf, "rate %ld\ncount %lld\nvelocity %lld\nedges %llu\nerrors %llu\n",
+			encoder_sim_rate,
+			(long long)motor_encoder_count(enc),
+			(long long)motor_encoder_velocity(enc),
+			(unsigned long long)atomic64_read(&enc->edges),
+			(unsigned long long)atomic64_read(&enc->errors));
+}
+
+static int encoder_sim_bench_thread(void *data)
+{
+	struct encoder_sim_bench *b = data;
+	ktime_t start = ktime_get();
+	unsigned long i;
+
+	for(i = 0; i < b->edges; i++)
+	{
+		motor_encoder_sim_edge(&b->enc, 1);
+		if((i & 0xfff) == 0xfff)
+			cond_resched();
+	}
+	b->ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	complete(&b->done);
+
+	// kthread_stop() collects us
+	set_current_state(TASK_INTERRUPTIBLE);
+	while(!kthread_should_stop())
+	{
+		schedule();
+		set_current_state(TASK_INTERRUPTIBLE);
+	}
+	__set_current_state(TASK_RUNNING);
+	return 0;
+}
+
+static ssize_t encoder_sim_bench_show(struct class *class, struct class_attribute *attr,
+			char *buf)
+{
+	struct encoder_sim_bench *b;
+	u64 total = 0;
+	u64 rate;
+	ssize_t len = 0;
+	int i;
+
+	mutex_lock(&encoder_sim_bench_lock);
+	for(i = 0; i < encoder_sim_bench_num; i++)
+	{
+		b = &encoder_sim_bench[i];
+		if(b->ns == 0)
+			continue;
+		rate = div64_u64((u64)b->edges * NSEC_PER_SEC, b->ns);
+		total += rate;
+		len += sprintf(buf + len, "cpu%d %llu edges/s (%lu edges, %llu ns, %llu errors)\n",
+				b->cpu, (unsigned long long)rate, b->edges,
+				(unsigned long long)b->ns,
+				(unsigned long long)atomic64_read(&b->enc.errors));
+	}
+	len += sprintf(buf + len, "total %llu edges/s\n", (unsigned long long)total);
+	mutex_unlock(&encoder_sim_bench_lock);
+	return len;
+}
+
+static ssize_t encoder_sim_bench_store(struct class *class, struct class_attribute *attr,
+			const char *buf, size_t count)
+{
+	struct encoder_sim_bench *b;
+	unsigned long edges;
+	int cpu;
+	int i;
+
+	if((sscanf(buf, "%lu", &edges) != 1) || (edges == 0) || (edges > ENCODER_SIM_MAX_BENCH))
+		return -EINVAL;
+
+	mutex_lock(&encoder_sim_bench_lock);
+	kfree(encoder_sim_bench);
+	encoder_sim_bench_num = 0;
+	encoder_sim_bench = kcalloc(num_possible_cpus(), sizeof(*encoder_sim_bench), GFP_KERNEL);
+	if(encoder_sim_bench == NULL)
+	{
+		mutex_unlock(&encoder_sim_bench_lock);
+		return -ENOMEM;
+	}
+
+	get_online_cpus();
+	for_each_online_cpu(cpu)
+	{
+		b = &encoder_sim_bench[encoder_sim_bench_num];
+		b->enc.sim = 1;
+		motor_encoder_register(NULL, &b->enc);
+		init_completion(&b->done);
+		b->edges = edges;
+		b->cpu = cpu;
+		b->thread = kthread_create(encoder_sim_bench_thread, b, "encoder-bench/%d", cpu);
+		if(IS_ERR(b->thread))
+			continue;
+		kthread_bind(b->thread, cpu);
+		encoder_sim_bench_num++;
+	}
+	// start them together
+	for(i = 0; i < encoder_sim_bench_num; i++)
+		wake_up_process(encoder_sim_bench[i].thread);
+	for(i = 0; i < encoder_sim_bench_num; i++)
+	{
+		b = &encoder_sim_bench[i];
+		wait_for_completion(&b->done);
+		kthread_stop(b->thread);
+		motor_encoder_unregister(&b->enc);
+	}
+	put_online_cpus();
+	mutex_unlock(&encoder_sim_bench_lock);
+	return count;
+}
+
+static struct class_attribute encoder_sim_class_attr[] =
+{
+	__ATTR(rate, S_IRUGO| S_IWUSR, encoder_sim_rate_show, encoder_sim_rate_store),
+	__ATTR(stats, S_IRUGO, encoder_sim_stats_show, NULL),
+	__ATTR(bench, S_IRUGO| S_IWUSR, encoder_sim_bench_show, encoder_sim_bench_store),
+	__ATTR_NULL,
+};
+
+static struct class encoder_sim_class =
+{
+	.name = MOTOR_NAME,
+	.owner = THIS_MODULE,
+	.class_attrs = (struct class_attribute *) &encoder_sim_class_attr,
+};
+
+static int encoder_sim_init(void)
+{
+	int status;
+
+	if(tick_us == 0)
+		return -EINVAL;
+
+	status = motor_encoder_register(NULL, &encoder_sim_enc);
+	if (status < 0)
+		return status;
+	hrtimer_init(&encoder_sim_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	encoder_sim_timer.function = encoder_sim_handler;
+
+	status = class_register(&encoder_sim_class);
+	if (status < 0)
+	{
+		printk("Registering Class Failed\n");
+		motor_encoder_unregister(&encoder_sim_enc);
+		return status;
+	}
+	return 0;
+}
+
+static void encoder_sim_exit(void)
+{
+	class_unregister(&encoder_sim_class);
+	hrtimer_cancel(&encoder_sim_timer);
+	motor_encoder_unregister(&encoder_sim_enc);
+	kfree(encoder_sim_bench);
+	printk(" GoodBye, %s\n",MOTOR_NAME);
+}
+
+module_init( encoder_sim_init);
+module_exit( encoder_sim_exit);
+
+MODULE_AUTHOR("Eric Hsiao, erichsiao815@gmail.com");
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("simulated quadrature encoder and decoder benchmark");
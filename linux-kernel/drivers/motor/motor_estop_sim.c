@@ -0,0 +1,263 @@
+/*
+ * 	motor_estop_sim.c
+ *
+ * Copyright (C) 2015 Eric Hsiao <erichsiao815@gmail.com>
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ *
+ * Worst case e-stop latency benchmark ("estop-sim"). It adds N simulated
+ * coil steppers to the step engine, each coil write costing write_ns like
+ * a gpio, runs them all at slightly different rates so their timers fire
+ * all over the place, and then e-stops from a hrtimer, in hard irq context
+ * like a stop button interrupt would:
+ *
+ *	run   : write the number of rounds, every round starts all motors,
+ *		lets them run for a while, e-stops and releases again
+ *	stats : how long motor_estop() took for the N motors, and how many
+ *		motors were left energized or stepped after it (both must
+ *		stay 0)
+ *
+ * The e-stop stops every motor of the class, not only the simulated ones.
+ *
+ *	modprobe motor_estop_sim motors=32
+ *	echo 1000 > /sys/class/estop-sim/run
+ *	cat /sys/class/estop-sim/stats
+ */
+
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/device.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/delay.h>
+#include <linux/completion.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/motor_stepper.h>
+#include <asm/div64.h>
+
+
+#define MOTOR_NAME		"estop-sim"
+
+#define ESTOP_SIM_MAX_MOTORS	256
+#define ESTOP_SIM_MAX_ROUNDS	100000
+
+static unsigned int motors = 16;
+module_param(motors, uint, S_IRUGO);
+MODULE_PARM_DESC(motors, "simulated steppers");
+
+static unsigned int pps = 2000;
+module_param(pps, uint, S_IRUGO);
+MODULE_PARM_DESC(pps, "step rate of the first motor, the others run a little faster");
+
+static unsigned int write_ns = 200;
+module_param(write_ns, uint, S_IRUGO);
+MODULE_PARM_DESC(write_ns, "cost of one coil write");
+
+static unsigned int run_ms = 10;
+module_param(run_ms, uint, S_IRUGO);
+MODULE_PARM_DESC(run_ms, "time the motors run before the e-stop");
+
+struct estop_sim_motor {
+	struct motor_stepper	stepper;
+	unsigned int		mask;		// simulated coil outputs
+	unsigned long		writes;
+};
+
+static struct estop_sim_motor *estop_sim_motors;
+static DEFINE_MUTEX(estop_sim_lock);
+static struct hrtimer estop_sim_timer;
+static struct completion estop_sim_done;
+static unsigned int estop_sim_stop_ns;		// of the round in flight
+
+static unsigned long estop_sim_rounds;
+static u64 estop_sim_stop_ns_sum;
+static unsigned int estop_sim_stop_ns_max;
+static unsigned long estop_sim_energized;	// motors with a coil on after the stop
+static unsigned long estop_sim_stepped;		// coil writes after the stop
+
+static void estop_sim_set_phase_mask(struct motor_stepper *stp, unsigned int mask)
+{
+	struct estop_sim_motor *m = stp->priv;
+
+	ndelay(write_ns);
+	m->mask = mask;
+	m->writes++;
+}
+
+static const struct motor_stepper_ops estop_sim_ops = {
+	.set_phase_mask	= estop_sim_set_phase_mask,
+};
+
+static enum hrtimer_restart estop_sim_handler(struct hrtimer *timer)
+{
+	ktime_t start = ktime_get();
+
+	motor_estop();
+	estop_sim_stop_ns = (unsigned int)ktime_to_ns(ktime_sub(ktime_get(), start));
+	complete(&estop_sim_done);
+	return HRTIMER_NORESTART;
+}
+
+/* called with estop_sim_lock held */
+static void estop_sim_round(void)
+{
+	unsigned long *writes;
+	unsigned int i;
+
+	writes = kcalloc(motors, sizeof(unsigned long), GFP_KERNEL);
+	if(writes == NULL)
+		return;
+	for(i = 0; i < motors; i++)
+		motor_stepper_move(&estop_sim_motors[i].stepper, MOTOR_STEPPER_CONTINUOUS);
+	msleep(run_ms);
+
+	init_completion(&estop_sim_done);
+	hrtimer_start(&estop_sim_timer, ktime_set(0, 0), HRTIMER_MODE_REL);
+	wait_for_completion(&estop_sim_done);
+
+	for(i = 0; i < motors; i++)
+	{
+		if(estop_sim_motors[i].mask)
+			estop_sim_energized++;
+		writes[i] = estop_sim_motors[i].writes;
+	}
+	msleep(2 * MSEC_PER_SEC / pps + 1);	// a few periods: no timer may step again
+	for(i = 0; i < motors; i++)
+		estop_sim_stepped += estop_sim_motors[i].writes - writes[i];
+	motor_estop_release();
+
+	estop_sim_rounds++;
+	estop_sim_stop_ns_sum += estop_sim_stop_ns;
+	if(estop_sim_stop_ns > estop_sim_stop_ns_max)
+		estop_sim_stop_ns_max = estop_sim_stop_ns;
+	kfree(writes);
+}
+
+static ssize_t estop_sim_run_store(struct class *class, struct class_attribute *attr,
+			const char *buf, size_t count)
+{
+	unsigned long rounds;
+
+	if((sscanf(buf, "%lu", &rounds) != 1) || (rounds == 0) ||
+		(rounds > ESTOP_SIM_MAX_ROUNDS))
+		return -EINVAL;
+	if(motor_estopped())
+		return -EBUSY;		// someone else holds the latch
+	if(mutex_lock_interruptible(&estop_sim_lock))
+		return -ERESTARTSYS;
+	while(rounds-- && !signal_pending(current))
+		estop_sim_round();
+	mutex_unlock(&estop_sim_lock);
+	return count;
+}
+
+static ssize_t estop_sim_stats_show(struct class *class, struct class_attribute *attr,
+			char *buf)
+{
+	u64 avg = estop_sim_stop_ns_sum;
+	unsigned int per_motor;
+
+	if(estop_sim_rounds)
+		do_div(avg, estop_sim_rounds);
+	per_motor = estop_sim_stop_ns_max / motors;
+	return sprintf(buf, "motors %u\nrounds %lu\nstop_ns_avg %llu\nstop_ns_max %u\n"
+			"stop_ns_max_per_motor %u\nenergized_after_stop %lu\nsteps_after_stop %lu\n",
+			motors, estop_sim_rounds, (unsigned long long)avg, estop_sim_stop_ns_max,
+			per_motor, estop_sim_energized, estop_sim_stepped);
+}
+
+static ssize_t estop_sim_stats_store(struct class *class, struct class_attribute *attr,
+			const char *buf, size_t count)
+{
+	mutex_lock(&estop_sim_lock);
+	estop_sim_rounds = 0;
+	estop_sim_stop_ns_sum = 0;
+	estop_sim_stop_ns_max = 0;
+	estop_sim_energized = 0;
+	estop_sim_stepped = 0;
+	mutex_unlock(&estop_sim_lock);
+	return count;
+}
+
+static struct class_attribute estop_sim_class_attr[] =
+{
+	__ATTR(run, S_IWUSR, NULL, estop_sim_run_store),
+	__ATTR(stats, S_IRUGO| S_IWUSR, estop_sim_stats_show, estop_sim_stats_store),
+	__ATTR_NULL,
+};
+
+static struct class estop_sim_class =
+{
+	.name = MOTOR_NAME,
+	.owner = THIS_MODULE,
+	.class_attrs = (struct class_attribute *) &estop_sim_class_attr,
+};
+
+static void estop_sim_release(unsigned int n)
+{
+	while(n--)
+		motor_stepper_release(&estop_sim_motors[n].stepper);
+	kfree(estop_sim_motors);
+}
+
+static int estop_sim_init(void)
+{
+	struct motor_stepper *stp;
+	unsigned int i;
+	int status;
+
+	if((motors == 0) || (motors > ESTOP_SIM_MAX_MOTORS) || (pps == 0) ||
+		(pps + motors > MOTOR_STEPPER_MAX_PPS))
+		return -EINVAL;
+	estop_sim_motors = kcalloc(motors, sizeof(*estop_sim_motors), GFP_KERNEL);
+	if(estop_sim_motors == NULL)
+		return -ENOMEM;
+	for(i = 0; i < motors; i++)
+	{
+		stp = &estop_sim_motors[i].stepper;
+		stp->cdev.name = MOTOR_NAME;
+		stp->ops = &estop_sim_ops;
+		stp->mode = MOTOR_STEPPER_HALF_STEP;
+		stp->pps = pps + i;		// the timers drift apart
+		stp->start_delay = ktime_set(0, 0);
+		stp->priv = &estop_sim_motors[i];
+		status = motor_stepper_init(stp);
+		if(status)
+		{
+			estop_sim_release(i);
+			return status;
+		}
+	}
+	hrtimer_init(&estop_sim_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	estop_sim_timer.function = estop_sim_handler;
+
+	status = class_register(&estop_sim_class);
+	if (status < 0)
+	{
+		printk("Registering Class Failed\n");
+		estop_sim_release(motors);
+		return status;
+	}
+	return 0;
+}
+
+static void estop_sim_exit(void)
+{
+	class_unregister(&estop_sim_class);
+	hrtimer_cancel(&estop_sim_timer);
+	estop_sim_release(motors);
+	printk(" GoodBye, %s\n",MOTOR_NAME);
+}
+
+module_init( estop_sim_init);
+module_exit( estop_sim_exit);
+
+MODULE_AUTHOR("Eric Hsiao, erichsiao815@gmail.com");
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("e-stop latency benchmark on simulated steppers");
@@ -0,0 +1,184 @@
+/*
+ * 	motor_expander_sim.c
+ *
+ * Copyright (C) 2015 Eric Hsiao <erichsiao815@gmail.com>
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ *
+ * Simulated i2c gpio expander registered as a step engine output port
+ * ("expander-sim"). Every write costs the time of one i2c transaction:
+ *
+ *	overhead_us + (2 + width/8) bytes * 9 bits / bus_khz
+ *
+ * so stepper throughput can be benchmarked without hardware. The stats
+ * attribute compares the transactions issued with the ones a per-pin
+ * gpio write would have needed.
+ *
+ *	modprobe motor_expander_sim
+ *	modprobe motor_l293d_stepper port=expander-sim
+ *	cat /sys/class/expander-sim/stats
+ */
+
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/device.h>
+#include <linux/delay.h>
+#include <linux/bitops.h>
+#include <linux/ktime.h>
+#include <linux/motor_stepper.h>
+#include <asm/div64.h>
+
+
+#define MOTOR_NAME		"expander-sim"
+
+static unsigned int width = 16;
+module_param(width, uint, S_IRUGO);
+MODULE_PARM_DESC(width, "number of output pins (8, 16 or 32)");
+
+static unsigned int bus_khz = 400;
+module_param(bus_khz, uint, S_IRUGO);
+MODULE_PARM_DESC(bus_khz, "simulated i2c clock");
+
+static unsigned int overhead_us = 20;
+module_param(overhead_us, uint, S_IRUGO);
+MODULE_PARM_DESC(overhead_us, "fixed cost of one transaction (driver, start/stop, ack)");
+
+static unsigned int tick_us = 1000;
+module_param(tick_us, uint, S_IRUGO);
+MODULE_PARM_DESC(tick_us, "step tick of the port");
+
+struct expander_sim {
+	unsigned long	latch;		// simulated output register
+	unsigned long	xfer_ns;	// bus time of one transaction
+	unsigned long	transactions;
+	unsigned long	bytes;
+	unsigned long	pins;		// pin changes, one transaction each on a per-pin path
+	u64		bus_ns;
+};
+
+static struct expander_sim expander_sim_data;
+
+static void _expander_sim_bus_delay(unsigned long ns)
+{
+	if(ns >= 10 * NSEC_PER_USEC)
+		usleep_range(ns / NSEC_PER_USEC, ns / NSEC_PER_USEC + 1);
+	else
+		ndelay(ns);
+}
+
+static int expander_sim_write(struct motor_stepper_port *port, const unsigned long *value,
+			const unsigned long *changed)
+{
+	struct expander_sim *sim = port->priv;
+	unsigned long mask = changed[0];
+
+	_expander_sim_bus_delay(sim->xfer_ns);
+	sim->latch = (sim->latch & ~mask) | (value[0] & mask);
+	sim->transactions++;
+	sim->bytes += 2 + width / 8;
+	sim->pins += hweight_long(mask);
+	sim->bus_ns += sim->xfer_ns;
+	return 0;
+}
+
+static const struct motor_stepper_port_ops expander_sim_ops = {
+	.write	= expander_sim_write,
+};
+
+static struct motor_stepper_port expander_sim_port = {
+	.name	= MOTOR_NAME,
+	.owner	= THIS_MODULE,
+	.ops	= &expander_sim_ops,
+	.priv	= &expander_sim_data,
+};
+
+static ssize_t expander_sim_stats_show(struct class *class, struct class_attribute *attr,
+			char *buf)
+{
+	struct expander_sim *sim = &expander_sim_data;
+	u64 per_pin_ns = (u64)sim->pins * sim->xfer_ns;
+
+	return sprintf(buf, "latch %08lx\ntransactions %lu\nbytes %lu\nbus_ns %llu\n"
+			"per_pin_transactions %lu\nper_pin_bus_ns %llu\n",
+			sim->latch, sim->transactions, sim->bytes,
+			(unsigned long long)sim->bus_ns,
+			sim->pins, (unsigned long long)per_pin_ns);
+}
+
+static ssize_t expander_sim_stats_store(struct class *class, struct class_attribute *attr,
+			const char *buf, size_t count)
+{
+	struct expander_sim *sim = &expander_sim_data;
+
+	sim->transactions = 0;
+	sim->bytes = 0;
+	sim->pins = 0;
+	sim->bus_ns = 0;
+	return count;
+}
+
+static struct class_attribute expander_sim_class_attr[] =
+{
+	__ATTR(stats, S_IRUGO| S_IWUSR, expander_sim_stats_show, expander_sim_stats_store),
+	__ATTR_NULL,
+};
+
+static struct class expander_sim_class =
+{
+	.name = MOTOR_NAME,
+	.owner = THIS_MODULE,
+	.class_attrs = (struct class_attribute *) &expander_sim_class_attr,
+};
+
+static int expander_sim_init(void)
+{
+	int status;
+	u64 ns;
+
+	if((width != 8) && (width != 16) && (width != 32))
+		return -EINVAL;
+	if(bus_khz == 0)
+		return -EINVAL;
+
+	// address + register + data bytes, 9 clocks each
+	ns = (u64)(2 + width / 8) * 9 * USEC_PER_SEC;
+	do_div(ns, bus_khz);
+	expander_sim_data.xfer_ns = (unsigned long)ns + overhead_us * NSEC_PER_USEC;
+
+	status = class_register(&expander_sim_class);
+	if (status < 0)
+	{
+		printk("Registering Class Failed\n");
+		return status;
+	}
+
+	expander_sim_port.tick_ns = tick_us * NSEC_PER_USEC;
+	expander_sim_port.width = width;
+	status = motor_stepper_port_register(&expander_sim_port);
+	if (status < 0)
+	{
+		class_unregister(&expander_sim_class);
+		return status;
+	}
+	printk("%s: %u pins, %lu ns per transaction\n", MOTOR_NAME, width, expander_sim_data.xfer_ns);
+	return 0;
+}
+
+static void expander_sim_exit(void)
+{
+	motor_stepper_port_unregister(&expander_sim_port);
+	class_unregister(&expander_sim_class);
+	printk(" GoodBye, %s\n",MOTOR_NAME);
+}
+
+module_init( expander_sim_init);
+module_exit( expander_sim_exit);
+
+MODULE_AUTHOR("Eric Hsiao, erichsiao815@gmail.com");
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("simulated i2c gpio expander for the stepper step engine");
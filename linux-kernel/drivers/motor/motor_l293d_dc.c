@@ -20,6 +20,15 @@
  *	speed control (PWM) ->
  *		for speed control, 1-2 EN & 3-4EN connect to one pwm pin,
  *		if you do not need to change car's speed, it can connect to 5V immediately.
+ *
+ * duty_ns and period_ns of the motor set the pwm in ns, speed is the
+ * duty in percent of the period.
+ *
+ * A wheel with a quadrature encoder sets pin_enc_a and pin_enc_b, the
+ * motor then reports encoder_count and encoder_velocity, and its pid
+ * attribute runs a velocity loop on the encoder.
+ *
+ * The class e-stop disables the pwm and drops all pins of every wheel.
  */
 
 #include <linux/init.h>
@@ -42,12 +51,15 @@
 #include <linux/hrtimer.h>
 #include <linux/platform_device.h>
 #include <linux/motor.h>
+#include <linux/motor_encoder.h>
+#include <linux/motor_pid.h>
 #include <linux/pwm.h>
+#include <linux/math64.h>
 
 
 #define MOTOR_NAME		"L293D-DC"
 
-#define PWM_PERIOD		50000 	//50msec, 20k hz
+#define PWM_PERIOD		50000 	//default, 50usec, 20k hz
 	
 
 
@@ -58,18 +70,26 @@ struct motor_l293d_ch_data {
 	enum motor_type type;
 	enum motor_state state;
 	int flag;
-	unsigned int duty;
+	unsigned long duty_ns;
+	unsigned long period_ns;	// 0 takes PWM_PERIOD
 	int pwmid;
 	struct pwm_device *pwm;
 	// control pin 
 	unsigned pin_ch_en;	//channel enable
 	unsigned pin_p;		//positive pin(A)
 	unsigned pin_n;		//negative pin(B)
+	// quadrature encoder, 0 if none
+	unsigned pin_enc_a;
+	unsigned pin_enc_b;
+	unsigned int enc_cpr;
+	struct motor_encoder encoder;
+	struct motor_pid pid;
 };
 
 struct motor_l293d_platform_data {
 	int num_ch;
 	struct motor_l293d_ch_data *data;
+	struct motor_estop estop;
 };
 
 static inline int _motor_gpio_output(unsigned gpio, int value)
@@ -114,6 +134,33 @@ static void _motor_dc_ctrl(enum motor_state ctrl, struct motor_l293d_ch_data *ch
 	}
 }
 
+/* e-stop, any context; the soc pwm and the pins do not sleep */
+static void motor_dc_estop_kill(struct motor_estop *me)
+{
+	struct motor_l293d_platform_data *pdata =
+		container_of(me, struct motor_l293d_platform_data, estop);
+	struct motor_l293d_ch_data *chdata;
+	int i;
+
+	for (i = 0; i < pdata->num_ch; i++)
+	{
+		chdata = &pdata->data[i];
+		if(chdata->use == 0)
+			continue;
+		if(chdata->pin_enc_a && chdata->pin_enc_b)
+			motor_pid_kill(&chdata->pid);	// or a sign flip drives it again
+		if(chdata->pwm)
+			pwm_disable(chdata->pwm);
+		chdata->state = MOTOR_STANDBY;
+		if(chdata->pin_p > 0)
+			gpio_set_value(chdata->pin_p, 0);
+		if(chdata->pin_n > 0)
+			gpio_set_value(chdata->pin_n, 0);
+		if(chdata->pin_ch_en > 0)
+			gpio_set_value(chdata->pin_ch_en, 0);
+	}
+}
+
 static struct motor_l293d_ch_data *_get_ch_data(struct motor_classdev *motor_cdev)
 {
 	int i;
@@ -157,18 +204,21 @@ static enum motor_state	 motor_dc_getstate(struct motor_classdev *motor_cdev)
 	return ch_data->state;
 }
 
+static int _motor_dc_pwm_config(struct motor_l293d_ch_data *chdata)
+{
+	if(chdata->pwm > 0)
+		return pwm_config(chdata->pwm, chdata->duty_ns, chdata->period_ns);
+	return 0;
+}
+
 static void motor_dc_setspeed(struct motor_classdev *motor_cdev,unsigned int duty)
 {
 	struct motor_l293d_ch_data *ch_data = _get_ch_data(motor_cdev); 
 	
 	if((duty >=0) &&(duty <= 100))
 	{
-		ch_data->duty = duty;
-		if(ch_data->pwm > 0)
-		{
-			duty = duty * PWM_PERIOD/ 100;
-			pwm_config(ch_data->pwm, duty, PWM_PERIOD);
-		}
+		ch_data->duty_ns = div_u64((u64)ch_data->period_ns * duty, 100);
+		_motor_dc_pwm_config(ch_data);
 	}
 }
 
@@ -176,7 +226,55 @@ static unsigned int motor_dc_getspeed(struct motor_classdev *motor_cdev)
 {
 	struct motor_l293d_ch_data *ch_data = _get_ch_data(motor_cdev); 
 	
-	return ch_data->duty;
+	return div_u64((u64)ch_data->duty_ns * 100 + ch_data->period_ns / 2, ch_data->period_ns);
+}
+
+static int motor_dc_setduty(struct motor_classdev *motor_cdev, unsigned long duty_ns)
+{
+	struct motor_l293d_ch_data *ch_data = _get_ch_data(motor_cdev); 
+	unsigned long old = ch_data->duty_ns;
+	int ret;
+
+	if(duty_ns > ch_data->period_ns)
+		return -EINVAL;
+	ch_data->duty_ns = duty_ns;
+	ret = _motor_dc_pwm_config(ch_data);
+	if(ret < 0)
+		ch_data->duty_ns = old;
+	return ret;
+}
+
+static unsigned long motor_dc_getduty(struct motor_classdev *motor_cdev)
+{
+	struct motor_l293d_ch_data *ch_data = _get_ch_data(motor_cdev); 
+
+	return ch_data->duty_ns;
+}
+
+/* a new period keeps the duty ratio */
+static int motor_dc_setperiod(struct motor_classdev *motor_cdev, unsigned long period_ns)
+{
+	struct motor_l293d_ch_data *ch_data = _get_ch_data(motor_cdev); 
+	unsigned long old_period = ch_data->period_ns;
+	unsigned long old_duty = ch_data->duty_ns;
+	int ret;
+
+	ch_data->duty_ns = div_u64((u64)old_duty * period_ns, old_period);
+	ch_data->period_ns = period_ns;
+	ret = _motor_dc_pwm_config(ch_data);
+	if(ret < 0)
+	{
+		ch_data->period_ns = old_period;
+		ch_data->duty_ns = old_duty;
+	}
+	return ret;
+}
+
+static unsigned long motor_dc_getperiod(struct motor_classdev *motor_cdev)
+{
+	struct motor_l293d_ch_data *ch_data = _get_ch_data(motor_cdev); 
+
+	return ch_data->period_ns;
 }
 
 static int __devinit motor_dc_probe(struct platform_device *pdev)
@@ -211,8 +309,18 @@ static int __devinit motor_dc_probe(struct platform_device *pdev)
 		motor_dev[i].flags = pdata->data[i].flag;
 		motor_dev[i].setspeed	 = motor_dc_setspeed;
 		motor_dev[i].getspeed = motor_dc_getspeed;
+		motor_dev[i].setduty	= motor_dc_setduty;
+		motor_dev[i].getduty	= motor_dc_getduty;
+		motor_dev[i].setperiod	= motor_dc_setperiod;
+		motor_dev[i].getperiod	= motor_dc_getperiod;
+		if(pdata->data[i].period_ns == 0)
+			pdata->data[i].period_ns = PWM_PERIOD;
+		if(pdata->data[i].duty_ns > pdata->data[i].period_ns)
+			pdata->data[i].duty_ns = pdata->data[i].period_ns;
 		motor_dev[i].ctl		= motor_dc_ctl;
 		motor_dev[i].getstate	= motor_dc_getstate;
+		if(pdata->data[i].pin_enc_a && pdata->data[i].pin_enc_b)
+			motor_pid_init(&motor_dev[i], &pdata->data[i].pid);
 		ret = motor_classdev_register(&pdev->dev, &motor_dev[i]);
 		if (ret) {
 			dev_err(&pdev->dev, "failed to register motor %s\n",motor_dev[i].name);
@@ -226,10 +334,19 @@ static int __devinit motor_dc_probe(struct platform_device *pdev)
 				dev_err(&pdev->dev, "failed to request pwm error\n");
 				goto err;
 			}
-			pwm_config(pdata->data[i].pwm, PWM_PERIOD, PWM_PERIOD);		//duty cycle = 100%
+			_motor_dc_pwm_config(&pdata->data[i]);
 			pwm_disable(pdata->data[i].pwm);
 		}
 		motor_dev[i].data = pdata;
+		if(pdata->data[i].pin_enc_a && pdata->data[i].pin_enc_b)
+		{
+			pdata->data[i].encoder.pin_a = pdata->data[i].pin_enc_a;
+			pdata->data[i].encoder.pin_b = pdata->data[i].pin_enc_b;
+			pdata->data[i].encoder.cpr = pdata->data[i].enc_cpr;
+			ret = motor_encoder_register(&motor_dev[i], &pdata->data[i].encoder);
+			if (ret)
+				dev_err(&pdev->dev, "motor %s: no encoder (%d)\n", motor_dev[i].name, ret);
+		}
 		gpio_request(pdata->data[i].pin_n, "dc motor +");
 		gpio_request(pdata->data[i].pin_p,"dc motor -");
 		gpio_request(pdata->data[i].pin_ch_en, "dc motor speed");
@@ -237,6 +354,8 @@ static int __devinit motor_dc_probe(struct platform_device *pdev)
 	}
 	// setting pwm if needed
 	platform_set_drvdata(pdev, motor_dev);
+	pdata->estop.kill = motor_dc_estop_kill;
+	motor_estop_register(&pdata->estop);
 	return 0;
 err:
 	if (i > 0) {
@@ -245,6 +364,10 @@ err:
 			{
 				continue;
 			}
+			if(motor_dev[i].pid)
+				motor_pid_release(motor_dev[i].pid);
+			if(motor_dev[i].encoder)
+				motor_encoder_unregister(motor_dev[i].encoder);
 			motor_classdev_unregister(&motor_dev[i]);
 		}
 	}
@@ -260,12 +383,17 @@ static int __exit motor_dc_remove(struct platform_device *pdev)
 
 	//printk("ch number %d\r\n",pdata->num_ch);
 
+	motor_estop_unregister(&pdata->estop);
 	for (i = 0; i < pdata->num_ch; i++) 
 	{
 		if(pdata->data[i].use == 0)
 		{
 			continue;
 		}
+		if(motor[i].pid)
+			motor_pid_release(motor[i].pid);
+		if(motor[i].encoder)
+			motor_encoder_unregister(motor[i].encoder);
 		motor_classdev_unregister(&motor[i]);
 		printk("motor %s removed \r\n",motor[i].name);
 		if(pdata->data[i].pwm > 0) pwm_free(pdata->data[i].pwm);
@@ -282,7 +410,8 @@ static struct motor_l293d_ch_data l293d_data[] =
 		.name = "wheel-right",
 		.type = MOTOR_TYPE_DC,
 		.flag = MOTOR_SUSPEND_SUPPORT,
-		.duty = 100,
+		.duty_ns = PWM_PERIOD,		// 100%
+		.period_ns = PWM_PERIOD,
 		.pwmid = 1 ,		//pwm using for all wheel
 		//.pin_ch_en =10,
 		.pin_p = 9,
@@ -294,7 +423,8 @@ static struct motor_l293d_ch_data l293d_data[] =
 		.name = "wheel-left",
 		.type = MOTOR_TYPE_DC,
 		.flag = MOTOR_SUSPEND_SUPPORT,
-		.duty = 100,
+		.duty_ns = PWM_PERIOD,
+		.period_ns = PWM_PERIOD,
 		.pwmid = -1 ,		// using same pwm with right wheel 
 		//.pin_ch_en =17,
 		.pin_p = 27,
@@ -17,6 +17,63 @@
  *		3Y : /B
  *
  *		1-2 EN & 3-4EN connect to one gpio or 5V immediately.
+ *
+ * With a port name in the platform data (or the port= module parameter),
+ * pin_a..pin_bn are pins of that step engine output port, e.g. an i2c
+ * expander, instead of gpios. All channels on the port are then written
+ * with one bus transaction per tick.
+ *
+ * With a group name (or the group= module parameter), all used channels
+ * also form a motor group, e.g. the X and Y axes of a stage, whose move
+ * attribute steps them in sync from one timer. Moves written to queue
+ * are planned ahead and run as one path, without stopping at corners the
+ * axes can take at speed (accel and jump_pps of each channel):
+ *
+ *	echo "400 -300" > /sys/class/motor/<group>/move
+ *	echo "100 20" > /sys/class/motor/<group>/queue
+ *	cat /sys/class/motor/<group>/queue		(free slots)
+ *
+ * Every channel also takes a stream of "pos vel dt_ns" points through its
+ * pvt attribute, e.g. a trajectory sampled at 1 kHz, and steps along a
+ * cubic curve through them; reading pvt shows the queued lead and any
+ * underruns:
+ *
+ *	echo "3 600 1000000 8 1100 1000000" > /sys/class/motor/<name>/pvt
+ *
+ * For many axes, each channel's ring attribute can be mmap'd instead: a
+ * ring of (steps, start_pps, end_pps, flags) segments that userspace fills
+ * without a syscall, see struct motor_stepper_ring. ring_ctl starts and
+ * stops it, sets the low watermark and can be poll()ed for refills:
+ *
+ *	echo start > /sys/class/motor/<name>/ring_ctl
+ *
+ * A move can also be armed to start at a CLOCK_MONOTONIC time, e.g. the
+ * same instant on several channels; start_ns tells when it did:
+ *
+ *	echo "forward 400 @<ns>" > /sys/class/motor/<name>/ctrl
+ *
+ * Or armed with moves of their own and fired together, the first steps
+ * of all of them in one timer expiry:
+ *
+ *	echo "arm forward 400" > /sys/class/motor/<name>/ctrl
+ *	echo now > /sys/class/motor/fire
+ *
+ * A gpio edge, e.g. a photo-eye, can start a preloaded move (or stop the
+ * motor) straight from its interrupt; reading trigger shows the latency:
+ *
+ *	echo "gpio 17 rising start" > /sys/class/motor/<name>/trigger
+ *	echo "move 400" > /sys/class/motor/<name>/trigger
+ *
+ * With limit switches (pin_limit_min, pin_limit_max) a move stops at a
+ * switch from its interrupt. Homing seeks the min switch, backs off and
+ * approaches it again slowly; from there minPos and maxPos bound moves:
+ *
+ *	echo home > /sys/class/motor/<name>/home
+ *
+ * A step timer that comes a period or more late is an overrun; overrun
+ * counts them and picks what happens: log, catchup, derate or stop:
+ *
+ *	echo derate > /sys/class/motor/<name>/overrun
  */
 
 #include <linux/init.h>
@@ -39,6 +96,7 @@
 #include <linux/hrtimer.h>
 #include <linux/platform_device.h>
 #include <linux/motor.h>
+#include <linux/motor_stepper.h>
 
 
 #define MOTOR_NAME		"L293D-STEPPER"
@@ -53,27 +111,40 @@ struct l293d_stepper_chdata {
 	enum motor_state state;
 	int flag;
 	unsigned int pps;
-	int pos;
-	char seqNum;
+	unsigned int accel;		// group paths, steps/s^2, 0 is default
+	unsigned int jump_pps;		// group paths, rate change at once, 0 is default
 	// control pin 
 	unsigned pin_ch_en;	//channel enable
 	unsigned pin_a;		// A
 	unsigned pin_an;		// /A
  	unsigned pin_b;		// B
  	unsigned pin_bn;		// /B
- 	// timer & work queue
-	struct work_struct work;
-	struct hrtimer hrtimer;
-	int	maxPos;
+	unsigned pin_limit_min;		// limit switch gpios, 0 none
+	unsigned pin_limit_max;
+ 	// step engine
+	struct motor_stepper stepper;
+	int	maxPos;			// soft limits once homed, unused if not above minPos
 	int	minPos;
  };
 
 struct l293d_stepper_platdata {
 	int num_ch;
 	unsigned pin_chip_en;		// enable pin
+	const char *port_name;		// coils on a step engine output port
+	struct motor_stepper_port *port;
+	const char *group_name;		// group of all used channels
+	struct motor_stepper_group group;
 	struct l293d_stepper_chdata *data;
 };
 
+static char *l293d_port_name;
+module_param_named(port, l293d_port_name, charp, S_IRUGO);
+MODULE_PARM_DESC(port, "step engine output port driving the coils instead of gpios");
+
+static char *l293d_group_name;
+module_param_named(group, l293d_group_name, charp, S_IRUGO);
+MODULE_PARM_DESC(group, "name of a motor group of all channels, for coordinated moves");
+
 
 
 
@@ -91,189 +162,52 @@ static inline int _motor_gpio_output(unsigned gpio, int value)
 	}
 }
 
-static void _StepSequence(int seq, struct l293d_stepper_chdata *pchdata)
+static inline void _motor_gpio_set(struct motor_stepper *stp, unsigned gpio, int value)
 {
-	#define		STEP_SEQ		8
-	int stepTable_1_2_phase[STEP_SEQ] =
-	{
-		0x01,	// 0011
-		0x03,	// 0011
-		0x02,	// 0011
-		0x06,	// 0110
-		0x04,	// 0011
-		0x0c,	// 1100
-		0x08,	// 0011
-		0x09,	// 1001
-	};
-	//printk("step seq %d\r\n",seq );
-	if((seq < 0) || (seq >= STEP_SEQ))
-	{	//standby
-		_motor_gpio_output(pchdata->pin_a,0);
-		_motor_gpio_output(pchdata->pin_b,0);
-		_motor_gpio_output(pchdata->pin_an,0);
-		_motor_gpio_output(pchdata->pin_bn,0);
-	}
+	if(gpio == 0)
+		return;
+	if(stp->cansleep)
+		gpio_set_value_cansleep(gpio, value ? 1 : 0);
 	else
-	{
-		_motor_gpio_output(pchdata->pin_a,stepTable_1_2_phase[seq]&0x01? 1:0);		//A
-		_motor_gpio_output(pchdata->pin_b,stepTable_1_2_phase[seq]&0x02? 1:0);		//B
-		_motor_gpio_output(pchdata->pin_an,stepTable_1_2_phase[seq]&0x04? 1:0);	//AM
-		_motor_gpio_output(pchdata->pin_bn,stepTable_1_2_phase[seq]&0x08? 1:0);	//BM
-	}
+		gpio_set_value(gpio, value ? 1 : 0);
 }
 
-static void motor_work_handler(struct work_struct *work)
+/* only the coils that changed since the last step are written */
+static void l293d_stepper_set_phase_mask(struct motor_stepper *stp, unsigned int mask)
 {
-	struct l293d_stepper_chdata *chdata =
-	    container_of(work, struct l293d_stepper_chdata, work);
-
-	if(chdata->pos ==0)
-	{
-		_StepSequence(-1, chdata);
-	}
-	else
-	{
-		_StepSequence(chdata->seqNum & (STEP_SEQ-1), chdata );
-	}
+	struct l293d_stepper_chdata *pchdata = stp->priv;
+	unsigned int changed = mask ^ stp->phase;
+
+	if(changed & MOTOR_COIL_A)
+		_motor_gpio_set(stp, pchdata->pin_a, mask & MOTOR_COIL_A);
+	if(changed & MOTOR_COIL_B)
+		_motor_gpio_set(stp, pchdata->pin_b, mask & MOTOR_COIL_B);
+	if(changed & MOTOR_COIL_AN)
+		_motor_gpio_set(stp, pchdata->pin_an, mask & MOTOR_COIL_AN);
+	if(changed & MOTOR_COIL_BN)
+		_motor_gpio_set(stp, pchdata->pin_bn, mask & MOTOR_COIL_BN);
 }
 
-enum hrtimer_restart motor_hrtimer_handler(struct hrtimer *timer)
+static int l293d_stepper_enable(struct motor_stepper *stp)
 {
-	struct l293d_stepper_chdata *chdata =
-	    container_of(timer, struct l293d_stepper_chdata, hrtimer);
+	struct l293d_stepper_chdata *pchdata = stp->priv;
 	
-	if(chdata->pos>0){
-		if(chdata->pos< 204000)	chdata->pos--;
-		chdata->seqNum--;
-	}
-	else if(chdata->pos<0)
-	{
-		if(chdata->pos> -204000)	chdata->pos++;
-		chdata->seqNum++;
-	}
-	//schedule_work(&chdata->work);	
-	motor_work_handler(&chdata->work);
-	if(chdata->pos!=0)	
-	{
-		hrtimer_forward_now(timer, ktime_set( 0, 1000000000/chdata->pps));
-		return HRTIMER_RESTART;
-	}
-	else
-	{
-		return HRTIMER_NORESTART;
-	}
-}
-
-static struct l293d_stepper_chdata *_get_ch_data(struct motor_classdev *motor_cdev)
-{
-	int i;
-	struct l293d_stepper_platdata *data= motor_cdev->data; 
-	struct l293d_stepper_chdata *ch_data = NULL; 
-	//printk("%s\r\n",motor_cdev->name);
-	for (i = 0; i<data->num_ch;i++)
-	{
-		if (strcmp(motor_cdev->name, data->data[i].name)==0)
-		{
-			ch_data = &data->data[i];
-			break;
-		}
-	}
-
-	if(i < data->num_ch)
-	{
-		return ch_data;
-	}
-	else
-	{
-		printk("[%s] error\r\n", __func__);
-		return NULL;
-	}
-}
-
-static void l293d_stepper_ctl(struct motor_classdev *motor_cdev,enum motor_state ctrl, int step)
-{
-	struct l293d_stepper_chdata *ch_data = _get_ch_data(motor_cdev); 
-	
-	if(ch_data != NULL)
-	{
-		switch(ctrl)
-		{
-			case MOTOR_FORWARD:
-				ch_data->pos= step;
-				break;
-			case MOTOR_BACKWARD:
-				ch_data->pos = -step;
-				break;
-			default:
-			case MOTOR_STANDBY:
-				ch_data->pos = 0;
-				break;
-		}
-		//printk("set motor step %d\r\n",ch_data-> pos);
-		if(ch_data->pos!=0)
-		{
-			if(hrtimer_active(&ch_data->hrtimer) == HRTIMER_STATE_INACTIVE )
-			{
-				hrtimer_start(&ch_data->hrtimer, 
-							ktime_set( 0, 50000000 ),		//50msec
-							HRTIMER_MODE_REL);
-				//motor_work_handler(NULL);
-			}
-		}
-	}
-}
-
-static enum motor_state	 l293d_stepper_getstate(struct motor_classdev *motor_cdev)
-{
-	struct l293d_stepper_chdata *ch_data = _get_ch_data(motor_cdev); 
-	if(ch_data->pos> 0)
-		return MOTOR_FORWARD;
-	else if(ch_data->pos < 0)
-		return MOTOR_BACKWARD;
-	else
-		return MOTOR_STANDBY;
-}
-
-static void l293d_stepper_setspeed(struct motor_classdev *motor_cdev,unsigned int speed)
-{
-	struct l293d_stepper_chdata *ch_data = _get_ch_data(motor_cdev); 
-	if((speed >0) &&(speed <= 5000))
-	{
-		ch_data->pps = speed;
-	}
+	_motor_gpio_set(stp, pchdata->pin_ch_en, 1);
+	return 0;
 }
 
-static unsigned int l293d_stepper_getspeed(struct motor_classdev *motor_cdev)
+static void l293d_stepper_disable(struct motor_stepper *stp)
 {
-	struct l293d_stepper_chdata *ch_data = _get_ch_data(motor_cdev); 
-	return ch_data->pps;
-}
+	struct l293d_stepper_chdata *pchdata = stp->priv;
 
-
-static void l293d_stepper_setpos(struct motor_classdev *motor_cdev,unsigned int pos)
-{
-	struct l293d_stepper_chdata *pdata = _get_ch_data(motor_cdev); 
-	//enum motor_state ctrl;
-	int target = pos;
-
-	if (target > pdata->maxPos) 
-		target = pdata->maxPos;
-	else if(target< pdata->minPos)
-		target= pdata->minPos;
-	
-	pdata->pos = pos;
-		
+	_motor_gpio_set(stp, pchdata->pin_ch_en, 0);
 }
 
-static unsigned int l293d_stepper_getpos(struct motor_classdev *motor_cdev)
-{
-	struct l293d_stepper_chdata *pdata = _get_ch_data(motor_cdev); 
-
-	if(pdata != NULL)
-		return pdata->pos;
-	else
-		return 99999;
-}
+static const struct motor_stepper_ops l293d_stepper_ops = {
+	.set_phase_mask	= l293d_stepper_set_phase_mask,
+	.enable		= l293d_stepper_enable,
+	.disable		= l293d_stepper_disable,
+};
 
 
 static int __devinit l293d_stepper_probe(struct platform_device *pdev)
@@ -281,7 +215,7 @@ static int __devinit l293d_stepper_probe(struct platform_device *pdev)
 	int ret =0;
 	int i = 0;
 	struct l293d_stepper_platdata *pdata = pdev->dev.platform_data; //dev_get_platdata(&pdev->dev);
-	struct motor_classdev *motor_dev;
+	struct l293d_stepper_chdata *chdata;
 
 	if (pdata == NULL) {
 		dev_err(&pdev->dev, "missing platform data\n");
@@ -293,50 +227,78 @@ static int __devinit l293d_stepper_probe(struct platform_device *pdev)
 		return -EINVAL;
 	}
 
-	motor_dev = kzalloc(sizeof(struct motor_classdev) * pdata->num_ch, GFP_KERNEL);
-	if (motor_dev == NULL) {
-		dev_err(&pdev->dev, "failed to alloc memory\n");
-		return -ENOMEM;
+	pdata->port = NULL;
+	pdata->group.group.naxes = 0;
+	if (pdata->port_name) {
+		pdata->port = motor_stepper_port_get(pdata->port_name);
+		if (pdata->port == NULL) {
+			dev_err(&pdev->dev, "output port %s not found\n", pdata->port_name);
+			return -ENODEV;
+		}
 	}
 
 	for (i = 0; i < pdata->num_ch; i++) 
 	{
-		unsigned gpio[4];
-		if(pdata->data[i].use == 0)
+		chdata = &pdata->data[i];
+		if(chdata->use == 0)
 			continue;
-		motor_dev[i].name = pdata->data[i].name;
-		motor_dev[i].type = pdata->data[i].type;
-		motor_dev[i].flags = pdata->data[i].flag;
-		motor_dev[i].setspeed	 = l293d_stepper_setspeed;
-		motor_dev[i].getspeed = l293d_stepper_getspeed;
-		motor_dev[i].ctl		= l293d_stepper_ctl;
-		motor_dev[i].getstate	= l293d_stepper_getstate;
-		motor_dev[i].setpos 	= l293d_stepper_setpos;
-		motor_dev[i].getpos 	= l293d_stepper_getpos;
-		ret = motor_classdev_register(&pdev->dev, &motor_dev[i]);
+
+		if(pdata->port)
+		{
+			chdata->stepper.port = pdata->port;
+			chdata->stepper.port_pin[0] = chdata->pin_a;
+			chdata->stepper.port_pin[1] = chdata->pin_b;
+			chdata->stepper.port_pin[2] = chdata->pin_an;
+			chdata->stepper.port_pin[3] = chdata->pin_bn;
+		}
+		else
+		{
+			gpio_request(chdata->pin_a, "stepper A");
+			gpio_request(chdata->pin_an, "stepper /A");
+			gpio_request(chdata->pin_b, "stepper B");
+			gpio_request(chdata->pin_bn, "stepper /B");
+			_motor_gpio_output(chdata->pin_a, 0);
+			_motor_gpio_output(chdata->pin_an, 0);
+			_motor_gpio_output(chdata->pin_b, 0);
+			_motor_gpio_output(chdata->pin_bn, 0);
+			_motor_gpio_output(chdata->pin_ch_en, 0);
+			chdata->stepper.cansleep = gpio_cansleep(chdata->pin_a) || gpio_cansleep(chdata->pin_an) ||
+					gpio_cansleep(chdata->pin_b) || gpio_cansleep(chdata->pin_bn);
+		}
+
+		chdata->stepper.cdev.name = chdata->name;
+		chdata->stepper.cdev.type = chdata->type;
+		chdata->stepper.cdev.flags = chdata->flag;
+		chdata->stepper.ops = &l293d_stepper_ops;
+		chdata->stepper.mode = MOTOR_STEPPER_HALF_STEP;
+		chdata->stepper.pps = chdata->pps;
+		chdata->stepper.accel = chdata->accel;
+		chdata->stepper.jump_pps = chdata->jump_pps;
+		chdata->stepper.limit_pin[0] = chdata->pin_limit_min;
+		chdata->stepper.limit_pin[1] = chdata->pin_limit_max;
+		chdata->stepper.min_pos = chdata->minPos;
+		chdata->stepper.max_pos = chdata->maxPos;
+		chdata->stepper.start_delay = ktime_set( 0, 50000000 );		//50msec
+		chdata->stepper.priv = chdata;
+		ret = motor_stepper_register(&pdev->dev, &chdata->stepper);
+		if (ret) {
+			dev_err(&pdev->dev, "failed to register motor %s\n",chdata->name);
+			goto err;
+		}
+		printk("register motor %s succeeded\r\n",chdata->name);
+		if(pdata->group_name && (pdata->group.group.naxes < MOTOR_GROUP_MAX_AXES))
+			pdata->group.axis[pdata->group.group.naxes++] = &chdata->stepper;
+	}
+	if (pdata->group_name) {
+		pdata->group.group.cdev.name = pdata->group_name;
+		pdata->group.group.cdev.flags = MOTOR_SUSPEND_SUPPORT;
+		ret = motor_stepper_group_register(&pdev->dev, &pdata->group);
 		if (ret) {
-			dev_err(&pdev->dev, "failed to register motor %s\n",motor_dev[i].name);
+			dev_err(&pdev->dev, "failed to register motor group %s\n", pdata->group_name);
 			goto err;
 		}
-		motor_dev[i].data = pdata;
-		
-		gpio_request(pdata->data[i].pin_a, "stepper A");
-		gpio_request(pdata->data[i].pin_an, "stepper /A");
-		gpio_request(pdata->data[i].pin_b, "stepper B");
-		gpio_request(pdata->data[i].pin_bn, "stepper /B");
-		printk("register motor %s succeeded\r\n",motor_dev[i].name);
-		
-		INIT_WORK(&pdata->data[i].work, motor_work_handler);
-		hrtimer_init(&pdata->data[i].hrtimer, CLOCK_REALTIME, HRTIMER_MODE_REL);
-		pdata->data[i].hrtimer.function = motor_hrtimer_handler;
-		
-		gpio[0] = pdata->data[i].pin_a;
-		gpio[1] = pdata->data[i].pin_b;
-		gpio[2] = pdata->data[i].pin_an;
-		gpio[3] = pdata->data[i].pin_bn;
-		_StepSequence(-1, &pdata->data[i]);
 	}
-	platform_set_drvdata(pdev, motor_dev);
+	platform_set_drvdata(pdev, pdata);
 	return 0;
 err:
 	if (i > 0) {
@@ -345,33 +307,35 @@ err:
 			{
 				continue;
 			}
-			motor_classdev_unregister(&motor_dev[i]);
+			motor_stepper_unregister(&pdata->data[i].stepper);
 		}
 	}
+	if (pdata->port)
+		motor_stepper_port_put(pdata->port);
 	printk("register motor failed\r\n");
 	return ret;
 }
 
 static int __exit l293d_stepper_remove(struct platform_device *pdev)
 {
-	struct motor_classdev	*motor = platform_get_drvdata(pdev);
-	struct l293d_stepper_platdata *pdata = motor->data;	//pdev->dev.platform_data;
+	struct l293d_stepper_platdata *pdata = platform_get_drvdata(pdev);
 	int i = 0;
 
 	printk("ch number %d\r\n",pdata->num_ch);
 
+	if (pdata->group_name)
+		motor_stepper_group_unregister(&pdata->group);
 	for (i = 0; i < pdata->num_ch; i++) 
 	{
 		if(pdata->data[i].use == 0)
 		{
 			continue;
 		}
-		motor_classdev_unregister(&motor[i]);
-		printk("motor %s removed \r\n",motor[i].name);
-		hrtimer_cancel(&pdata->data[i].hrtimer);
-		cancel_work_sync(&pdata->data[i].work);
+		motor_stepper_unregister(&pdata->data[i].stepper);
+		printk("motor %s removed \r\n",pdata->data[i].name);
 	}
-	kfree(motor);
+	if (pdata->port)
+		motor_stepper_port_put(pdata->port);
 	return 0;
 }
 
@@ -385,8 +349,6 @@ static struct l293d_stepper_chdata l293d_stepper_data[] =
 		//.state = MOTOR_STANDBY,
 		.flag = MOTOR_SUSPEND_SUPPORT,
 		.pps = 100,		 //TBD
-		.pos =0,
-		.seqNum = 0,
 		//.pin_ch_en =14,
 		.pin_a = 18,
 		.pin_an = 24,
@@ -425,6 +387,10 @@ static int motor_dc_init(void)
 
 	//l293d_platform_data.num_ch = sizeof(l293d_platform_data.data)/sizeof(struct l293d_stepper_chdatal293d_stepper_chdata);
 	printk("ch number %d\r\n",l293d_stepper_platform_data.num_ch);
+	if (l293d_port_name)
+		l293d_stepper_platform_data.port_name = l293d_port_name;
+	if (l293d_group_name)
+		l293d_stepper_platform_data.group_name = l293d_group_name;
 	pl293d_stepper_platform_device->dev.platform_data =  &l293d_stepper_platform_data;
 	status = platform_driver_register(&l293d_stepper_platform_driver);
 	if (status) {
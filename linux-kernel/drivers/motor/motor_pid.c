@@ -0,0 +1,347 @@
+/*
+ * 	motor_pid.c
+ *
+ * Copyright (C) 2015 Eric Hsiao <erichsiao815@gmail.com>
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ *
+ * Velocity PID for dc motors, run from a hrtimer every period_ns:
+ *
+ *	err = target - velocity
+ *	u   = kp * err + sum(ki * err) - kd * (velocity - last velocity)
+ *
+ * in Q16.16, with the output in duty ppm of the pwm period. A negative
+ * output runs the motor backward through ctl. At out_min or out_max the
+ * integrator only takes errors that pull the output back into range and
+ * is clamped to the limits (anti-windup). The derivative acts on the
+ * velocity, so a target step gives no kick.
+ *
+ * The loop is driven through the motor_classdev callbacks (ctl, setduty,
+ * getperiod) and shows up as the pid attribute of the motor:
+ *
+ *	echo "kp 20000" > /sys/class/motor/<motor>/pid
+ *	echo "target 5000" > /sys/class/motor/<motor>/pid
+ *	echo "enable 1" > /sys/class/motor/<motor>/pid
+ *	cat /sys/class/motor/<motor>/pid
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/init.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/motor_encoder.h>
+#include <linux/motor_pid.h>
+
+
+static s64 _motor_pid_read(struct motor_pid *pid)
+{
+	if(pid->read_velocity)
+		return pid->read_velocity(pid);
+	return motor_encoder_velocity(pid->cdev->encoder);
+}
+
+/* one new velocity estimate per loop */
+static void _motor_pid_window(struct motor_pid *pid)
+{
+	if(!pid->read_velocity && pid->cdev->encoder)
+		pid->cdev->encoder->window_ns = pid->period_ns / 2;
+}
+
+static s64 _motor_pid_gain(long milli)
+{
+	return div_s64((s64)milli * (1 << MOTOR_PID_SHIFT), 1000);
+}
+
+static void _motor_pid_output(struct motor_pid *pid, long out)
+{
+	struct motor_classdev *cdev = pid->cdev;
+	int dir = (out > 0) ? 1 : ((out < 0) ? -1 : pid->dir);
+
+	if(dir != pid->dir)
+	{
+		cdev->ctl(cdev, dir > 0 ? MOTOR_FORWARD : MOTOR_BACKWARD, 0);
+		pid->dir = dir;
+	}
+	cdev->setduty(cdev, div_u64((u64)ABS(out) * cdev->getperiod(cdev), MOTOR_PID_DUTY_FULL));
+	pid->out = out;
+}
+
+static enum hrtimer_restart motor_pid_handler(struct hrtimer *timer)
+{
+	struct motor_pid *pid = container_of(timer, struct motor_pid, timer);
+	ktime_t start = ktime_get();
+	s64 velocity, err, integ, u;
+	s64 integ_min, integ_max;
+	unsigned long err_abs, cost;
+	long out;
+	u64 missed;
+
+	spin_lock(&pid->lock);
+	if(unlikely(!pid->running || motor_estopped()))
+	{	// killed, maybe while we waited for the lock; the output stays off
+		spin_unlock(&pid->lock);
+		return HRTIMER_NORESTART;
+	}
+	velocity = _motor_pid_read(pid);
+	err = pid->target - velocity;
+	integ = pid->integ + pid->ki_q * err;
+	u = pid->kp_q * err + integ - pid->kd_q * (velocity - pid->velocity);
+	u >>= MOTOR_PID_SHIFT;
+	pid->velocity = velocity;
+
+	if(u > pid->out_max)
+	{
+		out = pid->out_max;
+		if(err < 0)
+			pid->integ = integ;
+		pid->stats.saturated++;
+	}
+	else if(u < pid->out_min)
+	{
+		out = pid->out_min;
+		if(err > 0)
+			pid->integ = integ;
+		pid->stats.saturated++;
+	}
+	else
+	{
+		out = u;
+		pid->integ = integ;
+	}
+	integ_min = (s64)pid->out_min * (1 << MOTOR_PID_SHIFT);
+	integ_max = (s64)pid->out_max * (1 << MOTOR_PID_SHIFT);
+	if(pid->integ > integ_max)
+		pid->integ = integ_max;
+	else if(pid->integ < integ_min)
+		pid->integ = integ_min;
+	_motor_pid_output(pid, out);
+
+	err_abs = ABS(err);
+	pid->stats.loops++;
+	pid->stats.err_sum += err_abs;
+	if(err_abs > pid->stats.err_max)
+		pid->stats.err_max = err_abs;
+	missed = hrtimer_forward_now(timer, ns_to_ktime(pid->period_ns));
+	if(missed > 1)
+		pid->stats.overruns += missed - 1;
+	cost = ktime_to_ns(ktime_sub(ktime_get(), start));
+	if(cost > pid->stats.loop_ns_max)
+		pid->stats.loop_ns_max = cost;
+	spin_unlock(&pid->lock);
+	return HRTIMER_RESTART;
+}
+
+static int _motor_pid_start(struct motor_pid *pid)
+{
+	unsigned long flags;
+
+	if(pid->running)
+		return 0;
+	if(!pid->read_velocity && !pid->cdev->encoder)
+		return -ENODEV;
+	if(motor_estopped())
+		return -EBUSY;
+
+	_motor_pid_window(pid);
+	spin_lock_irqsave(&pid->lock, flags);
+	pid->integ = 0;
+	pid->out = 0;
+	pid->dir = 0;
+	pid->velocity = _motor_pid_read(pid);
+	spin_unlock_irqrestore(&pid->lock, flags);
+	pid->running = true;
+	hrtimer_start(&pid->timer, ns_to_ktime(pid->period_ns), HRTIMER_MODE_REL);
+	return 0;
+}
+
+static void _motor_pid_stop(struct motor_pid *pid)
+{
+	struct motor_classdev *cdev = pid->cdev;
+
+	if(!pid->running)
+		return;
+	hrtimer_cancel(&pid->timer);
+	pid->running = false;
+	cdev->setduty(cdev, 0);
+	pid->out = 0;
+	if(pid->dir)
+		cdev->ctl(cdev, MOTOR_STANDBY, 0);
+	pid->dir = 0;
+}
+
+static int motor_pid_set(struct motor_classdev *motor_cdev, enum motor_pid_param param, long value)
+{
+	struct motor_pid *pid = motor_cdev->pid;
+	unsigned long flags;
+	int ret = 0;
+
+	switch(param)
+	{
+		case MOTOR_PID_ENABLE:
+			if(value)
+				return _motor_pid_start(pid);
+			_motor_pid_stop(pid);
+			return 0;
+		case MOTOR_PID_OUT_MIN:
+		case MOTOR_PID_OUT_MAX:
+			if(ABS(value) > MOTOR_PID_DUTY_FULL)
+				return -EINVAL;
+			break;
+		case MOTOR_PID_PERIOD:
+			if(value < MOTOR_PID_MIN_PERIOD_NS)
+				return -EINVAL;
+			break;
+		default:
+			break;
+	}
+
+	spin_lock_irqsave(&pid->lock, flags);
+	switch(param)
+	{
+		case MOTOR_PID_TARGET:
+			pid->target = value;
+			break;
+		case MOTOR_PID_KP:
+			pid->kp = value;
+			pid->kp_q = _motor_pid_gain(value);
+			break;
+		case MOTOR_PID_KI:
+			pid->ki = value;
+			pid->ki_q = _motor_pid_gain(value);
+			break;
+		case MOTOR_PID_KD:
+			pid->kd = value;
+			pid->kd_q = _motor_pid_gain(value);
+			break;
+		case MOTOR_PID_OUT_MIN:
+			if(value > pid->out_max)
+				ret = -EINVAL;
+			else
+				pid->out_min = value;
+			break;
+		case MOTOR_PID_OUT_MAX:
+			if(value < pid->out_min)
+				ret = -EINVAL;
+			else
+				pid->out_max = value;
+			break;
+		case MOTOR_PID_PERIOD:
+			pid->period_ns = value;
+			break;
+		default:
+			memset(&pid->stats, 0, sizeof(pid->stats));
+			break;
+	}
+	spin_unlock_irqrestore(&pid->lock, flags);
+	if(param == MOTOR_PID_PERIOD)
+		_motor_pid_window(pid);
+	return ret;
+}
+
+static long motor_pid_get(struct motor_classdev *motor_cdev, enum motor_pid_param param)
+{
+	struct motor_pid *pid = motor_cdev->pid;
+	unsigned long flags;
+	long value;
+
+	spin_lock_irqsave(&pid->lock, flags);
+	switch(param)
+	{
+		case MOTOR_PID_ENABLE:		value = pid->running;		break;
+		case MOTOR_PID_TARGET:		value = pid->target;		break;
+		case MOTOR_PID_KP:		value = pid->kp;		break;
+		case MOTOR_PID_KI:		value = pid->ki;		break;
+		case MOTOR_PID_KD:		value = pid->kd;		break;
+		case MOTOR_PID_OUT_MIN:		value = pid->out_min;		break;
+		case MOTOR_PID_OUT_MAX:		value = pid->out_max;		break;
+		case MOTOR_PID_PERIOD:		value = pid->period_ns;		break;
+		case MOTOR_PID_OUTPUT:		value = pid->out;		break;
+		case MOTOR_PID_VELOCITY:	value = pid->velocity;		break;
+		case MOTOR_PID_LOOPS:		value = pid->stats.loops;	break;
+		case MOTOR_PID_OVERRUNS:	value = pid->stats.overruns;	break;
+		case MOTOR_PID_SATURATED:	value = pid->stats.saturated;	break;
+		case MOTOR_PID_ERR_AVG:
+			value = pid->stats.loops ? div_u64(pid->stats.err_sum, pid->stats.loops) : 0;
+			break;
+		case MOTOR_PID_ERR_MAX:		value = pid->stats.err_max;	break;
+		case MOTOR_PID_LOOP_NS_MAX:	value = pid->stats.loop_ns_max;	break;
+		default:			value = 0;			break;
+	}
+	spin_unlock_irqrestore(&pid->lock, flags);
+	return value;
+}
+
+/**
+ * motor_pid_init - attach a velocity loop to a dc motor
+ * @cdev: the motor, before motor_classdev_register(); it must have ctl,
+ *	setduty and getperiod
+ * @pid: the loop, read_velocity and priv set by the caller
+ *
+ * The loop starts disabled with zero gains and full range limits.
+ */
+int motor_pid_init(struct motor_classdev *cdev, struct motor_pid *pid)
+{
+	if(!cdev->ctl || !cdev->setduty || !cdev->getperiod)
+		return -EINVAL;
+
+	spin_lock_init(&pid->lock);
+	hrtimer_init(&pid->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	pid->timer.function = motor_pid_handler;
+	pid->cdev = cdev;
+	pid->running = false;
+	pid->period_ns = MOTOR_PID_PERIOD_NS;
+	pid->target = 0;
+	pid->kp = pid->ki = pid->kd = 0;
+	pid->kp_q = pid->ki_q = pid->kd_q = 0;
+	pid->out_min = -MOTOR_PID_DUTY_FULL;
+	pid->out_max = MOTOR_PID_DUTY_FULL;
+	pid->out = 0;
+	pid->integ = 0;
+	pid->velocity = 0;
+	pid->dir = 0;
+	memset(&pid->stats, 0, sizeof(pid->stats));
+
+	cdev->pid = pid;
+	cdev->setpid = motor_pid_set;
+	cdev->getpid = motor_pid_get;
+	return 0;
+}
+EXPORT_SYMBOL_GPL(motor_pid_init);
+
+/* stop the loop, before motor_classdev_unregister() */
+void motor_pid_release(struct motor_pid *pid)
+{
+	_motor_pid_stop(pid);
+}
+EXPORT_SYMBOL_GPL(motor_pid_release);
+
+/**
+ * motor_pid_kill - stop the loop from an e-stop
+ * @pid: the loop
+ *
+ * Any context. The output is left to the caller, which has already cut
+ * the motor; the loop stays disabled until enabled again. A handler
+ * running right now finds the loop stopped once it has the lock.
+ */
+void motor_pid_kill(struct motor_pid *pid)
+{
+	unsigned long flags;
+
+	hrtimer_try_to_cancel(&pid->timer);
+	spin_lock_irqsave(&pid->lock, flags);
+	pid->running = false;
+	pid->out = 0;
+	pid->dir = 0;
+	spin_unlock_irqrestore(&pid->lock, flags);
+}
+EXPORT_SYMBOL_GPL(motor_pid_kill);
+
+MODULE_AUTHOR("Eric Hsiao, erichsiao815@gmail.com");
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("velocity pid loop for dc motors");
@@ -0,0 +1,236 @@
+/*
+ * 	motor_pid_sim.c
+ *
+ * Copyright (C) 2015 Eric Hsiao <erichsiao815@gmail.com>
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ *
+ * Simulated dc motor ("dc-sim") on the motor class, for benchmarking the
+ * velocity loop without hardware. The plant is first order:
+ *
+ *	tau * dv/dt = max_rate * duty / period - v
+ *
+ * integrated every tick_us, and its shaft drives a simulated encoder
+ * through the real decoder. The pid attribute reports loop rate,
+ * overruns, loop cost and tracking error:
+ *
+ *	modprobe motor_pid_sim
+ *	echo "target 8000" > /sys/class/motor/dc-sim/pid
+ *	echo "enable 1" > /sys/class/motor/dc-sim/pid
+ *	cat /sys/class/motor/dc-sim/pid
+ */
+
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/device.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/spinlock.h>
+#include <linux/math64.h>
+#include <linux/motor.h>
+#include <linux/motor_encoder.h>
+#include <linux/motor_pid.h>
+
+
+#define MOTOR_NAME		"dc-sim"
+
+static unsigned int max_rate = 20000;
+module_param(max_rate, uint, S_IRUGO);
+MODULE_PARM_DESC(max_rate, "steady state speed at 100% duty, counts per second");
+
+static unsigned int tau_ms = 50;
+module_param(tau_ms, uint, S_IRUGO);
+MODULE_PARM_DESC(tau_ms, "mechanical time constant");
+
+static unsigned int tick_us = 100;
+module_param(tick_us, uint, S_IRUGO);
+MODULE_PARM_DESC(tick_us, "plant integration step");
+
+struct pid_sim {
+	spinlock_t	lock;
+	struct hrtimer	timer;
+	ktime_t		last;
+	enum motor_state state;
+	int		dir;
+	unsigned long	duty_ns;
+	unsigned long	period_ns;
+	s64		velocity;	// milli counts per second
+	u64		acc;		// edge fraction, milli counts * ns
+};
+
+static struct pid_sim pid_sim_data;
+static struct motor_encoder pid_sim_encoder = {
+	.sim	= 1,
+};
+static struct motor_pid pid_sim_pid;
+
+static enum hrtimer_restart pid_sim_handler(struct hrtimer *timer)
+{
+	struct pid_sim *sim = &pid_sim_data;
+	ktime_t now = ktime_get();
+	s64 dt = ktime_to_ns(ktime_sub(now, sim->last));
+	s64 drive;
+	u64 edges;
+
+	spin_lock(&sim->lock);
+	sim->last = now;
+	drive = div_s64((s64)max_rate * 1000 * sim->duty_ns, sim->period_ns) * sim->dir;
+	sim->velocity += div_s64((drive - sim->velocity) * dt, tau_ms * NSEC_PER_MSEC);
+	sim->acc += (u64)ABS(sim->velocity) * dt;
+	edges = div64_u64(sim->acc, 1000ULL * NSEC_PER_SEC);
+	sim->acc -= edges * 1000ULL * NSEC_PER_SEC;
+	while(edges--)
+		motor_encoder_sim_edge(&pid_sim_encoder, sim->velocity > 0 ? 1 : -1);
+	spin_unlock(&sim->lock);
+
+	hrtimer_forward_now(timer, ktime_set(0, tick_us * NSEC_PER_USEC));
+	return HRTIMER_RESTART;
+}
+
+static void pid_sim_ctl(struct motor_classdev *motor_cdev, enum motor_state ctrl, int step)
+{
+	struct pid_sim *sim = &pid_sim_data;
+	unsigned long flags;
+
+	spin_lock_irqsave(&sim->lock, flags);
+	switch(ctrl)
+	{
+		case MOTOR_FORWARD:
+			sim->dir = 1;
+			sim->state = MOTOR_FORWARD;
+			break;
+		case MOTOR_BACKWARD:
+			sim->dir = -1;
+			sim->state = MOTOR_BACKWARD;
+			break;
+		default:
+		case MOTOR_STANDBY:
+			sim->dir = 0;
+			sim->state = MOTOR_STANDBY;
+			break;
+	}
+	spin_unlock_irqrestore(&sim->lock, flags);
+}
+
+static enum motor_state pid_sim_getstate(struct motor_classdev *motor_cdev)
+{
+	return pid_sim_data.state;
+}
+
+static int pid_sim_setduty(struct motor_classdev *motor_cdev, unsigned long duty_ns)
+{
+	struct pid_sim *sim = &pid_sim_data;
+	unsigned long flags;
+
+	if(duty_ns > sim->period_ns)
+		return -EINVAL;
+	spin_lock_irqsave(&sim->lock, flags);
+	sim->duty_ns = duty_ns;
+	spin_unlock_irqrestore(&sim->lock, flags);
+	return 0;
+}
+
+static unsigned long pid_sim_getduty(struct motor_classdev *motor_cdev)
+{
+	return pid_sim_data.duty_ns;
+}
+
+static int pid_sim_setperiod(struct motor_classdev *motor_cdev, unsigned long period_ns)
+{
+	struct pid_sim *sim = &pid_sim_data;
+	unsigned long flags;
+
+	spin_lock_irqsave(&sim->lock, flags);
+	sim->duty_ns = div_u64((u64)sim->duty_ns * period_ns, sim->period_ns);
+	sim->period_ns = period_ns;
+	spin_unlock_irqrestore(&sim->lock, flags);
+	return 0;
+}
+
+static unsigned long pid_sim_getperiod(struct motor_classdev *motor_cdev)
+{
+	return pid_sim_data.period_ns;
+}
+
+static void pid_sim_setspeed(struct motor_classdev *motor_cdev, unsigned int speed)
+{
+	if(speed <= 100)
+		pid_sim_setduty(motor_cdev, div_u64((u64)pid_sim_data.period_ns * speed, 100));
+}
+
+static unsigned int pid_sim_getspeed(struct motor_classdev *motor_cdev)
+{
+	return div_u64((u64)pid_sim_data.duty_ns * 100 + pid_sim_data.period_ns / 2, pid_sim_data.period_ns);
+}
+
+static struct motor_classdev pid_sim_classdev =
+{
+	.name		= MOTOR_NAME,
+	.type		= MOTOR_TYPE_DC,
+	.ctl		= pid_sim_ctl,
+	.getstate	= pid_sim_getstate,
+	.setspeed	= pid_sim_setspeed,
+	.getspeed	= pid_sim_getspeed,
+	.setduty	= pid_sim_setduty,
+	.getduty	= pid_sim_getduty,
+	.setperiod	= pid_sim_setperiod,
+	.getperiod	= pid_sim_getperiod,
+};
+
+static int pid_sim_init(void)
+{
+	struct pid_sim *sim = &pid_sim_data;
+	int status;
+
+	if((tick_us == 0) || (tau_ms == 0))
+		return -EINVAL;
+
+	spin_lock_init(&sim->lock);
+	sim->state = MOTOR_STANDBY;
+	sim->period_ns = 50000;			// 20 kHz
+	hrtimer_init(&sim->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	sim->timer.function = pid_sim_handler;
+
+	status = motor_pid_init(&pid_sim_classdev, &pid_sim_pid);
+	if (status < 0)
+		return status;
+	status = motor_classdev_register(NULL, &pid_sim_classdev);
+	if (status < 0)
+		return status;
+	status = motor_encoder_register(&pid_sim_classdev, &pid_sim_encoder);
+	if (status < 0)
+	{
+		motor_classdev_unregister(&pid_sim_classdev);
+		return status;
+	}
+
+	// gains for the default plant: 50 ppm per count/s is 100% at max_rate
+	pid_sim_classdev.setpid(&pid_sim_classdev, MOTOR_PID_KP, 20000);
+	pid_sim_classdev.setpid(&pid_sim_classdev, MOTOR_PID_KI, 1000);
+
+	sim->last = ktime_get();
+	hrtimer_start(&sim->timer, ktime_set(0, tick_us * NSEC_PER_USEC), HRTIMER_MODE_REL);
+	printk("%s: %u counts/s at 100%%, tau %u ms\n", MOTOR_NAME, max_rate, tau_ms);
+	return 0;
+}
+
+static void pid_sim_exit(void)
+{
+	motor_pid_release(&pid_sim_pid);
+	hrtimer_cancel(&pid_sim_data.timer);
+	motor_encoder_unregister(&pid_sim_encoder);
+	motor_classdev_unregister(&pid_sim_classdev);
+	printk(" GoodBye, %s\n",MOTOR_NAME);
+}
+
+module_init( pid_sim_init);
+module_exit( pid_sim_exit);
+
+MODULE_AUTHOR("Eric Hsiao, erichsiao815@gmail.com");
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("simulated dc motor plant for the velocity loop");
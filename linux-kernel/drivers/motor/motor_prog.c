@@ -0,0 +1,519 @@
+/*
+ * 	motor_prog.c
+ *
+ * Copyright (C) 2015 Eric Hsiao <erichsiao815@gmail.com>
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ *
+ * Interpreter of motion programs. The step engine that owns the motor
+ * calls motor_prog_run() from its timer whenever the motor comes to rest;
+ * the program runs until it starts a move, sleeps or waits for an event,
+ * and tells the engine which. Nothing in here sleeps.
+ *
+ * A program is checked once before it runs: opcodes and operands in
+ * range, loops nested at most MOTOR_PROG_DEPTH deep with bounded counts,
+ * and every loop body moving, dwelling or waiting, so no loop spins
+ * without the motor. A run still yields after MOTOR_PROG_BUDGET
+ * instructions in one call (a move-abs to where the motor is takes no
+ * time), which bounds the time spent in the timer.
+ *
+ * Events are class wide: SIGNAL wakes every program waiting for the
+ * event, or latches it for the next WAIT if none is. Userspace signals
+ * through prog_ctl and can poll() it for the end of the program and for
+ * the signals it sends:
+ *
+ *	cat cycle.bin > /sys/class/motor/<motor>/prog
+ *	echo run > /sys/class/motor/<motor>/prog_ctl
+ *	echo "signal 3" > /sys/class/motor/<motor>/prog_ctl
+ *	cat /sys/class/motor/<motor>/prog_ctl
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/init.h>
+#include <linux/device.h>
+#include <linux/sysfs.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/bitops.h>
+#include <linux/motor_prog.h>
+
+
+static DEFINE_SPINLOCK(motor_prog_lock);		// events and waiters
+static DEFINE_MUTEX(motor_prog_ctl_lock);		// upload and run
+static unsigned long motor_prog_events;
+static LIST_HEAD(motor_prog_waiters);
+
+static const char * const motor_prog_states[] = { "idle", "running", "error" };
+
+static inline void _motor_prog_notify(struct motor_prog *prog)
+{
+	if(prog->kn)
+		sysfs_notify_dirent(prog->kn);
+}
+
+static unsigned int _motor_prog_nargs(struct motor_prog *prog, u32 op)
+{
+	switch(op)
+	{
+		case MOTOR_PROG_MOVE:
+		case MOTOR_PROG_MOVE_ABS:
+			return prog->naxes;
+		case MOTOR_PROG_END:
+		case MOTOR_PROG_NEXT:
+			return 0;
+		default:
+			return 1;
+	}
+}
+
+/**
+ * motor_prog_verify - check a program before it runs
+ * @prog: the program, code and len filled in
+ *
+ * Returns -EINVAL with prog->err_pc at the first word it does not take.
+ */
+int motor_prog_verify(struct motor_prog *prog)
+{
+	bool blocks[MOTOR_PROG_DEPTH + 1];
+	unsigned int depth = 0;
+	unsigned int pc = 0;
+	unsigned int n;
+	unsigned int i;
+	bool moves;
+	s32 arg;
+	u32 op;
+
+	if(prog->len == 0)
+		goto bad;
+	blocks[0] = false;
+	while(pc < prog->len)
+	{
+		op = prog->code[pc];
+		if(op >= MOTOR_PROG_OP_NUM)
+			goto bad;
+		n = _motor_prog_nargs(prog, op);
+		if(pc + 1 + n > prog->len)
+			goto bad;
+		arg = n ? (s32)prog->code[pc + 1] : 0;
+		switch(op)
+		{
+			case MOTOR_PROG_END:
+				if(pc + 1 != prog->len)
+					goto bad;
+				break;
+			case MOTOR_PROG_MOVE:
+			case MOTOR_PROG_MOVE_ABS:
+				moves = false;
+				for(i = 0; i < n; i++)
+				{
+					arg = (s32)prog->code[pc + 1 + i];
+					if(abs(arg) > MOTOR_PROG_MOVE_MAX)
+						goto bad;
+					moves |= (arg != 0);
+				}
+				if((op == MOTOR_PROG_MOVE) && !moves)
+					goto bad;
+				blocks[depth] = true;
+				break;
+			case MOTOR_PROG_SPEED:
+				if(arg <= 0)
+					goto bad;
+				break;
+			case MOTOR_PROG_DWELL:
+				if((arg <= 0) || (arg > MOTOR_PROG_DWELL_MAX))
+					goto bad;
+				blocks[depth] = true;
+				break;
+			case MOTOR_PROG_LOOP:
+				if((arg <= 0) || (arg > MOTOR_PROG_LOOP_MAX) || (depth == MOTOR_PROG_DEPTH))
+					goto bad;
+				blocks[++depth] = false;
+				break;
+			case MOTOR_PROG_NEXT:
+				if((depth == 0) || !blocks[depth])
+					goto bad;
+				blocks[--depth] = true;
+				break;
+			case MOTOR_PROG_WAIT:
+			case MOTOR_PROG_SIGNAL:
+				if((arg < 0) || (arg >= MOTOR_PROG_EVENTS))
+					goto bad;
+				if(op == MOTOR_PROG_WAIT)
+					blocks[depth] = true;
+				break;
+		}
+		pc += 1 + n;
+	}
+	if(depth == 0)
+		return 0;
+bad:
+	prog->err_pc = pc;
+	return -EINVAL;
+}
+EXPORT_SYMBOL_GPL(motor_prog_verify);
+
+/**
+ * motor_prog_run - run a program up to its next move, dwell or wait
+ * @prog: the program
+ *
+ * Called by the owner with the motor at rest, from its timer and with
+ * its lock held. MOTOR_PROG_MOVING leaves the relative move in
+ * prog->steps, MOTOR_PROG_SLEEP the time in prog->sleep_ns.
+ */
+enum motor_prog_result motor_prog_run(struct motor_prog *prog)
+{
+	const u32 *code = prog->code;
+	unsigned int budget = MOTOR_PROG_BUDGET;
+	unsigned long flags;
+	unsigned int i;
+	bool moves;
+	s32 arg;
+	int d;
+
+	if(prog->state != MOTOR_PROG_RUNNING)
+		return MOTOR_PROG_DONE;
+	if(prog->event >= 0)
+	{	// not kicked by the event
+		spin_lock_irqsave(&motor_prog_lock, flags);
+		d = prog->event;
+		spin_unlock_irqrestore(&motor_prog_lock, flags);
+		if(d >= 0)
+			return MOTOR_PROG_WAITING;
+	}
+
+	while(budget--)
+	{
+		if(prog->pc >= prog->len)
+			break;
+		arg = (prog->pc + 1 < prog->len) ? (s32)code[prog->pc + 1] : 0;
+		prog->stats.insns++;
+		switch(code[prog->pc])
+		{
+			case MOTOR_PROG_MOVE:
+			case MOTOR_PROG_MOVE_ABS:
+				moves = false;
+				for(i = 0; i < prog->naxes; i++)
+				{
+					d = (s32)code[prog->pc + 1 + i];
+					if(code[prog->pc] == MOTOR_PROG_MOVE_ABS)
+						d -= prog->at[i];
+					prog->steps[i] = d;
+					prog->at[i] += d;
+					moves |= (d != 0);
+				}
+				prog->pc += 1 + prog->naxes;
+				if(moves)
+				{
+					prog->stats.moves++;
+					return MOTOR_PROG_MOVING;
+				}
+				break;
+			case MOTOR_PROG_SPEED:
+				prog->ops->setspeed(prog, arg);
+				prog->pc += 2;
+				break;
+			case MOTOR_PROG_DWELL:
+				prog->sleep_ns = (u64)arg * NSEC_PER_USEC;
+				prog->pc += 2;
+				return MOTOR_PROG_SLEEP;
+			case MOTOR_PROG_LOOP:
+				prog->pc += 2;
+				prog->loop_pc[prog->depth] = prog->pc;
+				prog->loop_left[prog->depth] = arg;
+				prog->depth++;
+				break;
+			case MOTOR_PROG_NEXT:
+				if(--prog->loop_left[prog->depth - 1])
+				{
+					prog->pc = prog->loop_pc[prog->depth - 1];
+				}
+				else
+				{
+					prog->depth--;
+					prog->pc++;
+				}
+				break;
+			case MOTOR_PROG_WAIT:
+				prog->pc += 2;
+				spin_lock_irqsave(&motor_prog_lock, flags);
+				if(test_and_clear_bit(arg, &motor_prog_events))
+				{
+					spin_unlock_irqrestore(&motor_prog_lock, flags);
+					break;
+				}
+				prog->event = arg;
+				list_add_tail(&prog->node, &motor_prog_waiters);
+				spin_unlock_irqrestore(&motor_prog_lock, flags);
+				return MOTOR_PROG_WAITING;
+			case MOTOR_PROG_SIGNAL:
+				prog->pc += 2;
+				prog->stats.signals++;
+				motor_prog_signal(arg);
+				_motor_prog_notify(prog);
+				break;
+			default:
+			case MOTOR_PROG_END:
+				prog->pc = prog->len;
+				break;
+		}
+	}
+	if(prog->pc < prog->len)
+	{
+		prog->stats.yields++;
+		prog->sleep_ns = MOTOR_PROG_YIELD_NS;
+		return MOTOR_PROG_SLEEP;
+	}
+	prog->state = MOTOR_PROG_IDLE;
+	_motor_prog_notify(prog);
+	return MOTOR_PROG_DONE;
+}
+EXPORT_SYMBOL_GPL(motor_prog_run);
+
+/**
+ * motor_prog_abort - end a program the owner stopped
+ * @prog: the program
+ *
+ * Called by the owner when it stops the motor, from any context.
+ */
+void motor_prog_abort(struct motor_prog *prog)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&motor_prog_lock, flags);
+	if(prog->event >= 0)
+	{
+		list_del_init(&prog->node);
+		prog->event = -1;
+	}
+	spin_unlock_irqrestore(&motor_prog_lock, flags);
+	if(prog->state == MOTOR_PROG_RUNNING)
+	{
+		prog->state = MOTOR_PROG_IDLE;
+		_motor_prog_notify(prog);
+	}
+}
+EXPORT_SYMBOL_GPL(motor_prog_abort);
+
+/**
+ * motor_prog_signal - raise an event
+ * @event: 0 to MOTOR_PROG_EVENTS - 1
+ *
+ * Kicks every program waiting for it; with none waiting, the event is
+ * kept for the next WAIT. Any context.
+ */
+void motor_prog_signal(unsigned int event)
+{
+	struct motor_prog *prog, *next;
+	unsigned long flags;
+	bool woken = false;
+
+	if(event >= MOTOR_PROG_EVENTS)
+		return;
+	spin_lock_irqsave(&motor_prog_lock, flags);
+	list_for_each_entry_safe(prog, next, &motor_prog_waiters, node)
+	{
+		if(prog->event != event)
+			continue;
+		list_del_init(&prog->node);
+		prog->event = -1;
+		prog->ops->kick(prog);
+		woken = true;
+	}
+	if(!woken)
+		set_bit(event, &motor_prog_events);
+	spin_unlock_irqrestore(&motor_prog_lock, flags);
+}
+EXPORT_SYMBOL_GPL(motor_prog_signal);
+
+static inline struct motor_prog *kobj_to_motor_prog(struct kobject *kobj)
+{
+	struct motor_classdev *motor_cdev = dev_get_drvdata(container_of(kobj, struct device, kobj));
+
+	return motor_cdev->prog;
+}
+
+/* prog: the bytecode, native endian words, written from offset 0 */
+static ssize_t motor_prog_code_read(struct file *filp, struct kobject *kobj,
+		struct bin_attribute *attr, char *buf, loff_t off, size_t count)
+{
+	struct motor_prog *prog = kobj_to_motor_prog(kobj);
+	size_t size = prog->len * sizeof(u32);
+
+	if(off >= size)
+		return 0;
+	count = min_t(size_t, count, size - off);
+	memcpy(buf, (char *)prog->code + off, count);
+	return count;
+}
+
+static ssize_t motor_prog_code_write(struct file *filp, struct kobject *kobj,
+		struct bin_attribute *attr, char *buf, loff_t off, size_t count)
+{
+	struct motor_prog *prog = kobj_to_motor_prog(kobj);
+	ssize_t ret = count;
+
+	if((off % sizeof(u32)) || (count % sizeof(u32)) || (off + count > sizeof(prog->code)))
+		return -EINVAL;
+	mutex_lock(&motor_prog_ctl_lock);
+	if(prog->state == MOTOR_PROG_RUNNING)
+	{
+		ret = -EBUSY;
+	}
+	else
+	{
+		if(off == 0)
+			prog->len = 0;
+		memcpy((char *)prog->code + off, buf, count);
+		prog->len = max_t(unsigned int, prog->len, (off + count) / sizeof(u32));
+		prog->state = MOTOR_PROG_IDLE;
+	}
+	mutex_unlock(&motor_prog_ctl_lock);
+	return ret;
+}
+
+static struct bin_attribute motor_prog_attrs_code = {
+	.attr	= { .name = "prog", .mode = S_IRUGO|S_IWUSR },
+	.size	= MOTOR_PROG_WORDS * sizeof(u32),
+	.read	= motor_prog_code_read,
+	.write	= motor_prog_code_write,
+};
+
+/* prog_ctl: "run", "stop" or "signal <event>" */
+static ssize_t motor_prog_ctl_store(struct device *dev, struct device_attribute *attr,
+			const char *buf, size_t count)
+{
+	struct motor_classdev *motor_cdev = dev_get_drvdata(dev);
+	struct motor_prog *prog = motor_cdev->prog;
+	unsigned int event;
+	int ret = 0;
+
+	if(sscanf(buf, "signal %u", &event) == 1)
+	{
+		if(event >= MOTOR_PROG_EVENTS)
+			return -EINVAL;
+		motor_prog_signal(event);
+		return count;
+	}
+
+	mutex_lock(&motor_prog_ctl_lock);
+	if(sysfs_streq(buf, "stop"))
+	{
+		prog->ops->stop(prog);
+	}
+	else if(!sysfs_streq(buf, "run"))
+	{
+		ret = -EINVAL;
+	}
+	else if(prog->state == MOTOR_PROG_RUNNING)
+	{
+		ret = -EBUSY;
+	}
+	else if(motor_prog_verify(prog))
+	{
+		prog->state = MOTOR_PROG_ERROR;
+		ret = -EINVAL;
+	}
+	else
+	{
+		prog->pc = 0;
+		prog->depth = 0;
+		prog->event = -1;
+		memset(prog->at, 0, sizeof(prog->at));
+		prog->state = MOTOR_PROG_RUNNING;
+		prog->stats.runs++;
+		ret = prog->ops->start(prog);
+		if(ret)
+			prog->state = MOTOR_PROG_IDLE;
+	}
+	mutex_unlock(&motor_prog_ctl_lock);
+	return ret ? ret : count;
+}
+
+static ssize_t motor_prog_ctl_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct motor_classdev *motor_cdev = dev_get_drvdata(dev);
+	struct motor_prog *prog = motor_cdev->prog;
+	unsigned int i;
+	ssize_t len;
+
+	len = sprintf(buf, "state %s\nlen %u\npc %u\n", motor_prog_states[prog->state],
+			prog->len, prog->pc);
+	if(prog->state == MOTOR_PROG_ERROR)
+		len += sprintf(buf + len, "err_pc %u\n", prog->err_pc);
+	len += sprintf(buf + len, "waiting %d\nat", prog->event);
+	for(i = 0; i < prog->naxes; i++)
+		len += sprintf(buf + len, " %d", prog->at[i]);
+	len += sprintf(buf + len, "\nruns %lu\ninsns %lu\nmoves %lu\nyields %lu\nsignals %lu\n",
+			prog->stats.runs, prog->stats.insns, prog->stats.moves,
+			prog->stats.yields, prog->stats.signals);
+	return len;
+}
+
+static struct device_attribute motor_prog_attrs_ctl =
+	__ATTR(prog_ctl, S_IRUGO|S_IWUSR, motor_prog_ctl_show, motor_prog_ctl_store);
+
+/**
+ * motor_prog_register - give a registered motor or group a program
+ * @cdev: the motor
+ * @prog: the program, ops and naxes set by the owner
+ *
+ * The motor gets the prog and prog_ctl attributes and cdev->prog points
+ * to @prog.
+ */
+int motor_prog_register(struct motor_classdev *cdev, struct motor_prog *prog)
+{
+	int ret;
+
+	if((prog->ops == NULL) || (prog->naxes == 0) || (prog->naxes > MOTOR_GROUP_MAX_AXES))
+		return -EINVAL;
+	prog->cdev = cdev;
+	prog->state = MOTOR_PROG_IDLE;
+	prog->len = 0;
+	prog->pc = 0;
+	prog->depth = 0;
+	prog->event = -1;
+	INIT_LIST_HEAD(&prog->node);
+	memset(&prog->stats, 0, sizeof(prog->stats));
+	cdev->prog = prog;
+
+	ret = device_create_bin_file(cdev->dev, &motor_prog_attrs_code);
+	if(ret)
+		goto err;
+	ret = device_create_file(cdev->dev, &motor_prog_attrs_ctl);
+	if(ret)
+	{
+		device_remove_bin_file(cdev->dev, &motor_prog_attrs_code);
+		goto err;
+	}
+	prog->kn = sysfs_get_dirent(cdev->dev->kobj.sd, NULL, "prog_ctl");
+	return 0;
+err:
+	cdev->prog = NULL;
+	return ret;
+}
+EXPORT_SYMBOL_GPL(motor_prog_register);
+
+/* the owner has stopped the motor */
+void motor_prog_unregister(struct motor_prog *prog)
+{
+	struct motor_classdev *cdev = prog->cdev;
+
+	motor_prog_abort(prog);
+	if(prog->kn)
+		sysfs_put(prog->kn);
+	prog->kn = NULL;
+	device_remove_file(cdev->dev, &motor_prog_attrs_ctl);
+	device_remove_bin_file(cdev->dev, &motor_prog_attrs_code);
+	cdev->prog = NULL;
+}
+EXPORT_SYMBOL_GPL(motor_prog_unregister);
+
+MODULE_AUTHOR("Eric Hsiao, erichsiao815@gmail.com");
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("motion program interpreter for motors");
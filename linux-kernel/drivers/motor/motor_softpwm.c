@@ -0,0 +1,218 @@
+/*
+ * 	motor_softpwm.c
+ *
+ * Copyright (C) 2015 Eric Hsiao <erichsiao815@gmail.com>
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ *
+ * Software pwm engine for dc motor channels. Every channel has one
+ * pending edge, kept in a list sorted by time, and a single hrtimer is
+ * armed for the head of the list. Each expiry writes all edges due within
+ * MOTOR_SOFTPWM_SLACK_NS and re-inserts their channels, so channels with
+ * a common period cost one interrupt per period start instead of one per
+ * channel.
+ *
+ * A period starts high and falls after duty_ns. 0 and 100% duty leave
+ * the channel out of the list. New settings are taken at the next period
+ * start, so a change never cuts a pulse short.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/init.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/gpio.h>
+#include <linux/motor_softpwm.h>
+
+
+static LIST_HEAD(motor_softpwm_edges);
+static DEFINE_SPINLOCK(motor_softpwm_lock);
+static struct hrtimer motor_softpwm_timer;
+
+static void _motor_softpwm_set(struct motor_softpwm *pwm, int level)
+{
+	if(pwm->level != level)
+	{
+		gpio_set_value(pwm->gpio, level);
+		pwm->level = level;
+	}
+}
+
+/*
+ * Queue the channel at its next_edge and re-arm the timer if it became
+ * the head. The handler always re-arms with hrtimer_start() and returns
+ * HRTIMER_NORESTART, so arming from here is safe while it runs.
+ */
+static void _motor_softpwm_queue(struct motor_softpwm *pwm)
+{
+	struct motor_softpwm *pos;
+
+	list_for_each_entry(pos, &motor_softpwm_edges, node)
+	{
+		if(ktime_to_ns(pwm->next_edge) < ktime_to_ns(pos->next_edge))
+			break;
+	}
+	list_add_tail(&pwm->node, &pos->node);
+	pwm->queued = true;
+	if(motor_softpwm_edges.next == &pwm->node)
+		hrtimer_start(&motor_softpwm_timer, pwm->next_edge, HRTIMER_MODE_ABS);
+}
+
+/* write the due edge and queue the next one, called with the lock held */
+static void _motor_softpwm_edge(struct motor_softpwm *pwm)
+{
+	if(pwm->level)
+	{	// falling edge, low until the next period start
+		_motor_softpwm_set(pwm, 0);
+		pwm->next_edge = ktime_add_ns(pwm->period_start, pwm->period_ns);
+		_motor_softpwm_queue(pwm);
+		return;
+	}
+
+	pwm->period_start = pwm->next_edge;
+	pwm->period_ns = pwm->req_period_ns;
+	pwm->duty_ns = pwm->req_duty_ns;
+	if(pwm->duty_ns == 0)
+		return;				// stays low
+	_motor_softpwm_set(pwm, 1);
+	if(pwm->duty_ns >= pwm->period_ns)
+		return;				// stays high
+	pwm->next_edge = ktime_add_ns(pwm->period_start, pwm->duty_ns);
+	_motor_softpwm_queue(pwm);
+}
+
+static enum hrtimer_restart motor_softpwm_handler(struct hrtimer *timer)
+{
+	struct motor_softpwm *pwm;
+	ktime_t limit;
+
+	spin_lock(&motor_softpwm_lock);
+	limit = ktime_add_ns(ktime_get(), MOTOR_SOFTPWM_SLACK_NS);
+	while(!list_empty(&motor_softpwm_edges))
+	{
+		pwm = list_first_entry(&motor_softpwm_edges, struct motor_softpwm, node);
+		if(ktime_to_ns(pwm->next_edge) > ktime_to_ns(limit))
+		{
+			hrtimer_start(timer, pwm->next_edge, HRTIMER_MODE_ABS);
+			break;
+		}
+		list_del(&pwm->node);
+		pwm->queued = false;
+		_motor_softpwm_edge(pwm);
+	}
+	spin_unlock(&motor_softpwm_lock);
+	return HRTIMER_NORESTART;
+}
+
+/**
+ * motor_softpwm_config - set duty and period of a channel
+ * @pwm: the channel
+ * @duty_ns: high time, 0 is off
+ * @period_ns: at least MOTOR_SOFTPWM_MIN_PERIOD_NS
+ *
+ * Takes effect at the next period start, or right away when the channel
+ * is idle at 0 or 100%.
+ */
+int motor_softpwm_config(struct motor_softpwm *pwm, unsigned long duty_ns, unsigned long period_ns)
+{
+	unsigned long flags;
+	ktime_t now;
+
+	if(period_ns < MOTOR_SOFTPWM_MIN_PERIOD_NS)
+		return -EINVAL;
+	if(duty_ns > period_ns)
+		duty_ns = period_ns;
+
+	spin_lock_irqsave(&motor_softpwm_lock, flags);
+	pwm->req_period_ns = period_ns;
+	pwm->req_duty_ns = duty_ns;
+	if(!pwm->queued)
+	{
+		now = ktime_get();
+		if(pwm->level && (duty_ns > 0) && (duty_ns < period_ns))
+		{	// leave 100%: this period started now
+			pwm->period_start = now;
+			pwm->period_ns = period_ns;
+			pwm->duty_ns = duty_ns;
+			pwm->next_edge = ktime_add_ns(now, duty_ns);
+			_motor_softpwm_queue(pwm);
+		}
+		else if(pwm->level && (duty_ns == 0))
+		{
+			_motor_softpwm_set(pwm, 0);
+		}
+		else if(!pwm->level && (duty_ns > 0))
+		{	// leave 0%: start a period now
+			pwm->next_edge = now;
+			_motor_softpwm_queue(pwm);
+		}
+	}
+	spin_unlock_irqrestore(&motor_softpwm_lock, flags);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(motor_softpwm_config);
+
+/**
+ * motor_softpwm_add - attach a gpio to the pwm engine
+ * @pwm: the channel, with gpio requested as an output
+ *
+ * The channel starts low and idle.
+ */
+int motor_softpwm_add(struct motor_softpwm *pwm)
+{
+	if(gpio_cansleep(pwm->gpio))
+		return -EINVAL;
+
+	INIT_LIST_HEAD(&pwm->node);
+	pwm->queued = false;
+	pwm->level = 0;
+	pwm->period_ns = MOTOR_SOFTPWM_MIN_PERIOD_NS;
+	pwm->duty_ns = 0;
+	pwm->req_period_ns = pwm->period_ns;
+	pwm->req_duty_ns = 0;
+	gpio_set_value(pwm->gpio, 0);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(motor_softpwm_add);
+
+/* detach the channel and drive it low */
+void motor_softpwm_remove(struct motor_softpwm *pwm)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&motor_softpwm_lock, flags);
+	if(pwm->queued)
+	{
+		list_del(&pwm->node);
+		pwm->queued = false;
+	}
+	_motor_softpwm_set(pwm, 0);
+	spin_unlock_irqrestore(&motor_softpwm_lock, flags);
+}
+EXPORT_SYMBOL_GPL(motor_softpwm_remove);
+
+static int __init motor_softpwm_init(void)
+{
+	hrtimer_init(&motor_softpwm_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	motor_softpwm_timer.function = motor_softpwm_handler;
+	return 0;
+}
+
+static void __exit motor_softpwm_exit(void)
+{
+	hrtimer_cancel(&motor_softpwm_timer);
+}
+
+module_init(motor_softpwm_init);
+module_exit(motor_softpwm_exit);
+
+MODULE_AUTHOR("Eric Hsiao, erichsiao815@gmail.com");
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("software pwm engine for motor channels");
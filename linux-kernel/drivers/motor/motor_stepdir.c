@@ -0,0 +1,363 @@
+/*
+ * 	motor_stepdir.c
+ *
+ * Copyright (C) 2015 Eric Hsiao <erichsiao815@gmail.com>
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ *
+ * Step/dir stepper controllers (A4988, DRV8825, ...) on the motor class:
+ *
+ *		STEP : one rising edge per (micro)step
+ *		DIR  : high is forward
+ *		EN   : optional, /ENABLE on A4988 and DRV8825 (en_active_low)
+ *
+ * The pulse width and the dir setup time are per channel, 0 takes the
+ * step engine defaults. The gpios must not sleep, every edge is written
+ * from the step timer.
+ *
+ * With CONFIG_MOTOR_STEPDIR_PWM, a channel whose STEP pin is also a pwm
+ * output (pwm_id, or the pwm= module parameter for channel 0) hands
+ * constant rate moves to a pwm pulse train; the step timer then only
+ * stops it. pwm-sunxi sim=1 runs this on a simulated register file, the
+ * stats attribute of the motor reports offloaded steps and miscounts.
+ */
+
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/device.h>
+#include <linux/gpio.h>
+#include <linux/hrtimer.h>
+#include <linux/platform_device.h>
+#include <linux/err.h>
+#ifdef CONFIG_MOTOR_STEPDIR_PWM
+#include <linux/pwm.h>
+#include <linux/pwm_pulse_train.h>
+#endif
+#include <linux/motor.h>
+#include <linux/motor_stepper.h>
+
+
+#define MOTOR_NAME		"STEPDIR"
+
+
+
+struct stepdir_chdata {
+	int ch;
+	bool use;
+	const char *name;
+	enum motor_type type;
+	int flag;
+	unsigned int pps;
+	unsigned long pulse_ns;		// minimum step high time
+	unsigned long dir_setup_ns;	// dir change to step edge
+	// control pin
+	unsigned pin_step;
+	unsigned pin_dir;
+	unsigned pin_en;		// 0 if hardwired
+	bool en_active_low;
+	int pwm_id;			// pwm on the STEP pin, -1 none
+	struct pwm_device *pwm;
+	// step engine
+	struct motor_stepper stepper;
+};
+
+struct stepdir_platdata {
+	int num_ch;
+	struct stepdir_chdata *data;
+};
+
+#ifdef CONFIG_MOTOR_STEPDIR_PWM
+static int stepdir_pwm = -1;
+module_param_named(pwm, stepdir_pwm, int, S_IRUGO);
+MODULE_PARM_DESC(pwm, "pwm on the STEP pin of channel 0, for pulse train offload");
+#endif
+
+
+
+static void stepdir_set_step(struct motor_stepper *stp, int level)
+{
+	struct stepdir_chdata *pchdata = stp->priv;
+
+	gpio_set_value(pchdata->pin_step, level);
+}
+
+static void stepdir_set_dir(struct motor_stepper *stp, int dir)
+{
+	struct stepdir_chdata *pchdata = stp->priv;
+
+	gpio_set_value(pchdata->pin_dir, dir > 0 ? 1 : 0);
+}
+
+static int stepdir_enable(struct motor_stepper *stp)
+{
+	struct stepdir_chdata *pchdata = stp->priv;
+
+	if(pchdata->pin_en)
+		gpio_set_value(pchdata->pin_en, pchdata->en_active_low ? 0 : 1);
+	return 0;
+}
+
+static void stepdir_disable(struct motor_stepper *stp)
+{
+	struct stepdir_chdata *pchdata = stp->priv;
+
+	if(pchdata->pin_en)
+		gpio_set_value(pchdata->pin_en, pchdata->en_active_low ? 1 : 0);
+}
+
+static const struct motor_stepper_ops stepdir_ops = {
+	.set_step	= stepdir_set_step,
+	.set_dir	= stepdir_set_dir,
+	.enable		= stepdir_enable,
+	.disable	= stepdir_disable,
+};
+
+#ifdef CONFIG_MOTOR_STEPDIR_PWM
+static int stepdir_train_start(struct motor_stepper *stp, unsigned long period_ns,
+			unsigned long *actual_ns)
+{
+	struct stepdir_chdata *pchdata = stp->priv;
+
+	return pwm_pulse_train(pchdata->pwm, stp->pulse_ns, period_ns, actual_ns);
+}
+
+static long stepdir_train_stop(struct motor_stepper *stp)
+{
+	struct stepdir_chdata *pchdata = stp->priv;
+
+	pwm_pulse_train_stop(pchdata->pwm);
+	// take the pin back from the pwm for the edge generator
+	gpio_direction_output(pchdata->pin_step, 0);
+	return pwm_pulse_count(pchdata->pwm);
+}
+
+static const struct motor_stepper_ops stepdir_pwm_ops = {
+	.set_step	= stepdir_set_step,
+	.set_dir	= stepdir_set_dir,
+	.enable		= stepdir_enable,
+	.disable	= stepdir_disable,
+	.train_start	= stepdir_train_start,
+	.train_stop	= stepdir_train_stop,
+};
+#endif
+
+static void _stepdir_gpio_free(struct stepdir_chdata *chdata)
+{
+	gpio_free(chdata->pin_step);
+	gpio_free(chdata->pin_dir);
+	if(chdata->pin_en)
+		gpio_free(chdata->pin_en);
+}
+
+static int _stepdir_gpio_request(struct device *dev, struct stepdir_chdata *chdata)
+{
+	int ret;
+
+	ret = gpio_request_one(chdata->pin_step, GPIOF_OUT_INIT_LOW, "stepper STEP");
+	if(ret)
+		return ret;
+	ret = gpio_request_one(chdata->pin_dir, GPIOF_OUT_INIT_LOW, "stepper DIR");
+	if(ret)
+		goto err_step;
+	if(chdata->pin_en)
+	{
+		ret = gpio_request_one(chdata->pin_en,
+				chdata->en_active_low ? GPIOF_OUT_INIT_HIGH : GPIOF_OUT_INIT_LOW,
+				"stepper EN");
+		if(ret)
+			goto err_dir;
+	}
+	if(gpio_cansleep(chdata->pin_step) || gpio_cansleep(chdata->pin_dir) ||
+		(chdata->pin_en && gpio_cansleep(chdata->pin_en)))
+	{
+		dev_err(dev, "motor %s: step/dir gpios must not sleep\n", chdata->name);
+		_stepdir_gpio_free(chdata);
+		return -EINVAL;
+	}
+	return 0;
+err_dir:
+	gpio_free(chdata->pin_dir);
+err_step:
+	gpio_free(chdata->pin_step);
+	return ret;
+}
+
+static void _stepdir_release(struct stepdir_chdata *chdata)
+{
+#ifdef CONFIG_MOTOR_STEPDIR_PWM
+	if (chdata->pwm)
+		pwm_free(chdata->pwm);
+	chdata->pwm = NULL;
+#endif
+	_stepdir_gpio_free(chdata);
+}
+
+static int __devinit stepdir_probe(struct platform_device *pdev)
+{
+	int ret =0;
+	int i = 0;
+	struct stepdir_platdata *pdata = pdev->dev.platform_data; //dev_get_platdata(&pdev->dev);
+	struct stepdir_chdata *chdata;
+
+	if (pdata == NULL) {
+		dev_err(&pdev->dev, "missing platform data\n");
+		return -ENODEV;
+	}
+
+	if (pdata->num_ch< 1 ) {
+		dev_err(&pdev->dev, "Invalid channel number %d\n", pdata->num_ch);
+		return -EINVAL;
+	}
+
+	for (i = 0; i < pdata->num_ch; i++)
+	{
+		chdata = &pdata->data[i];
+		if(chdata->use == 0)
+			continue;
+
+		ret = _stepdir_gpio_request(&pdev->dev, chdata);
+		if (ret) {
+			dev_err(&pdev->dev, "failed to request gpios of motor %s\n",chdata->name);
+			goto err;
+		}
+
+		chdata->stepper.cdev.name = chdata->name;
+		chdata->stepper.cdev.type = chdata->type;
+		chdata->stepper.cdev.flags = chdata->flag;
+		chdata->stepper.ops = &stepdir_ops;
+		chdata->pwm = NULL;
+#ifdef CONFIG_MOTOR_STEPDIR_PWM
+		if (chdata->pwm_id >= 0) {
+			chdata->pwm = pwm_request(chdata->pwm_id, chdata->name);
+			if (IS_ERR(chdata->pwm)) {
+				dev_err(&pdev->dev, "motor %s: pwm%d busy, no pulse train\n",
+						chdata->name, chdata->pwm_id);
+				chdata->pwm = NULL;
+			} else {
+				chdata->stepper.ops = &stepdir_pwm_ops;
+			}
+		}
+#endif
+		chdata->stepper.mode = MOTOR_STEPPER_STEP_DIR;
+		chdata->stepper.pulse_ns = chdata->pulse_ns;
+		chdata->stepper.dir_setup_ns = chdata->dir_setup_ns;
+		chdata->stepper.pps = chdata->pps;
+		chdata->stepper.start_delay = ktime_set( 0, 1000000 );		//1msec, driver wake-up
+		chdata->stepper.priv = chdata;
+		ret = motor_stepper_register(&pdev->dev, &chdata->stepper);
+		if (ret) {
+			dev_err(&pdev->dev, "failed to register motor %s\n",chdata->name);
+			_stepdir_release(chdata);
+			goto err;
+		}
+		printk("register motor %s succeeded\r\n",chdata->name);
+	}
+	platform_set_drvdata(pdev, pdata);
+	return 0;
+err:
+	for (i = i - 1; i >= 0; i--) {
+		if(pdata->data[i].use == 0)
+			continue;
+		motor_stepper_unregister(&pdata->data[i].stepper);
+		_stepdir_release(&pdata->data[i]);
+	}
+	printk("register motor failed\r\n");
+	return ret;
+}
+
+static int __exit stepdir_remove(struct platform_device *pdev)
+{
+	struct stepdir_platdata *pdata = platform_get_drvdata(pdev);
+	int i = 0;
+
+	for (i = 0; i < pdata->num_ch; i++)
+	{
+		if(pdata->data[i].use == 0)
+			continue;
+		motor_stepper_unregister(&pdata->data[i].stepper);
+		_stepdir_release(&pdata->data[i]);
+		printk("motor %s removed \r\n",pdata->data[i].name);
+	}
+	return 0;
+}
+
+static struct stepdir_chdata stepdir_data[] =
+{
+	{
+		.ch = 0,
+		.use = 1,
+		.name = "stepdir",
+		.type = MOTOR_TYPE_STEPPER,
+		.flag = MOTOR_SUSPEND_SUPPORT,
+		.pps = 1000,
+		.pulse_ns = 0,		// engine default
+		.dir_setup_ns = 0,
+		.pin_step = 17,
+		.pin_dir = 27,
+		.pin_en = 22,
+		.en_active_low = 1,
+		.pwm_id = -1,
+	},
+};
+
+static struct stepdir_platdata stepdir_platform_data =
+{
+	.num_ch = ARRAY_SIZE(stepdir_data),
+	.data = stepdir_data,
+};
+
+static struct platform_driver stepdir_platform_driver = {
+	.driver = {
+		.name = MOTOR_NAME,
+		.owner =	THIS_MODULE,
+	},
+	.probe 	=	stepdir_probe,
+	.remove	=	stepdir_remove,
+};
+
+struct platform_device *pstepdir_platform_device;
+
+
+static int motor_stepdir_init(void)
+{
+	int status;
+
+	pstepdir_platform_device = platform_device_register_simple(MOTOR_NAME, -1, NULL, 0);
+	if (IS_ERR(pstepdir_platform_device))
+		return PTR_ERR(pstepdir_platform_device);
+
+#ifdef CONFIG_MOTOR_STEPDIR_PWM
+	if (stepdir_pwm >= 0)
+		stepdir_data[0].pwm_id = stepdir_pwm;
+#endif
+	pstepdir_platform_device->dev.platform_data = &stepdir_platform_data;
+	status = platform_driver_register(&stepdir_platform_driver);
+	if (status) {
+		pr_err("Unable to register platform driver\n");
+		platform_device_unregister(pstepdir_platform_device);
+		return status;
+	}
+	return 0;
+}
+
+static void motor_stepdir_exit(void)
+{
+	platform_driver_unregister(&stepdir_platform_driver);
+	pstepdir_platform_device->dev.platform_data = NULL;
+	platform_device_unregister( pstepdir_platform_device);
+	printk(" GoodBye, %s\n",MOTOR_NAME);
+}
+
+
+
+module_init( motor_stepdir_init);
+module_exit( motor_stepdir_exit);
+
+MODULE_AUTHOR("Eric Hsiao, erichsiao815@gmail.com");
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("step/dir stepper controller (A4988, DRV8825) on the motor class");
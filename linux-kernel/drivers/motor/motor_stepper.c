@@ -0,0 +1,4229 @@
+/*
+ * 	motor_stepper.c
+ *
+ * Copyright (C) 2015 Eric Hsiao <erichsiao815@gmail.com>
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ *
+ * Step engine shared by all coil-level stepper drivers. It owns the
+ * step timer, the remaining step counter and the phase sequence, and
+ * registers the motor class device. Drivers only supply
+ * struct motor_stepper_ops to drive the coils.
+ *
+ * Step/dir steppers share the counter, speed and class glue but have no
+ * phase sequence: their timer only toggles the step pin, one edge per
+ * expiry, so the per-step work is two gpio writes. Long moves can be
+ * handed to a hardware pulse train (ops->train_start), leaving a single
+ * timer expiry to stop it and an estimate of the steps done.
+ *
+ * Steppers on a shared output port (motor_stepper_port) are not stepped
+ * by their own hrtimer but by the port thread, which merges the coil
+ * changes of all its channels into one bus write per tick. Threaded
+ * steppers are stepped the same way by the engine thread, which sleeps
+ * until the earliest of their deadlines and writes their coils from
+ * process context.
+ *
+ * A group (motor_stepper_group) steps several steppers from one timer of
+ * its own for coordinated moves; its axes keep their counters, sequence
+ * and outputs but not their timers while the group moves.
+ *
+ * A pvt stream (motor_stepper_pvt_push) takes over the timer of a stepper
+ * with a handler that steps along a curve through the queued points, the
+ * segment ring (motor_stepper_ring_start) with one that runs the segments
+ * userspace queues in a shared page. A motion program (motor_prog) runs
+ * from the timer of the stepper or group whenever the motor is at rest.
+ *
+ * Armed steppers (motor_stepper_arm) each hold a move of their own, and
+ * one expiry of the fire timer takes the first step of all of them. An
+ * edge trigger (motor_trigger) takes the first step of its preloaded move
+ * from the edge interrupt.
+ *
+ * New targets and rates for a single move on a coil step timer go through
+ * a command mailbox (struct motor_stepper_mbox) that the timer reads at
+ * its next step, so the caller never holds the lock the timer needs.
+ *
+ * A step timer runs on the cpu it was started on, unless the stepper is
+ * placed on one (motor_stepper_set_cpu, the cpu attribute, or the cpus
+ * parameter spreading new steppers over a list); its output thread and
+ * the port threads follow. The engine thread keeps to thread_cpu, or to
+ * the cpus list.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/init.h>
+#include <linux/device.h>
+#include <linux/err.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/smp.h>
+#include <linux/cpumask.h>
+#include <linux/wait.h>
+#include <linux/gpio.h>
+#include <linux/interrupt.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/bitops.h>
+#include <linux/slab.h>
+#include <linux/motor.h>
+#include <linux/motor_stepper.h>
+#include <linux/math64.h>
+#include <asm/div64.h>
+
+
+#define MOTOR_PORT_KICK		0
+
+static LIST_HEAD(motor_stepper_ports);
+static DEFINE_MUTEX(motor_stepper_port_lock);
+
+/* armed steppers, started together by the fire timer */
+static LIST_HEAD(motor_stepper_armed);
+static DEFINE_SPINLOCK(motor_stepper_arm_lock);
+static struct hrtimer motor_stepper_fire_timer;
+
+/* every stepper and group, for the e-stop */
+static LIST_HEAD(motor_stepper_all);
+static LIST_HEAD(motor_stepper_groups);
+static DEFINE_SPINLOCK(motor_stepper_engine_lock);
+
+/* cpus the step timers and threads are spread over, none is anywhere */
+static char *cpus;
+module_param(cpus, charp, S_IRUGO);
+MODULE_PARM_DESC(cpus, "cpu list to spread the step timers and threads over, e.g. 2-3");
+static struct cpumask motor_stepper_cpus;
+static int motor_stepper_cpu_last = -1;	// round robin, under motor_stepper_engine_lock
+
+/* the engine thread and the threaded steppers it steps */
+static bool motor_stepper_thread_all;
+module_param_named(thread, motor_stepper_thread_all, bool, S_IRUGO);
+MODULE_PARM_DESC(thread, "step every coil stepper off a port from the engine thread");
+static int thread_prio = MAX_USER_RT_PRIO/2;
+module_param(thread_prio, int, S_IRUGO);
+MODULE_PARM_DESC(thread_prio, "SCHED_FIFO priority of the engine thread");
+static int thread_cpu = -1;
+module_param(thread_cpu, int, S_IRUGO);
+MODULE_PARM_DESC(thread_cpu, "cpu of the engine thread, -1 for the cpus list or any");
+static LIST_HEAD(motor_stepper_threaded);
+static DEFINE_MUTEX(motor_stepper_thread_lock);	// the list, and the coil writes
+static struct task_struct *motor_stepper_engine_task;
+static unsigned long motor_stepper_engine_flags;
+static struct motor_stepper_engine_stats motor_stepper_engine_st;
+
+static const unsigned char motor_stepper_seq_2_phase[4] =
+{
+	0x03,	// 0011
+	0x06,	// 0110
+	0x0c,	// 1100
+	0x09,	// 1001
+};
+
+static const unsigned char motor_stepper_seq_1_2_phase[8] =
+{
+	0x01,	// 0001
+	0x03,	// 0011
+	0x02,	// 0010
+	0x06,	// 0110
+	0x04,	// 0100
+	0x0c,	// 1100
+	0x08,	// 1000
+	0x09,	// 1001
+};
+
+/* write the coils, enabling the driver on the way out of and back to 0 */
+static void _motor_stepper_write(struct motor_stepper *stp, unsigned int mask)
+{
+	if(mask == stp->phase)
+		return;
+	if((stp->phase == 0) && stp->ops->enable)
+		stp->ops->enable(stp);
+	stp->ops->set_phase_mask(stp, mask);
+	if((mask == 0) && stp->ops->disable)
+		stp->ops->disable(stp);
+	stp->phase = mask;
+}
+
+static inline void _motor_stepper_account_late(struct motor_stepper *stp, ktime_t now, ktime_t due)
+{
+#ifdef CONFIG_MOTOR_STEPPER_STATS
+	s64 late = ktime_to_ns(ktime_sub(now, due));
+
+	if(late < 0)
+		late = 0;
+	stp->stats.late_samples++;
+	stp->stats.late_ns += late;
+	if(late > stp->stats.late_ns_max)
+		stp->stats.late_ns_max = (unsigned int)late;
+#endif
+}
+
+/* the first step of a move goes out at now, called with stp->lock held */
+static inline void _motor_stepper_mark_start(struct motor_stepper *stp, ktime_t now)
+{
+	if(!stp->start_pending)
+		return;
+	stp->start_pending = false;
+	stp->started = now;
+	if(stp->trig_pending)
+	{
+		stp->trig_pending = false;
+		motor_trigger_account(&stp->trig, now);
+	}
+	if(ktime_to_ns(stp->start_at) == 0)
+		return;
+	stp->stats.start_late_ns = ktime_to_ns(ktime_sub(now, stp->start_at));
+	if(stp->stats.start_late_ns > stp->stats.start_late_ns_max)
+		stp->stats.start_late_ns_max = (unsigned int)stp->stats.start_late_ns;
+	stp->start_at = ktime_set(0, 0);
+}
+
+/*
+ * Called with stp->lock held. Non-sleeping coils are written right away,
+ * sleeping ones are queued in order for the output thread so that no step
+ * is collapsed when the thread runs late.
+ */
+static void _motor_stepper_output(struct motor_stepper *stp, unsigned int mask, ktime_t due)
+{
+	unsigned int next;
+
+	if(stp->port || stp->threaded)
+	{	// picked up by the port or engine thread when it next runs
+		stp->port_req = mask;
+		return;
+	}
+	if(stp->thread == NULL)
+	{
+		_motor_stepper_account_late(stp, hrtimer_cb_get_time(&stp->hrtimer), due);
+		_motor_stepper_write(stp, mask);
+		return;
+	}
+
+	next = (stp->q_head + 1) & (MOTOR_STEPPER_QUEUE - 1);
+	if(next == stp->q_tail)
+	{
+		stp->stats.dropped++;
+		return;
+	}
+	stp->q_mask[stp->q_head] = mask;
+	stp->q_due[stp->q_head] = due;
+	stp->q_head = next;
+	wake_up_process(stp->thread);
+}
+
+static void _motor_stepper_energize(struct motor_stepper *stp)
+{
+	if(stp->energized)
+		return;
+	stp->energized = true;
+	if(stp->mode == MOTOR_STEPPER_STEP_DIR)
+	{
+		if(stp->ops->enable)
+			stp->ops->enable(stp);
+		return;
+	}
+	_motor_stepper_output(stp, stp->seq[stp->seq_idx & stp->seq_mask],
+			hrtimer_cb_get_time(&stp->hrtimer));
+}
+
+/* steps a pulse train has emitted by now, called with stp->lock held */
+static unsigned long _motor_stepper_train_done(struct motor_stepper *stp, ktime_t now)
+{
+	s64 elapsed = ktime_to_ns(ktime_sub(now, stp->train_start));
+	u64 done;
+
+	if(elapsed < 0)
+		return 0;
+	done = (u64)elapsed;
+	do_div(done, stp->train_period_ns);
+	done++;			// the first pulse starts the train
+	if((stp->train_steps < MOTOR_STEPPER_CONTINUOUS) && (done > stp->train_steps))
+		done = stp->train_steps;
+	return (unsigned long)done;
+}
+
+static bool _motor_stepper_train_start(struct motor_stepper *stp, ktime_t now)
+{
+	int steps = abs(stp->pos);
+
+	if(stp->soft_limits)
+	{	// the train cannot see the limits, only run it up to them
+		if(stp->pos > 0)
+			steps = min(steps, stp->max_pos - stp->position);
+		else
+			steps = min(steps, stp->position - stp->min_pos);
+	}
+
+	if((stp->ops->train_start == NULL) || (steps < stp->offload_min))
+		return false;
+	if(stp->ops->train_start(stp, stp->period_ns, &stp->train_period_ns) ||
+		(stp->train_period_ns == 0))
+		return false;
+	stp->offloaded = true;
+	stp->train_start = now;
+	stp->train_steps = steps;
+	stp->stats.offloads++;
+	return true;
+}
+
+static void _motor_stepper_train_stop(struct motor_stepper *stp, ktime_t now)
+{
+	unsigned long done = _motor_stepper_train_done(stp, now);
+	long pulses = stp->ops->train_stop(stp);
+
+	stp->offloaded = false;
+	stp->sched.pps = 0;		// the edge generator starts a new schedule
+	stp->stats.offload_steps += done;
+	if(pulses >= 0)
+		stp->stats.offload_miscount += abs(pulses - (long)done);
+	stp->position += stp->dir * ((pulses >= 0) ? (int)pulses : (int)done);
+}
+
+static void _motor_stepper_deenergize(struct motor_stepper *stp, ktime_t due)
+{
+	if(stp->mode == MOTOR_STEPPER_STEP_DIR)
+	{
+		if(stp->offloaded)
+			_motor_stepper_train_stop(stp, due);
+		if(stp->step_high)
+		{
+			stp->ops->set_step(stp, 0);
+			stp->step_high = false;
+		}
+		if(stp->energized && stp->ops->disable)
+			stp->ops->disable(stp);
+		stp->energized = false;
+		return;
+	}
+	stp->energized = false;
+	_motor_stepper_output(stp, 0, due);
+}
+
+static int motor_stepper_thread(void *data)
+{
+	struct motor_stepper *stp = data;
+	unsigned int mask;
+	ktime_t due;
+
+	while(!kthread_should_stop())
+	{
+		set_current_state(TASK_INTERRUPTIBLE);
+		spin_lock_irq(&stp->lock);
+		if(stp->q_tail == stp->q_head)
+		{
+			spin_unlock_irq(&stp->lock);
+			schedule();
+			continue;
+		}
+		__set_current_state(TASK_RUNNING);
+		mask = stp->q_mask[stp->q_tail];
+		due = stp->q_due[stp->q_tail];
+		stp->q_tail = (stp->q_tail + 1) & (MOTOR_STEPPER_QUEUE - 1);
+		spin_unlock_irq(&stp->lock);
+
+		_motor_stepper_account_late(stp, hrtimer_cb_get_time(&stp->hrtimer), due);
+		_motor_stepper_write(stp, mask);
+	}
+	__set_current_state(TASK_RUNNING);
+	return 0;
+}
+
+/* a limit switch or a soft limit is in the way of a step towards dir */
+static inline bool _motor_stepper_blocked(struct motor_stepper *stp, int dir)
+{
+	if(stp->limits & ((dir > 0) ? MOTOR_STEPPER_LIMIT_MAX : MOTOR_STEPPER_LIMIT_MIN))
+		return true;
+	if(!stp->soft_limits)
+		return false;
+	return (dir > 0) ? (stp->position >= stp->max_pos) : (stp->position <= stp->min_pos);
+}
+
+/* one step along the sequence, false once the move is complete or blocked */
+static bool _motor_stepper_advance(struct motor_stepper *stp)
+{
+	if(stp->pos == 0)
+		return false;
+	if(_motor_stepper_blocked(stp, stp->pos))
+	{
+		stp->pos = 0;
+		stp->stats.limit_stops++;
+		return false;
+	}
+	if(stp->pos > 0)
+	{
+		if(stp->pos < MOTOR_STEPPER_CONTINUOUS)	stp->pos--;
+		stp->seq_idx--;
+		stp->position++;
+	}
+	else
+	{
+		if(stp->pos > -MOTOR_STEPPER_CONTINUOUS)	stp->pos++;
+		stp->seq_idx++;
+		stp->position--;
+	}
+	return true;
+}
+
+/*
+ * Publish a command to the running move: a new target if pos is given, and
+ * a new rate unless pps is 0, one of the two. Returns whether the step
+ * timer will take it, otherwise the caller applies it itself. *seq is the
+ * target's or the rate's, for _motor_stepper_cmd_claim() or
+ * _motor_stepper_cmd_claim_pps(). stp->lock may be held, the mailbox lock
+ * is never held across it.
+ */
+static bool _motor_stepper_cmd_post(struct motor_stepper *stp, const int *pos,
+		unsigned int pps, unsigned int *seq)
+{
+	struct motor_stepper_mbox *mb = &stp->mbox;
+	unsigned long flags;
+
+	spin_lock_irqsave(&mb->lock, flags);
+	if(pos)
+	{
+		mb->next.pos = *pos;
+		*seq = ++mb->next.pos_seq;
+	}
+	if(pps)
+	{	// carried on in later slots, but only taken once
+		mb->next.pps = pps;
+		*seq = ++mb->next.pps_seq;
+	}
+	mb->slot[(mb->seq + 1) & 1] = mb->next;
+	smp_wmb();		// the slot before the seq that points at it
+	ACCESS_ONCE(mb->seq) = mb->seq + 1;
+	stp->stats.cmds_posted++;
+	spin_unlock_irqrestore(&mb->lock, flags);
+	smp_mb();		// the post before the look, pairs with _motor_stepper_cmd_close()
+	return ACCESS_ONCE(stp->cmd_open);
+}
+
+/*
+ * At a step: take the latest command if there is a new one. The slot of
+ * seq is only written again two posts later, after seq has moved on, so
+ * a seq that stayed put over the copy means the copy is whole. A dropped
+ * target is void for the timer, but its writer may still claim it.
+ * Called with stp->lock held; returns true if a new target was applied.
+ */
+static bool _motor_stepper_cmd_take(struct motor_stepper *stp, bool drop)
+{
+	struct motor_stepper_mbox *mb = &stp->mbox;
+	struct motor_stepper_cmd cmd;
+	unsigned int seq = ACCESS_ONCE(mb->seq);
+
+	if(likely(seq == mb->taken))
+		return false;
+	for(;;)
+	{
+		smp_rmb();		// seq before the slot, pairs with _motor_stepper_cmd_post()
+		cmd = mb->slot[seq & 1];
+		smp_rmb();		// the slot before seq is looked at again
+		if(ACCESS_ONCE(mb->seq) == seq)
+			break;
+		seq = ACCESS_ONCE(mb->seq);
+		stp->stats.cmd_retries++;
+	}
+	mb->taken = seq;
+	stp->stats.cmds_taken++;
+
+	if((int)(cmd.pps_seq - mb->pps_seen) > 0)
+	{	// a rate not yet applied, pps may have been set directly since
+		mb->pps_seen = cmd.pps_seq;
+		if(stp->pps_ceiling && (cmd.pps > stp->pps_ceiling))
+			cmd.pps = stp->pps_ceiling;	// derated since it was posted
+		if(cmd.pps != stp->pps)
+		{	// the schedule rebases at the next step
+			stp->pps = cmd.pps;
+			stp->period_ns = NSEC_PER_SEC / cmd.pps;
+		}
+	}
+	if((int)(cmd.pos_seq - mb->pos_seen) <= 0)
+		return false;
+	mb->pos_seen = cmd.pos_seq;
+	if(drop)
+		return false;
+	mb->pos_taken = cmd.pos_seq;
+	stp->pos = cmd.pos;
+	return true;
+}
+
+/*
+ * The target of pos_seq is applied by the caller rather than the timer,
+ * unless the timer has taken it or a newer one already. Called with
+ * stp->lock held.
+ */
+static inline bool _motor_stepper_cmd_claim(struct motor_stepper *stp, unsigned int pos_seq)
+{
+	struct motor_stepper_mbox *mb = &stp->mbox;
+
+	if((int)(pos_seq - mb->pos_taken) <= 0)
+		return false;
+	mb->pos_taken = pos_seq;
+	if((int)(pos_seq - mb->pos_seen) > 0)
+		mb->pos_seen = pos_seq;
+	return true;
+}
+
+/*
+ * Likewise for the rate of pps_seq: applied by the caller unless the timer
+ * has taken it or a newer one. Called with stp->lock held.
+ */
+static inline bool _motor_stepper_cmd_claim_pps(struct motor_stepper *stp, unsigned int pps_seq)
+{
+	struct motor_stepper_mbox *mb = &stp->mbox;
+
+	if((int)(pps_seq - mb->pps_seen) <= 0)
+		return false;
+	mb->pps_seen = pps_seq;
+	return true;
+}
+
+/*
+ * The timer is done with the move: close the mailbox, then take what was
+ * posted before the close. Returns true if that brought a new target and
+ * the move goes on with its first step. Called with stp->lock held.
+ */
+static bool _motor_stepper_cmd_close(struct motor_stepper *stp)
+{
+	ACCESS_ONCE(stp->cmd_open) = false;
+	smp_mb();		// pairs with _motor_stepper_cmd_post()
+	if(!_motor_stepper_cmd_take(stp, false) || !_motor_stepper_advance(stp))
+		return false;
+	ACCESS_ONCE(stp->cmd_open) = true;
+	return true;
+}
+
+/*
+ * The move is stopped: close the mailbox, a target still in it is void
+ * unless its writer saw the close and claims it. Called with stp->lock held.
+ */
+static inline void _motor_stepper_cmd_drop(struct motor_stepper *stp)
+{
+	ACCESS_ONCE(stp->cmd_open) = false;
+	smp_mb();		// pairs with _motor_stepper_cmd_post()
+	_motor_stepper_cmd_take(stp, true);
+	stp->pos = 0;
+}
+
+/* the first step of a move is due at, called with stp->lock held */
+static inline void _motor_stepper_sched_begin(struct motor_stepper *stp, ktime_t at)
+{
+	motor_stepper_sched_start(&stp->sched, at, stp->pps);
+	stp->catchup = false;
+}
+
+/* runs on stp->cpu from an ipi: starts the timer there, unless the move is gone */
+static void motor_stepper_timer_remote(void *info)
+{
+	struct motor_stepper *stp = info;
+	unsigned long flags;
+
+	spin_lock_irqsave(&stp->lock, flags);
+	if((stp->running || (stp->stream != MOTOR_STEPPER_STREAM_NONE)) &&
+		!motor_estopped() && !hrtimer_active(&stp->hrtimer))
+		hrtimer_start(&stp->hrtimer, stp->timer_at, HRTIMER_MODE_ABS_PINNED);
+	spin_unlock_irqrestore(&stp->lock, flags);
+	smp_mb();
+	stp->timer_remote = false;
+}
+
+/*
+ * Starts the step timer on stp->cpu, where it then stays: every expiry
+ * re-arms it on the cpu it fired on. From another cpu the start goes
+ * there by an ipi, a few usec later; if one is still on its way the timer
+ * starts here instead. Any context, usually with stp->lock held.
+ */
+static void _motor_stepper_timer_start(struct motor_stepper *stp, ktime_t t,
+		const enum hrtimer_mode mode)
+{
+	int cpu = ACCESS_ONCE(stp->cpu);
+	int this = get_cpu();
+
+	if(cpu < 0)
+	{
+		hrtimer_start(&stp->hrtimer, t, mode);
+	}
+	else if((cpu == this) || !cpu_online(cpu))
+	{
+		hrtimer_start(&stp->hrtimer, t, (mode == HRTIMER_MODE_REL) ?
+				HRTIMER_MODE_REL_PINNED : HRTIMER_MODE_ABS_PINNED);
+	}
+	else if(!ACCESS_ONCE(stp->timer_remote))
+	{
+		stp->timer_at = (mode == HRTIMER_MODE_REL) ? ktime_add(ktime_get(), t) : t;
+		stp->timer_remote = true;
+		smp_wmb();		// timer_at before the ipi reads it
+		__smp_call_function_single(cpu, &stp->timer_csd, 0);
+	}
+	else
+		hrtimer_start(&stp->hrtimer, t, mode);
+	put_cpu();
+}
+
+/* the next cpu of the cpus parameter, -1 without one */
+static int _motor_stepper_spread_cpu(void)
+{
+	unsigned long flags;
+	int cpu;
+
+	if(cpumask_empty(&motor_stepper_cpus))
+		return -1;
+	spin_lock_irqsave(&motor_stepper_engine_lock, flags);
+	cpu = cpumask_next(motor_stepper_cpu_last, &motor_stepper_cpus);
+	if(cpu >= nr_cpu_ids)
+		cpu = cpumask_first(&motor_stepper_cpus);
+	motor_stepper_cpu_last = cpu;
+	spin_unlock_irqrestore(&motor_stepper_engine_lock, flags);
+	return cpu;
+}
+
+/* a move ended or was stopped, called with or without stp->lock */
+static inline void _motor_stepper_ended(struct motor_stepper *stp)
+{
+	if(stp->homing)
+		wake_up(&stp->home_wq);
+}
+
+static inline void _motor_stepper_port_kick(struct motor_stepper_port *port)
+{
+	set_bit(MOTOR_PORT_KICK, &port->flags);
+	wake_up_process(port->thread);
+}
+
+static inline void _motor_stepper_engine_kick(void)
+{
+	set_bit(MOTOR_PORT_KICK, &motor_stepper_engine_flags);
+	wake_up_process(motor_stepper_engine_task);
+}
+
+/* stepped by a port or the engine thread: single moves only */
+static inline bool _motor_stepper_polled(struct motor_stepper *stp)
+{
+	return stp->port || stp->threaded;
+}
+
+/* the move of a polled stepper changed, have its thread look at it now */
+static inline void _motor_stepper_poll_kick(struct motor_stepper *stp)
+{
+	if(stp->port)
+		_motor_stepper_port_kick(stp->port);
+	else if(stp->threaded)
+		_motor_stepper_engine_kick();
+}
+
+static ktime_t _motor_stepper_next_due(struct motor_stepper *stp, ktime_t now);
+
+/*
+ * Step every channel that is due, merge the coil masks of all channels and
+ * flush the changed pins in one transaction. Returns true while any channel
+ * is moving.
+ */
+static bool _motor_stepper_port_tick(struct motor_stepper_port *port, ktime_t now)
+{
+	struct motor_stepper *stp;
+	unsigned long *frame = port->frame;
+	bool dirty = false;
+	bool busy = false;
+	unsigned int i;
+	ktime_t due;
+#ifdef CONFIG_MOTOR_STEPPER_STATS
+	ktime_t start;
+	unsigned int cost;
+#endif
+
+	// io_lock keeps a releasing channel from clearing its pins under us
+	mutex_lock(&port->io_lock);
+	memcpy(frame, port->value, port->words * sizeof(unsigned long));
+	spin_lock_irq(&port->lock);
+	list_for_each_entry(stp, &port->channels, port_node)
+	{
+		spin_lock(&stp->lock);
+		if(stp->running && (ktime_to_ns(now) >= ktime_to_ns(stp->next_due)))
+		{
+			due = stp->next_due;
+			stp->next_due = ktime_set(0, 0);
+			if(_motor_stepper_advance(stp))
+			{
+				if(stp->start_pending || (stp->sched.pps == 0))
+					_motor_stepper_sched_begin(stp, due);
+				_motor_stepper_account_late(stp, now, due);
+				_motor_stepper_mark_start(stp, now);
+				stp->port_req = stp->seq[stp->seq_idx & stp->seq_mask];
+				stp->next_due = _motor_stepper_next_due(stp, now);
+			}
+			if(ktime_to_ns(stp->next_due) == 0)
+			{	// a period after the last step, or ended by the stop policy
+				stp->energized = false;
+				stp->running = false;
+				stp->port_req = 0;
+				_motor_stepper_ended(stp);
+			}
+			port->stats.updates++;
+		}
+		busy |= stp->running;
+		frame[stp->port_word] = (frame[stp->port_word] & ~stp->port_map[0x0f]) |
+				stp->port_map[stp->port_req];
+		stp->phase = stp->port_req;
+		spin_unlock(&stp->lock);
+	}
+	spin_unlock_irq(&port->lock);
+	port->stats.ticks++;
+
+	for(i = 0; i < port->words; i++)
+	{
+		port->changed[i] = frame[i] ^ port->value[i];
+		if(port->changed[i])
+			dirty = true;
+	}
+	if(dirty)
+	{
+#ifdef CONFIG_MOTOR_STEPPER_STATS
+		start = ktime_get();
+#endif
+		port->ops->write(port, frame, port->changed);
+		memcpy(port->value, frame, port->words * sizeof(unsigned long));
+		port->stats.flushes++;
+#ifdef CONFIG_MOTOR_STEPPER_STATS
+		cost = (unsigned int)ktime_to_ns(ktime_sub(ktime_get(), start));
+		port->stats.flush_ns += cost;
+		if(cost > port->stats.flush_ns_max)
+			port->stats.flush_ns_max = cost;
+#endif
+	}
+	mutex_unlock(&port->io_lock);
+	return busy;
+}
+
+static int motor_stepper_port_thread(void *data)
+{
+	struct motor_stepper_port *port = data;
+	ktime_t next = ktime_get();
+	ktime_t now;
+	bool busy;
+
+	while(!kthread_should_stop())
+	{
+		now = ktime_get();
+		busy = _motor_stepper_port_tick(port, now);
+		if(ktime_to_ns(now) >= ktime_to_ns(next))
+		{	// absolute ticks, skip the ones we are too late for
+			next = ktime_add_ns(next, port->tick_ns);
+			if(ktime_to_ns(next) <= ktime_to_ns(now))
+				next = ktime_add_ns(now, port->tick_ns);
+		}
+
+		set_current_state(TASK_INTERRUPTIBLE);
+		if(test_and_clear_bit(MOTOR_PORT_KICK, &port->flags) || kthread_should_stop())
+		{
+			__set_current_state(TASK_RUNNING);
+		}
+		else if(busy)
+		{
+			schedule_hrtimeout(&next, HRTIMER_MODE_ABS);
+		}
+		else
+		{
+			schedule();
+			next = ktime_get();
+		}
+	}
+	__set_current_state(TASK_RUNNING);
+	return 0;
+}
+
+static inline void _motor_stepper_account_cost(struct motor_stepper *stp, ktime_t start)
+{
+#ifdef CONFIG_MOTOR_STEPPER_STATS
+	unsigned int cost = (unsigned int)ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	stp->stats.steps++;
+	stp->stats.step_ns += cost;
+	if(cost > stp->stats.step_ns_max)
+		stp->stats.step_ns_max = cost;
+#endif
+}
+
+static unsigned int _motor_stepper_max_pps(struct motor_stepper *stp)
+{
+	unsigned int max = MOTOR_STEPPER_MAX_PPS;
+
+	if(stp->mode == MOTOR_STEPPER_STEP_DIR)
+	{	// the pulse needs some low time after it too
+		max = min_t(unsigned long, MOTOR_STEPPER_STEPDIR_MAX_PPS,
+				NSEC_PER_SEC / (2 * stp->pulse_ns));
+	}
+	if(stp->pps_ceiling && (stp->pps_ceiling < max))
+		max = stp->pps_ceiling;
+	return max;
+}
+
+static const char * const motor_stepper_overrun_names[] = {
+	[MOTOR_STEPPER_OVERRUN_LOG]	= "log",
+	[MOTOR_STEPPER_OVERRUN_CATCHUP]	= "catchup",
+	[MOTOR_STEPPER_OVERRUN_DERATE]	= "derate",
+	[MOTOR_STEPPER_OVERRUN_STOP]	= "stop",
+};
+
+/* first step of the schedule due after now, as an index from its base */
+static u64 _motor_stepper_sched_after(struct motor_stepper_sched *sc, ktime_t now)
+{
+	s64 t = ktime_to_ns(ktime_sub(now, sc->base));
+
+	return (t < 0) ? 0 : div_u64((u64)t * sc->pps, NSEC_PER_SEC) + 1;
+}
+
+/* skip the steps of the schedule due at or before now */
+static void _motor_stepper_sched_skip(struct motor_stepper_sched *sc, ktime_t now)
+{
+	u64 k = _motor_stepper_sched_after(sc, now);
+	u32 n;
+
+	sc->base = ktime_add_ns(sc->base, div_u64_rem(k, sc->pps, &n) * NSEC_PER_SEC);
+	sc->n = n;
+}
+
+/*
+ * Deadline of the next step of a single move, from its absolute schedule.
+ * If that has passed already, the expiry came a step period or more late
+ * and the overrun policy decides; returns 0 if the move is to end there.
+ * Called with stp->lock held, right after a step.
+ */
+static ktime_t _motor_stepper_next_due(struct motor_stepper *stp, ktime_t now)
+{
+	struct motor_stepper_sched *sc = &stp->sched;
+	ktime_t next = motor_stepper_sched_next(sc, stp->pps);
+	ktime_t early;
+	u64 missed;
+	unsigned int pps;
+
+	if(likely(!stp->catchup && (ktime_to_ns(next) > ktime_to_ns(now))))
+		return next;
+	if(!stp->catchup)
+	{
+		missed = _motor_stepper_sched_after(sc, now) - sc->n;
+		stp->stats.overruns++;
+		stp->stats.overrun_periods += missed;
+		if(missed > stp->stats.overrun_max)
+			stp->stats.overrun_max = (unsigned int)min_t(u64, missed, UINT_MAX);
+	}
+	else
+		missed = 0;
+
+	switch(stp->overrun_policy)
+	{
+		case MOTOR_STEPPER_OVERRUN_CATCHUP:
+			pps = min_t(unsigned int, _motor_stepper_max_pps(stp),
+					stp->pps * MOTOR_STEPPER_CATCHUP_PCT / 100);
+			if(pps <= stp->pps)
+				break;		// already at the limit, nothing to make up with
+			early = ktime_add_ns(now, NSEC_PER_SEC / pps);
+			if(ktime_to_ns(next) >= ktime_to_ns(early))
+			{	// back on the schedule
+				stp->catchup = false;
+				return next;
+			}
+			stp->catchup = true;
+			stp->stats.catchup_steps++;
+			return early;
+
+		case MOTOR_STEPPER_OVERRUN_DERATE:
+			pps = max(stp->pps * MOTOR_STEPPER_DERATE_PCT / 100, 1U);
+			stp->pps_ceiling = pps;
+			stp->pps = pps;
+			stp->period_ns = NSEC_PER_SEC / pps;
+			stp->stats.derates++;
+			printk_ratelimited(KERN_WARNING "motor %s: step timer overrun, derated to %u pps\n",
+					stp->cdev.name, pps);
+			if(stp->overrun_kn)
+				sysfs_notify_dirent(stp->overrun_kn);
+			break;
+
+		case MOTOR_STEPPER_OVERRUN_STOP:
+			stp->pos = 0;
+			stp->overrun_fault = true;
+			stp->stats.overrun_stops++;
+			printk_ratelimited(KERN_ERR "motor %s: step timer overrun, %llu steps late, stopped\n",
+					stp->cdev.name, (unsigned long long)missed);
+			if(stp->overrun_kn)
+				sysfs_notify_dirent(stp->overrun_kn);
+			return ktime_set(0, 0);
+
+		default:
+			printk_ratelimited(KERN_WARNING "motor %s: step timer overrun, %llu steps late\n",
+					stp->cdev.name, (unsigned long long)missed);
+			break;
+	}
+	stp->catchup = false;
+	_motor_stepper_sched_skip(sc, now);
+	return motor_stepper_sched_due(sc);
+}
+
+/*
+ * Step every threaded stepper that is due and write its coils, outside
+ * its lock as they may sleep. Returns true while any of them is moving,
+ * with the earliest deadline of them in *next.
+ */
+static bool _motor_stepper_engine_tick(ktime_t now, ktime_t *next)
+{
+	struct motor_stepper *stp;
+	unsigned int mask;
+	bool stepped;
+	bool busy = false;
+	ktime_t due;
+#ifdef CONFIG_MOTOR_STEPPER_STATS
+	ktime_t start;
+	unsigned int cost;
+#endif
+
+	mutex_lock(&motor_stepper_thread_lock);
+	list_for_each_entry(stp, &motor_stepper_threaded, port_node)
+	{
+#ifdef CONFIG_MOTOR_STEPPER_STATS
+		start = ktime_get();
+#endif
+		stepped = false;
+		spin_lock_irq(&stp->lock);
+		if(stp->running && (ktime_to_ns(now) >= ktime_to_ns(stp->next_due)))
+		{
+			due = stp->next_due;
+			stp->next_due = ktime_set(0, 0);
+			if(_motor_stepper_advance(stp))
+			{
+				if(stp->start_pending || (stp->sched.pps == 0))
+					_motor_stepper_sched_begin(stp, due);
+				_motor_stepper_account_late(stp, now, due);
+				_motor_stepper_mark_start(stp, now);
+				stp->port_req = stp->seq[stp->seq_idx & stp->seq_mask];
+				stp->next_due = _motor_stepper_next_due(stp, now);
+			}
+			if(ktime_to_ns(stp->next_due) == 0)
+			{	// a period after the last step, or ended by the stop policy
+				if(!stp->hold)
+				{
+					stp->energized = false;
+					stp->port_req = 0;
+				}
+				stp->running = false;
+				_motor_stepper_ended(stp);
+			}
+			stepped = true;
+		}
+		if(stp->running)
+		{
+			if(!busy || (ktime_to_ns(stp->next_due) < ktime_to_ns(*next)))
+				*next = stp->next_due;
+			busy = true;
+		}
+		mask = stp->port_req;
+		spin_unlock_irq(&stp->lock);
+
+		_motor_stepper_write(stp, mask);
+		if(stepped)
+		{
+			motor_stepper_engine_st.steps++;
+#ifdef CONFIG_MOTOR_STEPPER_STATS
+			_motor_stepper_account_cost(stp, start);
+#endif
+		}
+	}
+	motor_stepper_engine_st.wakeups++;
+#ifdef CONFIG_MOTOR_STEPPER_STATS
+	cost = (unsigned int)ktime_to_ns(ktime_sub(ktime_get(), now));
+	motor_stepper_engine_st.busy_ns += cost;
+	if(cost > motor_stepper_engine_st.busy_ns_max)
+		motor_stepper_engine_st.busy_ns_max = cost;
+#endif
+	mutex_unlock(&motor_stepper_thread_lock);
+	return busy;
+}
+
+static int motor_stepper_engine_thread(void *data)
+{
+	ktime_t next;
+	bool busy;
+
+	while(!kthread_should_stop())
+	{
+		busy = _motor_stepper_engine_tick(ktime_get(), &next);
+		set_current_state(TASK_INTERRUPTIBLE);
+		if(test_and_clear_bit(MOTOR_PORT_KICK, &motor_stepper_engine_flags) ||
+			kthread_should_stop())
+		{
+			__set_current_state(TASK_RUNNING);
+		}
+		else if(busy)
+		{	// absolute, a late wakeup is not added to the next one
+			schedule_hrtimeout(&next, HRTIMER_MODE_ABS);
+		}
+		else
+		{
+			schedule();
+		}
+	}
+	__set_current_state(TASK_RUNNING);
+	return 0;
+}
+
+/* started by the first threaded stepper, called with motor_stepper_thread_lock held */
+static int _motor_stepper_engine_start(void)
+{
+	struct sched_param param = { .sched_priority = thread_prio };
+	struct task_struct *task;
+
+	if(motor_stepper_engine_task)
+		return 0;
+	task = kthread_run(motor_stepper_engine_thread, NULL, "motor/engine");
+	if(IS_ERR(task))
+		return PTR_ERR(task);
+	sched_setscheduler(task, SCHED_FIFO, &param);
+	if(thread_cpu >= 0)
+		set_cpus_allowed_ptr(task, cpumask_of(thread_cpu));
+	else if(!cpumask_empty(&motor_stepper_cpus))
+		set_cpus_allowed_ptr(task, &motor_stepper_cpus);
+	motor_stepper_engine_task = task;
+	return 0;
+}
+
+/**
+ * motor_stepper_engine_stats - read the counters of the engine thread
+ * @st: filled in
+ * @reset: clear them once read
+ *
+ * busy_ns is only counted with CONFIG_MOTOR_STEPPER_STATS.
+ */
+void motor_stepper_engine_stats(struct motor_stepper_engine_stats *st, bool reset)
+{
+	mutex_lock(&motor_stepper_thread_lock);
+	*st = motor_stepper_engine_st;
+	if(reset)
+		memset(&motor_stepper_engine_st, 0, sizeof(motor_stepper_engine_st));
+	mutex_unlock(&motor_stepper_thread_lock);
+}
+EXPORT_SYMBOL_GPL(motor_stepper_engine_stats);
+
+/**
+ * motor_stepper_sim_step - a step of a single move on a simulated clock
+ * @stp: a stepper at rest, for simulations
+ * @start: the schedule starts at this step, 0 goes on with it
+ * @now: when the expiry for the step ran
+ *
+ * Runs the deadline and overrun code of the step timer, without a timer
+ * or coils. Returns the next deadline the timer would be armed with, or
+ * 0 if the overrun policy ends the move there.
+ */
+ktime_t motor_stepper_sim_step(struct motor_stepper *stp, ktime_t start, ktime_t now)
+{
+	unsigned long flags;
+	ktime_t next;
+
+	spin_lock_irqsave(&stp->lock, flags);
+	if(ktime_to_ns(start))
+		_motor_stepper_sched_begin(stp, start);
+	next = _motor_stepper_next_due(stp, now);
+	spin_unlock_irqrestore(&stp->lock, flags);
+	return next;
+}
+EXPORT_SYMBOL_GPL(motor_stepper_sim_step);
+
+static enum hrtimer_restart motor_stepper_hrtimer_handler(struct hrtimer *timer)
+{
+	struct motor_stepper *stp =
+	    container_of(timer, struct motor_stepper, hrtimer);
+	enum hrtimer_restart ret = HRTIMER_RESTART;
+	ktime_t due = hrtimer_get_expires(timer);
+	ktime_t next;
+#ifdef CONFIG_MOTOR_STEPPER_STATS
+	ktime_t start = ktime_get();
+#endif
+
+	spin_lock(&stp->lock);
+	if(unlikely(motor_estopped()))
+	{	// the e-stop has released the coils, maybe while we waited for the lock
+		spin_unlock(&stp->lock);
+		return HRTIMER_NORESTART;
+	}
+	if(stp->cmd_open)
+		_motor_stepper_cmd_take(stp, false);
+	if(!_motor_stepper_advance(stp) && !(stp->cmd_open && _motor_stepper_cmd_close(stp)))
+	{	// one period after the last step: release the coils, unless held
+		if(!stp->hold)
+			_motor_stepper_deenergize(stp, due);
+		stp->running = false;
+		_motor_stepper_ended(stp);
+		ret = HRTIMER_NORESTART;
+	}
+	else
+	{
+		if(stp->start_pending || (stp->sched.pps == 0))
+			_motor_stepper_sched_begin(stp, due);
+		_motor_stepper_mark_start(stp, hrtimer_cb_get_time(timer));
+		_motor_stepper_output(stp, stp->seq[stp->seq_idx & stp->seq_mask], due);
+		ACCESS_ONCE(stp->cmd_open) = (stp->stream == MOTOR_STEPPER_STREAM_NONE);
+		next = _motor_stepper_next_due(stp, hrtimer_cb_get_time(timer));
+		if(likely(ktime_to_ns(next)))
+			hrtimer_set_expires(timer, next);
+		else
+		{	// stop policy: release now rather than a period later
+			if(!stp->hold)
+				_motor_stepper_deenergize(stp, hrtimer_cb_get_time(timer));
+			_motor_stepper_cmd_drop(stp);
+			stp->running = false;
+			_motor_stepper_ended(stp);
+			ret = HRTIMER_NORESTART;
+		}
+	}
+	spin_unlock(&stp->lock);
+
+#ifdef CONFIG_MOTOR_STEPPER_STATS
+	_motor_stepper_account_cost(stp, start);
+#endif
+	return ret;
+}
+
+/*
+ * Step/dir pulse generator, one edge per expiry:
+ *	low  -> high	start a step, the pulse lasts pulse_ns
+ *	high -> low	end it, low until the next step is due
+ * A direction change holds the step pin low for dir_setup_ns first. Once
+ * the direction is set, a long enough move goes to the pulse train and
+ * the next expiry is its deadline, in the low time after the last pulse.
+ */
+static enum hrtimer_restart motor_stepper_stepdir_handler(struct hrtimer *timer)
+{
+	struct motor_stepper *stp =
+	    container_of(timer, struct motor_stepper, hrtimer);
+	enum hrtimer_restart ret = HRTIMER_RESTART;
+	ktime_t due = hrtimer_get_expires(timer);
+	int dir;
+	ktime_t now;
+	ktime_t next;
+#ifdef CONFIG_MOTOR_STEPPER_STATS
+	ktime_t start = ktime_get();
+#endif
+
+	spin_lock(&stp->lock);
+	if(unlikely(motor_estopped()))
+	{
+		spin_unlock(&stp->lock);
+		return HRTIMER_NORESTART;
+	}
+	if(stp->offloaded)
+	{	// deadline of the train, finish like after a software step
+		_motor_stepper_train_stop(stp, hrtimer_cb_get_time(timer));
+		stp->pos = 0;
+		hrtimer_forward_now(timer, ns_to_ktime(stp->period_ns / 2));
+		spin_unlock(&stp->lock);
+		return ret;
+	}
+	if(stp->step_high)
+	{
+		stp->ops->set_step(stp, 0);
+		stp->step_high = false;
+		next = ktime_add_ns(hrtimer_cb_get_time(timer), stp->pulse_ns);	// shortest low time
+		hrtimer_set_expires(timer, (ktime_to_ns(stp->step_due) > ktime_to_ns(next)) ? stp->step_due : next);
+		spin_unlock(&stp->lock);
+		return ret;
+	}
+
+	if((stp->pos != 0) && _motor_stepper_blocked(stp, stp->pos))
+	{	// no pulse at a limit
+		stp->pos = 0;
+		stp->stats.limit_stops++;
+	}
+	if(stp->pos == 0)
+	{	// one period after the last step
+		if(!stp->hold)
+			_motor_stepper_deenergize(stp, due);
+		stp->running = false;
+		_motor_stepper_ended(stp);
+		ret = HRTIMER_NORESTART;
+	}
+	else if((dir = (stp->pos > 0) ? 1 : -1) != stp->dir)
+	{
+		stp->ops->set_dir(stp, dir);
+		stp->dir = dir;
+		hrtimer_forward_now(timer, ns_to_ktime(stp->dir_setup_ns));
+	}
+	else if(_motor_stepper_train_start(stp, hrtimer_cb_get_time(timer)))
+	{
+		_motor_stepper_mark_start(stp, stp->train_start);
+		if(stp->train_steps >= MOTOR_STEPPER_CONTINUOUS)
+		{	// runs until motor_stepper_stop()
+			ret = HRTIMER_NORESTART;
+		}
+		else
+		{
+			u64 end = (u64)(stp->train_steps - 1) * stp->train_period_ns +
+					(stp->train_period_ns + stp->pulse_ns) / 2;
+
+			hrtimer_set_expires(timer, ktime_add_ns(stp->train_start, end));
+		}
+	}
+	else if(unlikely(!_motor_stepper_advance(stp)))
+	{	// a limit closed since the check: no pulse, the move ends
+		if(!stp->hold)
+			_motor_stepper_deenergize(stp, due);
+		stp->running = false;
+		_motor_stepper_ended(stp);
+		ret = HRTIMER_NORESTART;
+	}
+	else
+	{
+		now = hrtimer_cb_get_time(timer);
+		if(stp->start_pending || (stp->sched.pps == 0))
+			_motor_stepper_sched_begin(stp, due);
+		_motor_stepper_account_late(stp, now, due);
+		_motor_stepper_mark_start(stp, now);
+		stp->ops->set_step(stp, 1);
+		stp->step_high = true;
+		stp->step_due = _motor_stepper_next_due(stp, now);
+		if(unlikely(ktime_to_ns(stp->step_due) == 0))	// the stop policy, after this pulse
+			stp->step_due = ktime_add_ns(now, stp->period_ns);
+		hrtimer_set_expires(timer, ktime_add_ns(now, stp->pulse_ns));
+	}
+	spin_unlock(&stp->lock);
+
+#ifdef CONFIG_MOTOR_STEPPER_STATS
+	_motor_stepper_account_cost(stp, start);
+#endif
+	return ret;
+}
+
+/* the shared page is writable by userspace, so status is only mirrored there */
+static inline void _motor_stepper_ring_status(struct motor_stepper *stp,
+		enum motor_stepper_ring_status status)
+{
+	stp->ring_status = status;
+	ACCESS_ONCE(stp->ring->status) = status;
+}
+
+/* back to single moves, called with stp->lock held */
+static void _motor_stepper_unstream(struct motor_stepper *stp)
+{
+	switch(stp->stream)
+	{
+		case MOTOR_STEPPER_STREAM_NONE:
+			return;
+		case MOTOR_STEPPER_STREAM_RING:
+			_motor_stepper_ring_status(stp, MOTOR_STEPPER_RING_IDLE);
+			break;
+		case MOTOR_STEPPER_STREAM_PROG:
+			motor_prog_abort(&stp->prog);
+			break;
+		default:
+			break;
+	}
+	stp->stream = MOTOR_STEPPER_STREAM_NONE;
+	if(stp->mode == MOTOR_STEPPER_STEP_DIR)
+		stp->hrtimer.function = motor_stepper_stepdir_handler;
+	else
+		stp->hrtimer.function = motor_stepper_hrtimer_handler;
+}
+
+/* off the armed list; once done, a fire in progress has started us or will not */
+static void _motor_stepper_disarm(struct motor_stepper *stp)
+{
+	unsigned long flags;
+
+	if(!stp->armed)
+		return;
+	spin_lock_irqsave(&motor_stepper_arm_lock, flags);
+	if(stp->armed)
+		list_del_init(&stp->arm_node);
+	stp->armed = false;
+	spin_unlock_irqrestore(&motor_stepper_arm_lock, flags);
+}
+
+/*
+ * Drops the move or stream and releases the coils. A step handler still
+ * running finds nothing left to do once it has the lock, and stops.
+ */
+static void _motor_stepper_reset(struct motor_stepper *stp, ktime_t now)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&stp->lock, flags);
+	_motor_stepper_cmd_drop(stp);
+	stp->running = false;
+	stp->q_tail = stp->q_head;		// pending steps are void
+	stp->start_pending = false;
+	stp->trig_pending = false;
+	_motor_stepper_unstream(stp);
+	_motor_stepper_deenergize(stp, now);
+	spin_unlock_irqrestore(&stp->lock, flags);
+	_motor_stepper_poll_kick(stp);
+	_motor_stepper_ended(stp);
+}
+
+static void _motor_stepper_halt(struct motor_stepper *stp)
+{
+	_motor_stepper_disarm(stp);		// before the cancel, a fire may still start us
+	hrtimer_cancel(&stp->hrtimer);
+	_motor_stepper_reset(stp, hrtimer_cb_get_time(&stp->hrtimer));
+}
+
+/* _motor_stepper_halt() that does not wait for a running step handler */
+static void _motor_stepper_kill(struct motor_stepper *stp, ktime_t now)
+{
+	hrtimer_try_to_cancel(&stp->hrtimer);
+	_motor_stepper_reset(stp, now);
+}
+
+/* drops the path and program of the group, a running tick then stops */
+static void _motor_stepper_group_reset(struct motor_stepper_group *sg)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&sg->lock, flags);
+	sg->running = false;
+	sg->step_high = false;
+	sg->stepped = 0;
+	sg->plan_tail = sg->plan_head;
+	if(sg->prog_on)
+	{
+		sg->prog_on = false;
+		motor_prog_abort(&sg->prog);
+	}
+	spin_unlock_irqrestore(&sg->lock, flags);
+}
+
+/*
+ * motor_stepper_stop() for hard irq handlers (limit switches, stop
+ * triggers), which must not spin on a step handler running on another
+ * cpu: its timer is left to find the move gone, like after an e-stop.
+ */
+static void _motor_stepper_stop_irq(struct motor_stepper *stp)
+{
+	struct motor_stepper_group *sg = stp->group;
+	ktime_t now = ktime_get();
+	unsigned int i;
+
+	if(sg && sg->running)
+	{
+		hrtimer_try_to_cancel(&sg->hrtimer);
+		_motor_stepper_group_reset(sg);
+		for(i = 0; i < sg->group.naxes; i++)
+		{
+			_motor_stepper_disarm(sg->axis[i]);
+			_motor_stepper_kill(sg->axis[i], now);
+		}
+		return;
+	}
+	_motor_stepper_disarm(stp);
+	_motor_stepper_kill(stp, now);
+}
+
+/**
+ * motor_stepper_move - start or retarget a relative move
+ * @stp: the stepper
+ * @step: steps to go, negative is backward, 0 stops the motor
+ *
+ * A running move is retargeted in place, otherwise the coils are energized
+ * and the first step follows after stp->start_delay. A single move of a
+ * coil stepper on its own timer takes the new target through the mailbox
+ * at its next step, without stp->lock.
+ */
+void motor_stepper_move(struct motor_stepper *stp, int step)
+{
+	unsigned long flags;
+	unsigned int pos_seq;
+
+	if(step == 0)
+	{
+		motor_stepper_stop(stp);
+		return;
+	}
+	if(stp->group && stp->group->running)
+		return;
+	if((stp->stream != MOTOR_STEPPER_STREAM_NONE) || stp->armed)
+		_motor_stepper_halt(stp);
+	if(_motor_stepper_cmd_post(stp, &step, 0, &pos_seq))
+		return;
+
+	spin_lock_irqsave(&stp->lock, flags);
+	if(motor_estopped() || !_motor_stepper_cmd_claim(stp, pos_seq))
+	{	// or the timer has taken it after all
+		spin_unlock_irqrestore(&stp->lock, flags);
+		return;
+	}
+	stp->pos = step;
+	if(stp->offloaded)
+	{	// back to the edge generator, it starts a new train if worth it
+		_motor_stepper_train_stop(stp, hrtimer_cb_get_time(&stp->hrtimer));
+		if(hrtimer_try_to_cancel(&stp->hrtimer) >= 0)
+			_motor_stepper_timer_start(stp, ns_to_ktime(stp->period_ns / 2), HRTIMER_MODE_REL);
+	}
+	else if(!stp->running)
+	{
+		stp->running = true;
+		stp->start_pending = true;
+		stp->start_at = ktime_set(0, 0);
+		_motor_stepper_energize(stp);
+		if(_motor_stepper_polled(stp))
+			stp->next_due = ktime_add(ktime_get(), stp->start_delay);
+		else
+			_motor_stepper_timer_start(stp, stp->start_delay, HRTIMER_MODE_REL);
+	}
+	spin_unlock_irqrestore(&stp->lock, flags);
+	_motor_stepper_poll_kick(stp);
+}
+EXPORT_SYMBOL_GPL(motor_stepper_move);
+
+/* step/dir: set the dir pin ahead of the first step, called with stp->lock held */
+static void _motor_stepper_preset_dir(struct motor_stepper *stp, int step)
+{
+	int dir = (step > 0) ? 1 : -1;
+
+	if((stp->mode != MOTOR_STEPPER_STEP_DIR) || (dir == stp->dir))
+		return;
+	stp->ops->set_dir(stp, dir);
+	stp->dir = dir;
+}
+
+/**
+ * motor_stepper_move_at - start a relative move at a given time
+ * @stp: the stepper
+ * @step: steps to go, negative is backward
+ * @at: CLOCK_MONOTONIC time of the first step
+ *
+ * Whatever the motor is doing is stopped, the coils are energized (and
+ * the dir pin set) right away and the step timer is armed for @at, so
+ * @at should be at least stp->start_delay ahead. The first step then
+ * comes with the usual timer latency, on a port with up to a port tick
+ * more, on the engine thread with its wakeup latency; stp->started tells when it really went out.
+ * Returns -ETIME if @at has already passed.
+ */
+int motor_stepper_move_at(struct motor_stepper *stp, int step, ktime_t at)
+{
+	unsigned long flags;
+
+	if(step == 0)
+		return -EINVAL;
+	if(stp->group && stp->group->running)
+		return -EBUSY;
+	_motor_stepper_halt(stp);
+
+	spin_lock_irqsave(&stp->lock, flags);
+	if(motor_estopped() || (ktime_to_ns(at) <= ktime_to_ns(ktime_get())))
+	{
+		spin_unlock_irqrestore(&stp->lock, flags);
+		return motor_estopped() ? -EBUSY : -ETIME;
+	}
+	stp->pos = step;
+	stp->running = true;
+	stp->start_pending = true;
+	stp->start_at = at;
+	stp->stats.timed_starts++;
+	_motor_stepper_energize(stp);
+	_motor_stepper_preset_dir(stp, step);	// now, the setup time is not taken at @at
+	if(_motor_stepper_polled(stp))
+		stp->next_due = at;
+	else
+		_motor_stepper_timer_start(stp, at, HRTIMER_MODE_ABS);
+	spin_unlock_irqrestore(&stp->lock, flags);
+	_motor_stepper_poll_kick(stp);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(motor_stepper_move_at);
+
+/**
+ * motor_stepper_arm - hold a move until the next fire
+ * @stp: the stepper
+ * @step: steps to go, negative is backward, 0 only disarms
+ *
+ * The motor is stopped and energized, so arm at least stp->start_delay
+ * before the fire. Arming again replaces the pending move; any other
+ * move or a stop disarms. Steppers on a port or threaded ones are
+ * stepped by a thread, not a timer of their own, and cannot be armed.
+ */
+int motor_stepper_arm(struct motor_stepper *stp, int step)
+{
+	unsigned long flags;
+
+	if(_motor_stepper_polled(stp))
+		return -EOPNOTSUPP;
+	if(stp->group && stp->group->running)
+		return -EBUSY;
+	_motor_stepper_halt(stp);
+	if(step == 0)
+		return 0;
+
+	spin_lock_irqsave(&motor_stepper_arm_lock, flags);
+	spin_lock(&stp->lock);
+	if(motor_estopped())
+	{
+		spin_unlock(&stp->lock);
+		spin_unlock_irqrestore(&motor_stepper_arm_lock, flags);
+		return -EBUSY;
+	}
+	stp->armed = true;
+	stp->armed_pos = step;
+	_motor_stepper_energize(stp);
+	_motor_stepper_preset_dir(stp, step);
+	list_add_tail(&stp->arm_node, &motor_stepper_armed);
+	spin_unlock(&stp->lock);
+	spin_unlock_irqrestore(&motor_stepper_arm_lock, flags);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(motor_stepper_arm);
+
+/*
+ * Takes the first step of a move right away, in the caller's context,
+ * and leaves the rest to the step timer. The motor is at rest, energized
+ * and a step/dir one has its dir pin set; called with stp->lock held.
+ * Returns when the step went out.
+ */
+static ktime_t _motor_stepper_kickoff(struct motor_stepper *stp, int step, ktime_t due)
+{
+	ktime_t now;
+
+	stp->pos = step;
+	stp->running = true;
+	if(!_motor_stepper_advance(stp))
+	{	// a limit is closed, no first step: the timer ends the move
+		_motor_stepper_timer_start(stp, ns_to_ktime(stp->period_ns), HRTIMER_MODE_REL);
+		return ktime_get();
+	}
+	if(stp->mode == MOTOR_STEPPER_STEP_DIR)
+	{
+		stp->ops->set_step(stp, 1);
+		stp->step_high = true;
+		now = ktime_get();
+		_motor_stepper_sched_begin(stp, now);
+		stp->step_due = motor_stepper_sched_next(&stp->sched, stp->pps);
+		_motor_stepper_timer_start(stp, ktime_add_ns(now, stp->pulse_ns), HRTIMER_MODE_ABS);
+	}
+	else
+	{
+		_motor_stepper_output(stp, stp->seq[stp->seq_idx & stp->seq_mask], due);
+		now = ktime_get();
+		_motor_stepper_sched_begin(stp, due);
+		_motor_stepper_timer_start(stp, motor_stepper_sched_next(&stp->sched, stp->pps),
+				HRTIMER_MODE_ABS);
+	}
+	return now;
+}
+
+/*
+ * Takes the first step of every armed stepper, one after the other with
+ * nothing in between, and hands each to its own timer for the rest. The
+ * coil steppers keep their phase to the fire time.
+ */
+static enum hrtimer_restart motor_stepper_fire_handler(struct hrtimer *timer)
+{
+	struct motor_stepper *stp, *next;
+	ktime_t due = hrtimer_get_expires(timer);
+	ktime_t first = ktime_set(0, 0);
+	ktime_t now;
+	unsigned int skew;
+
+	spin_lock(&motor_stepper_arm_lock);
+	list_for_each_entry_safe(stp, next, &motor_stepper_armed, arm_node)
+	{
+		list_del_init(&stp->arm_node);
+		stp->armed = false;
+		if(stp->group && stp->group->running)
+			continue;		// the group took it over since
+
+		spin_lock(&stp->lock);
+		now = _motor_stepper_kickoff(stp, stp->armed_pos, due);
+		stp->start_pending = true;
+		stp->start_at = due;
+		stp->stats.timed_starts++;
+		_motor_stepper_mark_start(stp, now);
+
+		if(ktime_to_ns(first) == 0)
+			first = now;
+		skew = (unsigned int)ktime_to_ns(ktime_sub(now, first));
+		stp->stats.fired++;
+		stp->stats.fire_skew_ns = skew;
+		if(skew > stp->stats.fire_skew_ns_max)
+			stp->stats.fire_skew_ns_max = skew;
+		spin_unlock(&stp->lock);
+	}
+	spin_unlock(&motor_stepper_arm_lock);
+	return HRTIMER_NORESTART;
+}
+
+/**
+ * motor_stepper_fire - start all armed steppers together
+ * @at: CLOCK_MONOTONIC time of the first steps, 0 is now
+ *
+ * Returns -ENOENT if no stepper is armed, -ETIME if @at has passed.
+ */
+int motor_stepper_fire(ktime_t at)
+{
+	unsigned long flags;
+	int ret = 0;
+
+	spin_lock_irqsave(&motor_stepper_arm_lock, flags);
+	if(list_empty(&motor_stepper_armed))
+		ret = -ENOENT;
+	else if(ktime_to_ns(at) == 0)
+		hrtimer_start(&motor_stepper_fire_timer, ktime_set(0, 0), HRTIMER_MODE_REL);
+	else if(ktime_to_ns(at) <= ktime_to_ns(ktime_get()))
+		ret = -ETIME;
+	else
+		hrtimer_start(&motor_stepper_fire_timer, at, HRTIMER_MODE_ABS);
+	spin_unlock_irqrestore(&motor_stepper_arm_lock, flags);
+	return ret;
+}
+EXPORT_SYMBOL_GPL(motor_stepper_fire);
+
+/*
+ * Edge triggers (motor_trigger). A start edge takes the first step of the
+ * preloaded move from the interrupt when the motor is held energized and,
+ * for step/dir, already faces the right way; otherwise the settle or dir
+ * setup time comes first. While a start trigger is loaded the coils stay
+ * energized at rest, until a stop or standby releases them.
+ */
+static inline struct motor_stepper *trig_to_motor_stepper(struct motor_trigger *trig)
+{
+	return container_of(trig, struct motor_stepper, trig);
+}
+
+static int motor_stepper_trig_start(struct motor_trigger *trig)
+{
+	struct motor_stepper *stp = trig_to_motor_stepper(trig);
+	int step = trig->steps;
+	unsigned long flags;
+	ktime_t delay;
+	ktime_t now;
+	int ret = 0;
+
+	if(step == 0)
+		return -EINVAL;
+	spin_lock_irqsave(&stp->lock, flags);
+	if(stp->running || stp->armed || (stp->stream != MOTOR_STEPPER_STREAM_NONE) ||
+		(stp->group && stp->group->running) || motor_estopped())
+	{
+		ret = -EBUSY;
+	}
+	else if(stp->energized &&
+		((stp->mode != MOTOR_STEPPER_STEP_DIR) || (stp->dir == ((step > 0) ? 1 : -1))))
+	{
+		stp->start_pending = true;
+		stp->start_at = ktime_set(0, 0);
+		stp->trig_pending = true;
+		now = _motor_stepper_kickoff(stp, step, trig->edge_time);
+		_motor_stepper_mark_start(stp, now);
+	}
+	else
+	{
+		delay = stp->energized ? ktime_set(0, 0) : stp->start_delay;
+		_motor_stepper_energize(stp);
+		if((stp->mode == MOTOR_STEPPER_STEP_DIR) && (stp->dir != ((step > 0) ? 1 : -1)))
+		{
+			_motor_stepper_preset_dir(stp, step);
+			if(ktime_to_ns(delay) < stp->dir_setup_ns)
+				delay = ns_to_ktime(stp->dir_setup_ns);
+		}
+		stp->pos = step;
+		stp->running = true;
+		stp->start_pending = true;
+		stp->start_at = ktime_set(0, 0);
+		stp->trig_pending = true;
+		_motor_stepper_timer_start(stp, delay, HRTIMER_MODE_REL);
+	}
+	spin_unlock_irqrestore(&stp->lock, flags);
+	return ret;
+}
+
+static void motor_stepper_trig_stop(struct motor_trigger *trig)
+{
+	_motor_stepper_stop_irq(trig_to_motor_stepper(trig));
+}
+
+static void motor_stepper_trig_load(struct motor_trigger *trig)
+{
+	struct motor_stepper *stp = trig_to_motor_stepper(trig);
+	unsigned long flags;
+
+	spin_lock_irqsave(&stp->lock, flags);
+	stp->hold = motor_trigger_bound(trig) && (trig->action == MOTOR_TRIGGER_START) &&
+			(trig->steps != 0);
+	if(!stp->running && !stp->armed && (stp->stream == MOTOR_STEPPER_STREAM_NONE))
+	{
+		if(stp->hold && !motor_estopped())
+		{
+			_motor_stepper_energize(stp);
+			_motor_stepper_preset_dir(stp, trig->steps);
+		}
+		else if(stp->energized)
+			_motor_stepper_deenergize(stp, hrtimer_cb_get_time(&stp->hrtimer));
+	}
+	spin_unlock_irqrestore(&stp->lock, flags);
+}
+
+static const struct motor_trigger_ops motor_stepper_trig_ops = {
+	.start	= motor_stepper_trig_start,
+	.stop	= motor_stepper_trig_stop,
+	.load	= motor_stepper_trig_load,
+};
+
+/*
+ * Limit switches and homing. Both edges of a switch interrupt and keep
+ * stp->limits up to date; when the switch a move heads for closes (any
+ * switch, in a stream or a group) the handler stops the stepper on the
+ * spot. No step is ever taken into a closed switch either, so a move
+ * that starts on one ends at the next expiry. Once homed, position counts
+ * from the home switch and moves end at min_pos and max_pos; a pulse
+ * train is cut to them, a pvt or ring stream only sees the switches.
+ */
+static irqreturn_t motor_stepper_limit_irq(int irq, void *dev_id)
+{
+	struct motor_stepper *stp = dev_id;
+	int i = (irq == stp->limit_irq[1]) ? 1 : 0;
+	bool active = (gpio_get_value(stp->limit_pin[i]) != 0) != stp->limit_active_low;
+	bool hit = false;
+	unsigned long flags;
+
+	spin_lock_irqsave(&stp->lock, flags);
+	if(active)
+	{
+		stp->limits |= 1 << i;
+		if(stp->group && stp->group->running)
+			hit = true;
+		else if(stp->running)
+			hit = (stp->stream != MOTOR_STEPPER_STREAM_NONE) ||
+				((stp->pos != 0) && ((stp->pos > 0) == (i == 1)));
+	}
+	else
+		stp->limits &= ~(1 << i);
+	if(hit)
+		stp->stats.limit_stops++;
+	spin_unlock_irqrestore(&stp->lock, flags);
+
+	if(hit)
+		_motor_stepper_stop_irq(stp);
+	return IRQ_HANDLED;
+}
+
+static void _motor_stepper_limit_free(struct motor_stepper *stp)
+{
+	int i;
+
+	for(i = 0; i < 2; i++)
+	{
+		if(stp->limit_irq[i] < 0)
+			continue;
+		free_irq(stp->limit_irq[i], stp);
+		gpio_free(stp->limit_pin[i]);
+		stp->limit_irq[i] = -1;
+	}
+	stp->limits = 0;
+}
+
+static int _motor_stepper_limit_request(struct motor_stepper *stp)
+{
+	unsigned pin;
+	int irq;
+	int ret = 0;
+	int i;
+
+	for(i = 0; i < 2; i++)
+	{
+		pin = stp->limit_pin[i];
+		if(pin == 0)
+			continue;
+		ret = gpio_request_one(pin, GPIOF_IN, i ? "limit max" : "limit min");
+		if(ret)
+			break;
+		if(gpio_cansleep(pin))
+		{
+			gpio_free(pin);
+			ret = -EINVAL;
+			break;
+		}
+		if((gpio_get_value(pin) != 0) != stp->limit_active_low)
+			stp->limits |= 1 << i;
+		irq = gpio_to_irq(pin);
+		ret = irq < 0 ? irq : request_irq(irq, motor_stepper_limit_irq,
+				IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING, stp->cdev.name, stp);
+		if(ret)
+		{
+			gpio_free(pin);
+			break;
+		}
+		stp->limit_irq[i] = irq;
+	}
+	if(ret)
+		_motor_stepper_limit_free(stp);
+	return ret;
+}
+
+/* one leg of the homing, 0 once the move has ended */
+static int _motor_stepper_home_move(struct motor_stepper *stp, int step, unsigned int pps)
+{
+	u64 ms = div_u64((u64)abs(step) * MSEC_PER_SEC, pps) +
+			div_u64(ktime_to_ns(stp->start_delay), NSEC_PER_MSEC) + MSEC_PER_SEC;
+	long left;
+
+	motor_stepper_setspeed(stp, pps);
+	motor_stepper_move(stp, step);
+	left = wait_event_interruptible_timeout(stp->home_wq, !stp->running,
+			msecs_to_jiffies((unsigned int)min_t(u64, ms, UINT_MAX)));
+	if(left > 0)
+		return 0;
+	motor_stepper_stop(stp);
+	return left ? (int)left : -ETIMEDOUT;
+}
+
+/**
+ * motor_stepper_home - find the home switch and count from it
+ * @stp: the stepper, with a limit switch on the home_dir side
+ *
+ * Seeks the switch at home_fast_pps for up to home_travel steps, backs
+ * off home_backoff steps and approaches it again at home_slow_pps; where
+ * the switch closes is position 0 and the soft limits apply from there.
+ * Sleeps until done. Returns -ENODEV without the switch, -ENOENT if it
+ * was not reached, -EIO if it did not open on the back-off, -ETIMEDOUT
+ * if a leg did not end in time, or -ERESTARTSYS on a signal.
+ */
+int motor_stepper_home(struct motor_stepper *stp)
+{
+	int dir = (stp->home_dir > 0) ? 1 : -1;
+	unsigned int bit = (dir > 0) ? MOTOR_STEPPER_LIMIT_MAX : MOTOR_STEPPER_LIMIT_MIN;
+	unsigned int fast = stp->home_fast_pps ? stp->home_fast_pps : stp->pps;
+	unsigned int slow = stp->home_slow_pps ? stp->home_slow_pps : max(fast / 4, 1U);
+	unsigned int backoff = stp->home_backoff ? stp->home_backoff : MOTOR_STEPPER_HOME_BACKOFF;
+	unsigned int travel = stp->home_travel ? stp->home_travel : MOTOR_STEPPER_HOME_TRAVEL;
+	unsigned int pps = stp->pps;
+	unsigned long flags;
+	int ret = 0;
+
+	if(stp->limit_irq[(dir > 0) ? 1 : 0] < 0)
+		return -ENODEV;
+	if((stp->group && stp->group->running) || motor_estopped())
+		return -EBUSY;
+	travel = min(travel, (unsigned int)MOTOR_STEPPER_CONTINUOUS - 1);
+	backoff = min(backoff, travel / 2);
+
+	spin_lock_irqsave(&stp->lock, flags);
+	if(stp->homing)
+	{	// leave the homing in progress and its results alone
+		spin_unlock_irqrestore(&stp->lock, flags);
+		return -EBUSY;
+	}
+	stp->homing = true;
+	stp->homed = false;
+	stp->soft_limits = false;
+	spin_unlock_irqrestore(&stp->lock, flags);
+
+	motor_stepper_stop(stp);
+	ret = _motor_stepper_home_move(stp, dir * (int)travel, fast);
+	if(!ret && !(stp->limits & bit))
+		ret = -ENOENT;
+	if(!ret)
+		ret = _motor_stepper_home_move(stp, -dir * (int)backoff, fast);
+	if(!ret && (stp->limits & bit))
+		ret = -EIO;
+	if(!ret)
+		ret = _motor_stepper_home_move(stp, dir * (int)(2 * backoff), slow);
+	if(!ret && !(stp->limits & bit))
+		ret = -ENOENT;
+
+	spin_lock_irqsave(&stp->lock, flags);
+	if(!ret)
+	{
+		stp->position = 0;
+		stp->homed = true;
+		stp->soft_limits = (stp->max_pos > stp->min_pos);
+	}
+	stp->homing = false;
+	spin_unlock_irqrestore(&stp->lock, flags);
+	motor_stepper_setspeed(stp, pps);
+	return ret;
+}
+EXPORT_SYMBOL_GPL(motor_stepper_home);
+
+/**
+ * motor_stepper_stop - stop immediately and release the coils
+ * @stp: the stepper
+ *
+ * An axis of a moving group stops the whole group.
+ */
+void motor_stepper_stop(struct motor_stepper *stp)
+{
+	if(stp->group && stp->group->running)
+		motor_stepper_group_stop(stp->group);
+	_motor_stepper_halt(stp);
+}
+EXPORT_SYMBOL_GPL(motor_stepper_stop);
+
+/* called with stp->lock held */
+static void _motor_stepper_setspeed(struct motor_stepper *stp, unsigned int pps)
+{
+	if(stp->pps_ceiling && (pps > stp->pps_ceiling))
+		pps = stp->pps_ceiling;		// derated after an overrun
+	if((pps == 0) || (pps > _motor_stepper_max_pps(stp)))
+		return;
+	stp->pps = pps;
+	stp->period_ns = NSEC_PER_SEC / pps;
+}
+
+/*
+ * A single move on the coil timer changes rate at its next step, through
+ * the mailbox; otherwise the rate is set under stp->lock, which the other
+ * step handlers hold. Any context without stp->lock held.
+ */
+void motor_stepper_setspeed(struct motor_stepper *stp, unsigned int pps)
+{
+	unsigned long flags;
+	unsigned int pps_seq;
+
+	if(stp->pps_ceiling && (pps > stp->pps_ceiling))
+		pps = stp->pps_ceiling;
+	if((pps == 0) || (pps > _motor_stepper_max_pps(stp)))
+		return;
+	if(_motor_stepper_cmd_post(stp, NULL, pps, &pps_seq))
+		return;
+	spin_lock_irqsave(&stp->lock, flags);
+	if(_motor_stepper_cmd_claim_pps(stp, pps_seq))
+		_motor_stepper_setspeed(stp, pps);
+	spin_unlock_irqrestore(&stp->lock, flags);
+}
+EXPORT_SYMBOL_GPL(motor_stepper_setspeed);
+
+/**
+ * motor_stepper_set_cpu - place the step timer of a stepper on a cpu
+ * @stp: the stepper
+ * @cpu: an online cpu, or -1 for wherever the timer is started
+ *
+ * Takes effect the next time the timer starts, a move in progress stays
+ * where it runs; the output thread of sleeping coils moves at once. The
+ * steppers of a port are stepped by its thread, which keeps to the cpus
+ * parameter, threaded ones by the engine thread on thread_cpu.
+ */
+int motor_stepper_set_cpu(struct motor_stepper *stp, int cpu)
+{
+	if((cpu < -1) || ((cpu >= 0) && ((cpu >= nr_cpu_ids) || !cpu_online(cpu))))
+		return -EINVAL;
+	ACCESS_ONCE(stp->cpu) = cpu;
+	if(stp->thread)
+		set_cpus_allowed_ptr(stp->thread, (cpu < 0) ? cpu_possible_mask : cpumask_of(cpu));
+	return 0;
+}
+EXPORT_SYMBOL_GPL(motor_stepper_set_cpu);
+
+static u64 _motor_stepper_isqrt(u64 x)
+{
+	u64 r = 0;
+	u64 bit = 1ULL << 62;
+
+	while(bit > x)
+		bit >>= 2;
+	while(bit)
+	{
+		if(x >= r + bit)
+		{
+			x -= r + bit;
+			r = (r >> 1) + bit;
+		}
+		else
+		{
+			r >>= 1;
+		}
+		bit >>= 2;
+	}
+	return r;
+}
+
+/*
+ * pvt streams
+ *
+ * A segment runs from the position and velocity of one point to those of
+ * the next in dt_ns. With D the distance and m0, m1 the velocities times
+ * dt_ns, all in Q16 steps, the Hermite curve is
+ *	p(u) = p0 + ((a u + b) u + c) u
+ *	a = -2 D + m0 + m1,  b = 3 D - 2 m0 - m1,  c = m0
+ * for u from 0 to 1. The timer takes a step whenever the curve is half a
+ * step away from the stepped position, and sleeps until the next such
+ * crossing as predicted from the slope of the curve, at least one step
+ * period of the max rate and at most MOTOR_STEPPER_PVT_IDLE_NS.
+ */
+
+#define MOTOR_PVT_NEXT(i)	(((i) + 1) & (MOTOR_STEPPER_PVT - 1))
+
+/* steps/s times ns, in Q16 steps: 65536 / 10^9 is 128 / 1953125 */
+static inline s64 _motor_stepper_pvt_span(int vel, unsigned int dt_ns)
+{
+	return div_s64((s64)vel * dt_ns * 128, 1953125);
+}
+
+/* start the next queued segment, called with stp->lock held */
+static void _motor_stepper_pvt_load(struct motor_stepper_pvt *pvt)
+{
+	struct motor_stepper_pvt_point *pt = &pvt->q[pvt->tail];
+	s64 d = (s64)(pt->pos - pvt->p1) << 16;
+	s64 m0 = _motor_stepper_pvt_span(pvt->v1, pt->dt_ns);
+	s64 m1 = _motor_stepper_pvt_span(pt->vel, pt->dt_ns);
+
+	pvt->t0 += pvt->t;
+	pvt->t = pt->dt_ns;
+	pvt->p0 = pvt->p1;
+	pvt->p1 = pt->pos;
+	pvt->v1 = pt->vel;
+	pvt->a = -2 * d + m0 + m1;
+	pvt->b = 3 * d - 2 * m0 - m1;
+	pvt->c = m0;
+	pvt->tail = MOTOR_PVT_NEXT(pvt->tail);
+}
+
+/* Q16 position at virtual time vt of the segment, and its slope dp/du */
+static s64 _motor_stepper_pvt_at(struct motor_stepper_pvt *pvt, s64 vt, s64 *slope)
+{
+	s64 u;
+	s64 p;
+
+	if(vt >= pvt->t0 + pvt->t)
+	{
+		*slope = 0;
+		return (s64)pvt->p1 << 16;
+	}
+	u = div_s64((vt - pvt->t0) << 16, pvt->t);
+	*slope = ((((3 * pvt->a * u) >> 16) + 2 * pvt->b) * u >> 16) + pvt->c;
+	p = ((((pvt->a * u) >> 16) + pvt->b) * u >> 16) + pvt->c;
+	return ((s64)pvt->p0 << 16) + ((p * u) >> 16);
+}
+
+static enum hrtimer_restart motor_stepper_pvt_handler(struct hrtimer *timer)
+{
+	struct motor_stepper *stp =
+	    container_of(timer, struct motor_stepper, hrtimer);
+	struct motor_stepper_pvt *pvt = &stp->pvt;
+	enum hrtimer_restart ret = HRTIMER_RESTART;
+	ktime_t due = hrtimer_get_expires(timer);
+	ktime_t now = hrtimer_cb_get_time(timer);
+	s64 min = NSEC_PER_SEC / _motor_stepper_max_pps(stp);
+	s64 vt, p, here, slope, wait;
+	unsigned int err;
+	bool dry;
+	int dir = 0;
+#ifdef CONFIG_MOTOR_STEPPER_STATS
+	ktime_t start = ktime_get();
+#endif
+
+	spin_lock(&stp->lock);
+	if(unlikely(motor_estopped() || (stp->stream != MOTOR_STEPPER_STREAM_PVT)))
+	{	// e-stop, or stopped from an irq while we waited for the lock
+		spin_unlock(&stp->lock);
+		return HRTIMER_NORESTART;
+	}
+	if(stp->step_high)
+	{
+		stp->ops->set_step(stp, 0);
+		stp->step_high = false;
+		hrtimer_forward_now(timer, ns_to_ktime(stp->pulse_ns));
+		spin_unlock(&stp->lock);
+		return ret;
+	}
+
+	vt = ktime_to_ns(ktime_sub(now, pvt->vbase));
+	while((vt >= pvt->t0 + pvt->t) && (pvt->tail != pvt->head))
+		_motor_stepper_pvt_load(pvt);
+	dry = (vt >= pvt->t0 + pvt->t);
+	if(dry && pvt->v1)
+	{	// hold the last point, the next segment starts from rest
+		pvt->stats.underruns++;
+		pvt->v1 = 0;
+	}
+
+	p = _motor_stepper_pvt_at(pvt, vt, &slope);
+	here = (s64)pvt->pos << 16;
+	if(p >= here + (1 << 15))
+		dir = 1;
+	else if(p <= here - (1 << 15))
+		dir = -1;
+
+	if(dir && (stp->mode == MOTOR_STEPPER_STEP_DIR) && (dir != stp->dir))
+	{
+		stp->ops->set_dir(stp, dir);
+		stp->dir = dir;
+		hrtimer_forward_now(timer, ns_to_ktime(stp->dir_setup_ns));
+		spin_unlock(&stp->lock);
+		return ret;
+	}
+	if(dir)
+	{
+		pvt->pos += dir;
+		here += (s64)dir << 16;
+		pvt->stats.steps++;
+		if(stp->mode == MOTOR_STEPPER_STEP_DIR)
+		{
+			_motor_stepper_account_late(stp, now, due);
+			stp->ops->set_step(stp, 1);
+			stp->step_high = true;
+		}
+		else
+		{
+			stp->seq_idx -= dir;
+			_motor_stepper_output(stp, stp->seq[stp->seq_idx & stp->seq_mask], due);
+		}
+		stp->position += dir;
+	}
+	err = (unsigned int)((abs64(p - here) * 1000) >> 16);
+	if(err > pvt->stats.err_max)
+		pvt->stats.err_max = err;
+
+	if(stp->step_high)
+	{
+		wait = stp->pulse_ns;
+	}
+	else if(dry)
+	{
+		if(pvt->pos == pvt->p1)
+		{	// on the last point, the coils hold it
+			stp->running = false;
+			ret = HRTIMER_NORESTART;
+		}
+		wait = min;
+	}
+	else
+	{
+		wait = MOTOR_STEPPER_PVT_IDLE_NS;
+		if(slope)
+		{	// until the curve is half a step past the next one
+			wait = div64_s64((here + ((slope > 0) ? (1 << 15) : -(1 << 15)) - p) * pvt->t, slope);
+			wait = clamp_t(s64, wait, min, MOTOR_STEPPER_PVT_IDLE_NS);
+		}
+		if(pvt->t0 + pvt->t - vt < wait)
+			wait = max(pvt->t0 + pvt->t - vt, min);
+	}
+	if(ret == HRTIMER_RESTART)
+		hrtimer_forward_now(timer, ns_to_ktime(wait));
+	spin_unlock(&stp->lock);
+
+#ifdef CONFIG_MOTOR_STEPPER_STATS
+	_motor_stepper_account_cost(stp, start);
+#endif
+	return ret;
+}
+
+/**
+ * motor_stepper_pvt_push - queue a point of a pvt stream
+ * @stp: the stepper
+ * @pos: steps from where the stream started
+ * @vel: steps/s at the point
+ * @dt_ns: time from the previous point
+ *
+ * The first point after a stop, a single move or a ring starts a new stream from
+ * position 0 at rest; the motor is stopped first. The stream (re)starts
+ * once pvt_lead_ns of points are queued, the queue is full or a point
+ * comes to rest, the first time after stp->start_delay. Returns -EAGAIN
+ * while the queue is full and -EINVAL for a point the motor cannot reach
+ * at its max rate.
+ */
+int motor_stepper_pvt_push(struct motor_stepper *stp, int pos, int vel, unsigned int dt_ns)
+{
+	struct motor_stepper_pvt *pvt = &stp->pvt;
+	struct motor_stepper_pvt_point *pt;
+	unsigned int max = _motor_stepper_max_pps(stp);
+	unsigned long flags;
+	ktime_t delay;
+	s64 hold;
+	int ret = 0;
+
+	if(_motor_stepper_polled(stp))
+		return -EINVAL;
+	if((dt_ns == 0) || (dt_ns > MOTOR_STEPPER_PVT_MAX_DT_NS) || (abs(vel) > max))
+		return -EINVAL;
+	if(stp->group && stp->group->running)
+		return -EBUSY;
+	if(stp->stream != MOTOR_STEPPER_STREAM_PVT)
+	{
+		_motor_stepper_halt(stp);
+		spin_lock_irqsave(&stp->lock, flags);
+		memset(pvt, 0, offsetof(struct motor_stepper_pvt, stats));
+		stp->hrtimer.function = motor_stepper_pvt_handler;
+		stp->stream = MOTOR_STEPPER_STREAM_PVT;
+		spin_unlock_irqrestore(&stp->lock, flags);
+	}
+
+	spin_lock_irqsave(&stp->lock, flags);
+	if((stp->stream != MOTOR_STEPPER_STREAM_PVT) || motor_estopped())	// stopped meanwhile
+		ret = -EBUSY;
+	else if(abs64((s64)pos - pvt->end_pos) > div_u64((u64)max * dt_ns, NSEC_PER_SEC) + 1)
+		ret = -EINVAL;
+	else if(MOTOR_PVT_NEXT(pvt->head) == pvt->tail)
+		ret = -EAGAIN;
+	if(ret)
+	{
+		spin_unlock_irqrestore(&stp->lock, flags);
+		return ret;
+	}
+
+	pt = &pvt->q[pvt->head];
+	pt->pos = pos;
+	pt->vel = vel;
+	pt->dt_ns = dt_ns;
+	pvt->head = MOTOR_PVT_NEXT(pvt->head);
+	pvt->t_end += dt_ns;
+	pvt->end_pos = pos;
+	pvt->stats.points++;
+
+	hold = pvt->t0 + pvt->t;
+	if(!stp->running && ((pvt->t_end - hold >= stp->pvt_lead_ns) || (vel == 0) ||
+		(MOTOR_PVT_NEXT(pvt->head) == pvt->tail)))
+	{	// the virtual clock goes on from the point the motor holds
+		delay = stp->energized ? ktime_set(0, 0) : stp->start_delay;
+		pvt->vbase = ktime_sub_ns(ktime_add(hrtimer_cb_get_time(&stp->hrtimer), delay), hold);
+		stp->running = true;
+		_motor_stepper_energize(stp);
+		_motor_stepper_timer_start(stp, delay, HRTIMER_MODE_REL);
+	}
+	spin_unlock_irqrestore(&stp->lock, flags);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(motor_stepper_pvt_push);
+
+/*
+ * segment ring
+ *
+ * The timer takes the next descriptor when a segment is done. With the
+ * ring dry it looks again every MOTOR_STEPPER_RING_IDLE_NS, so userspace
+ * only ever writes to shared memory; the coils are released unless the
+ * last segment asked to hold. Pollers of ring_ctl are woken when the ring
+ * drops below ring_low queued segments and at the end of segments marked
+ * MOTOR_STEPPER_RING_WAKE.
+ */
+
+static inline void _motor_stepper_ring_wake(struct motor_stepper *stp)
+{
+	if(stp->ring_kn)
+	{
+		sysfs_notify_dirent(stp->ring_kn);
+		stp->ring_stats.wakeups++;
+	}
+}
+
+/* step period at the current point of the ring segment, v^2 linear in steps */
+static unsigned long _motor_stepper_ring_period(struct motor_stepper *stp)
+{
+	struct motor_stepper_ring_desc *seg = &stp->ring_cur;
+	u64 s2 = (u64)seg->start_pps * seg->start_pps;
+	u64 e2 = (u64)seg->end_pps * seg->end_pps;
+	unsigned int n = abs(seg->steps);
+	u64 v2;
+
+	if(e2 >= s2)
+		v2 = s2 + div_u64((e2 - s2) * stp->ring_step, n);
+	else
+		v2 = s2 - div_u64((s2 - e2) * stp->ring_step, n);
+	return NSEC_PER_SEC / max_t(u64, _motor_stepper_isqrt(v2), 1);
+}
+
+/*
+ * Copy the next descriptor out of the ring and free its slot, called with
+ * stp->lock held. Returns 1 for a segment, 0 with the ring dry and
+ * -EINVAL for a descriptor (or head) userspace got wrong.
+ */
+static int _motor_stepper_ring_load(struct motor_stepper *stp)
+{
+	struct motor_stepper_ring *ring = stp->ring;
+	struct motor_stepper_ring_desc *seg = &stp->ring_cur;
+	unsigned int max = _motor_stepper_max_pps(stp);
+	u32 tail = ring->tail;
+	u32 queued = ACCESS_ONCE(ring->head) - tail;
+
+	if(queued == 0)
+		return 0;
+	if(queued > MOTOR_STEPPER_RING)
+		return -EINVAL;
+	smp_rmb();		// the descriptor was written before head moved
+	seg->steps = ACCESS_ONCE(ring->desc[tail & (MOTOR_STEPPER_RING - 1)].steps);
+	seg->start_pps = ACCESS_ONCE(ring->desc[tail & (MOTOR_STEPPER_RING - 1)].start_pps);
+	seg->end_pps = ACCESS_ONCE(ring->desc[tail & (MOTOR_STEPPER_RING - 1)].end_pps);
+	seg->flags = ACCESS_ONCE(ring->desc[tail & (MOTOR_STEPPER_RING - 1)].flags);
+	if((abs(seg->steps) >= MOTOR_STEPPER_CONTINUOUS) ||
+		(seg->start_pps == 0) || (seg->start_pps > max) ||
+		(seg->end_pps == 0) || (seg->end_pps > max) ||
+		(seg->flags & ~(MOTOR_STEPPER_RING_WAKE | MOTOR_STEPPER_RING_HOLD)))
+		return -EINVAL;
+	smp_mb();		// done with the slot before userspace may refill it
+	ACCESS_ONCE(ring->tail) = tail + 1;
+	if((queued - 1 < stp->ring_low) && (queued >= stp->ring_low))
+		_motor_stepper_ring_wake(stp);
+	stp->ring_step = 0;
+	stp->ring_stats.segments++;
+	return 1;
+}
+
+static enum hrtimer_restart motor_stepper_ring_handler(struct hrtimer *timer)
+{
+	struct motor_stepper *stp =
+	    container_of(timer, struct motor_stepper, hrtimer);
+	struct motor_stepper_ring_desc *seg = &stp->ring_cur;
+	enum hrtimer_restart ret = HRTIMER_RESTART;
+	ktime_t due = hrtimer_get_expires(timer);
+	bool ended;
+	unsigned int end_pps;
+	u32 end_flags;
+	int dir;
+	int r;
+#ifdef CONFIG_MOTOR_STEPPER_STATS
+	ktime_t start = ktime_get();
+#endif
+
+	spin_lock(&stp->lock);
+	if(unlikely(motor_estopped() || (stp->stream != MOTOR_STEPPER_STREAM_RING)))
+	{	// e-stop, or stopped from an irq while we waited for the lock
+		spin_unlock(&stp->lock);
+		return HRTIMER_NORESTART;
+	}
+	if(stp->step_high)
+	{
+		stp->ops->set_step(stp, 0);
+		stp->step_high = false;
+		hrtimer_forward_now(timer, ns_to_ktime(stp->ring_period_ns - stp->pulse_ns));
+		spin_unlock(&stp->lock);
+		return ret;
+	}
+
+	if(stp->pos == 0)
+	{
+		ended = (seg->steps != 0);
+		end_pps = seg->end_pps;
+		end_flags = seg->flags;
+		if(seg->flags & MOTOR_STEPPER_RING_WAKE)
+			_motor_stepper_ring_wake(stp);
+		seg->steps = 0;
+		seg->flags = 0;
+		while(((r = _motor_stepper_ring_load(stp)) > 0) && (seg->steps == 0))
+		{	// an empty segment only marks a point to be woken at
+			if(seg->flags & MOTOR_STEPPER_RING_WAKE)
+				_motor_stepper_ring_wake(stp);
+		}
+		if(r < 0)
+		{
+			_motor_stepper_deenergize(stp, due);
+			stp->running = false;
+			_motor_stepper_ring_status(stp, MOTOR_STEPPER_RING_ERROR);
+			_motor_stepper_ring_wake(stp);
+			spin_unlock(&stp->lock);
+			return HRTIMER_NORESTART;
+		}
+		if(r == 0)
+		{
+			if(ended)
+			{	// dry right after a segment, too fast to stop at once?
+				if(end_pps > stp->jump_pps)
+					stp->ring_stats.underruns++;
+				if(!(end_flags & MOTOR_STEPPER_RING_HOLD))
+					_motor_stepper_deenergize(stp, due);
+			}
+			hrtimer_forward_now(timer, ns_to_ktime(MOTOR_STEPPER_RING_IDLE_NS));
+			spin_unlock(&stp->lock);
+			return ret;
+		}
+		stp->pos = seg->steps;
+		if(!stp->energized)
+		{
+			_motor_stepper_energize(stp);
+			hrtimer_forward_now(timer, stp->start_delay);
+			spin_unlock(&stp->lock);
+			return ret;
+		}
+	}
+
+	dir = (stp->pos > 0) ? 1 : -1;
+	if((stp->mode == MOTOR_STEPPER_STEP_DIR) && (dir != stp->dir))
+	{
+		stp->ops->set_dir(stp, dir);
+		stp->dir = dir;
+		hrtimer_forward_now(timer, ns_to_ktime(stp->dir_setup_ns));
+		spin_unlock(&stp->lock);
+		return ret;
+	}
+
+	if(!_motor_stepper_advance(stp))
+	{	// a limit is closed: no step, the stream ends here
+		_motor_stepper_deenergize(stp, due);
+		stp->running = false;
+		_motor_stepper_unstream(stp);
+		_motor_stepper_ring_wake(stp);
+		spin_unlock(&stp->lock);
+		return HRTIMER_NORESTART;
+	}
+	stp->ring_period_ns = _motor_stepper_ring_period(stp);
+	stp->ring_step++;
+	if(stp->mode == MOTOR_STEPPER_STEP_DIR)
+	{
+		_motor_stepper_account_late(stp, hrtimer_cb_get_time(timer), due);
+		stp->ops->set_step(stp, 1);
+		stp->step_high = true;
+		hrtimer_forward_now(timer, ns_to_ktime(stp->pulse_ns));
+	}
+	else
+	{
+		_motor_stepper_output(stp, stp->seq[stp->seq_idx & stp->seq_mask], due);
+		hrtimer_forward_now(timer, ns_to_ktime(stp->ring_period_ns));
+	}
+	spin_unlock(&stp->lock);
+
+#ifdef CONFIG_MOTOR_STEPPER_STATS
+	_motor_stepper_account_cost(stp, start);
+#endif
+	return ret;
+}
+
+/**
+ * motor_stepper_ring_start - run the stepper from its segment ring
+ * @stp: the stepper, registered and not on a port
+ *
+ * The motor is stopped and the ring emptied; from then on the step timer
+ * follows whatever userspace queues until the motor is stopped or given
+ * another move.
+ */
+int motor_stepper_ring_start(struct motor_stepper *stp)
+{
+	unsigned long flags;
+
+	if(stp->ring == NULL)
+		return -EINVAL;
+	if(stp->group && stp->group->running)
+		return -EBUSY;
+	_motor_stepper_halt(stp);
+
+	spin_lock_irqsave(&stp->lock, flags);
+	if(motor_estopped())
+	{
+		spin_unlock_irqrestore(&stp->lock, flags);
+		return -EBUSY;
+	}
+	stp->ring->head = 0;
+	stp->ring->tail = 0;
+	_motor_stepper_ring_status(stp, MOTOR_STEPPER_RING_RUNNING);
+	memset(&stp->ring_cur, 0, sizeof(stp->ring_cur));
+	stp->stream = MOTOR_STEPPER_STREAM_RING;
+	stp->hrtimer.function = motor_stepper_ring_handler;
+	stp->running = true;
+	_motor_stepper_timer_start(stp, ktime_set(0, 0), HRTIMER_MODE_REL);
+	spin_unlock_irqrestore(&stp->lock, flags);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(motor_stepper_ring_start);
+
+/*
+ * motion programs
+ *
+ * The handler of a running program wraps the one of the step mode: the
+ * moves of the program are stepped like any other, and whenever the motor
+ * is at rest the program says what comes next. The coils stay energized
+ * from the start of the program to its end.
+ */
+
+static inline struct motor_stepper *prog_to_motor_stepper(struct motor_prog *prog)
+{
+	return container_of(prog, struct motor_stepper, prog);
+}
+
+static enum hrtimer_restart motor_stepper_prog_handler(struct hrtimer *timer)
+{
+	struct motor_stepper *stp =
+	    container_of(timer, struct motor_stepper, hrtimer);
+	enum hrtimer_restart ret = HRTIMER_NORESTART;
+
+	spin_lock(&stp->lock);
+	if(unlikely(motor_estopped() || (stp->stream != MOTOR_STEPPER_STREAM_PROG)))
+	{	// e-stop, or stopped from an irq while we waited for the lock
+		spin_unlock(&stp->lock);
+		return ret;
+	}
+	if(stp->pos || stp->step_high || stp->offloaded)
+		goto step;
+	switch(motor_prog_run(&stp->prog))
+	{
+		case MOTOR_PROG_MOVING:
+			stp->pos = stp->prog.steps[0];
+			stp->sched.pps = 0;	// timed from its first step, not across a dwell or wait
+			goto step;
+		case MOTOR_PROG_SLEEP:
+			hrtimer_forward_now(timer, ns_to_ktime(stp->prog.sleep_ns));
+			ret = HRTIMER_RESTART;
+			break;
+		case MOTOR_PROG_WAITING:
+			break;
+		case MOTOR_PROG_DONE:
+			_motor_stepper_deenergize(stp, hrtimer_get_expires(timer));
+			_motor_stepper_unstream(stp);
+			stp->running = false;
+			break;
+	}
+	spin_unlock(&stp->lock);
+	return ret;
+
+step:
+	spin_unlock(&stp->lock);
+	if(stp->mode == MOTOR_STEPPER_STEP_DIR)
+		ret = motor_stepper_stepdir_handler(timer);
+	else
+		ret = motor_stepper_hrtimer_handler(timer);
+	if(ret == HRTIMER_RESTART)
+		return ret;
+	spin_lock(&stp->lock);
+	if(!stp->running && (stp->stream == MOTOR_STEPPER_STREAM_PROG))
+		_motor_stepper_unstream(stp);	// a limit or the stop policy ended the move, the program ends too
+	spin_unlock(&stp->lock);
+	return ret;
+}
+
+static int motor_stepper_prog_start(struct motor_prog *prog)
+{
+	struct motor_stepper *stp = prog_to_motor_stepper(prog);
+	unsigned long flags;
+
+	if(stp->group && stp->group->running)
+		return -EBUSY;
+	_motor_stepper_halt(stp);
+
+	spin_lock_irqsave(&stp->lock, flags);
+	if(motor_estopped())
+	{
+		spin_unlock_irqrestore(&stp->lock, flags);
+		return -EBUSY;
+	}
+	stp->stream = MOTOR_STEPPER_STREAM_PROG;
+	stp->hrtimer.function = motor_stepper_prog_handler;
+	stp->running = true;
+	_motor_stepper_energize(stp);
+	_motor_stepper_timer_start(stp, stp->start_delay, HRTIMER_MODE_REL);
+	spin_unlock_irqrestore(&stp->lock, flags);
+	return 0;
+}
+
+static void motor_stepper_prog_stop(struct motor_prog *prog)
+{
+	motor_stepper_stop(prog_to_motor_stepper(prog));
+}
+
+/* from motor_prog_run() in the step handler, stp->lock held */
+static void motor_stepper_prog_setspeed(struct motor_prog *prog, unsigned int pps)
+{
+	_motor_stepper_setspeed(prog_to_motor_stepper(prog), pps);
+}
+
+static void motor_stepper_prog_kick(struct motor_prog *prog)
+{
+	struct motor_stepper *stp = prog_to_motor_stepper(prog);
+
+	_motor_stepper_timer_start(stp, ktime_set(0, 0), HRTIMER_MODE_REL);
+}
+
+static const struct motor_prog_ops motor_stepper_prog_ops = {
+	.start		= motor_stepper_prog_start,
+	.stop		= motor_stepper_prog_stop,
+	.setspeed	= motor_stepper_prog_setspeed,
+	.kick		= motor_stepper_prog_kick,
+};
+
+/*
+ * motor class glue
+ */
+
+/**
+ * motor_stepper_remaining - steps left in the current move
+ * @stp: the stepper
+ *
+ * Negative is backward. While a pulse train runs this is an estimate
+ * from the elapsed time, in a pvt stream it is the way to the last
+ * queued point.
+ */
+int motor_stepper_remaining(struct motor_stepper *stp)
+{
+	unsigned long flags;
+	unsigned long done;
+	int pos;
+
+	spin_lock_irqsave(&stp->lock, flags);
+	if(stp->stream == MOTOR_STEPPER_STREAM_PVT)
+		pos = stp->pvt.end_pos - stp->pvt.pos;
+	else
+		pos = stp->pos;
+	if(stp->offloaded && (abs(pos) < MOTOR_STEPPER_CONTINUOUS))
+	{
+		done = _motor_stepper_train_done(stp, hrtimer_cb_get_time(&stp->hrtimer));
+		pos = (pos > 0) ? pos - (int)done : pos + (int)done;
+	}
+	spin_unlock_irqrestore(&stp->lock, flags);
+	return pos;
+}
+EXPORT_SYMBOL_GPL(motor_stepper_remaining);
+
+static inline struct motor_stepper *to_motor_stepper(struct motor_classdev *motor_cdev)
+{
+	return container_of(motor_cdev, struct motor_stepper, cdev);
+}
+
+static void motor_stepper_ctl(struct motor_classdev *motor_cdev, enum motor_state ctrl, int step)
+{
+	struct motor_stepper *stp = to_motor_stepper(motor_cdev);
+
+	switch(ctrl)
+	{
+		case MOTOR_FORWARD:
+			motor_stepper_move(stp, step);
+			break;
+		case MOTOR_BACKWARD:
+			motor_stepper_move(stp, -step);
+			break;
+		default:
+		case MOTOR_STANDBY:
+			motor_stepper_stop(stp);
+			break;
+	}
+}
+
+static int motor_stepper_ctl_at(struct motor_classdev *motor_cdev, enum motor_state ctrl,
+		int step, ktime_t at)
+{
+	struct motor_stepper *stp = to_motor_stepper(motor_cdev);
+
+	switch(ctrl)
+	{
+		case MOTOR_FORWARD:
+			return motor_stepper_move_at(stp, step, at);
+		case MOTOR_BACKWARD:
+			return motor_stepper_move_at(stp, -step, at);
+		default:
+			return -EINVAL;
+	}
+}
+
+static int motor_stepper_cdev_arm(struct motor_classdev *motor_cdev, enum motor_state ctrl, int step)
+{
+	struct motor_stepper *stp = to_motor_stepper(motor_cdev);
+
+	switch(ctrl)
+	{
+		case MOTOR_FORWARD:
+			return motor_stepper_arm(stp, step);
+		case MOTOR_BACKWARD:
+			return motor_stepper_arm(stp, -step);
+		default:
+			return motor_stepper_arm(stp, 0);
+	}
+}
+
+static int motor_stepper_cdev_fire(struct motor_fire *mf, ktime_t at)
+{
+	return motor_stepper_fire(at);
+}
+
+static struct motor_fire motor_stepper_fire_hook = {
+	.fire	= motor_stepper_cdev_fire,
+};
+
+static ktime_t motor_stepper_getstart(struct motor_classdev *motor_cdev)
+{
+	struct motor_stepper *stp = to_motor_stepper(motor_cdev);
+	unsigned long flags;
+	ktime_t started;
+
+	spin_lock_irqsave(&stp->lock, flags);
+	started = stp->started;
+	spin_unlock_irqrestore(&stp->lock, flags);
+	return started;
+}
+
+static enum motor_state motor_stepper_getstate(struct motor_classdev *motor_cdev)
+{
+	int pos = motor_stepper_remaining(to_motor_stepper(motor_cdev));
+
+	if(pos > 0)
+		return MOTOR_FORWARD;
+	else if(pos < 0)
+		return MOTOR_BACKWARD;
+	else
+		return MOTOR_STANDBY;
+}
+
+static void motor_stepper_cdev_setspeed(struct motor_classdev *motor_cdev, unsigned int speed)
+{
+	motor_stepper_setspeed(to_motor_stepper(motor_cdev), speed);
+}
+
+static unsigned int motor_stepper_getspeed(struct motor_classdev *motor_cdev)
+{
+	return to_motor_stepper(motor_cdev)->pps;
+}
+
+static void motor_stepper_setpos(struct motor_classdev *motor_cdev, unsigned int pos)
+{
+	motor_stepper_move(to_motor_stepper(motor_cdev), (int)pos);
+}
+
+static unsigned int motor_stepper_getpos(struct motor_classdev *motor_cdev)
+{
+	return motor_stepper_remaining(to_motor_stepper(motor_cdev));
+}
+
+#ifdef CONFIG_MOTOR_STEPPER_STATS
+static ssize_t motor_stepper_stats_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct motor_stepper *stp = to_motor_stepper(dev_get_drvdata(dev));
+	unsigned long steps = stp->stats.steps;
+	unsigned long late_samples = stp->stats.late_samples;
+	u64 avg = stp->stats.step_ns;
+	u64 late_avg = stp->stats.late_ns;
+	ssize_t len;
+
+	if(steps)
+		do_div(avg, steps);
+	if(late_samples)
+		do_div(late_avg, late_samples);
+	len = sprintf(buf, "mode %s\nsteps %lu\nstep_ns_avg %llu\nstep_ns_max %u\n"
+			"late_ns_avg %llu\nlate_ns_max %u\ndropped %lu\n",
+			stp->port ? "port" : stp->threaded ? "engine thread" :
+			stp->thread ? "threaded" :
+			(stp->mode == MOTOR_STEPPER_STEP_DIR) ? "step/dir" : "direct",
+			steps, (unsigned long long)avg, stp->stats.step_ns_max,
+			(unsigned long long)late_avg, stp->stats.late_ns_max,
+			stp->stats.dropped);
+	if(stp->stats.cmds_posted)
+	{
+		len += sprintf(buf + len, "cmds_posted %lu\ncmds_taken %lu\ncmd_retries %lu\n",
+				stp->stats.cmds_posted, stp->stats.cmds_taken, stp->stats.cmd_retries);
+	}
+	if(stp->ops->train_start)
+	{
+		len += sprintf(buf + len, "offloads %lu\noffload_steps %lu\noffload_miscount %lu\n",
+				stp->stats.offloads, stp->stats.offload_steps,
+				stp->stats.offload_miscount);
+	}
+	if(stp->stats.timed_starts)
+	{
+		len += sprintf(buf + len, "timed_starts %lu\nstart_late_ns %lld\nstart_late_ns_max %u\n",
+				stp->stats.timed_starts, (long long)stp->stats.start_late_ns,
+				stp->stats.start_late_ns_max);
+	}
+	if(stp->stats.fired)
+	{
+		len += sprintf(buf + len, "fired %lu\nfire_skew_ns %u\nfire_skew_ns_max %u\n",
+				stp->stats.fired, stp->stats.fire_skew_ns, stp->stats.fire_skew_ns_max);
+	}
+	if(stp->port)
+	{
+		struct motor_stepper_port_stats *ps = &stp->port->stats;
+		u64 flush_avg = ps->flush_ns;
+
+		if(ps->flushes)
+			do_div(flush_avg, ps->flushes);
+		len += sprintf(buf + len, "port %s\nport_ticks %lu\nport_updates %lu\n"
+				"port_flushes %lu\nport_flush_ns_avg %llu\nport_flush_ns_max %u\n",
+				stp->port->name, ps->ticks, ps->updates, ps->flushes,
+				(unsigned long long)flush_avg, ps->flush_ns_max);
+	}
+	if(stp->threaded)
+	{
+		struct motor_stepper_engine_stats es;
+
+		motor_stepper_engine_stats(&es, false);
+		len += sprintf(buf + len, "engine_wakeups %lu\nengine_steps %lu\n"
+				"engine_busy_ns %llu\nengine_busy_ns_max %u\n",
+				es.wakeups, es.steps, (unsigned long long)es.busy_ns, es.busy_ns_max);
+	}
+	return len;
+}
+
+static ssize_t motor_stepper_stats_store(struct device *dev, struct device_attribute *attr,
+			const char *buf, size_t count)
+{
+	struct motor_stepper *stp = to_motor_stepper(dev_get_drvdata(dev));
+
+	memset(&stp->stats, 0, sizeof(stp->stats));
+	memset(&stp->pvt.stats, 0, sizeof(stp->pvt.stats));
+	if(stp->port)
+		memset(&stp->port->stats, 0, sizeof(stp->port->stats));
+	if(stp->threaded)
+	{
+		struct motor_stepper_engine_stats es;
+
+		motor_stepper_engine_stats(&es, true);
+	}
+	return count;
+}
+
+static struct device_attribute motor_stepper_attrs_stats =
+	__ATTR(stats, S_IRUGO|S_IWUSR, motor_stepper_stats_show, motor_stepper_stats_store);
+#endif
+
+/* home: write "home" to run the homing, or "zero" to take here as home */
+static ssize_t motor_stepper_home_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct motor_stepper *stp = to_motor_stepper(dev_get_drvdata(dev));
+	unsigned int limits = stp->limits;
+
+	return sprintf(buf, "homed %d\nposition %d\nlimits%s%s%s\nmin_pos %d\nmax_pos %d\n"
+			"limit_stops %lu\n", stp->homed, stp->position,
+			(limits & MOTOR_STEPPER_LIMIT_MIN) ? " min" : "",
+			(limits & MOTOR_STEPPER_LIMIT_MAX) ? " max" : "",
+			limits ? "" : " none", stp->min_pos, stp->max_pos,
+			stp->stats.limit_stops);
+}
+
+static ssize_t motor_stepper_home_store(struct device *dev, struct device_attribute *attr,
+			const char *buf, size_t count)
+{
+	struct motor_stepper *stp = to_motor_stepper(dev_get_drvdata(dev));
+	unsigned long flags;
+	int ret;
+
+	if(!strncmp(buf, "home", 4))
+	{
+		ret = motor_stepper_home(stp);
+		return ret < 0 ? ret : count;
+	}
+	if(strncmp(buf, "zero", 4))
+		return -EINVAL;
+	spin_lock_irqsave(&stp->lock, flags);
+	stp->position = 0;
+	stp->homed = true;
+	stp->soft_limits = (stp->max_pos > stp->min_pos);
+	spin_unlock_irqrestore(&stp->lock, flags);
+	return count;
+}
+
+static struct device_attribute motor_stepper_attrs_home =
+	__ATTR(home, S_IRUGO|S_IWUSR, motor_stepper_home_show, motor_stepper_home_store);
+
+/* cpu: where the step timer runs, write a cpu or -1 for any */
+static ssize_t motor_stepper_cpu_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct motor_stepper *stp = to_motor_stepper(dev_get_drvdata(dev));
+
+	return sprintf(buf, "%d\n", stp->cpu);
+}
+
+static ssize_t motor_stepper_cpu_store(struct device *dev, struct device_attribute *attr,
+			const char *buf, size_t count)
+{
+	struct motor_stepper *stp = to_motor_stepper(dev_get_drvdata(dev));
+	int cpu;
+	int ret;
+
+	if(kstrtoint(buf, 0, &cpu))
+		return -EINVAL;
+	ret = motor_stepper_set_cpu(stp, cpu);
+	return ret < 0 ? ret : count;
+}
+
+static struct device_attribute motor_stepper_attrs_cpu =
+	__ATTR(cpu, S_IRUGO|S_IWUSR, motor_stepper_cpu_show, motor_stepper_cpu_store);
+
+/*
+ * overrun: write a policy (log, catchup, derate, stop), or "reset" to
+ * clear the counters, a derated speed ceiling and the fault. Pollers are
+ * woken on a derate or a stop.
+ */
+static ssize_t motor_stepper_overrun_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct motor_stepper *stp = to_motor_stepper(dev_get_drvdata(dev));
+
+	return sprintf(buf, "policy %s\noverruns %lu\nperiods_missed %lu\nperiods_missed_max %u\n"
+			"catchup_steps %lu\nderates %lu\nstops %lu\npps_ceiling %u\nfault %d\n",
+			motor_stepper_overrun_names[stp->overrun_policy],
+			stp->stats.overruns, stp->stats.overrun_periods, stp->stats.overrun_max,
+			stp->stats.catchup_steps, stp->stats.derates, stp->stats.overrun_stops,
+			stp->pps_ceiling, stp->overrun_fault);
+}
+
+static ssize_t motor_stepper_overrun_store(struct device *dev, struct device_attribute *attr,
+			const char *buf, size_t count)
+{
+	struct motor_stepper *stp = to_motor_stepper(dev_get_drvdata(dev));
+	unsigned long flags;
+	int i;
+
+	if(!strncmp(buf, "reset", 5))
+	{
+		spin_lock_irqsave(&stp->lock, flags);
+		stp->stats.overruns = 0;
+		stp->stats.overrun_periods = 0;
+		stp->stats.overrun_max = 0;
+		stp->stats.catchup_steps = 0;
+		stp->stats.derates = 0;
+		stp->stats.overrun_stops = 0;
+		stp->pps_ceiling = 0;
+		stp->overrun_fault = false;
+		spin_unlock_irqrestore(&stp->lock, flags);
+		return count;
+	}
+	for(i = 0; i < ARRAY_SIZE(motor_stepper_overrun_names); i++)
+	{
+		if(sysfs_streq(buf, motor_stepper_overrun_names[i]))
+		{
+			spin_lock_irqsave(&stp->lock, flags);
+			stp->overrun_policy = i;
+			stp->catchup = false;
+			spin_unlock_irqrestore(&stp->lock, flags);
+			return count;
+		}
+	}
+	return -EINVAL;
+}
+
+static struct device_attribute motor_stepper_attrs_overrun =
+	__ATTR(overrun, S_IRUGO|S_IWUSR, motor_stepper_overrun_show, motor_stepper_overrun_store);
+
+/*
+ * pvt: write "pos vel dt_ns" points, any number per write. A write that
+ * fills the queue returns the bytes of the points taken, so the rest is
+ * written again; -EAGAIN if it took none. Reading tells how far the queue
+ * reaches ahead of the virtual clock (lead_ns).
+ */
+static ssize_t motor_stepper_pvt_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct motor_stepper *stp = to_motor_stepper(dev_get_drvdata(dev));
+	struct motor_stepper_pvt *pvt = &stp->pvt;
+	unsigned long flags;
+	unsigned int queued;
+	s64 vt;
+	ssize_t len;
+
+	spin_lock_irqsave(&stp->lock, flags);
+	queued = (pvt->head - pvt->tail) & (MOTOR_STEPPER_PVT - 1);
+	if(stp->stream != MOTOR_STEPPER_STREAM_PVT)
+		vt = pvt->t_end;
+	else if(stp->running)
+		vt = ktime_to_ns(ktime_sub(hrtimer_cb_get_time(&stp->hrtimer), pvt->vbase));
+	else
+		vt = pvt->t0 + pvt->t;
+	vt = clamp_t(s64, vt, 0, pvt->t_end);
+	len = sprintf(buf, "state %s\nqueued %u\nfree %u\nlead_ns %lld\nvclock_ns %lld\n"
+			"pos %d\npoints %lu\nunderruns %lu\nsteps %lu\nerr_max %u\n",
+			(stp->stream != MOTOR_STEPPER_STREAM_PVT) ? "off" : stp->running ? "running" : "holding",
+			queued, MOTOR_STEPPER_PVT - 1 - queued,
+			(long long)(pvt->t_end - vt), (long long)vt, pvt->pos,
+			pvt->stats.points, pvt->stats.underruns, pvt->stats.steps,
+			pvt->stats.err_max);
+	spin_unlock_irqrestore(&stp->lock, flags);
+	return len;
+}
+
+static ssize_t motor_stepper_pvt_store(struct device *dev, struct device_attribute *attr,
+			const char *buf, size_t count)
+{
+	struct motor_stepper *stp = to_motor_stepper(dev_get_drvdata(dev));
+	const char *p = buf;
+	unsigned int dt_ns;
+	int pos, vel;
+	int n;
+	int ret;
+
+	while(sscanf(p, "%d %d %u%n", &pos, &vel, &dt_ns, &n) == 3)
+	{
+		ret = motor_stepper_pvt_push(stp, pos, vel, dt_ns);
+		if(ret)
+			return (p == buf) ? ret : p - buf;
+		p += n;
+	}
+	p = skip_spaces(p);
+	if(*p && (p < buf + count))
+		return -EINVAL;
+	return count;
+}
+
+static struct device_attribute motor_stepper_attrs_pvt =
+	__ATTR(pvt, S_IRUGO|S_IWUSR, motor_stepper_pvt_show, motor_stepper_pvt_store);
+
+/*
+ * ring: mmap the shared page. Its mappings are zapped when the attribute
+ * is removed, so the page can be freed after that.
+ */
+static int motor_stepper_ring_mmap(struct file *filp, struct kobject *kobj,
+		struct bin_attribute *attr, struct vm_area_struct *vma)
+{
+	struct motor_stepper *stp = to_motor_stepper(dev_get_drvdata(container_of(kobj, struct device, kobj)));
+
+	if((vma->vm_pgoff != 0) || (vma->vm_end - vma->vm_start > PAGE_SIZE))
+		return -EINVAL;
+	return remap_pfn_range(vma, vma->vm_start, virt_to_phys(stp->ring) >> PAGE_SHIFT,
+			vma->vm_end - vma->vm_start, vma->vm_page_prot);
+}
+
+static struct bin_attribute motor_stepper_attrs_ring = {
+	.attr	= { .name = "ring", .mode = S_IRUSR|S_IWUSR },
+	.size	= PAGE_SIZE,
+	.mmap	= motor_stepper_ring_mmap,
+};
+
+/*
+ * ring_ctl: write "start" to run from the ring, "stop" to stop, or a
+ * number for the low watermark. poll() it for wakeups.
+ */
+static ssize_t motor_stepper_ring_ctl_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct motor_stepper *stp = to_motor_stepper(dev_get_drvdata(dev));
+	struct motor_stepper_ring *ring = stp->ring;
+	static const char * const status[] = { "idle", "running", "error" };
+	u32 head = ACCESS_ONCE(ring->head);
+	u32 tail = ACCESS_ONCE(ring->tail);
+
+	return sprintf(buf, "state %s\nhead %u\ntail %u\nqueued %u\nlow %u\n"
+			"segments %lu\nunderruns %lu\nwakeups %lu\n",
+			status[stp->ring_status], head, tail, head - tail, stp->ring_low,
+			stp->ring_stats.segments, stp->ring_stats.underruns,
+			stp->ring_stats.wakeups);
+}
+
+static ssize_t motor_stepper_ring_ctl_store(struct device *dev, struct device_attribute *attr,
+			const char *buf, size_t count)
+{
+	struct motor_stepper *stp = to_motor_stepper(dev_get_drvdata(dev));
+	unsigned long low;
+	int ret;
+
+	if(sysfs_streq(buf, "start"))
+	{
+		ret = motor_stepper_ring_start(stp);
+		if(ret)
+			return ret;
+	}
+	else if(sysfs_streq(buf, "stop"))
+	{
+		motor_stepper_stop(stp);
+	}
+	else
+	{
+		ret = kstrtoul(buf, 10, &low);
+		if(ret)
+			return ret;
+		if(low > MOTOR_STEPPER_RING)
+			return -EINVAL;
+		stp->ring_low = low;
+	}
+	return count;
+}
+
+static struct device_attribute motor_stepper_attrs_ring_ctl =
+	__ATTR(ring_ctl, S_IRUGO|S_IWUSR, motor_stepper_ring_ctl_show, motor_stepper_ring_ctl_store);
+
+
+/**
+ * motor_stepper_init - prepare a stepper without a motor class device
+ * @stp: the stepper, with ops, mode and pps filled in
+ *
+ * The coils are left released. With stp->cansleep set, the coils are
+ * written from a SCHED_FIFO thread fed by the step timer. With stp->port
+ * set, the stepper is attached to that port and stepped by its thread,
+ * its ops may then be empty; with stp->threaded set (or the thread
+ * parameter, off a port), it is stepped by the engine thread and its
+ * coils may sleep.
+ * A MOTOR_STEPPER_STEP_DIR stepper needs set_step and set_dir, and can use
+ * neither a port, the engine thread nor sleeping gpios. A pps above what
+ * the mode can step is -EINVAL, 0 takes 100.
+ */
+int motor_stepper_init(struct motor_stepper *stp)
+{
+	struct sched_param param = { .sched_priority = MAX_USER_RT_PRIO/2 };
+
+	int i;
+	unsigned int coil;
+	int ret;
+
+	if((stp->ops == NULL) || (stp->overrun_policy > MOTOR_STEPPER_OVERRUN_STOP) ||
+		(stp->port && stp->threaded))
+		return -EINVAL;
+	if(stp->mode == MOTOR_STEPPER_STEP_DIR)
+	{
+		if((stp->ops->set_step == NULL) || (stp->ops->set_dir == NULL) ||
+			stp->port || stp->threaded || stp->cansleep)
+			return -EINVAL;
+	}
+	else if((stp->port == NULL) && (stp->ops->set_phase_mask == NULL))
+		return -EINVAL;
+	else if((stp->port == NULL) && motor_stepper_thread_all)
+		stp->threaded = true;
+
+	switch(stp->mode)
+	{
+		case MOTOR_STEPPER_HALF_STEP:
+			stp->seq = motor_stepper_seq_1_2_phase;
+			stp->seq_mask = ARRAY_SIZE(motor_stepper_seq_1_2_phase) - 1;
+			break;
+		case MOTOR_STEPPER_FULL_STEP:
+			stp->seq = motor_stepper_seq_2_phase;
+			stp->seq_mask = ARRAY_SIZE(motor_stepper_seq_2_phase) - 1;
+			break;
+		case MOTOR_STEPPER_STEP_DIR:
+			stp->seq = NULL;
+			stp->seq_mask = 0;
+			if(stp->pulse_ns == 0)
+				stp->pulse_ns = MOTOR_STEPPER_PULSE_NS;
+			if(stp->dir_setup_ns == 0)
+				stp->dir_setup_ns = MOTOR_STEPPER_DIR_SETUP_NS;
+			if(stp->offload_min == 0)
+				stp->offload_min = MOTOR_STEPPER_OFFLOAD_MIN;
+			if((stp->ops->train_start == NULL) != (stp->ops->train_stop == NULL))
+				return -EINVAL;
+			break;
+		default:
+			return -EINVAL;
+	}
+	stp->pps_ceiling = 0;
+	if(stp->pps == 0)
+		stp->pps = 100;
+	if(stp->pps > _motor_stepper_max_pps(stp))
+		return -EINVAL;
+
+	spin_lock_init(&stp->lock);
+	hrtimer_init(&stp->hrtimer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	if(stp->mode == MOTOR_STEPPER_STEP_DIR)
+		stp->hrtimer.function = motor_stepper_stepdir_handler;
+	else
+		stp->hrtimer.function = motor_stepper_hrtimer_handler;
+	stp->pos = 0;
+	stp->seq_idx = 0;
+	stp->phase = 0;
+	stp->energized = false;
+	stp->running = false;
+	stp->step_high = false;
+	stp->dir = 0;
+	stp->offloaded = false;
+	stp->sched.pps = 0;
+	stp->cpu = _motor_stepper_spread_cpu();
+	stp->timer_remote = false;
+	stp->timer_csd.func = motor_stepper_timer_remote;
+	stp->timer_csd.info = stp;
+	stp->timer_csd.flags = 0;
+	stp->catchup = false;
+	stp->overrun_fault = false;
+	stp->overrun_kn = NULL;
+	stp->start_at = ktime_set(0, 0);
+	stp->started = ktime_set(0, 0);
+	stp->start_pending = false;
+	INIT_LIST_HEAD(&stp->arm_node);
+	stp->armed = false;
+	stp->hold = false;
+	stp->trig_pending = false;
+	stp->limit_irq[0] = -1;
+	stp->limit_irq[1] = -1;
+	stp->limits = 0;
+	stp->position = 0;
+	stp->homed = false;
+	stp->soft_limits = false;
+	stp->homing = false;
+	init_waitqueue_head(&stp->home_wq);
+	stp->q_head = 0;
+	stp->q_tail = 0;
+	stp->stream = MOTOR_STEPPER_STREAM_NONE;
+	stp->ring = NULL;
+	stp->ring_kn = NULL;
+	memset(&stp->pvt, 0, sizeof(stp->pvt));
+	if(stp->pvt_lead_ns == 0)
+		stp->pvt_lead_ns = MOTOR_STEPPER_PVT_LEAD_NS;
+	memset(&stp->stats, 0, sizeof(stp->stats));
+	memset(&stp->mbox, 0, sizeof(stp->mbox));
+	spin_lock_init(&stp->mbox.lock);
+	stp->cmd_open = false;
+	stp->period_ns = NSEC_PER_SEC / stp->pps;
+	if(stp->accel == 0)
+		stp->accel = MOTOR_STEPPER_ACCEL;
+	if(stp->jump_pps == 0)
+		stp->jump_pps = MOTOR_STEPPER_JUMP_PPS;
+
+	stp->thread = NULL;
+	if(stp->port)
+	{
+		stp->port_word = stp->port_pin[0] / BITS_PER_LONG;
+		for(coil = 0; coil < 4; coil++)
+		{
+			if((stp->port_pin[coil] >= stp->port->width) ||
+				(stp->port_pin[coil] / BITS_PER_LONG != stp->port_word))
+				return -EINVAL;
+		}
+		for(i = 0; i < ARRAY_SIZE(stp->port_map); i++)
+		{
+			stp->port_map[i] = 0;
+			for(coil = 0; coil < 4; coil++)
+				if(i & (1 << coil))
+					stp->port_map[i] |= 1UL << (stp->port_pin[coil] % BITS_PER_LONG);
+		}
+		stp->port_req = 0;
+		spin_lock_irq(&stp->port->lock);
+		list_add_tail(&stp->port_node, &stp->port->channels);
+		spin_unlock_irq(&stp->port->lock);
+	}
+	else if(stp->threaded)
+	{	// the engine thread writes the coils, sleeping or not
+		stp->port_req = 0;
+		mutex_lock(&motor_stepper_thread_lock);
+		ret = _motor_stepper_engine_start();
+		if(ret == 0)
+			list_add_tail(&stp->port_node, &motor_stepper_threaded);
+		mutex_unlock(&motor_stepper_thread_lock);
+		if(ret)
+			return ret;
+	}
+	else if(stp->cansleep)
+	{
+		stp->thread = kthread_run(motor_stepper_thread, stp, "motor/%s", stp->cdev.name);
+		if(IS_ERR(stp->thread))
+		{
+			ret = PTR_ERR(stp->thread);
+			stp->thread = NULL;
+			return ret;
+		}
+		sched_setscheduler(stp->thread, SCHED_FIFO, &param);
+		if(stp->cpu >= 0)
+			set_cpus_allowed_ptr(stp->thread, cpumask_of(stp->cpu));
+	}
+	spin_lock_irq(&motor_stepper_engine_lock);
+	list_add_tail(&stp->engine_node, &motor_stepper_all);
+	spin_unlock_irq(&motor_stepper_engine_lock);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(motor_stepper_init);
+
+void motor_stepper_release(struct motor_stepper *stp)
+{
+	struct motor_stepper_port *port = stp->port;
+
+	spin_lock_irq(&motor_stepper_engine_lock);
+	list_del(&stp->engine_node);
+	spin_unlock_irq(&motor_stepper_engine_lock);
+	motor_stepper_stop(stp);
+	while(ACCESS_ONCE(stp->timer_remote))
+		cpu_relax();		// a timer start on its way to stp->cpu
+	synchronize_sched();		// and the ipi done with timer_csd
+	hrtimer_cancel(&stp->hrtimer);
+	if(port)
+	{	// release the pins ourselves, the port thread no longer sees us
+		spin_lock_irq(&port->lock);
+		list_del(&stp->port_node);
+		spin_unlock_irq(&port->lock);
+		mutex_lock(&port->io_lock);
+		if(port->value[stp->port_word] & stp->port_map[0x0f])
+		{
+			memset(port->changed, 0, port->words * sizeof(unsigned long));
+			port->changed[stp->port_word] = port->value[stp->port_word] & stp->port_map[0x0f];
+			port->value[stp->port_word] &= ~stp->port_map[0x0f];
+			port->ops->write(port, port->value, port->changed);
+		}
+		mutex_unlock(&port->io_lock);
+	}
+	if(stp->threaded)
+	{	// release the coils ourselves, the engine thread no longer sees us
+		mutex_lock(&motor_stepper_thread_lock);
+		list_del(&stp->port_node);
+		mutex_unlock(&motor_stepper_thread_lock);
+		_motor_stepper_write(stp, 0);
+	}
+	if(stp->thread)
+	{
+		kthread_stop(stp->thread);
+		stp->thread = NULL;
+		_motor_stepper_write(stp, 0);
+	}
+}
+EXPORT_SYMBOL_GPL(motor_stepper_release);
+
+/**
+ * motor_stepper_register - register a stepper with the motor class
+ * @parent: The device to register.
+ * @stp: the stepper; stp->cdev.name, type and flags are set by the caller.
+ */
+int motor_stepper_register(struct device *parent, struct motor_stepper *stp)
+{
+	int ret;
+
+	ret = motor_stepper_init(stp);
+	if(ret)
+		return ret;
+
+	stp->cdev.ctl		= motor_stepper_ctl;
+	stp->cdev.ctl_at	= motor_stepper_ctl_at;
+	stp->cdev.getstart	= motor_stepper_getstart;
+	if(!_motor_stepper_polled(stp))
+		stp->cdev.arm	= motor_stepper_cdev_arm;
+	stp->cdev.getstate	= motor_stepper_getstate;
+	stp->cdev.setspeed	= motor_stepper_cdev_setspeed;
+	stp->cdev.getspeed	= motor_stepper_getspeed;
+	stp->cdev.setpos	= motor_stepper_setpos;
+	stp->cdev.getpos	= motor_stepper_getpos;
+	ret = motor_classdev_register(parent, &stp->cdev);
+	if(ret)
+	{
+		motor_stepper_release(stp);
+		return ret;
+	}
+	ret = _motor_stepper_limit_request(stp);
+	if(ret)
+	{
+		motor_classdev_unregister(&stp->cdev);
+		motor_stepper_release(stp);
+		return ret;
+	}
+	device_create_file(stp->cdev.dev, &motor_stepper_attrs_home);
+	if(!_motor_stepper_polled(stp))
+		device_create_file(stp->cdev.dev, &motor_stepper_attrs_cpu);
+	if(device_create_file(stp->cdev.dev, &motor_stepper_attrs_overrun) == 0)
+		stp->overrun_kn = sysfs_get_dirent(stp->cdev.dev->kobj.sd, NULL, "overrun");
+
+#ifdef CONFIG_MOTOR_STEPPER_STATS
+	device_create_file(stp->cdev.dev, &motor_stepper_attrs_stats);
+#endif
+	if(_motor_stepper_polled(stp))
+		return 0;
+	device_create_file(stp->cdev.dev, &motor_stepper_attrs_pvt);
+	stp->prog.ops = &motor_stepper_prog_ops;
+	stp->prog.naxes = 1;
+	motor_prog_register(&stp->cdev, &stp->prog);
+	stp->trig.ops = &motor_stepper_trig_ops;
+	motor_trigger_register(&stp->cdev, &stp->trig);
+
+	stp->ring = (struct motor_stepper_ring *)get_zeroed_page(GFP_KERNEL);
+	if(stp->ring == NULL)
+		return 0;		// moves and pvt streams still work
+	stp->ring->size = MOTOR_STEPPER_RING;
+	stp->ring_low = MOTOR_STEPPER_RING / 4;
+	stp->ring_status = MOTOR_STEPPER_RING_IDLE;
+	memset(&stp->ring_stats, 0, sizeof(stp->ring_stats));
+	if(device_create_bin_file(stp->cdev.dev, &motor_stepper_attrs_ring) ||
+		device_create_file(stp->cdev.dev, &motor_stepper_attrs_ring_ctl))
+	{
+		device_remove_bin_file(stp->cdev.dev, &motor_stepper_attrs_ring);
+		free_page((unsigned long)stp->ring);
+		stp->ring = NULL;
+		return 0;
+	}
+	stp->ring_kn = sysfs_get_dirent(stp->cdev.dev->kobj.sd, NULL, "ring_ctl");
+	return 0;
+}
+EXPORT_SYMBOL_GPL(motor_stepper_register);
+
+void motor_stepper_unregister(struct motor_stepper *stp)
+{
+	struct sysfs_dirent *kn;
+	unsigned long flags;
+
+	device_remove_file(stp->cdev.dev, &motor_stepper_attrs_home);
+	if(stp->overrun_kn)
+	{
+		spin_lock_irqsave(&stp->lock, flags);
+		kn = stp->overrun_kn;
+		stp->overrun_kn = NULL;
+		spin_unlock_irqrestore(&stp->lock, flags);
+		sysfs_put(kn);
+	}
+	device_remove_file(stp->cdev.dev, &motor_stepper_attrs_overrun);
+	if(!_motor_stepper_polled(stp))
+		device_remove_file(stp->cdev.dev, &motor_stepper_attrs_cpu);
+	_motor_stepper_limit_free(stp);
+#ifdef CONFIG_MOTOR_STEPPER_STATS
+	device_remove_file(stp->cdev.dev, &motor_stepper_attrs_stats);
+#endif
+	if(!_motor_stepper_polled(stp))
+		device_remove_file(stp->cdev.dev, &motor_stepper_attrs_pvt);
+	if(stp->cdev.trigger)
+		motor_trigger_unregister(&stp->trig);
+	if(stp->cdev.prog)
+	{
+		motor_stepper_stop(stp);
+		motor_prog_unregister(&stp->prog);
+	}
+	if(stp->ring)
+	{
+		motor_stepper_stop(stp);
+		if(stp->ring_kn)
+			sysfs_put(stp->ring_kn);
+		stp->ring_kn = NULL;
+		device_remove_file(stp->cdev.dev, &motor_stepper_attrs_ring_ctl);
+		device_remove_bin_file(stp->cdev.dev, &motor_stepper_attrs_ring);
+	}
+	motor_classdev_unregister(&stp->cdev);
+	motor_stepper_release(stp);
+	if(stp->ring)
+	{
+		free_page((unsigned long)stp->ring);
+		stp->ring = NULL;
+	}
+}
+EXPORT_SYMBOL_GPL(motor_stepper_unregister);
+
+/*
+ * groups
+ *
+ * Moves of a group are segments in a look-ahead queue. Path speeds are in
+ * steps per second along the straight line of a segment (its length is
+ * the euclidean norm of the deltas); each axis runs at its share of it.
+ * Per segment, the acceleration and top speed are the highest that keep
+ * every axis within its accel and max rate, and a corner may be taken at
+ * the speed where no axis changes its rate by more than its jump_pps.
+ *
+ * When a segment is queued, a reverse pass lowers entry speeds so that
+ * the path can still slow down to a stop at the end of the queue, and a
+ * forward pass lowers them to what can be reached by accelerating. The
+ * reverse pass ends at the first entry speed it does not change. The
+ * segment at the head of the queue keeps the entry speed the running one
+ * is heading for. The timer then runs each segment on a trapezoid between
+ * its entry and exit speeds.
+ */
+
+/* the speed reached from v over the whole segment at its acceleration */
+static unsigned int _motor_stepper_reach(struct motor_stepper_segment *seg, unsigned int v)
+{
+	return (unsigned int)_motor_stepper_isqrt((u64)v * v + 2ULL * seg->accel * seg->len);
+}
+
+/* limits of a new segment, false if it does not move */
+static bool _motor_stepper_segment_prep(struct motor_stepper_group *sg,
+		struct motor_stepper_segment *seg, const int *steps)
+{
+	struct motor_stepper *stp;
+	u64 sum = 0;
+	unsigned int i;
+	unsigned int d;
+	unsigned int v_max;
+	unsigned int v_rest;
+	unsigned int accel;
+
+	seg->major = 0;
+	for(i = 0; i < sg->group.naxes; i++)
+	{
+		seg->steps[i] = steps[i];
+		d = abs(steps[i]);
+		seg->major = max(seg->major, d);
+		sum += (u64)d * d;
+	}
+	if(seg->major == 0)
+		return false;
+	seg->len = (unsigned int)_motor_stepper_isqrt(sum);
+
+	seg->v_nom = sg->pps;
+	seg->v_rest = UINT_MAX;
+	seg->accel = UINT_MAX;
+	for(i = 0; i < sg->group.naxes; i++)
+	{
+		d = abs(steps[i]);
+		if(d == 0)
+			continue;
+		stp = sg->axis[i];
+		v_max = div_u64((u64)_motor_stepper_max_pps(stp) * seg->len, d);
+		v_rest = div_u64((u64)stp->jump_pps * seg->len, d);
+		accel = div_u64((u64)stp->accel * seg->len, d);
+		seg->v_nom = min(seg->v_nom, v_max);
+		seg->v_rest = min(seg->v_rest, v_rest);
+		seg->accel = min(seg->accel, accel);
+	}
+	seg->v_rest = clamp(seg->v_rest, 1U, seg->v_nom);
+	seg->v_junction = seg->v_rest;
+	seg->v_entry = seg->v_rest;
+	seg->v_exit = seg->v_rest;
+	return true;
+}
+
+/* highest speed at the corner from p to n */
+static unsigned int _motor_stepper_junction(struct motor_stepper_group *sg,
+		struct motor_stepper_segment *p, struct motor_stepper_segment *n)
+{
+	unsigned int v = min(p->v_nom, n->v_nom);
+	unsigned int i;
+	s64 diff;
+	u64 lim;
+
+	for(i = 0; i < sg->group.naxes; i++)
+	{	// the rate of axis i changes by v * |p_i / p_len - n_i / n_len|
+		diff = (s64)p->steps[i] * n->len - (s64)n->steps[i] * p->len;
+		if(diff == 0)
+			continue;
+		lim = div64_u64((u64)sg->axis[i]->jump_pps * p->len * n->len, abs64(diff));
+		if(lim < v)
+			v = (unsigned int)lim;
+	}
+	return max(v, 1U);
+}
+
+#define MOTOR_PLAN_NEXT(i)	(((i) + 1) & (MOTOR_STEPPER_PLAN - 1))
+#define MOTOR_PLAN_PREV(i)	(((i) - 1) & (MOTOR_STEPPER_PLAN - 1))
+
+/* called with sg->lock held after a segment was queued */
+static void _motor_stepper_group_plan(struct motor_stepper_group *sg)
+{
+	struct motor_stepper_segment *seg;
+	unsigned int first = sg->plan_tail;
+	unsigned int last = MOTOR_PLAN_PREV(sg->plan_head);
+	unsigned int k;
+	unsigned int v;
+	unsigned int exit;
+
+	// reverse: stop at the end of the queue
+	seg = &sg->plan[last];
+	exit = seg->v_rest;
+	for(k = last; k != first; k = MOTOR_PLAN_PREV(k))
+	{
+		seg = &sg->plan[k];
+		v = min(seg->v_junction, _motor_stepper_reach(seg, exit));
+		if((k != last) && (v == seg->v_entry))
+			break;
+		seg->v_entry = v;
+		exit = v;
+	}
+
+	// forward: no faster than accelerating from the head
+	for(k = first; k != last; k = MOTOR_PLAN_NEXT(k))
+	{
+		v = _motor_stepper_reach(&sg->plan[k], sg->plan[k].v_entry);
+		seg = &sg->plan[MOTOR_PLAN_NEXT(k)];
+		if(seg->v_entry > v)
+			seg->v_entry = v;
+	}
+}
+
+/*
+ * Take the head of the queue as the running segment, called with sg->lock
+ * held. Returns true if a step/dir axis changed direction.
+ */
+static bool _motor_stepper_group_load(struct motor_stepper_group *sg)
+{
+	struct motor_stepper_segment *seg = &sg->cur;
+	struct motor_stepper *stp;
+	bool dir_changed = false;
+	unsigned int i;
+	int dir;
+
+	*seg = sg->plan[sg->plan_tail];
+	sg->plan_tail = MOTOR_PLAN_NEXT(sg->plan_tail);
+	seg->v_exit = (sg->plan_tail != sg->plan_head) ?
+			sg->plan[sg->plan_tail].v_entry : seg->v_rest;
+	sg->tick = 0;
+	sg->stats.segments++;
+
+	for(i = 0; i < sg->group.naxes; i++)
+	{
+		sg->delta[i] = abs(seg->steps[i]);
+		sg->err[i] = seg->major / 2;
+		stp = sg->axis[i];
+		spin_lock(&stp->lock);
+		stp->pos = seg->steps[i];
+		dir = (seg->steps[i] > 0) ? 1 : -1;
+		if(sg->step_dir && seg->steps[i] && (dir != stp->dir))
+		{
+			stp->ops->set_dir(stp, dir);
+			stp->dir = dir;
+			dir_changed = true;
+		}
+		spin_unlock(&stp->lock);
+	}
+	return dir_changed;
+}
+
+/* tick period at the current point of the trapezoid */
+static unsigned long _motor_stepper_group_tick_ns(struct motor_stepper_group *sg)
+{
+	struct motor_stepper_segment *seg = &sg->cur;
+	u64 s = div_u64((u64)sg->tick * seg->len, seg->major);
+	u64 v2 = (u64)seg->v_nom * seg->v_nom;
+	u64 up = (u64)seg->v_entry * seg->v_entry + 2ULL * seg->accel * s;
+	u64 down = (u64)seg->v_exit * seg->v_exit + 2ULL * seg->accel * (seg->len - s);
+	u64 v;
+
+	v2 = min(v2, min(up, down));
+	v = max_t(u64, _motor_stepper_isqrt(v2), 1);
+	return (unsigned long)div64_u64((u64)NSEC_PER_SEC * seg->len, v * seg->major);
+}
+
+/* the group is at rest in a program, called with sg->lock held */
+static enum motor_prog_result _motor_stepper_group_prog(struct motor_stepper_group *sg)
+{
+	enum motor_prog_result r = motor_prog_run(&sg->prog);
+
+	if(r == MOTOR_PROG_MOVING)
+	{	// the only segment, it starts and ends at rest
+		_motor_stepper_segment_prep(sg, &sg->plan[sg->plan_head], sg->prog.steps);
+		sg->plan_head = MOTOR_PLAN_NEXT(sg->plan_head);
+		_motor_stepper_group_plan(sg);
+	}
+	else if(r == MOTOR_PROG_DONE)
+	{
+		sg->prog_on = false;
+	}
+	return r;
+}
+
+/*
+ * One tick of a group move: every axis whose Bresenham error goes negative
+ * takes a step. Step/dir axes get their pulses ended by an extra expiry
+ * pulse_ns later, all in the same one. A tick after the last step of a
+ * segment starts the next one, or releases the axes when the queue is
+ * empty.
+ */
+static enum hrtimer_restart motor_stepper_group_handler(struct hrtimer *timer)
+{
+	struct motor_stepper_group *sg =
+	    container_of(timer, struct motor_stepper_group, hrtimer);
+	enum hrtimer_restart ret = HRTIMER_RESTART;
+	ktime_t due = hrtimer_get_expires(timer);
+	struct motor_stepper *stp;
+	enum motor_prog_result r;
+	unsigned int i;
+#ifdef CONFIG_MOTOR_STEPPER_STATS
+	ktime_t start = ktime_get();
+	unsigned int cost;
+#endif
+
+	spin_lock(&sg->lock);
+	if(unlikely(motor_estopped() || !sg->running))
+	{	// e-stop, or stopped from an irq while we waited for the lock
+		spin_unlock(&sg->lock);
+		return HRTIMER_NORESTART;
+	}
+	if(sg->step_high)
+	{
+		for(i = 0; i < sg->group.naxes; i++)
+		{
+			if(!(sg->stepped & (1 << i)))
+				continue;
+			stp = sg->axis[i];
+			spin_lock(&stp->lock);
+			stp->ops->set_step(stp, 0);
+			stp->step_high = false;
+			spin_unlock(&stp->lock);
+		}
+		sg->stepped = 0;
+		sg->step_high = false;
+		hrtimer_forward_now(timer, ns_to_ktime(sg->tick_ns - sg->pulse_ns));
+		spin_unlock(&sg->lock);
+		return ret;
+	}
+
+	if(sg->tick == sg->cur.major)
+	{
+		r = MOTOR_PROG_DONE;
+		if(sg->prog_on && (sg->plan_tail == sg->plan_head))
+			r = _motor_stepper_group_prog(sg);
+		if(r == MOTOR_PROG_SLEEP)
+		{
+			hrtimer_forward_now(timer, ns_to_ktime(sg->prog.sleep_ns));
+			spin_unlock(&sg->lock);
+			return ret;
+		}
+		if(r == MOTOR_PROG_WAITING)
+		{	// the axes hold until the event kicks the timer
+			spin_unlock(&sg->lock);
+			return HRTIMER_NORESTART;
+		}
+		if(sg->plan_tail == sg->plan_head)
+		{	// one period after the last step: release the axes
+			for(i = 0; i < sg->group.naxes; i++)
+			{
+				stp = sg->axis[i];
+				spin_lock(&stp->lock);
+				_motor_stepper_deenergize(stp, due);
+				stp->running = false;
+				spin_unlock(&stp->lock);
+			}
+			sg->running = false;
+			spin_unlock(&sg->lock);
+			return HRTIMER_NORESTART;
+		}
+		if(_motor_stepper_group_load(sg))
+		{
+			hrtimer_forward_now(timer, ns_to_ktime(sg->axis[0]->dir_setup_ns));
+			spin_unlock(&sg->lock);
+			return ret;
+		}
+	}
+
+	sg->tick_ns = _motor_stepper_group_tick_ns(sg);
+	sg->tick++;
+	for(i = 0; i < sg->group.naxes; i++)
+	{
+		if(sg->delta[i] == 0)
+			continue;
+		sg->err[i] -= sg->delta[i];
+		if(sg->err[i] >= 0)
+			continue;
+		sg->err[i] += sg->cur.major;
+		stp = sg->axis[i];
+		spin_lock(&stp->lock);
+		if(!_motor_stepper_advance(stp))
+		{	// a limit holds this axis, the others go on
+			spin_unlock(&stp->lock);
+			continue;
+		}
+		if(sg->step_dir)
+		{
+			stp->ops->set_step(stp, 1);
+			stp->step_high = true;
+			sg->stepped |= 1 << i;
+		}
+		else
+		{
+			_motor_stepper_output(stp, stp->seq[stp->seq_idx & stp->seq_mask], due);
+		}
+		spin_unlock(&stp->lock);
+		sg->stats.steps++;
+	}
+	if(sg->stepped)
+	{
+		sg->step_high = true;
+		hrtimer_forward_now(timer, ns_to_ktime(sg->pulse_ns));
+	}
+	else
+	{
+		hrtimer_forward_now(timer, ns_to_ktime(sg->tick_ns));
+	}
+	spin_unlock(&sg->lock);
+
+	sg->stats.ticks++;
+#ifdef CONFIG_MOTOR_STEPPER_STATS
+	cost = (unsigned int)ktime_to_ns(ktime_sub(ktime_get(), start));
+	sg->stats.tick_ns += cost;
+	if(cost > sg->stats.tick_ns_max)
+		sg->stats.tick_ns_max = cost;
+#endif
+	return ret;
+}
+
+/**
+ * motor_stepper_group_stop - stop every axis of the group
+ * @sg: the group
+ *
+ * Queued segments are dropped.
+ */
+void motor_stepper_group_stop(struct motor_stepper_group *sg)
+{
+	unsigned int i;
+
+	hrtimer_cancel(&sg->hrtimer);
+	_motor_stepper_group_reset(sg);
+	for(i = 0; i < sg->group.naxes; i++)
+		_motor_stepper_halt(sg->axis[i]);
+}
+EXPORT_SYMBOL_GPL(motor_stepper_group_stop);
+
+/**
+ * motor_stepper_group_queue - append a segment to the path of the group
+ * @sg: the group
+ * @steps: one delta per axis, negative is backward
+ *
+ * The path is replanned and, if the group is idle, started: single axis
+ * moves are stopped, all axes are energized and the first tick follows
+ * after the longest start_delay (and dir setup time) among them. Returns
+ * -EAGAIN while the queue is full and -EBUSY while a program runs.
+ */
+int motor_stepper_group_queue(struct motor_stepper_group *sg, const int *steps)
+{
+	struct motor_stepper_segment seg;
+	struct motor_stepper *stp;
+	unsigned long flags;
+	ktime_t delay = ktime_set(0, 0);
+	unsigned int i;
+
+	for(i = 0; i < sg->group.naxes; i++)
+	{
+		if(abs(steps[i]) >= MOTOR_STEPPER_CONTINUOUS)
+			return -EINVAL;
+	}
+	if(sg->prog_on)
+		return -EBUSY;
+	if(!_motor_stepper_segment_prep(sg, &seg, steps))
+		return 0;
+	if(!sg->running)
+	{
+		for(i = 0; i < sg->group.naxes; i++)
+			_motor_stepper_halt(sg->axis[i]);
+	}
+
+	spin_lock_irqsave(&sg->lock, flags);
+	if(motor_estopped() || (MOTOR_PLAN_NEXT(sg->plan_head) == sg->plan_tail))
+	{
+		spin_unlock_irqrestore(&sg->lock, flags);
+		return motor_estopped() ? -EBUSY : -EAGAIN;
+	}
+	if(sg->plan_tail != sg->plan_head)
+		seg.v_junction = _motor_stepper_junction(sg, &sg->plan[MOTOR_PLAN_PREV(sg->plan_head)], &seg);
+	sg->plan[sg->plan_head] = seg;
+	sg->plan_head = MOTOR_PLAN_NEXT(sg->plan_head);
+	_motor_stepper_group_plan(sg);
+
+	if(!sg->running)
+	{
+		for(i = 0; i < sg->group.naxes; i++)
+		{
+			stp = sg->axis[i];
+			spin_lock(&stp->lock);
+			stp->running = true;
+			_motor_stepper_energize(stp);
+			if(ktime_to_ns(stp->start_delay) > ktime_to_ns(delay))
+				delay = stp->start_delay;
+			spin_unlock(&stp->lock);
+		}
+		if(_motor_stepper_group_load(sg) &&
+			(ktime_to_ns(delay) < sg->axis[0]->dir_setup_ns))
+			delay = ns_to_ktime(sg->axis[0]->dir_setup_ns);
+		sg->running = true;
+		hrtimer_start(&sg->hrtimer, delay, HRTIMER_MODE_REL);
+	}
+	spin_unlock_irqrestore(&sg->lock, flags);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(motor_stepper_group_queue);
+
+/**
+ * motor_stepper_group_move - start a coordinated relative move
+ * @sg: the group
+ * @steps: one delta per axis, negative is backward
+ *
+ * A running move, of the group or of single axes, is stopped first and
+ * the move is the only segment of the path.
+ */
+int motor_stepper_group_move(struct motor_stepper_group *sg, const int *steps)
+{
+	motor_stepper_group_stop(sg);
+	return motor_stepper_group_queue(sg, steps);
+}
+EXPORT_SYMBOL_GPL(motor_stepper_group_move);
+
+/* segments that can still be queued */
+unsigned int motor_stepper_group_space(struct motor_stepper_group *sg)
+{
+	return (sg->plan_tail - sg->plan_head - 1) & (MOTOR_STEPPER_PLAN - 1);
+}
+EXPORT_SYMBOL_GPL(motor_stepper_group_space);
+
+/* path speed, in steps per second along the segment */
+void motor_stepper_group_setspeed(struct motor_stepper_group *sg, unsigned int pps)
+{
+	unsigned int max = MOTOR_STEPPER_MAX_PPS;
+
+	if(sg->step_dir)
+	{
+		max = min_t(unsigned long, MOTOR_STEPPER_STEPDIR_MAX_PPS,
+				NSEC_PER_SEC / (2 * sg->pulse_ns));
+	}
+	if((pps > 0) && (pps <= max))
+		sg->pps = pps;
+}
+EXPORT_SYMBOL_GPL(motor_stepper_group_setspeed);
+
+static inline struct motor_stepper_group *to_motor_stepper_group(struct motor_classdev *motor_cdev)
+{
+	return container_of(motor_cdev, struct motor_stepper_group, group.cdev);
+}
+
+static inline struct motor_stepper_group *group_to_motor_stepper_group(struct motor_group *grp)
+{
+	return container_of(grp, struct motor_stepper_group, group);
+}
+
+static int motor_stepper_group_cdev_move(struct motor_group *grp, const int *steps)
+{
+	return motor_stepper_group_move(group_to_motor_stepper_group(grp), steps);
+}
+
+static int motor_stepper_group_cdev_queue(struct motor_group *grp, const int *steps)
+{
+	return motor_stepper_group_queue(group_to_motor_stepper_group(grp), steps);
+}
+
+static unsigned int motor_stepper_group_cdev_space(struct motor_group *grp)
+{
+	return motor_stepper_group_space(group_to_motor_stepper_group(grp));
+}
+
+/* only standby acts on a group, moves go through its move attribute */
+static void motor_stepper_group_ctl(struct motor_classdev *motor_cdev, enum motor_state ctrl, int step)
+{
+	if(ctrl == MOTOR_STANDBY)
+		motor_stepper_group_stop(to_motor_stepper_group(motor_cdev));
+}
+
+static enum motor_state motor_stepper_group_getstate(struct motor_classdev *motor_cdev)
+{
+	return to_motor_stepper_group(motor_cdev)->running ? MOTOR_FORWARD : MOTOR_STANDBY;
+}
+
+static void motor_stepper_group_cdev_setspeed(struct motor_classdev *motor_cdev, unsigned int speed)
+{
+	motor_stepper_group_setspeed(to_motor_stepper_group(motor_cdev), speed);
+}
+
+static unsigned int motor_stepper_group_getspeed(struct motor_classdev *motor_cdev)
+{
+	return to_motor_stepper_group(motor_cdev)->pps;
+}
+
+static inline struct motor_stepper_group *prog_to_motor_stepper_group(struct motor_prog *prog)
+{
+	return container_of(prog, struct motor_stepper_group, prog);
+}
+
+/* like the start of a queued path, with the program in place of the queue */
+static int motor_stepper_group_prog_start(struct motor_prog *prog)
+{
+	struct motor_stepper_group *sg = prog_to_motor_stepper_group(prog);
+	struct motor_stepper *stp;
+	unsigned long flags;
+	ktime_t delay = ktime_set(0, 0);
+	unsigned int i;
+
+	motor_stepper_group_stop(sg);
+	spin_lock_irqsave(&sg->lock, flags);
+	if(motor_estopped())
+	{
+		spin_unlock_irqrestore(&sg->lock, flags);
+		return -EBUSY;
+	}
+	for(i = 0; i < sg->group.naxes; i++)
+	{
+		stp = sg->axis[i];
+		spin_lock(&stp->lock);
+		stp->running = true;
+		_motor_stepper_energize(stp);
+		if(ktime_to_ns(stp->start_delay) > ktime_to_ns(delay))
+			delay = stp->start_delay;
+		spin_unlock(&stp->lock);
+	}
+	sg->cur.major = 0;
+	sg->tick = 0;
+	sg->prog_on = true;
+	sg->running = true;
+	hrtimer_start(&sg->hrtimer, delay, HRTIMER_MODE_REL);
+	spin_unlock_irqrestore(&sg->lock, flags);
+	return 0;
+}
+
+static void motor_stepper_group_prog_stop(struct motor_prog *prog)
+{
+	motor_stepper_group_stop(prog_to_motor_stepper_group(prog));
+}
+
+static void motor_stepper_group_prog_setspeed(struct motor_prog *prog, unsigned int pps)
+{
+	motor_stepper_group_setspeed(prog_to_motor_stepper_group(prog), pps);
+}
+
+static void motor_stepper_group_prog_kick(struct motor_prog *prog)
+{
+	hrtimer_start(&prog_to_motor_stepper_group(prog)->hrtimer, ktime_set(0, 0), HRTIMER_MODE_REL);
+}
+
+static const struct motor_prog_ops motor_stepper_group_prog_ops = {
+	.start		= motor_stepper_group_prog_start,
+	.stop		= motor_stepper_group_prog_stop,
+	.setspeed	= motor_stepper_group_prog_setspeed,
+	.kick		= motor_stepper_group_prog_kick,
+};
+
+#ifdef CONFIG_MOTOR_STEPPER_STATS
+static ssize_t motor_stepper_group_stats_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct motor_stepper_group *sg = to_motor_stepper_group(dev_get_drvdata(dev));
+	unsigned long ticks = sg->stats.ticks;
+	u64 avg = sg->stats.tick_ns;
+
+	if(ticks)
+		do_div(avg, ticks);
+	return sprintf(buf, "axes %u\nticks %lu\nsteps %lu\nsegments %lu\n"
+			"tick_ns_avg %llu\ntick_ns_max %u\ntick_rate %lu\n",
+			sg->group.naxes, ticks, sg->stats.steps, sg->stats.segments,
+			(unsigned long long)avg, sg->stats.tick_ns_max,
+			(sg->running && sg->tick_ns) ? NSEC_PER_SEC / sg->tick_ns : 0);
+}
+
+static ssize_t motor_stepper_group_stats_store(struct device *dev, struct device_attribute *attr,
+			const char *buf, size_t count)
+{
+	struct motor_stepper_group *sg = to_motor_stepper_group(dev_get_drvdata(dev));
+
+	memset(&sg->stats, 0, sizeof(sg->stats));
+	return count;
+}
+
+static struct device_attribute motor_stepper_group_attrs_stats =
+	__ATTR(stats, S_IRUGO|S_IWUSR, motor_stepper_group_stats_show, motor_stepper_group_stats_store);
+#endif
+
+/**
+ * motor_stepper_group_register - register a group of registered steppers
+ * @parent: The device to register.
+ * @sg: the group; group.cdev.name and flags, group.naxes, axis[] and pps
+ *	are set by the caller.
+ *
+ * A stepper can be in one group only. The group must be unregistered
+ * before its axes.
+ */
+int motor_stepper_group_register(struct device *parent, struct motor_stepper_group *sg)
+{
+	struct motor_stepper *stp;
+	unsigned int i;
+	int ret;
+
+	if((sg->group.naxes == 0) || (sg->group.naxes > MOTOR_GROUP_MAX_AXES))
+		return -EINVAL;
+	sg->step_dir = (sg->axis[0]->mode == MOTOR_STEPPER_STEP_DIR);
+	sg->pulse_ns = 0;
+	for(i = 0; i < sg->group.naxes; i++)
+	{
+		stp = sg->axis[i];
+		if(_motor_stepper_polled(stp) || stp->group ||
+			((stp->mode == MOTOR_STEPPER_STEP_DIR) != sg->step_dir))
+			return -EINVAL;
+		sg->pulse_ns = max(sg->pulse_ns, stp->pulse_ns);
+		sg->group.axis[i] = &stp->cdev;
+	}
+
+	spin_lock_init(&sg->lock);
+	hrtimer_init(&sg->hrtimer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	sg->hrtimer.function = motor_stepper_group_handler;
+	sg->running = false;
+	sg->step_high = false;
+	sg->stepped = 0;
+	sg->tick = 0;
+	sg->tick_ns = 0;
+	sg->cur.major = 0;
+	sg->plan_head = 0;
+	sg->plan_tail = 0;
+	sg->prog_on = false;
+	memset(&sg->stats, 0, sizeof(sg->stats));
+	if(sg->pps == 0)
+		sg->pps = 100;
+	motor_stepper_group_setspeed(sg, sg->pps);
+	spin_lock_irq(&motor_stepper_engine_lock);
+	list_add_tail(&sg->engine_node, &motor_stepper_groups);
+	spin_unlock_irq(&motor_stepper_engine_lock);
+
+	sg->group.cdev.type	= MOTOR_TYPE_STEPPER;
+	sg->group.cdev.ctl	= motor_stepper_group_ctl;
+	sg->group.cdev.getstate	= motor_stepper_group_getstate;
+	sg->group.cdev.setspeed	= motor_stepper_group_cdev_setspeed;
+	sg->group.cdev.getspeed	= motor_stepper_group_getspeed;
+	sg->group.move		= motor_stepper_group_cdev_move;
+	sg->group.queue		= motor_stepper_group_cdev_queue;
+	sg->group.getspace	= motor_stepper_group_cdev_space;
+	ret = motor_group_register(parent, &sg->group);
+	if(ret)
+	{
+		spin_lock_irq(&motor_stepper_engine_lock);
+		list_del(&sg->engine_node);
+		spin_unlock_irq(&motor_stepper_engine_lock);
+		return ret;
+	}
+	for(i = 0; i < sg->group.naxes; i++)
+		sg->axis[i]->group = sg;
+
+#ifdef CONFIG_MOTOR_STEPPER_STATS
+	device_create_file(sg->group.cdev.dev, &motor_stepper_group_attrs_stats);
+#endif
+	sg->prog.ops = &motor_stepper_group_prog_ops;
+	sg->prog.naxes = sg->group.naxes;
+	motor_prog_register(&sg->group.cdev, &sg->prog);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(motor_stepper_group_register);
+
+void motor_stepper_group_unregister(struct motor_stepper_group *sg)
+{
+	unsigned int i;
+
+	motor_stepper_group_stop(sg);
+	if(sg->group.cdev.prog)
+		motor_prog_unregister(&sg->prog);
+#ifdef CONFIG_MOTOR_STEPPER_STATS
+	device_remove_file(sg->group.cdev.dev, &motor_stepper_group_attrs_stats);
+#endif
+	motor_group_unregister(&sg->group);
+	spin_lock_irq(&motor_stepper_engine_lock);
+	list_del(&sg->engine_node);
+	spin_unlock_irq(&motor_stepper_engine_lock);
+	// nothing can start the group any more, stop a move begun meanwhile
+	motor_stepper_group_stop(sg);
+	for(i = 0; i < sg->group.naxes; i++)
+		sg->axis[i]->group = NULL;
+}
+EXPORT_SYMBOL_GPL(motor_stepper_group_unregister);
+
+/**
+ * motor_stepper_port_register - register a shared output port
+ * @port: the port, with name, ops and tick_ns filled in
+ *
+ * Starts the SCHED_FIFO thread that steps the channels of the port. All
+ * pins are assumed low.
+ */
+int motor_stepper_port_register(struct motor_stepper_port *port)
+{
+	struct sched_param param = { .sched_priority = MAX_USER_RT_PRIO/2 };
+
+	if((port->ops == NULL) || (port->ops->write == NULL))
+		return -EINVAL;
+	if(port->tick_ns == 0)
+		port->tick_ns = NSEC_PER_MSEC;
+	if(port->width == 0)
+		port->width = BITS_PER_LONG;
+
+	port->words = BITS_TO_LONGS(port->width);
+	port->value = kcalloc(3 * port->words, sizeof(unsigned long), GFP_KERNEL);
+	if(port->value == NULL)
+		return -ENOMEM;
+	port->frame = port->value + port->words;
+	port->changed = port->frame + port->words;
+
+	INIT_LIST_HEAD(&port->channels);
+	spin_lock_init(&port->lock);
+	mutex_init(&port->io_lock);
+	port->flags = 0;
+	memset(&port->stats, 0, sizeof(port->stats));
+
+	port->thread = kthread_run(motor_stepper_port_thread, port, "motor/%s", port->name);
+	if(IS_ERR(port->thread))
+	{
+		kfree(port->value);
+		return PTR_ERR(port->thread);
+	}
+	sched_setscheduler(port->thread, SCHED_FIFO, &param);
+	if(!cpumask_empty(&motor_stepper_cpus))
+		set_cpus_allowed_ptr(port->thread, &motor_stepper_cpus);
+
+	mutex_lock(&motor_stepper_port_lock);
+	list_add_tail(&port->node, &motor_stepper_ports);
+	mutex_unlock(&motor_stepper_port_lock);
+	printk(KERN_DEBUG "Registered motor port: %s\n", port->name);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(motor_stepper_port_register);
+
+/* all steppers of the port must have been released */
+void motor_stepper_port_unregister(struct motor_stepper_port *port)
+{
+	mutex_lock(&motor_stepper_port_lock);
+	list_del(&port->node);
+	mutex_unlock(&motor_stepper_port_lock);
+	kthread_stop(port->thread);
+	kfree(port->value);
+}
+EXPORT_SYMBOL_GPL(motor_stepper_port_unregister);
+
+/**
+ * motor_stepper_port_get - look up a registered port by name
+ * @name: port name
+ *
+ * Returns the port with a reference on its module, or NULL.
+ */
+struct motor_stepper_port *motor_stepper_port_get(const char *name)
+{
+	struct motor_stepper_port *port;
+	struct motor_stepper_port *found = NULL;
+
+	mutex_lock(&motor_stepper_port_lock);
+	list_for_each_entry(port, &motor_stepper_ports, node)
+	{
+		if(strcmp(port->name, name) == 0)
+		{
+			if(try_module_get(port->owner))
+				found = port;
+			break;
+		}
+	}
+	mutex_unlock(&motor_stepper_port_lock);
+	return found;
+}
+EXPORT_SYMBOL_GPL(motor_stepper_port_get);
+
+void motor_stepper_port_put(struct motor_stepper_port *port)
+{
+	module_put(port->owner);
+}
+EXPORT_SYMBOL_GPL(motor_stepper_port_put);
+
+/*
+ * e-stop
+ *
+ * All steppers and groups of the engine are killed in one pass without
+ * sleeping. A timer is cancelled unless its handler runs right now, and
+ * then the handler finds the latch once it has the lock and stops there.
+ * The coils are dropped like at the end of a move: right away, queued to
+ * the output thread of a sleeping coil driver, or at the port tick or
+ * engine thread wakeup the kick brings.
+ */
+static void motor_stepper_estop_kill(struct motor_estop *me)
+{
+	struct motor_stepper_group *sg;
+	struct motor_stepper *stp, *next;
+	ktime_t now = ktime_get();
+	unsigned long flags;
+
+	spin_lock_irqsave(&motor_stepper_engine_lock, flags);
+	spin_lock(&motor_stepper_arm_lock);
+	hrtimer_try_to_cancel(&motor_stepper_fire_timer);
+	list_for_each_entry_safe(stp, next, &motor_stepper_armed, arm_node)
+	{
+		list_del_init(&stp->arm_node);
+		stp->armed = false;
+	}
+	spin_unlock(&motor_stepper_arm_lock);
+
+	list_for_each_entry(sg, &motor_stepper_groups, engine_node)
+	{
+		hrtimer_try_to_cancel(&sg->hrtimer);
+		_motor_stepper_group_reset(sg);
+	}
+	list_for_each_entry(stp, &motor_stepper_all, engine_node)
+		_motor_stepper_kill(stp, now);
+	spin_unlock_irqrestore(&motor_stepper_engine_lock, flags);
+}
+
+static struct motor_estop motor_stepper_estop_hook = {
+	.kill	= motor_stepper_estop_kill,
+};
+
+static int __init motor_stepper_engine_init(void)
+{
+	int ret;
+
+	if(cpus && (cpulist_parse(cpus, &motor_stepper_cpus) ||
+		!cpumask_subset(&motor_stepper_cpus, cpu_online_mask)))
+	{
+		printk(KERN_WARNING "motor stepper: cpus=%s is not a list of online cpus, ignored\n", cpus);
+		cpumask_clear(&motor_stepper_cpus);
+	}
+	if((thread_prio < 1) || (thread_prio >= MAX_USER_RT_PRIO))
+	{
+		printk(KERN_WARNING "motor stepper: thread_prio=%d out of range, using %d\n",
+				thread_prio, MAX_USER_RT_PRIO/2);
+		thread_prio = MAX_USER_RT_PRIO/2;
+	}
+	if((thread_cpu >= 0) && ((thread_cpu >= nr_cpu_ids) || !cpu_online(thread_cpu)))
+	{
+		printk(KERN_WARNING "motor stepper: thread_cpu=%d is not online, ignored\n", thread_cpu);
+		thread_cpu = -1;
+	}
+	hrtimer_init(&motor_stepper_fire_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	motor_stepper_fire_timer.function = motor_stepper_fire_handler;
+	ret = motor_fire_register(&motor_stepper_fire_hook);
+	if(ret)
+		return ret;
+	ret = motor_estop_register(&motor_stepper_estop_hook);
+	if(ret)
+		motor_fire_unregister(&motor_stepper_fire_hook);
+	return ret;
+}
+
+static void __exit motor_stepper_engine_exit(void)
+{
+	motor_estop_unregister(&motor_stepper_estop_hook);
+	motor_fire_unregister(&motor_stepper_fire_hook);
+	hrtimer_cancel(&motor_stepper_fire_timer);
+	if(motor_stepper_engine_task)
+		kthread_stop(motor_stepper_engine_task);
+}
+
+subsys_initcall(motor_stepper_engine_init);
+module_exit(motor_stepper_engine_exit);
+
+MODULE_AUTHOR("Eric Hsiao, erichsiao815@gmail.com");
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("Stepper motor step engine");
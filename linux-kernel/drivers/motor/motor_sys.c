@@ -20,6 +20,16 @@
  * - de-warning
  * - add mutex for ctrl function
  *
+ * - duty_ns and period_ns attributes for ns resolution pwm
+ * - pid attribute for the closed loop
+ * - motor groups with move and queue attributes for coordinated axes
+ * - "forward|backward <steps> @<ns>" in ctrl starts at a CLOCK_MONOTONIC
+ *   time, start_ns tells when the last move really started
+ * - "arm forward|backward <steps>" / "disarm" in ctrl, and a class fire
+ *   attribute that starts all armed motors together
+ * - class estop attribute and motor_estop(), a latched stop of every
+ *   motor from any context
+ *
  */
 
 #include <linux/module.h>
@@ -38,6 +48,20 @@
 static char motor_sub_ver[] = "1.01";
 
 static DEFINE_MUTEX(motor_lock);
+static LIST_HEAD(motor_fire_list);
+
+/* e-stop, never behind motor_lock */
+static LIST_HEAD(motor_estop_list);
+static DEFINE_SPINLOCK(motor_estop_lock);
+atomic_t motor_estop_latched = ATOMIC_INIT(0);
+EXPORT_SYMBOL_GPL(motor_estop_latched);
+
+static struct {
+	unsigned long	estops;
+	unsigned int	hooks;
+	unsigned int	stop_ns_last;	// entry to the last kill() returned
+	unsigned int	stop_ns_max;
+} motor_estop_stats;
 
 static struct class motor_class = {
 	.name = "motor",
@@ -75,15 +99,53 @@ static ssize_t motor_ctl_store(struct device *dev, struct device_attribute *attr
 {
 	struct motor_classdev *motor_cdev = dev_get_drvdata(dev);
 	int para=0;
+	long long at=0;
 	char cmd[16];
+	int ret = 0;
 
 	memset(cmd,0 ,sizeof(cmd));
 	if(!motor_cdev->ctl)
 		return -EPERM;
+	if(motor_estopped() && strncmp(buf, "standby", 7) && strncmp(buf, "disarm", 6))
+		return -EBUSY;		// only stops until the e-stop is released
+
+	if(sscanf(buf, "%15s %d @%lld", cmd, &para, &at) == 3)
+	{	// scheduled start, the time is CLOCK_MONOTONIC in ns
+		if(!motor_cdev->ctl_at)
+			return -EPERM;
+		if(at <= 0)
+			return -EINVAL;
+		mutex_lock(&motor_lock);
+		if(!strncmp(cmd,"forward",7))
+			ret = motor_cdev->ctl_at(motor_cdev, MOTOR_FORWARD, ABS(para), ns_to_ktime(at));
+		else if(!strncmp(cmd,"backward",8))
+			ret = motor_cdev->ctl_at(motor_cdev, MOTOR_BACKWARD, ABS(para), ns_to_ktime(at));
+		else
+			ret = -EINVAL;
+		mutex_unlock(&motor_lock);
+		return ret < 0 ? ret : count;
+	}
 
-	mutex_lock(&motor_lock);		//TBD!!
-	sscanf(buf, "%s %d", cmd, &para);
+	if(!strncmp(cmd,"arm",4) || !strncmp(cmd,"disarm",7))
+	{	// "arm forward|backward <steps>", started by the class fire attribute
+		if(!motor_cdev->arm)
+			return -EPERM;
+		if((cmd[0] == 'a') && (sscanf(buf, "%*s %15s %d", cmd, &para) != 2))
+			return -EINVAL;
+		mutex_lock(&motor_lock);
+		if(!strncmp(cmd,"forward",7))
+			ret = motor_cdev->arm(motor_cdev, MOTOR_FORWARD, ABS(para));
+		else if(!strncmp(cmd,"backward",8))
+			ret = motor_cdev->arm(motor_cdev, MOTOR_BACKWARD, ABS(para));
+		else if(!strncmp(cmd,"disarm",7))
+			ret = motor_cdev->arm(motor_cdev, MOTOR_STANDBY, 0);
+		else
+			ret = -EINVAL;
+		mutex_unlock(&motor_lock);
+		return ret < 0 ? ret : count;
+	}
 
+	mutex_lock(&motor_lock);		//TBD!!
 	if(!strncmp(cmd,"forward",7))
 		motor_cdev->ctl(motor_cdev, MOTOR_FORWARD, ABS(para));
 	else if(!strncmp(cmd,"backward",8))
@@ -99,9 +161,20 @@ static ssize_t motor_ctl_store(struct device *dev, struct device_attribute *attr
 	else if(!strncmp(cmd,"standby",7))
 		motor_cdev->ctl(motor_cdev, MOTOR_STANDBY, 0);
 	else
-		return  -EPERM;		//cmd error 
+		ret = -EPERM;		//cmd error 
 	mutex_unlock(&motor_lock);		//TBD!!
-	return count;
+	return ret < 0 ? ret : count;
+}
+
+/* CLOCK_MONOTONIC ns of the first step of the last move, 0 before any */
+static ssize_t motor_start_show(struct device *dev, 
+		struct device_attribute *attr, char *buf)
+{
+	struct motor_classdev *motor_cdev = dev_get_drvdata(dev);
+
+	if(!motor_cdev->getstart)
+		return -EPERM;
+	return sprintf(buf, "%lld\n", (long long)ktime_to_ns(motor_cdev->getstart(motor_cdev)));
 }
 
 
@@ -213,6 +286,278 @@ static ssize_t motor_pos_show(struct device *dev,
 }
 
 
+static ssize_t motor_duty_store(struct device *dev, struct device_attribute *attr,
+			const char *buf, size_t count)
+{
+	struct motor_classdev *motor_cdev = dev_get_drvdata(dev);
+	unsigned long duty_ns;
+	int ret;
+
+	if(!motor_cdev->setduty)
+		return -EPERM;
+	if(sscanf(buf, "%lu", &duty_ns) != 1)
+		return -EINVAL;
+	mutex_lock(&motor_lock);
+	ret = motor_cdev->setduty(motor_cdev, duty_ns);
+	mutex_unlock(&motor_lock);
+	return ret < 0 ? ret : count;
+}
+
+static ssize_t motor_duty_show(struct device *dev, 
+		struct device_attribute *attr, char *buf)
+{
+	struct motor_classdev *motor_cdev = dev_get_drvdata(dev);
+
+	if(!motor_cdev->getduty)
+		return -EPERM;
+	return sprintf(buf, "%lu\n", motor_cdev->getduty(motor_cdev));
+}
+
+static ssize_t motor_period_store(struct device *dev, struct device_attribute *attr,
+			const char *buf, size_t count)
+{
+	struct motor_classdev *motor_cdev = dev_get_drvdata(dev);
+	unsigned long period_ns;
+	int ret;
+
+	if(!motor_cdev->setperiod)
+		return -EPERM;
+	if((sscanf(buf, "%lu", &period_ns) != 1) || (period_ns == 0))
+		return -EINVAL;
+	mutex_lock(&motor_lock);
+	ret = motor_cdev->setperiod(motor_cdev, period_ns);
+	mutex_unlock(&motor_lock);
+	return ret < 0 ? ret : count;
+}
+
+static ssize_t motor_period_show(struct device *dev, 
+		struct device_attribute *attr, char *buf)
+{
+	struct motor_classdev *motor_cdev = dev_get_drvdata(dev);
+
+	if(!motor_cdev->getperiod)
+		return -EPERM;
+	return sprintf(buf, "%lu\n", motor_cdev->getperiod(motor_cdev));
+}
+
+
+static const char * const motor_pid_names[MOTOR_PID_PARAM_NUM] = {
+	[MOTOR_PID_ENABLE]	= "enable",
+	[MOTOR_PID_TARGET]	= "target",
+	[MOTOR_PID_KP]		= "kp",
+	[MOTOR_PID_KI]		= "ki",
+	[MOTOR_PID_KD]		= "kd",
+	[MOTOR_PID_OUT_MIN]	= "out_min",
+	[MOTOR_PID_OUT_MAX]	= "out_max",
+	[MOTOR_PID_PERIOD]	= "period_ns",
+	[MOTOR_PID_OUTPUT]	= "output",
+	[MOTOR_PID_VELOCITY]	= "velocity",
+	[MOTOR_PID_LOOPS]	= "loops",
+	[MOTOR_PID_OVERRUNS]	= "overruns",
+	[MOTOR_PID_SATURATED]	= "saturated",
+	[MOTOR_PID_ERR_AVG]	= "err_avg",
+	[MOTOR_PID_ERR_MAX]	= "err_max",
+	[MOTOR_PID_LOOP_NS_MAX]	= "loop_ns_max",
+};
+
+static ssize_t motor_pid_store(struct device *dev, struct device_attribute *attr,
+			const char *buf, size_t count)
+{
+	struct motor_classdev *motor_cdev = dev_get_drvdata(dev);
+	char cmd[16];
+	long value = 0;
+	int i;
+	int ret;
+
+	if(!motor_cdev->setpid)
+		return -EPERM;
+	if(sscanf(buf, "%15s %ld", cmd, &value) < 1)
+		return -EINVAL;
+	for(i = 0; i < MOTOR_PID_PARAM_NUM; i++)
+	{
+		if(!strcmp(cmd, motor_pid_names[i]))
+			break;
+	}
+	if(i == MOTOR_PID_PARAM_NUM)
+		return -EINVAL;
+
+	mutex_lock(&motor_lock);
+	ret = motor_cdev->setpid(motor_cdev, i, value);
+	mutex_unlock(&motor_lock);
+	return ret < 0 ? ret : count;
+}
+
+static ssize_t motor_pid_show(struct device *dev, 
+		struct device_attribute *attr, char *buf)
+{
+	struct motor_classdev *motor_cdev = dev_get_drvdata(dev);
+	ssize_t len = 0;
+	int i;
+
+	if(!motor_cdev->getpid)
+		return -EPERM;
+	for(i = 0; i < MOTOR_PID_PARAM_NUM; i++)
+		len += sprintf(buf + len, "%s %ld\n", motor_pid_names[i], motor_cdev->getpid(motor_cdev, i));
+	return len;
+}
+
+static inline struct motor_group *to_motor_group(struct motor_classdev *motor_cdev)
+{
+	return container_of(motor_cdev, struct motor_group, cdev);
+}
+
+/* "dx dy ...", one step delta per axis, missing axes stay */
+static int motor_group_parse(struct motor_group *grp, const char *buf, int *steps)
+{
+	unsigned int i;
+	int len;
+
+	memset(steps, 0, sizeof(int) * MOTOR_GROUP_MAX_AXES);
+	for(i = 0; i < grp->naxes; i++)
+	{
+		if(sscanf(buf, "%d%n", &steps[i], &len) != 1)
+			break;
+		buf += len;
+	}
+	return (i == 0) ? -EINVAL : 0;
+}
+
+static ssize_t motor_group_move_store(struct device *dev, struct device_attribute *attr,
+			const char *buf, size_t count)
+{
+	struct motor_group *grp = to_motor_group(dev_get_drvdata(dev));
+	int steps[MOTOR_GROUP_MAX_AXES];
+	int ret;
+
+	if(motor_group_parse(grp, buf, steps))
+		return -EINVAL;
+	if(motor_estopped())
+		return -EBUSY;
+	mutex_lock(&motor_lock);
+	ret = grp->move(grp, steps);
+	mutex_unlock(&motor_lock);
+	return ret < 0 ? ret : count;
+}
+
+/* -EAGAIN while the queue is full */
+static ssize_t motor_group_queue_store(struct device *dev, struct device_attribute *attr,
+			const char *buf, size_t count)
+{
+	struct motor_group *grp = to_motor_group(dev_get_drvdata(dev));
+	int steps[MOTOR_GROUP_MAX_AXES];
+	int ret;
+
+	if(motor_group_parse(grp, buf, steps))
+		return -EINVAL;
+	if(motor_estopped())
+		return -EBUSY;
+	mutex_lock(&motor_lock);
+	ret = grp->queue(grp, steps);
+	mutex_unlock(&motor_lock);
+	return ret < 0 ? ret : count;
+}
+
+static ssize_t motor_group_queue_show(struct device *dev, 
+		struct device_attribute *attr, char *buf)
+{
+	struct motor_group *grp = to_motor_group(dev_get_drvdata(dev));
+
+	return sprintf(buf, "%u\n", grp->getspace ? grp->getspace(grp) : 0);
+}
+
+/* one line per axis: name and remaining steps */
+static ssize_t motor_group_axes_show(struct device *dev, 
+		struct device_attribute *attr, char *buf)
+{
+	struct motor_group *grp = to_motor_group(dev_get_drvdata(dev));
+	struct motor_classdev *axis;
+	ssize_t len = 0;
+	unsigned int i;
+
+	for(i = 0; i < grp->naxes; i++)
+	{
+		axis = grp->axis[i];
+		len += sprintf(buf + len, "%s %d\n", axis->name,
+				axis->getpos ? (int)axis->getpos(axis) : 0);
+	}
+	return len;
+}
+
+
+/*
+ * fire: "now" or "@<CLOCK_MONOTONIC ns>" starts the armed motors of every
+ * engine. -ENOENT if no motor is armed.
+ */
+static ssize_t motor_fire_store(struct class *class, struct class_attribute *attr,
+			const char *buf, size_t count)
+{
+	struct motor_fire *mf;
+	long long at = 0;
+	int ret = -ENOENT;
+	int r;
+
+	if(buf[0] == '@')
+	{
+		if((sscanf(buf, "@%lld", &at) != 1) || (at <= 0))
+			return -EINVAL;
+	}
+	else if(strncmp(buf, "now", 3))
+		return -EINVAL;
+	if(motor_estopped())
+		return -EBUSY;
+
+	mutex_lock(&motor_lock);
+	list_for_each_entry(mf, &motor_fire_list, node)
+	{
+		r = mf->fire(mf, ns_to_ktime(at));
+		if((r == 0) || (ret == -ENOENT))
+			ret = r;
+	}
+	mutex_unlock(&motor_lock);
+	return ret < 0 ? ret : count;
+}
+
+/*
+ * estop: "stop" stops every motor and latches, "release" lets them be
+ * started again, "reset" clears the timing. Reading shows the latch and
+ * how long the last and the slowest stop took to get through all engines.
+ */
+static ssize_t motor_estop_show(struct class *class, struct class_attribute *attr,
+			char *buf)
+{
+	return sprintf(buf, "latched %d\nestops %lu\nengines %u\nstop_ns_last %u\nstop_ns_max %u\n",
+			motor_estopped(), motor_estop_stats.estops, motor_estop_stats.hooks,
+			motor_estop_stats.stop_ns_last, motor_estop_stats.stop_ns_max);
+}
+
+static ssize_t motor_estop_store(struct class *class, struct class_attribute *attr,
+			const char *buf, size_t count)
+{
+	unsigned long flags;
+
+	if(!strncmp(buf, "stop", 4))
+		motor_estop();
+	else if(!strncmp(buf, "release", 7))
+		motor_estop_release();
+	else if(!strncmp(buf, "reset", 5))
+	{
+		spin_lock_irqsave(&motor_estop_lock, flags);
+		motor_estop_stats.estops = 0;
+		motor_estop_stats.stop_ns_last = 0;
+		motor_estop_stats.stop_ns_max = 0;
+		spin_unlock_irqrestore(&motor_estop_lock, flags);
+	}
+	else
+		return -EINVAL;
+	return count;
+}
+
+static struct class_attribute motor_class_class_attrs[] = {
+	__ATTR(fire, S_IWUSR, NULL, motor_fire_store),
+	__ATTR(estop, S_IRUGO|S_IWUSR, motor_estop_show, motor_estop_store),
+	__ATTR_NULL,
+};
+
 static struct device_attribute motor_class_attrs[] = {
 	__ATTR(type, S_IRUGO, motor_type_show, NULL),
 	__ATTR(state, S_IRUGO, motor_state_show, NULL ),
@@ -225,13 +570,29 @@ static struct device_attribute motor_attrs_speed =
 static struct device_attribute motor_attrs_ctrl = 
 	__ATTR(ctrl, S_IWUGO, NULL, motor_ctl_store);
 
+static struct device_attribute motor_attrs_start = 
+	__ATTR(start_ns, S_IRUGO, motor_start_show, NULL);
+
 static struct device_attribute motor_attrs_pos = 
 	__ATTR(pos, S_IRUGO|S_IWUGO, motor_pos_show, motor_pos_store);
 
-//static struct device_attribute motor_attrs_pid[] = {
-//	__ATTR(pid, S_IRUGO|S_IWUGO, , ),
-//	__ATTR_NULL,
-//};
+static struct device_attribute motor_attrs_duty = 
+	__ATTR(duty_ns, S_IRUGO|S_IWUSR, motor_duty_show, motor_duty_store);
+
+static struct device_attribute motor_attrs_period = 
+	__ATTR(period_ns, S_IRUGO|S_IWUSR, motor_period_show, motor_period_store);
+
+static struct device_attribute motor_attrs_pid = 
+	__ATTR(pid, S_IRUGO|S_IWUSR, motor_pid_show, motor_pid_store);
+
+static struct device_attribute motor_attrs_group_move = 
+	__ATTR(move, S_IWUSR, NULL, motor_group_move_store);
+
+static struct device_attribute motor_attrs_group_axes = 
+	__ATTR(axes, S_IRUGO, motor_group_axes_show, NULL);
+
+static struct device_attribute motor_attrs_group_queue = 
+	__ATTR(queue, S_IRUGO|S_IWUSR, motor_group_queue_show, motor_group_queue_store);
 
 
 /**
@@ -249,10 +610,18 @@ int motor_classdev_register(struct device *parent, struct motor_classdev *motor_
 	motor_cdev->state = MOTOR_STANDBY;
 	if (motor_cdev->ctl)
 		device_create_file(motor_cdev->dev, &motor_attrs_ctrl);
+	if (motor_cdev->getstart)
+		device_create_file(motor_cdev->dev, &motor_attrs_start);
 	if((motor_cdev->setspeed) && (motor_cdev->getspeed))
 		device_create_file(motor_cdev->dev, &motor_attrs_speed);
 	if((motor_cdev->setpos) && (motor_cdev->getpos))
 		device_create_file(motor_cdev->dev, &motor_attrs_pos);
+	if((motor_cdev->setduty) && (motor_cdev->getduty))
+		device_create_file(motor_cdev->dev, &motor_attrs_duty);
+	if((motor_cdev->setperiod) && (motor_cdev->getperiod))
+		device_create_file(motor_cdev->dev, &motor_attrs_period);
+	if((motor_cdev->setpid) && (motor_cdev->getpid))
+		device_create_file(motor_cdev->dev, &motor_attrs_pid);
 	printk(KERN_DEBUG "Registered motor device: %s\n",
 			motor_cdev->name);
 	return 0;
@@ -273,6 +642,131 @@ void motor_classdev_unregister(struct motor_classdev *motor_cdev)
 }
 EXPORT_SYMBOL_GPL(motor_classdev_unregister);
 
+/**
+ * motor_fire_register - add an engine to the class fire attribute
+ * @mf: fire callback of the engine
+ */
+int motor_fire_register(struct motor_fire *mf)
+{
+	if(mf->fire == NULL)
+		return -EINVAL;
+	mutex_lock(&motor_lock);
+	list_add_tail(&mf->node, &motor_fire_list);
+	mutex_unlock(&motor_lock);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(motor_fire_register);
+
+void motor_fire_unregister(struct motor_fire *mf)
+{
+	mutex_lock(&motor_lock);
+	list_del(&mf->node);
+	mutex_unlock(&motor_lock);
+}
+EXPORT_SYMBOL_GPL(motor_fire_unregister);
+
+/**
+ * motor_estop_register - add an engine to the e-stop
+ * @me: kill callback of the engine
+ *
+ * An engine registered while the e-stop is latched is killed right away.
+ */
+int motor_estop_register(struct motor_estop *me)
+{
+	unsigned long flags;
+
+	if(me->kill == NULL)
+		return -EINVAL;
+	spin_lock_irqsave(&motor_estop_lock, flags);
+	list_add_tail(&me->node, &motor_estop_list);
+	motor_estop_stats.hooks++;
+	if(motor_estopped())
+		me->kill(me);
+	spin_unlock_irqrestore(&motor_estop_lock, flags);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(motor_estop_register);
+
+void motor_estop_unregister(struct motor_estop *me)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&motor_estop_lock, flags);
+	list_del(&me->node);
+	motor_estop_stats.hooks--;
+	spin_unlock_irqrestore(&motor_estop_lock, flags);
+}
+EXPORT_SYMBOL_GPL(motor_estop_unregister);
+
+/**
+ * motor_estop - stop every motor now and latch
+ *
+ * Any context. The latch is up before the first engine is killed, so a
+ * start racing with the stop is refused or killed with the rest. A step
+ * timer handler calling this must not restart its timer.
+ */
+void motor_estop(void)
+{
+	struct motor_estop *me;
+	unsigned long flags;
+	ktime_t start = ktime_get();
+	unsigned int ns;
+
+	atomic_set(&motor_estop_latched, 1);
+	smp_mb();
+	spin_lock_irqsave(&motor_estop_lock, flags);
+	list_for_each_entry(me, &motor_estop_list, node)
+		me->kill(me);
+	ns = (unsigned int)ktime_to_ns(ktime_sub(ktime_get(), start));
+	motor_estop_stats.estops++;
+	motor_estop_stats.stop_ns_last = ns;
+	if(ns > motor_estop_stats.stop_ns_max)
+		motor_estop_stats.stop_ns_max = ns;
+	spin_unlock_irqrestore(&motor_estop_lock, flags);
+}
+EXPORT_SYMBOL_GPL(motor_estop);
+
+/* motors stay stopped, they can be started again */
+void motor_estop_release(void)
+{
+	atomic_set(&motor_estop_latched, 0);
+}
+EXPORT_SYMBOL_GPL(motor_estop_release);
+
+/**
+ * motor_group_register - register a group of motors moved together
+ * @parent: The device to register.
+ * @grp: the group, with cdev, axes and move filled in by the driver.
+ *
+ * The axes stay registered motors of their own.
+ */
+int motor_group_register(struct device *parent, struct motor_group *grp)
+{
+	int ret;
+
+	if((grp->move == NULL) || (grp->naxes == 0) || (grp->naxes > MOTOR_GROUP_MAX_AXES))
+		return -EINVAL;
+	ret = motor_classdev_register(parent, &grp->cdev);
+	if(ret)
+		return ret;
+	device_create_file(grp->cdev.dev, &motor_attrs_group_move);
+	device_create_file(grp->cdev.dev, &motor_attrs_group_axes);
+	if(grp->queue)
+		device_create_file(grp->cdev.dev, &motor_attrs_group_queue);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(motor_group_register);
+
+/*
+ * Removes the group device only; the driver stops the group first, and
+ * unregisters the axes after.
+ */
+void motor_group_unregister(struct motor_group *grp)
+{
+	motor_classdev_unregister(&grp->cdev);
+}
+EXPORT_SYMBOL_GPL(motor_group_unregister);
+
 
 static int motor_suspend(struct device *dev, pm_message_t state)
 {
@@ -302,6 +796,7 @@ static int __init motor_init(void)
 {
 	int result = 0;
 
+	motor_class.class_attrs = motor_class_class_attrs;
 	result = class_register(&motor_class);
 	if (result) 
 	{
@@ -0,0 +1,270 @@
+/*
+ * 	motor_thread_sim.c
+ *
+ * Copyright (C) 2015 Eric Hsiao <erichsiao815@gmail.com>
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ *
+ * Step jitter and cpu use of the two step engine backends ("thread-sim").
+ * N simulated coil steppers run on hrtimers of their own and N more are
+ * threaded, stepped by the engine thread; a run moves one set for run_ms
+ * and takes its numbers from the step engine statistics:
+ *
+ *	run   : write "timer" or "thread"
+ *	stats : per backend, the steps, how late they were taken, the cpu
+ *		time spent stepping (step handlers, or the engine thread from
+ *		wakeup to sleep) and the wakeups it took
+ *
+ * Neither cpu time counts the interrupt entry or the context switch
+ * around it. With the thread parameter of the step engine set, both sets
+ * are threaded.
+ *
+ *	modprobe motor_thread_sim motors=8 pps=2000
+ *	echo timer > /sys/class/thread-sim/run
+ *	echo thread > /sys/class/thread-sim/run
+ *	cat /sys/class/thread-sim/stats
+ */
+
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/device.h>
+#include <linux/delay.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/motor_stepper.h>
+#include <asm/div64.h>
+
+
+#define MOTOR_NAME		"thread-sim"
+
+#define THREAD_SIM_MAX_MOTORS	64
+
+enum {
+	THREAD_SIM_TIMER,
+	THREAD_SIM_THREAD,
+	THREAD_SIM_MODES,
+};
+
+static const char * const thread_sim_modes[THREAD_SIM_MODES] = {
+	[THREAD_SIM_TIMER]	= "timer",
+	[THREAD_SIM_THREAD]	= "thread",
+};
+
+static unsigned int motors = 4;
+module_param(motors, uint, S_IRUGO);
+MODULE_PARM_DESC(motors, "simulated steppers per backend");
+
+static unsigned int pps = 2000;
+module_param(pps, uint, S_IRUGO);
+MODULE_PARM_DESC(pps, "step rate");
+
+static unsigned int write_ns;
+module_param(write_ns, uint, S_IRUGO);
+MODULE_PARM_DESC(write_ns, "time a coil write takes");
+
+static unsigned int run_ms = 2000;
+module_param(run_ms, uint, S_IRUGO);
+MODULE_PARM_DESC(run_ms, "length of a run");
+
+struct thread_sim_result {
+	unsigned long	steps;
+	unsigned long	late_samples;
+	u64		late_ns;
+	unsigned int	late_ns_max;
+	u64		cpu_ns;
+	unsigned long	wakeups;
+};
+
+static struct motor_stepper *thread_sim_steppers[THREAD_SIM_MODES];
+static struct thread_sim_result thread_sim_results[THREAD_SIM_MODES];
+static DEFINE_MUTEX(thread_sim_lock);
+
+static void thread_sim_set_phase_mask(struct motor_stepper *stp, unsigned int mask)
+{
+	if(write_ns)
+		ndelay(write_ns);
+}
+
+static const struct motor_stepper_ops thread_sim_ops = {
+	.set_phase_mask	= thread_sim_set_phase_mask,
+};
+
+/* called with thread_sim_lock held */
+static void thread_sim_round(unsigned int mode)
+{
+	struct thread_sim_result *r = &thread_sim_results[mode];
+	struct motor_stepper *stp = thread_sim_steppers[mode];
+	struct motor_stepper_engine_stats es;
+	unsigned int i;
+
+	for(i = 0; i < motors; i++)
+		memset(&stp[i].stats, 0, sizeof(stp[i].stats));
+	motor_stepper_engine_stats(&es, true);
+	for(i = 0; i < motors; i++)
+		motor_stepper_move(&stp[i], MOTOR_STEPPER_CONTINUOUS);
+	msleep(run_ms);
+	for(i = 0; i < motors; i++)
+		motor_stepper_stop(&stp[i]);
+
+	memset(r, 0, sizeof(*r));
+	for(i = 0; i < motors; i++)
+	{
+		r->steps += stp[i].stats.steps;
+		r->late_samples += stp[i].stats.late_samples;
+		r->late_ns += stp[i].stats.late_ns;
+		r->late_ns_max = max(r->late_ns_max, stp[i].stats.late_ns_max);
+		r->cpu_ns += stp[i].stats.step_ns;
+	}
+	r->wakeups = r->steps;		// one expiry per step
+	if(stp[0].threaded)
+	{
+		motor_stepper_engine_stats(&es, false);
+		r->cpu_ns = es.busy_ns;
+		r->wakeups = es.wakeups;
+	}
+}
+
+static ssize_t thread_sim_run_store(struct class *class, struct class_attribute *attr,
+			const char *buf, size_t count)
+{
+	unsigned int mode;
+
+	for(mode = 0; mode < THREAD_SIM_MODES; mode++)
+		if(sysfs_streq(buf, thread_sim_modes[mode]))
+			break;
+	if(mode == THREAD_SIM_MODES)
+		return -EINVAL;
+	if(mutex_lock_interruptible(&thread_sim_lock))
+		return -ERESTARTSYS;
+	thread_sim_round(mode);
+	mutex_unlock(&thread_sim_lock);
+	return count;
+}
+
+static ssize_t thread_sim_stats_show(struct class *class, struct class_attribute *attr,
+			char *buf)
+{
+	struct thread_sim_result *r;
+	unsigned int mode;
+	ssize_t len = 0;
+	u64 avg, per_step;
+
+	mutex_lock(&thread_sim_lock);
+	for(mode = 0; mode < THREAD_SIM_MODES; mode++)
+	{
+		r = &thread_sim_results[mode];
+		avg = r->late_ns;
+		if(r->late_samples)
+			do_div(avg, r->late_samples);
+		per_step = r->cpu_ns;
+		if(r->steps)
+			do_div(per_step, r->steps);
+		len += sprintf(buf + len, "%s_steps %lu\n%s_late_ns_avg %llu\n%s_late_ns_max %u\n"
+				"%s_cpu_ns %llu\n%s_cpu_ns_per_step %llu\n%s_wakeups %lu\n",
+				thread_sim_modes[mode], r->steps,
+				thread_sim_modes[mode], (unsigned long long)avg,
+				thread_sim_modes[mode], r->late_ns_max,
+				thread_sim_modes[mode], (unsigned long long)r->cpu_ns,
+				thread_sim_modes[mode], (unsigned long long)per_step,
+				thread_sim_modes[mode], r->wakeups);
+	}
+	mutex_unlock(&thread_sim_lock);
+	return len;
+}
+
+static struct class_attribute thread_sim_class_attr[] =
+{
+	__ATTR(run, S_IWUSR, NULL, thread_sim_run_store),
+	__ATTR(stats, S_IRUGO, thread_sim_stats_show, NULL),
+	__ATTR_NULL,
+};
+
+static struct class thread_sim_class =
+{
+	.name = MOTOR_NAME,
+	.owner = THIS_MODULE,
+	.class_attrs = (struct class_attribute *) &thread_sim_class_attr,
+};
+
+static void thread_sim_release(unsigned int mode, unsigned int n)
+{
+	while(n--)
+		motor_stepper_release(&thread_sim_steppers[mode][n]);
+	kfree(thread_sim_steppers[mode]);
+}
+
+static int thread_sim_setup(unsigned int mode)
+{
+	struct motor_stepper *stp;
+	unsigned int i;
+	int status;
+
+	thread_sim_steppers[mode] = kcalloc(motors, sizeof(struct motor_stepper), GFP_KERNEL);
+	if(thread_sim_steppers[mode] == NULL)
+		return -ENOMEM;
+	for(i = 0; i < motors; i++)
+	{
+		stp = &thread_sim_steppers[mode][i];
+		stp->cdev.name = MOTOR_NAME;
+		stp->ops = &thread_sim_ops;
+		stp->mode = MOTOR_STEPPER_HALF_STEP;
+		stp->pps = pps;
+		stp->start_delay = ktime_set(0, 0);
+		stp->threaded = (mode == THREAD_SIM_THREAD);
+		status = motor_stepper_init(stp);
+		if(status)
+		{
+			thread_sim_release(mode, i);
+			return status;
+		}
+	}
+	return 0;
+}
+
+static int thread_sim_init(void)
+{
+	int status;
+
+	if((motors == 0) || (motors > THREAD_SIM_MAX_MOTORS) || (pps == 0) ||
+		(pps > MOTOR_STEPPER_MAX_PPS) || (write_ns >= NSEC_PER_SEC / pps) || (run_ms == 0))
+		return -EINVAL;
+	status = thread_sim_setup(THREAD_SIM_TIMER);
+	if(status)
+		return status;
+	status = thread_sim_setup(THREAD_SIM_THREAD);
+	if(status)
+	{
+		thread_sim_release(THREAD_SIM_TIMER, motors);
+		return status;
+	}
+
+	status = class_register(&thread_sim_class);
+	if (status < 0)
+	{
+		printk("Registering Class Failed\n");
+		thread_sim_release(THREAD_SIM_THREAD, motors);
+		thread_sim_release(THREAD_SIM_TIMER, motors);
+		return status;
+	}
+	return 0;
+}
+
+static void thread_sim_exit(void)
+{
+	class_unregister(&thread_sim_class);
+	thread_sim_release(THREAD_SIM_THREAD, motors);
+	thread_sim_release(THREAD_SIM_TIMER, motors);
+	printk(" GoodBye, %s\n",MOTOR_NAME);
+}
+
+module_init( thread_sim_init);
+module_exit( thread_sim_exit);
+
+MODULE_AUTHOR("Eric Hsiao, erichsiao815@gmail.com");
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("step jitter and cpu use, hrtimer against engine thread stepping");
@@ -0,0 +1,358 @@
+/*
+ * 	motor_trigger.c
+ *
+ * Copyright (C) 2015 Eric Hsiao <erichsiao815@gmail.com>
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ *
+ * Edge triggers for motor class devices. A motor binds one edge source
+ * through its trigger attribute, a gpio interrupt or a simulated line,
+ * and the edge either starts a preloaded move or stops the motor from
+ * the interrupt handler itself:
+ *
+ *	gpio <pin> rising|falling|both start|stop
+ *	sim <line> rising|falling|both start|stop
+ *	move <steps>		preloaded move of a start trigger
+ *	off			unbind
+ *	reset			clear the stats
+ *
+ * The latency is taken from the edge to the first step of the move, as
+ * reported by the owner through motor_trigger_account(). For a gpio the
+ * edge is timed on entry to the handler, so the interrupt entry itself is
+ * not in it; a simulated edge is timed when it was due, so the timer
+ * latency is.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/init.h>
+#include <linux/device.h>
+#include <linux/gpio.h>
+#include <linux/interrupt.h>
+#include <linux/spinlock.h>
+#include <linux/ktime.h>
+#include <linux/motor_trigger.h>
+#include <asm/div64.h>
+
+
+static struct list_head motor_trigger_sim[MOTOR_TRIGGER_SIM_LINES];
+static DEFINE_SPINLOCK(motor_trigger_sim_lock);
+
+static void _motor_trigger_edge(struct motor_trigger *trig, ktime_t at)
+{
+	trig->stats.edges++;
+	if(trig->action == MOTOR_TRIGGER_STOP)
+	{
+		trig->ops->stop(trig);
+		trig->stats.stops++;
+		return;
+	}
+	trig->edge_time = at;
+	if(trig->ops->start(trig))
+		trig->stats.missed++;
+	else
+		trig->stats.starts++;
+}
+
+static irqreturn_t motor_trigger_irq(int irq, void *dev_id)
+{
+	struct motor_trigger *trig = dev_id;
+
+	if(ACCESS_ONCE(trig->irq) == irq)	// not before a rebind is done
+		_motor_trigger_edge(trig, ktime_get());
+	return IRQ_HANDLED;
+}
+
+/**
+ * motor_trigger_account - the first step of a triggered move went out
+ * @trig: the trigger
+ * @stepped: when, CLOCK_MONOTONIC
+ *
+ * Called by the owner, from any context.
+ */
+void motor_trigger_account(struct motor_trigger *trig, ktime_t stepped)
+{
+	s64 latency = ktime_to_ns(ktime_sub(stepped, trig->edge_time));
+
+	if(latency < 0)
+		latency = 0;
+	trig->stats.latency_samples++;
+	trig->stats.latency_ns += latency;
+	trig->stats.latency_ns_last = (unsigned int)latency;
+	if(latency > trig->stats.latency_ns_max)
+		trig->stats.latency_ns_max = (unsigned int)latency;
+}
+EXPORT_SYMBOL_GPL(motor_trigger_account);
+
+/**
+ * motor_trigger_sim_edge - an edge on a simulated line
+ * @line: 0 to MOTOR_TRIGGER_SIM_LINES - 1
+ * @rising: rising or falling edge
+ * @at: when the edge happened, the latency is taken from it
+ *
+ * Serves every trigger bound to the line, like its interrupt would.
+ * Any context, hard irq for a faithful latency (motor_trigger_sim).
+ */
+void motor_trigger_sim_edge(unsigned int line, bool rising, ktime_t at)
+{
+	struct motor_trigger *trig;
+	unsigned int edge = rising ? MOTOR_TRIGGER_RISING : MOTOR_TRIGGER_FALLING;
+	unsigned long flags;
+
+	if(line >= MOTOR_TRIGGER_SIM_LINES)
+		return;
+	spin_lock_irqsave(&motor_trigger_sim_lock, flags);
+	list_for_each_entry(trig, &motor_trigger_sim[line], node)
+	{
+		if(trig->edge & edge)
+			_motor_trigger_edge(trig, at);
+	}
+	spin_unlock_irqrestore(&motor_trigger_sim_lock, flags);
+}
+EXPORT_SYMBOL_GPL(motor_trigger_sim_edge);
+
+/* called with trig->lock held */
+static void _motor_trigger_unbind(struct motor_trigger *trig)
+{
+	unsigned long flags;
+
+	if(trig->gpio >= 0)
+	{
+		free_irq(trig->irq, trig);
+		gpio_free(trig->gpio);
+		trig->irq = -1;
+		trig->gpio = -1;
+	}
+	if(trig->sim_line >= 0)
+	{
+		spin_lock_irqsave(&motor_trigger_sim_lock, flags);
+		list_del_init(&trig->node);
+		spin_unlock_irqrestore(&motor_trigger_sim_lock, flags);
+		trig->sim_line = -1;
+	}
+}
+
+/*
+ * Called with trig->lock held. The binding so far stays until the new
+ * line is requested; a rebind of the same line only changes its edges.
+ */
+static int _motor_trigger_bind_gpio(struct motor_trigger *trig, unsigned gpio,
+		unsigned int edges, enum motor_trigger_action action)
+{
+	unsigned long irqflags = 0;
+	int irq;
+	int ret;
+
+	if(edges & MOTOR_TRIGGER_RISING)
+		irqflags |= IRQF_TRIGGER_RISING;
+	if(edges & MOTOR_TRIGGER_FALLING)
+		irqflags |= IRQF_TRIGGER_FALLING;
+	if(trig->gpio == gpio)
+	{
+		disable_irq(trig->irq);
+		ret = irq_set_irq_type(trig->irq, irqflags);
+		if(!ret)
+		{
+			trig->edge = edges;
+			trig->action = action;
+		}
+		enable_irq(trig->irq);
+		return ret;
+	}
+
+	ret = gpio_request_one(gpio, GPIOF_IN, "motor trigger");
+	if(ret)
+		return ret;
+	irq = gpio_to_irq(gpio);
+	ret = irq < 0 ? irq : request_irq(irq, motor_trigger_irq, irqflags, trig->cdev->name, trig);
+	if(ret)
+	{
+		gpio_free(gpio);
+		return ret;
+	}
+	_motor_trigger_unbind(trig);
+	trig->edge = edges;
+	trig->action = action;
+	trig->gpio = gpio;
+	smp_wmb();		// edge and action before the handler serves the line
+	ACCESS_ONCE(trig->irq) = irq;
+	return 0;
+}
+
+/* called with trig->lock held, the binding so far stays on a bad line */
+static int _motor_trigger_bind_sim(struct motor_trigger *trig, unsigned int line,
+		unsigned int edges, enum motor_trigger_action action)
+{
+	unsigned long flags;
+
+	if(line >= MOTOR_TRIGGER_SIM_LINES)
+		return -EINVAL;
+	if(trig->sim_line != line)
+		_motor_trigger_unbind(trig);
+	spin_lock_irqsave(&motor_trigger_sim_lock, flags);
+	trig->edge = edges;
+	trig->action = action;
+	if(trig->sim_line != line)
+		list_add_tail(&trig->node, &motor_trigger_sim[line]);
+	trig->sim_line = line;
+	spin_unlock_irqrestore(&motor_trigger_sim_lock, flags);
+	return 0;
+}
+
+static ssize_t motor_trigger_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct motor_classdev *motor_cdev = dev_get_drvdata(dev);
+	struct motor_trigger *trig = motor_cdev->trigger;
+	u64 avg = trig->stats.latency_ns;
+	ssize_t len;
+
+	if(trig->stats.latency_samples)
+		do_div(avg, trig->stats.latency_samples);
+	mutex_lock(&trig->lock);
+	if(trig->gpio >= 0)
+		len = sprintf(buf, "source gpio %d\n", trig->gpio);
+	else if(trig->sim_line >= 0)
+		len = sprintf(buf, "source sim %d\n", trig->sim_line);
+	else
+		len = sprintf(buf, "source none\n");
+	len += sprintf(buf + len, "edge %s\naction %s\nmove %d\n",
+			(trig->edge == (MOTOR_TRIGGER_RISING | MOTOR_TRIGGER_FALLING)) ? "both" :
+			(trig->edge == MOTOR_TRIGGER_FALLING) ? "falling" : "rising",
+			(trig->action == MOTOR_TRIGGER_STOP) ? "stop" : "start",
+			trig->steps);
+	mutex_unlock(&trig->lock);
+	len += sprintf(buf + len, "edges %lu\nstarts %lu\nstops %lu\nmissed %lu\n"
+			"latency_ns_last %u\nlatency_ns_avg %llu\nlatency_ns_max %u\n",
+			trig->stats.edges, trig->stats.starts, trig->stats.stops,
+			trig->stats.missed, trig->stats.latency_ns_last,
+			(unsigned long long)avg, trig->stats.latency_ns_max);
+	return len;
+}
+
+static ssize_t motor_trigger_store(struct device *dev, struct device_attribute *attr,
+			const char *buf, size_t count)
+{
+	struct motor_classdev *motor_cdev = dev_get_drvdata(dev);
+	struct motor_trigger *trig = motor_cdev->trigger;
+	char src[8], edge[8], action[8];
+	enum motor_trigger_action act;
+	unsigned int edges;
+	unsigned int n;
+	int steps;
+	int ret = 0;
+
+	if(!strncmp(buf, "reset", 5))
+	{
+		memset(&trig->stats, 0, sizeof(trig->stats));
+		return count;
+	}
+
+	mutex_lock(&trig->lock);
+	if(sscanf(buf, "move %d", &steps) == 1)
+	{
+		trig->steps = steps;
+	}
+	else if(!strncmp(buf, "off", 3))
+	{
+		_motor_trigger_unbind(trig);
+	}
+	else if(sscanf(buf, "%7s %u %7s %7s", src, &n, edge, action) == 4)
+	{
+		if(!strcmp(edge, "rising"))
+			edges = MOTOR_TRIGGER_RISING;
+		else if(!strcmp(edge, "falling"))
+			edges = MOTOR_TRIGGER_FALLING;
+		else if(!strcmp(edge, "both"))
+			edges = MOTOR_TRIGGER_RISING | MOTOR_TRIGGER_FALLING;
+		else
+			edges = 0;
+
+		act = strcmp(action, "stop") ? MOTOR_TRIGGER_START : MOTOR_TRIGGER_STOP;
+		if((edges == 0) || (strcmp(action, "start") && strcmp(action, "stop")))
+			ret = -EINVAL;
+		else if(!strcmp(src, "gpio"))
+			ret = _motor_trigger_bind_gpio(trig, n, edges, act);
+		else if(!strcmp(src, "sim"))
+			ret = _motor_trigger_bind_sim(trig, n, edges, act);
+		else
+			ret = -EINVAL;
+	}
+	else
+		ret = -EINVAL;
+
+	if(!ret && trig->ops->load)
+		trig->ops->load(trig);
+	mutex_unlock(&trig->lock);
+	return ret < 0 ? ret : count;
+}
+
+static struct device_attribute motor_trigger_attrs =
+	__ATTR(trigger, S_IRUGO|S_IWUSR, motor_trigger_show, motor_trigger_store);
+
+/**
+ * motor_trigger_register - give a motor a trigger attribute
+ * @cdev: the motor
+ * @trig: the trigger, ops set
+ *
+ * The trigger starts unbound; cdev->trigger points to @trig.
+ */
+int motor_trigger_register(struct motor_classdev *cdev, struct motor_trigger *trig)
+{
+	int ret;
+
+	if((trig->ops == NULL) || (trig->ops->start == NULL) || (trig->ops->stop == NULL))
+		return -EINVAL;
+	mutex_init(&trig->lock);
+	INIT_LIST_HEAD(&trig->node);
+	trig->cdev = cdev;
+	trig->gpio = -1;
+	trig->irq = -1;
+	trig->sim_line = -1;
+	trig->edge = MOTOR_TRIGGER_RISING;
+	trig->action = MOTOR_TRIGGER_START;
+	trig->steps = 0;
+	memset(&trig->stats, 0, sizeof(trig->stats));
+
+	ret = device_create_file(cdev->dev, &motor_trigger_attrs);
+	if(ret)
+		return ret;
+	cdev->trigger = trig;
+	return 0;
+}
+EXPORT_SYMBOL_GPL(motor_trigger_register);
+
+/* unbinds, no edge is served once this returns */
+void motor_trigger_unregister(struct motor_trigger *trig)
+{
+	device_remove_file(trig->cdev->dev, &motor_trigger_attrs);
+	mutex_lock(&trig->lock);
+	_motor_trigger_unbind(trig);
+	mutex_unlock(&trig->lock);
+	trig->cdev->trigger = NULL;
+}
+EXPORT_SYMBOL_GPL(motor_trigger_unregister);
+
+static int __init motor_trigger_init(void)
+{
+	int i;
+
+	for(i = 0; i < MOTOR_TRIGGER_SIM_LINES; i++)
+		INIT_LIST_HEAD(&motor_trigger_sim[i]);
+	return 0;
+}
+
+static void __exit motor_trigger_exit(void)
+{
+}
+
+subsys_initcall(motor_trigger_init);
+module_exit(motor_trigger_exit);
+
+MODULE_AUTHOR("Eric Hsiao, erichsiao815@gmail.com");
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("gpio edge triggers for motors");
@@ -0,0 +1,212 @@
+/*
+ * 	motor_trigger_sim.c
+ *
+ * Copyright (C) 2015 Eric Hsiao <erichsiao815@gmail.com>
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ *
+ * Simulated trigger input ("trigger-sim") for the motor edge triggers,
+ * no sensor needed. Pulses on a sim line are raised from a hrtimer, in
+ * hard irq context like a gpio interrupt, and every edge is timed when
+ * it was due, so the trigger latency of the motors bound to the line
+ * includes the interrupt latency:
+ *
+ *	pulse  : write a line to raise one pulse on it now
+ *	period : write "<line> <usec>" for a pulse every usec, 0 stops
+ *	stats  : pulses raised and how late the timer raised them
+ *
+ *	modprobe motor_trigger_sim
+ *	echo "sim 0 rising start" > /sys/class/motor/<name>/trigger
+ *	echo "move 200" > /sys/class/motor/<name>/trigger
+ *	echo "0 500000" > /sys/class/trigger-sim/period
+ *	cat /sys/class/motor/<name>/trigger
+ */
+
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/device.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/mutex.h>
+#include <linux/motor_trigger.h>
+#include <asm/div64.h>
+
+
+#define MOTOR_NAME		"trigger-sim"
+
+static unsigned int width_us = 100;
+module_param(width_us, uint, S_IRUGO);
+MODULE_PARM_DESC(width_us, "high time of a pulse");
+
+static struct hrtimer trigger_sim_timer;
+static DEFINE_MUTEX(trigger_sim_lock);
+static unsigned int trigger_sim_line;
+static unsigned long trigger_sim_period_us;	// 0 single pulse
+static ktime_t trigger_sim_rise;		// due time of the current pulse
+static bool trigger_sim_high;
+
+/* timer side only */
+static unsigned long trigger_sim_pulses;
+static unsigned long trigger_sim_late_samples;
+static u64 trigger_sim_late_ns;
+static unsigned int trigger_sim_late_ns_max;
+
+static enum hrtimer_restart trigger_sim_handler(struct hrtimer *timer)
+{
+	ktime_t due = hrtimer_get_expires(timer);
+	s64 late = ktime_to_ns(ktime_sub(ktime_get(), due));
+
+	trigger_sim_high = !trigger_sim_high;
+	motor_trigger_sim_edge(trigger_sim_line, trigger_sim_high, due);
+
+	if(late < 0)
+		late = 0;
+	trigger_sim_late_samples++;
+	trigger_sim_late_ns += late;
+	if(late > trigger_sim_late_ns_max)
+		trigger_sim_late_ns_max = (unsigned int)late;
+
+	if(trigger_sim_high)
+	{
+		trigger_sim_pulses++;
+		hrtimer_set_expires(timer, ktime_add_ns(due, (u64)width_us * NSEC_PER_USEC));
+		return HRTIMER_RESTART;
+	}
+	if(trigger_sim_period_us == 0)
+		return HRTIMER_NORESTART;
+	trigger_sim_rise = ktime_add_ns(trigger_sim_rise, (u64)trigger_sim_period_us * NSEC_PER_USEC);
+	hrtimer_set_expires(timer, trigger_sim_rise);
+	return HRTIMER_RESTART;
+}
+
+/* called with trigger_sim_lock held, a falling edge ends a pulse in flight */
+static void trigger_sim_start(unsigned int line, unsigned long period_us)
+{
+	hrtimer_cancel(&trigger_sim_timer);
+	if(trigger_sim_high)
+		motor_trigger_sim_edge(trigger_sim_line, false, ktime_get());
+	trigger_sim_high = false;
+	trigger_sim_line = line;
+	trigger_sim_period_us = period_us;
+	trigger_sim_rise = ktime_get();
+	hrtimer_start(&trigger_sim_timer, trigger_sim_rise, HRTIMER_MODE_ABS);
+}
+
+static ssize_t trigger_sim_pulse_store(struct class *class, struct class_attribute *attr,
+			const char *buf, size_t count)
+{
+	unsigned int line;
+
+	if((sscanf(buf, "%u", &line) != 1) || (line >= MOTOR_TRIGGER_SIM_LINES))
+		return -EINVAL;
+	mutex_lock(&trigger_sim_lock);
+	trigger_sim_start(line, 0);
+	mutex_unlock(&trigger_sim_lock);
+	return count;
+}
+
+static ssize_t trigger_sim_period_show(struct class *class, struct class_attribute *attr,
+			char *buf)
+{
+	return sprintf(buf, "%u %lu\n", trigger_sim_line, trigger_sim_period_us);
+}
+
+static ssize_t trigger_sim_period_store(struct class *class, struct class_attribute *attr,
+			const char *buf, size_t count)
+{
+	unsigned int line = 0;
+	unsigned long period_us = 0;
+	int n = sscanf(buf, "%u %lu", &line, &period_us);
+
+	if((n == 1) && (line == 0))
+	{	// "0" stops
+		mutex_lock(&trigger_sim_lock);
+		trigger_sim_period_us = 0;
+		mutex_unlock(&trigger_sim_lock);
+		return count;
+	}
+	if((n != 2) || (line >= MOTOR_TRIGGER_SIM_LINES) ||
+		((period_us != 0) && (period_us <= width_us)))
+		return -EINVAL;
+
+	mutex_lock(&trigger_sim_lock);
+	if(period_us)
+		trigger_sim_start(line, period_us);
+	else
+		trigger_sim_period_us = 0;
+	mutex_unlock(&trigger_sim_lock);
+	return count;
+}
+
+static ssize_t trigger_sim_stats_show(struct class *class, struct class_attribute *attr,
+			char *buf)
+{
+	u64 avg = trigger_sim_late_ns;
+
+	if(trigger_sim_late_samples)
+		do_div(avg, trigger_sim_late_samples);
+	return sprintf(buf, "pulses %lu\nedge_late_ns_avg %llu\nedge_late_ns_max %u\n",
+			trigger_sim_pulses, (unsigned long long)avg, trigger_sim_late_ns_max);
+}
+
+static ssize_t trigger_sim_stats_store(struct class *class, struct class_attribute *attr,
+			const char *buf, size_t count)
+{
+	trigger_sim_pulses = 0;
+	trigger_sim_late_samples = 0;
+	trigger_sim_late_ns = 0;
+	trigger_sim_late_ns_max = 0;
+	return count;
+}
+
+static struct class_attribute trigger_sim_class_attr[] =
+{
+	__ATTR(pulse, S_IWUSR, NULL, trigger_sim_pulse_store),
+	__ATTR(period, S_IRUGO| S_IWUSR, trigger_sim_period_show, trigger_sim_period_store),
+	__ATTR(stats, S_IRUGO| S_IWUSR, trigger_sim_stats_show, trigger_sim_stats_store),
+	__ATTR_NULL,
+};
+
+static struct class trigger_sim_class =
+{
+	.name = MOTOR_NAME,
+	.owner = THIS_MODULE,
+	.class_attrs = (struct class_attribute *) &trigger_sim_class_attr,
+};
+
+static int trigger_sim_init(void)
+{
+	int status;
+
+	if(width_us == 0)
+		return -EINVAL;
+	hrtimer_init(&trigger_sim_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	trigger_sim_timer.function = trigger_sim_handler;
+
+	status = class_register(&trigger_sim_class);
+	if (status < 0)
+	{
+		printk("Registering Class Failed\n");
+		return status;
+	}
+	return 0;
+}
+
+static void trigger_sim_exit(void)
+{
+	class_unregister(&trigger_sim_class);
+	hrtimer_cancel(&trigger_sim_timer);
+	printk(" GoodBye, %s\n",MOTOR_NAME);
+}
+
+module_init( trigger_sim_init);
+module_exit( trigger_sim_exit);
+
+MODULE_AUTHOR("Eric Hsiao, erichsiao815@gmail.com");
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("simulated trigger input for motor edge triggers");
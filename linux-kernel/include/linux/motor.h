@@ -17,6 +17,8 @@
 #include <linux/spinlock.h>
 #include <linux/rwsem.h>
 #include <linux/timer.h>
+#include <linux/ktime.h>
+#include <linux/atomic.h>
 
 
 #define ABS(X) ((X) < 0 ? (-1 * (X)) : (X))
@@ -45,6 +47,32 @@ enum motor_state {
 	MOTOR_HOLD,		// exciting and braking
 };
 
+/* parameters of the closed loop, "name value" in the pid attribute */
+enum motor_pid_param {
+	MOTOR_PID_ENABLE,		// 1 runs the loop
+	MOTOR_PID_TARGET,		// velocity setpoint, counts per second
+	MOTOR_PID_KP,			// gains, 1/1000 duty ppm per count/s, per loop
+	MOTOR_PID_KI,
+	MOTOR_PID_KD,
+	MOTOR_PID_OUT_MIN,		// duty limits in ppm of the period, < 0 runs backward
+	MOTOR_PID_OUT_MAX,
+	MOTOR_PID_PERIOD,		// loop period, ns
+	MOTOR_PID_OUTPUT,		// read only from here on, writing one clears the stats
+	MOTOR_PID_VELOCITY,
+	MOTOR_PID_LOOPS,
+	MOTOR_PID_OVERRUNS,
+	MOTOR_PID_SATURATED,
+	MOTOR_PID_ERR_AVG,
+	MOTOR_PID_ERR_MAX,
+	MOTOR_PID_LOOP_NS_MAX,
+	MOTOR_PID_PARAM_NUM,
+};
+
+struct motor_encoder;
+struct motor_pid;
+struct motor_prog;
+struct motor_trigger;
+
 struct motor_classdev {
 	const char			*name;
 	unsigned int 			type;
@@ -55,14 +83,91 @@ struct motor_classdev {
 	struct device		*dev;
 	
 	void		(*ctl)(struct motor_classdev *motor_cdev,enum motor_state ctrl, int step);
+	/* optional: forward/backward with the first step at a CLOCK_MONOTONIC time */
+	int		(*ctl_at)(struct motor_classdev *motor_cdev, enum motor_state ctrl, int step, ktime_t at);
+	ktime_t		(*getstart)(struct motor_classdev *motor_cdev);	// first step of the last move
+	/* optional: hold a forward/backward move for the next fire, MOTOR_STANDBY disarms */
+	int		(*arm)(struct motor_classdev *motor_cdev, enum motor_state ctrl, int step);
 	enum motor_state	(*getstate)(struct motor_classdev *led_cdev);
 	void		(*setspeed)(struct motor_classdev *motor_cdev,unsigned int speed);		//unit of dc is duty, stepper is pps/ppm
 	unsigned int		(*getspeed)(struct motor_classdev *motor_cdev);
 	void		(*setpos)(struct motor_classdev *motor_cdev,unsigned int pos);	
 	unsigned int		(*getpos)(struct motor_classdev *motor_cdev);
+	/* dc: pwm high time and period in ns, speed is the percent view of these */
+	int		(*setduty)(struct motor_classdev *motor_cdev, unsigned long duty_ns);
+	unsigned long	(*getduty)(struct motor_classdev *motor_cdev);
+	int		(*setperiod)(struct motor_classdev *motor_cdev, unsigned long period_ns);
+	unsigned long	(*getperiod)(struct motor_classdev *motor_cdev);
+
+	int		(*setpid)(struct motor_classdev *motor_cdev, enum motor_pid_param param, long value);
+	long		(*getpid)(struct motor_classdev *motor_cdev, enum motor_pid_param param);
+
+	struct motor_encoder	*encoder;	// set by motor_encoder_register()
+	struct motor_pid	*pid;		// set by motor_pid_init()
+	struct motor_prog	*prog;		// set by motor_prog_register()
+	struct motor_trigger	*trigger;	// set by motor_trigger_register()
+};
+
+/*
+ * A group of motors moved together, e.g. the axes of an XY stage. It is a
+ * motor class device itself (type, state, ctrl and speed act on the whole
+ * group) with a move attribute taking one step delta per axis, and a
+ * queue attribute that appends a move to the path without stopping.
+ */
+#define MOTOR_GROUP_MAX_AXES	8
+
+struct motor_group {
+	struct motor_classdev	cdev;		// name and flags are set by the driver
+	unsigned int		naxes;
+	struct motor_classdev	*axis[MOTOR_GROUP_MAX_AXES];
+
+	int		(*move)(struct motor_group *grp, const int *steps);	// naxes deltas
+	int		(*queue)(struct motor_group *grp, const int *steps);	// after the queued moves
+	unsigned int	(*getspace)(struct motor_group *grp);		// moves that can be queued
 };
 
+/*
+ * Armed starts: "arm forward|backward <steps>" in ctrl leaves a move
+ * pending on a motor, and writing the class fire attribute starts all
+ * armed motors together. Every engine that can arm motors registers how
+ * to fire them; fire() returns -ENOENT when none of its motors is armed.
+ */
+struct motor_fire {
+	struct list_head	node;
+	int	(*fire)(struct motor_fire *mf, ktime_t at);	// CLOCK_MONOTONIC, 0 is now
+};
+
+int motor_fire_register(struct motor_fire *mf);
+void motor_fire_unregister(struct motor_fire *mf);
+
+/*
+ * Emergency stop: motor_estop() stops every motor of the class in one
+ * pass, from any context, and latches until motor_estop_release(); while
+ * latched no motor starts. Every engine or driver with outputs registers
+ * a kill() that cancels its timers and drops its coils and pwm outputs
+ * without sleeping, handing outputs that can only be written sleeping to
+ * their threads. Not to be called with a lock of an engine held.
+ */
+struct motor_estop {
+	struct list_head	node;
+	void	(*kill)(struct motor_estop *me);
+};
+
+extern atomic_t motor_estop_latched;
+
+static inline bool motor_estopped(void)
+{
+	return atomic_read(&motor_estop_latched) != 0;
+}
+
+int motor_estop_register(struct motor_estop *me);
+void motor_estop_unregister(struct motor_estop *me);
+void motor_estop(void);
+void motor_estop_release(void);
+
 int motor_classdev_register(struct device *parent, struct motor_classdev *motor_cdev);
 void motor_classdev_unregister(struct motor_classdev *motor_cdev);
+int motor_group_register(struct device *parent, struct motor_group *grp);
+void motor_group_unregister(struct motor_group *grp);
 
 #endif
@@ -0,0 +1,64 @@
+/*
+ * 	motor_encoder.h
+ *
+ * Copyright (C) 2015 Eric Hsiao <erichsiao815@gmail.com>
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Quadrature encoder input for motor class devices. Both edges of A and
+ * B interrupt, the decoder counts x4 from a transition table under a
+ * raw spinlock and keeps its counters in atomic64_t for the readers.
+ */
+
+#ifndef __LINUX_MOTOR_ENCODER_H_
+#define __LINUX_MOTOR_ENCODER_H_
+
+#include <linux/types.h>
+#include <linux/atomic.h>
+#include <linux/spinlock.h>
+#include <linux/motor.h>
+
+/* default velocity window */
+#define MOTOR_ENCODER_WINDOW_NS		1000000
+
+struct motor_encoder {
+	/* set by the driver */
+	unsigned		pin_a;
+	unsigned		pin_b;
+	bool			reverse;	// swap the count direction
+	bool			sim;		// no gpios, edges from motor_encoder_sim_edge()
+	unsigned int		cpr;		// counts (x4) per revolution, 0 unknown
+	unsigned long		window_ns;	// velocity window, 0 takes MOTOR_ENCODER_WINDOW_NS
+
+	/* owned by the decoder */
+	struct motor_classdev	*cdev;
+	int			irq_a;
+	int			irq_b;
+	raw_spinlock_t		irq_lock;	// pin read and state, A and B irqs
+	unsigned int		state;		// last AB
+	atomic64_t		count;
+	atomic64_t		edge_ns;	// time of the last counted edge
+	atomic64_t		edges;
+	atomic64_t		errors;		// A and B changed together, an edge was lost
+	atomic64_t		irqs;
+	unsigned int		sim_phase;
+
+	/* velocity estimator, readers only */
+	spinlock_t		lock;
+	s64			win_count;
+	s64			win_edge_ns;
+	s64			win_ns;
+	s64			velocity;	// counts per second
+};
+
+int motor_encoder_register(struct motor_classdev *cdev, struct motor_encoder *enc);
+void motor_encoder_unregister(struct motor_encoder *enc);
+s64 motor_encoder_count(struct motor_encoder *enc);
+void motor_encoder_set_count(struct motor_encoder *enc, s64 count);
+s64 motor_encoder_velocity(struct motor_encoder *enc);
+void motor_encoder_sim_edge(struct motor_encoder *enc, int dir);
+
+#endif
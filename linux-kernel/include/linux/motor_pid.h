@@ -0,0 +1,73 @@
+/*
+ * 	motor_pid.h
+ *
+ * Copyright (C) 2015 Eric Hsiao <erichsiao815@gmail.com>
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Fixed-point velocity loop for dc motors. It runs from a hrtimer,
+ * reads the motor encoder (or a driver velocity source) and writes the
+ * duty through motor_classdev setduty, so a loop costs no syscall.
+ */
+
+#ifndef __LINUX_MOTOR_PID_H_
+#define __LINUX_MOTOR_PID_H_
+
+#include <linux/types.h>
+#include <linux/spinlock.h>
+#include <linux/hrtimer.h>
+#include <linux/motor.h>
+
+#define MOTOR_PID_PERIOD_NS	1000000		// default loop period, 1 kHz
+#define MOTOR_PID_MIN_PERIOD_NS	50000
+
+/* the gains are kept in Q16.16 */
+#define MOTOR_PID_SHIFT		16
+
+/* duty ppm of 100% */
+#define MOTOR_PID_DUTY_FULL	1000000
+
+struct motor_pid_stats {
+	unsigned long	loops;
+	unsigned long	overruns;	// loop periods missed
+	unsigned long	saturated;	// loops at out_min or out_max
+	u64		err_sum;	// |target - velocity|
+	unsigned long	err_max;
+	unsigned long	loop_ns_max;
+};
+
+struct motor_pid {
+	/* set by the driver */
+	s64			(*read_velocity)(struct motor_pid *pid);	// NULL reads cdev->encoder
+	void			*priv;
+
+	/* loop */
+	struct motor_classdev	*cdev;
+	spinlock_t		lock;
+	struct hrtimer		timer;
+	bool			running;
+	unsigned long		period_ns;
+	long			target;
+	long			kp;		// 1/1000, as written to the pid attribute
+	long			ki;
+	long			kd;
+	s64			kp_q;		// Q16.16
+	s64			ki_q;
+	s64			kd_q;
+	long			out_min;
+	long			out_max;
+	long			out;
+	s64			integ;		// Q16.16 duty ppm
+	s64			velocity;
+	int			dir;		// direction last set with ctl, 0 none
+	struct motor_pid_stats	stats;
+};
+
+int motor_pid_init(struct motor_classdev *cdev, struct motor_pid *pid);
+void motor_pid_release(struct motor_pid *pid);
+void motor_pid_kill(struct motor_pid *pid);
+
+#endif
@@ -0,0 +1,123 @@
+/*
+ * 	motor_prog.h
+ *
+ * Copyright (C) 2015 Eric Hsiao <erichsiao815@gmail.com>
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Motion programs: a short bytecode uploaded to a motor or a group and
+ * run by the step engine from its own timer, so a fixed cycle (move,
+ * dwell, move back, repeat, wait for an event) needs no userspace until
+ * it ends. Programs are verified before they run and every loop in them
+ * is bounded.
+ */
+
+#ifndef __LINUX_MOTOR_PROG_H_
+#define __LINUX_MOTOR_PROG_H_
+
+#include <linux/types.h>
+#include <linux/list.h>
+#include <linux/motor.h>
+
+struct sysfs_dirent;
+
+/*
+ * A program is an array of 32 bit words: an opcode followed by its
+ * operands, naxes of them for the moves and one for the others.
+ */
+enum motor_prog_op {
+	MOTOR_PROG_END,			// end of the program
+	MOTOR_PROG_MOVE,		// relative steps per axis
+	MOTOR_PROG_MOVE_ABS,		// position per axis, from where the program started
+	MOTOR_PROG_SPEED,		// pps
+	MOTOR_PROG_DWELL,		// usec
+	MOTOR_PROG_LOOP,		// count, runs the code up to the matching NEXT
+	MOTOR_PROG_NEXT,
+	MOTOR_PROG_WAIT,		// event, consumes it
+	MOTOR_PROG_SIGNAL,		// event, wakes the programs waiting for it
+	MOTOR_PROG_OP_NUM,
+};
+
+#define MOTOR_PROG_WORDS	256		// longest program
+#define MOTOR_PROG_DEPTH	4		// nested loops
+#define MOTOR_PROG_LOOP_MAX	1000000
+#define MOTOR_PROG_MOVE_MAX	100000		// |steps| of a move, |position| of move-abs
+#define MOTOR_PROG_DWELL_MAX	60000000	// usec
+#define MOTOR_PROG_EVENTS	32
+
+/* instructions run per call before the program yields for YIELD_NS */
+#define MOTOR_PROG_BUDGET	64
+#define MOTOR_PROG_YIELD_NS	100000
+
+/* what motor_prog_run() wants from the owner */
+enum motor_prog_result {
+	MOTOR_PROG_MOVING,		// run prog->steps, then call again
+	MOTOR_PROG_SLEEP,		// call again in prog->sleep_ns
+	MOTOR_PROG_WAITING,		// ops->kick() comes when the event does
+	MOTOR_PROG_DONE,		// ended, or stopped
+};
+
+enum motor_prog_state {
+	MOTOR_PROG_IDLE,
+	MOTOR_PROG_RUNNING,
+	MOTOR_PROG_ERROR,		// did not verify
+};
+
+struct motor_prog;
+
+/*
+ * Filled by the step engine that runs the program. start takes over the
+ * motor and has motor_prog_run() called from its timer, with the motor
+ * at rest; stop ends that. setspeed is called from motor_prog_run() and
+ * kick from any context, neither may sleep.
+ */
+struct motor_prog_ops {
+	int	(*start)(struct motor_prog *prog);
+	void	(*stop)(struct motor_prog *prog);
+	void	(*setspeed)(struct motor_prog *prog, unsigned int pps);
+	void	(*kick)(struct motor_prog *prog);
+};
+
+struct motor_prog_stats {
+	unsigned long	runs;
+	unsigned long	insns;
+	unsigned long	moves;
+	unsigned long	yields;			// budget ran out
+	unsigned long	signals;
+};
+
+struct motor_prog {
+	/* set by the owner */
+	const struct motor_prog_ops	*ops;
+	unsigned int		naxes;
+
+	/* owned by the interpreter */
+	struct motor_classdev	*cdev;
+	struct sysfs_dirent	*kn;		// prog_ctl, notified at the end and on signals
+	enum motor_prog_state	state;
+	u32			code[MOTOR_PROG_WORDS];
+	unsigned int		len;		// words
+	unsigned int		err_pc;		// first bad word when verify fails
+	unsigned int		pc;
+	unsigned int		depth;
+	unsigned int		loop_pc[MOTOR_PROG_DEPTH];
+	unsigned int		loop_left[MOTOR_PROG_DEPTH];
+	int			at[MOTOR_GROUP_MAX_AXES];	// positions from the start
+	int			steps[MOTOR_GROUP_MAX_AXES];	// move for the owner
+	u64			sleep_ns;
+	int			event;		// waited for, -1 none
+	struct list_head	node;		// on the waiters list
+	struct motor_prog_stats	stats;
+};
+
+int motor_prog_register(struct motor_classdev *cdev, struct motor_prog *prog);
+void motor_prog_unregister(struct motor_prog *prog);
+int motor_prog_verify(struct motor_prog *prog);
+enum motor_prog_result motor_prog_run(struct motor_prog *prog);
+void motor_prog_abort(struct motor_prog *prog);
+void motor_prog_signal(unsigned int event);
+
+#endif
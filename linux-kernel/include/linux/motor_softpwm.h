@@ -0,0 +1,48 @@
+/*
+ * 	motor_softpwm.h
+ *
+ * Copyright (C) 2015 Eric Hsiao <erichsiao815@gmail.com>
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Software pwm on gpios for boards without a free pwm channel. All
+ * channels share one hrtimer driven by a list of their next edges,
+ * sorted by time; edges due together are written in one interrupt.
+ */
+
+#ifndef __LINUX_MOTOR_SOFTPWM_H_
+#define __LINUX_MOTOR_SOFTPWM_H_
+
+#include <linux/types.h>
+#include <linux/list.h>
+#include <linux/ktime.h>
+
+/* 20 kHz, above that the edge interrupts cost more than they are worth */
+#define MOTOR_SOFTPWM_MIN_PERIOD_NS	50000
+
+/* edges closer than this to the one being serviced are written with it */
+#define MOTOR_SOFTPWM_SLACK_NS		2000
+
+struct motor_softpwm {
+	unsigned		gpio;		// requested, non-sleeping output
+
+	/* owned by the pwm engine */
+	struct list_head	node;		// in the edge list while queued
+	bool			queued;
+	int			level;
+	unsigned long		period_ns;
+	unsigned long		duty_ns;
+	unsigned long		req_period_ns;	// taken at the next period start
+	unsigned long		req_duty_ns;
+	ktime_t			period_start;
+	ktime_t			next_edge;
+};
+
+int motor_softpwm_add(struct motor_softpwm *pwm);
+void motor_softpwm_remove(struct motor_softpwm *pwm);
+int motor_softpwm_config(struct motor_softpwm *pwm, unsigned long duty_ns, unsigned long period_ns);
+
+#endif
@@ -0,0 +1,584 @@
+/*
+ * 	motor_stepper.h
+ *
+ * Copyright (C) 2015 Eric Hsiao <erichsiao815@gmail.com>
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Shared step engine for coil-level and step/dir stepper drivers. A
+ * hardware driver only fills a struct motor_stepper_ops; the step timer,
+ * step counter, phase sequence and motor class glue live in motor_stepper.c.
+ * Steppers can be grouped so that one timer steps all their axes in sync,
+ * or follow a stream of (position, velocity, time) points or of segments
+ * from a ring that userspace fills in shared memory, or run a motion
+ * program, or start from an edge trigger. Limit switches stop a stepper
+ * from their interrupt, and home it; the class e-stop stops them all.
+ */
+
+#ifndef __LINUX_MOTOR_STEPPER_H_
+#define __LINUX_MOTOR_STEPPER_H_
+
+#include <linux/types.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/hrtimer.h>
+#include <linux/wait.h>
+#include <linux/smp.h>
+#include <linux/math64.h>
+#include <linux/motor.h>
+#include <linux/motor_prog.h>
+#include <linux/motor_trigger.h>
+
+struct task_struct;
+struct module;
+struct sysfs_dirent;
+
+/* |step| at or above this value keeps running until standby */
+#define MOTOR_STEPPER_CONTINUOUS	204000
+
+#define MOTOR_STEPPER_MAX_PPS		5000
+#define MOTOR_STEPPER_STEPDIR_MAX_PPS	50000
+
+/* step/dir defaults, enough for A4988 (1us / 200ns) and DRV8825 (1.9us / 650ns) */
+#define MOTOR_STEPPER_PULSE_NS		2000
+#define MOTOR_STEPPER_DIR_SETUP_NS	1000
+
+/* group path limits of an axis, defaults */
+#define MOTOR_STEPPER_ACCEL		2000	// steps/s^2
+#define MOTOR_STEPPER_JUMP_PPS		200	// speed change taken at once
+
+/* segments in the look-ahead queue of a group, power of 2 */
+#define MOTOR_STEPPER_PLAN		16
+
+/* pvt stream: points buffered per stepper (power of 2), longest point */
+#define MOTOR_STEPPER_PVT		64
+#define MOTOR_STEPPER_PVT_MAX_DT_NS	100000000
+#define MOTOR_STEPPER_PVT_LEAD_NS	10000000	// queued time before a stream starts
+#define MOTOR_STEPPER_PVT_IDLE_NS	500000		// timer period with no step in sight
+
+/* segment ring shared with userspace: entries (power of 2), poll period when dry */
+#define MOTOR_STEPPER_RING		128
+#define MOTOR_STEPPER_RING_IDLE_NS	1000000
+
+/* limit switches, bits of stp->limits; limit_pin[0] is min, [1] max */
+#define MOTOR_STEPPER_LIMIT_MIN		(1 << 0)
+#define MOTOR_STEPPER_LIMIT_MAX		(1 << 1)
+
+/* homing defaults: back-off from the switch, longest seek */
+#define MOTOR_STEPPER_HOME_BACKOFF	32
+#define MOTOR_STEPPER_HOME_TRAVEL	100000
+
+/* shortest step/dir move handed to a pulse train */
+#define MOTOR_STEPPER_OFFLOAD_MIN	32
+
+/* steps buffered for the output thread of sleeping coils, power of 2 */
+#define MOTOR_STEPPER_QUEUE		16
+
+/* coil bits of the phase mask passed to set_phase_mask() */
+#define MOTOR_COIL_A		(1 << 0)
+#define MOTOR_COIL_B		(1 << 1)
+#define MOTOR_COIL_AN		(1 << 2)
+#define MOTOR_COIL_BN		(1 << 3)
+
+/* what drives the step timer besides single moves */
+enum motor_stepper_stream {
+	MOTOR_STEPPER_STREAM_NONE,
+	MOTOR_STEPPER_STREAM_PVT,	// motor_stepper_pvt_push()
+	MOTOR_STEPPER_STREAM_RING,	// the mmap'd segment ring
+	MOTOR_STEPPER_STREAM_PROG,	// a motion program
+};
+
+/*
+ * What a single move does when its step timer expires a step period or
+ * more after it was due, instead of silently skipping the missed steps.
+ */
+enum motor_stepper_overrun_policy {
+	MOTOR_STEPPER_OVERRUN_LOG,	// count, log (ratelimited) and skip the missed steps
+	MOTOR_STEPPER_OVERRUN_CATCHUP,	// back onto the schedule, at most CATCHUP_PCT of the rate
+	MOTOR_STEPPER_OVERRUN_DERATE,	// lower the speed ceiling to DERATE_PCT of the rate
+	MOTOR_STEPPER_OVERRUN_STOP,	// end the move, flag a fault on the overrun attribute
+};
+
+#define MOTOR_STEPPER_CATCHUP_PCT	150
+#define MOTOR_STEPPER_DERATE_PCT	75
+
+enum motor_stepper_mode {
+	MOTOR_STEPPER_FULL_STEP,	// 2-phase, 4 steps per electrical cycle
+	MOTOR_STEPPER_HALF_STEP,	// 1-2 phase, 8 steps per electrical cycle
+	MOTOR_STEPPER_STEP_DIR,		// external controller, one pulse per (micro)step
+};
+
+/*
+ * Absolute step schedule of a move: step n is due at base + n * 1s / pps
+ * on CLOCK_MONOTONIC, however late the expiries before it were, so the
+ * timing error never adds up. base moves ahead a whole second every pps
+ * steps to keep n small, and to the step in hand when the rate changes.
+ */
+struct motor_stepper_sched {
+	ktime_t		base;
+	unsigned int	n;
+	unsigned int	pps;		// 0 not started
+};
+
+static inline void motor_stepper_sched_start(struct motor_stepper_sched *s,
+		ktime_t at, unsigned int pps)
+{
+	s->base = at;
+	s->n = 0;
+	s->pps = pps;
+}
+
+static inline ktime_t motor_stepper_sched_due(const struct motor_stepper_sched *s)
+{
+	return ktime_add_ns(s->base, div_u64((u64)s->n * NSEC_PER_SEC, s->pps));
+}
+
+/* on to the next step at pps, returns its deadline */
+static inline ktime_t motor_stepper_sched_next(struct motor_stepper_sched *s, unsigned int pps)
+{
+	if(pps != s->pps)
+		motor_stepper_sched_start(s, motor_stepper_sched_due(s), pps);
+	if(++s->n >= s->pps)
+	{
+		s->base = ktime_add_ns(s->base, NSEC_PER_SEC);
+		s->n -= s->pps;
+	}
+	return motor_stepper_sched_due(s);
+}
+
+struct motor_stepper;
+struct motor_stepper_port;
+struct motor_stepper_group;
+
+/*
+ * set_phase_mask is called from the step timer (hard irq context) and must
+ * not sleep, unless stp->cansleep is set. stp->phase still holds the
+ * previously written mask during the call, so drivers can update only the
+ * coils that changed.
+ * enable / disable are optional and called when the coils leave and
+ * return to the released (0) state.
+ * None of them are used for a stepper whose coils live on a port. For a
+ * threaded stepper all three are called from the engine thread and may
+ * sleep.
+ *
+ * A MOTOR_STEPPER_STEP_DIR stepper fills set_step and set_dir instead of
+ * set_phase_mask; both are called from the step timer and must not sleep.
+ * The timer fires on every edge: set_step(1) starts a pulse, set_step(0)
+ * ends it pulse_ns later, and set_dir() is followed by dir_setup_ns of
+ * low time before the next pulse. enable / disable bracket every move.
+ *
+ * train_start / train_stop are optional for step/dir: a move of at least
+ * offload_min steps is then emitted by a hardware pulse train at the
+ * constant step rate, and the step timer only fires once to stop it.
+ * train_start returns 0 and the period the hardware really runs at;
+ * train_stop returns the pulses emitted, or a negative value if unknown.
+ * Both are called from the step timer and must not sleep.
+ */
+struct motor_stepper_ops {
+	void	(*set_phase_mask)(struct motor_stepper *stp, unsigned int mask);
+	int	(*enable)(struct motor_stepper *stp);
+	void	(*disable)(struct motor_stepper *stp);
+	void	(*set_step)(struct motor_stepper *stp, int level);
+	void	(*set_dir)(struct motor_stepper *stp, int dir);	// 1 forward, -1 backward
+	int	(*train_start)(struct motor_stepper *stp, unsigned long period_ns,
+			unsigned long *actual_ns);
+	long	(*train_stop)(struct motor_stepper *stp);
+};
+
+struct motor_stepper_stats {
+	unsigned long	steps;
+	u64		step_ns;		// total time spent in the step handler
+	unsigned int	step_ns_max;
+	unsigned long	late_samples;
+	u64		late_ns;		// coil write time after the step deadline
+	unsigned int	late_ns_max;
+	unsigned long	dropped;		// steps lost on a full output queue
+	unsigned long	offloads;		// pulse trains started
+	unsigned long	offload_steps;		// steps emitted by pulse trains
+	unsigned long	offload_miscount;	// |emitted - estimated| when the train reports
+	unsigned long	timed_starts;		// moves started by motor_stepper_move_at() or a fire
+	s64		start_late_ns;		// first step after the requested time, last one
+	unsigned int	start_late_ns_max;
+	unsigned long	fired;			// armed moves started by motor_stepper_fire()
+	unsigned int	fire_skew_ns;		// first step after the first motor's, last fire
+	unsigned int	fire_skew_ns_max;
+	unsigned long	limit_stops;		// moves stopped by a switch or a soft limit
+	unsigned long	overruns;		// expiries a step period or more late
+	unsigned long	overrun_periods;	// step periods missed by them
+	unsigned int	overrun_max;		// most periods missed at once
+	unsigned long	catchup_steps;		// steps taken early to make up for them
+	unsigned long	derates;		// speed ceiling lowered
+	unsigned long	overrun_stops;		// moves ended by an overrun
+	unsigned long	cmds_posted;		// commands put in the mailbox
+	unsigned long	cmds_taken;		// commands taken by the step timer
+	unsigned long	cmd_retries;		// takes repeated over a post in progress
+};
+
+/*
+ * Command mailbox between process context and the step timer of a single
+ * move. A writer builds the whole command in the slot the timer is not
+ * reading and flips seq to it behind a write barrier; at its next step the
+ * timer copies the latest one out between read barriers, with no lock,
+ * and copies again if seq moved meanwhile. Only writers serialize, on
+ * lock, which the timer never takes. A new target bumps pos_seq, so that
+ * a command re-posted with only a new rate does not restart the move, and
+ * a new rate bumps pps_seq, so that one carried along with a later target
+ * does not undo a rate set directly since.
+ */
+struct motor_stepper_cmd {
+	int		pos;		// remaining steps, sign is direction
+	unsigned int	pos_seq;	// of the target
+	unsigned int	pps;
+	unsigned int	pps_seq;	// of the rate
+};
+
+struct motor_stepper_mbox {
+	struct motor_stepper_cmd	slot[2];
+	unsigned int	seq;		// slot[seq & 1] is the latest
+	spinlock_t	lock;		// writers
+	struct motor_stepper_cmd	next;	// writer side, the command to post
+	unsigned int	taken;		// timer side, seq of the last command taken
+	unsigned int	pos_seen;	// under stp->lock, targets up to here taken or void
+	unsigned int	pos_taken;	// under stp->lock, targets up to here applied
+	unsigned int	pps_seen;	// under stp->lock, rates up to here applied or superseded
+};
+
+/* a trajectory point, dt_ns after the previous one */
+struct motor_stepper_pvt_point {
+	int		pos;		// steps from the start of the stream
+	int		vel;		// steps/s
+	unsigned int	dt_ns;
+};
+
+struct motor_stepper_pvt_stats {
+	unsigned long	points;
+	unsigned long	underruns;		// queue ran dry while moving
+	unsigned long	steps;
+	unsigned int	err_max;		// |interpolated - stepped| in millisteps
+};
+
+/*
+ * A pvt stream moves a stepper through queued (position, velocity, time)
+ * points. Between two points the position is a cubic Hermite curve of the
+ * virtual time of the stream, which only runs while there are points to
+ * follow: when the queue runs dry the motor holds the last point and the
+ * clock stops, and it goes on from there with the next point. Positions
+ * are in Q16 steps, the curve parameter u in Q16 of the segment.
+ */
+struct motor_stepper_pvt {
+	struct motor_stepper_pvt_point	q[MOTOR_STEPPER_PVT];
+	unsigned int	head;			// next free
+	unsigned int	tail;			// next to run
+	int		p0;			// steps at the start of the segment
+	int		p1;			// at its end
+	int		v1;			// steps/s at its end
+	s64		a;			// p(u) = p0 + ((a u + b) u + c) u
+	s64		b;
+	s64		c;
+	s64		t0;			// virtual ns at the start of the segment
+	unsigned int	t;			// its length
+	s64		t_end;			// virtual ns of the last queued point
+	int		end_pos;		// and its position
+	ktime_t		vbase;			// step timer time of virtual 0
+	int		pos;			// steps taken
+	struct motor_stepper_pvt_stats	stats;
+};
+
+/*
+ * The segment ring is one page mapped by userspace through the ring
+ * attribute. Userspace fills desc[head % MOTOR_STEPPER_RING] and then
+ * stores head + 1 with release semantics; the step timer reads head,
+ * copies the descriptor out behind a read barrier and stores tail + 1
+ * after a full barrier as it starts the segment. Both indices run freely
+ * and wrap at 2^32.
+ * A segment takes |steps| steps, with the rate going from start_pps to
+ * end_pps at a constant acceleration. The kernel checks every descriptor
+ * and stops the motor with status MOTOR_STEPPER_RING_ERROR on a bad one;
+ * status is only a copy for userspace, the kernel keeps its own.
+ */
+#define MOTOR_STEPPER_RING_WAKE		(1 << 0)	// wake pollers when the segment ends
+#define MOTOR_STEPPER_RING_HOLD		(1 << 1)	// keep the coils energized if the ring runs dry after it
+
+enum motor_stepper_ring_status {
+	MOTOR_STEPPER_RING_IDLE,
+	MOTOR_STEPPER_RING_RUNNING,
+	MOTOR_STEPPER_RING_ERROR,
+};
+
+struct motor_stepper_ring_desc {
+	s32		steps;			// negative is backward
+	u32		start_pps;
+	u32		end_pps;
+	u32		flags;
+};
+
+struct motor_stepper_ring {
+	u32		head;			// written by userspace
+	u32		tail;			// written by the step timer
+	u32		size;			// MOTOR_STEPPER_RING
+	u32		status;
+	u32		pad[12];
+	struct motor_stepper_ring_desc	desc[MOTOR_STEPPER_RING];
+};
+
+struct motor_stepper_ring_stats {
+	unsigned long	segments;
+	unsigned long	underruns;		// ran dry short of a stop
+	unsigned long	wakeups;		// pollers notified
+};
+
+/*
+ * An output port is a bank of pins written in one bus transaction, e.g. an
+ * i2c gpio expander or a chain of shift registers. The steppers on a port
+ * are stepped by one SCHED_FIFO thread every tick_ns; the coil masks of all
+ * channels due in that tick are merged into one frame and flushed with a
+ * single write(), which may sleep. value is the whole frame as a bitmap of
+ * width pins, changed marks the pins that differ from the last write.
+ */
+struct motor_stepper_port_ops {
+	int	(*write)(struct motor_stepper_port *port, const unsigned long *value,
+			const unsigned long *changed);
+};
+
+struct motor_stepper_port_stats {
+	unsigned long	ticks;
+	unsigned long	updates;		// channel steps merged into a flush
+	unsigned long	flushes;		// bus transactions issued
+	u64		flush_ns;
+	unsigned int	flush_ns_max;
+};
+
+/*
+ * Threaded steppers (stp->threaded, or every coil stepper off a port with
+ * the thread parameter) are not stepped by a hrtimer of their own but by
+ * the engine thread, one SCHED_FIFO thread that sleeps until the earliest
+ * deadline of all of them and steps every one that is due. Their coils are
+ * written from that thread and may sleep; like on a port, they only take
+ * single moves.
+ */
+struct motor_stepper_engine_stats {
+	unsigned long	wakeups;
+	unsigned long	steps;
+	u64		busy_ns;		// wakeup to sleep, all wakeups
+	unsigned int	busy_ns_max;
+};
+
+struct motor_stepper_port {
+	const char		*name;
+	struct module		*owner;
+	const struct motor_stepper_port_ops	*ops;
+	unsigned long		tick_ns;	// 0 is 1 msec
+	unsigned int		width;		// pins, 0 is BITS_PER_LONG
+	void			*priv;
+
+	/* owned by the step engine */
+	struct list_head	node;
+	struct list_head	channels;
+	spinlock_t		lock;
+	struct mutex		io_lock;
+	struct task_struct	*thread;
+	unsigned long		flags;
+	unsigned int		words;
+	unsigned long		*value;		// pins as last written
+	unsigned long		*frame;		// frame being composed
+	unsigned long		*changed;
+	struct motor_stepper_port_stats	stats;
+};
+
+struct motor_stepper {
+	struct motor_classdev	cdev;		// name, type and flags are set by the driver
+	const struct motor_stepper_ops	*ops;
+	enum motor_stepper_mode	mode;
+	unsigned int		pps;
+	ktime_t			start_delay;	// delay between energizing and the first step
+	void			*priv;		// driver data
+	bool			cansleep;	// set_phase_mask may sleep
+	bool			threaded;	// stepped by the engine thread, not a timer of its own
+	struct motor_stepper_port	*port;		// coils are on a shared output port
+	unsigned int		port_pin[4];	// port pins of A, B, /A, /B, in one word
+	unsigned long		pulse_ns;	// step/dir: minimum step high time, 0 is default
+	unsigned long		dir_setup_ns;	// step/dir: dir to step setup time, 0 is default
+	unsigned int		offload_min;	// step/dir: shortest move for train_start, 0 is default
+	unsigned int		accel;		// group paths: steps/s^2, 0 is default
+	unsigned int		jump_pps;	// group paths: rate change at once, 0 is default
+	struct motor_stepper_group	*group;		// set by motor_stepper_group_register()
+	unsigned long		pvt_lead_ns;	// pvt: queued time before a stream (re)starts, 0 is default
+	unsigned		limit_pin[2];	// gpios of the min and max limit switches, 0 none
+	bool			limit_active_low;
+	int			min_pos;	// soft limits from home, once homed and if max_pos > min_pos
+	int			max_pos;
+	int			home_dir;	// switch to home on: < 0 min (default), > 0 max
+	unsigned int		home_fast_pps;	// seek, 0 is pps
+	unsigned int		home_slow_pps;	// approach, 0 is a quarter of the seek
+	unsigned int		home_backoff;	// steps, 0 is default
+	unsigned int		home_travel;	// longest seek, 0 is default
+	enum motor_stepper_overrun_policy	overrun_policy;	// also set through the overrun attribute
+
+	/* owned by the step engine */
+	spinlock_t		lock;
+	struct hrtimer		hrtimer;
+	int			cpu;		// of the step timer and output thread, -1 any
+	bool			timer_remote;	// the timer is being started on cpu
+	ktime_t			timer_at;
+	struct call_single_data	timer_csd;
+	const unsigned char	*seq;
+	unsigned int		seq_mask;
+	unsigned long		period_ns;
+	struct motor_stepper_sched	sched;	// of the single move running
+	ktime_t			step_due;	// step/dir: deadline of the next pulse
+	bool			catchup;	// behind the schedule, taking steps early
+	unsigned int		pps_ceiling;	// lowered by the derate policy, 0 none
+	bool			overrun_fault;	// a move was ended by the stop policy
+	struct sysfs_dirent	*overrun_kn;	// overrun, notified on a derate or a stop
+	int			pos;		// remaining steps, sign is direction
+	struct motor_stepper_mbox	mbox;	// targets and rates for the running move
+	bool			cmd_open;	// the step timer takes mailbox commands
+	unsigned char		seq_idx;
+	unsigned int		phase;		// last mask written to the coils
+	bool			energized;
+	bool			running;	// step timer owns the motor
+	bool			step_high;	// step/dir: inside a pulse
+	int			dir;		// step/dir: level on the dir pin, 0 unknown
+	bool			offloaded;	// step/dir: a pulse train is running
+	ktime_t			train_start;
+	unsigned long		train_period_ns;
+	int			train_steps;	// steps of the train, MOTOR_STEPPER_CONTINUOUS
+	struct task_struct	*thread;	// output thread when cansleep
+	unsigned int		q_head;
+	unsigned int		q_tail;
+	unsigned char		q_mask[MOTOR_STEPPER_QUEUE];
+	ktime_t			q_due[MOTOR_STEPPER_QUEUE];
+	struct list_head	port_node;	// on its port, or the engine thread
+	unsigned int		port_word;	// frame word holding the coil pins
+	unsigned long		port_map[16];	// phase mask to port pins
+	unsigned int		port_req;	// phase mask for the next port flush or engine thread write
+	ktime_t			next_due;	// next step on the port or engine thread clock
+	ktime_t			start_at;	// requested time of the first step, 0 none
+	ktime_t			started;	// first step of the last move, CLOCK_MONOTONIC
+	bool			start_pending;	// no step taken yet in this move
+	struct list_head	engine_node;	// on the list of all steppers, for the e-stop
+	struct list_head	arm_node;	// on the armed list
+	bool			armed;
+	int			armed_pos;	// the move a fire starts
+	bool			hold;		// stay energized at rest, a start trigger is loaded
+	bool			trig_pending;	// the move was started by the trigger
+	int			limit_irq[2];
+	unsigned int		limits;		// switches active, MOTOR_STEPPER_LIMIT_*
+	int			position;	// steps from home
+	bool			homed;
+	bool			soft_limits;	// min_pos and max_pos apply
+	bool			homing;
+	wait_queue_head_t	home_wq;	// woken when a move of the homing ends
+	enum motor_stepper_stream	stream;		// the timer follows a stream
+	struct motor_stepper_pvt	pvt;
+	struct motor_stepper_ring	*ring;		// shared page, a registered stepper with a timer
+	struct sysfs_dirent	*ring_kn;	// ring_ctl, notified for pollers
+	struct motor_stepper_ring_desc	ring_cur;	// running segment
+	unsigned int		ring_step;	// steps of it taken
+	unsigned long		ring_period_ns;
+	unsigned int		ring_low;	// wake pollers below this many queued
+	enum motor_stepper_ring_status	ring_status;	// mirrored to ring->status, never read back
+	struct motor_stepper_ring_stats	ring_stats;
+	struct motor_prog	prog;		// a registered stepper with a timer
+	struct motor_trigger	trig;		// a registered stepper with a timer
+	struct motor_stepper_stats	stats;
+};
+
+struct motor_stepper_group_stats {
+	unsigned long	ticks;			// timer expiries that stepped at least one axis
+	unsigned long	steps;			// axis steps, all axes
+	unsigned long	segments;
+	u64		tick_ns;
+	unsigned int	tick_ns_max;
+};
+
+/*
+ * A straight segment of a group path. Speeds are along the segment, in
+ * steps per second of its euclidean length.
+ */
+struct motor_stepper_segment {
+	int		steps[MOTOR_GROUP_MAX_AXES];
+	unsigned int	major;		// ticks, the longest delta
+	unsigned int	len;		// length in steps
+	unsigned int	accel;		// steps/s^2
+	unsigned int	v_nom;		// top speed, group pps within the axes max rate
+	unsigned int	v_rest;		// speed to start from or stop at rest
+	unsigned int	v_junction;	// highest speed at the corner from the previous segment
+	unsigned int	v_entry;	// planned
+	unsigned int	v_exit;		// fixed when the segment starts
+};
+
+/*
+ * A group steps its axes from one timer. A segment takes one delta per
+ * axis; the longest one sets the number of ticks, and every other axis
+ * steps on the ticks a Bresenham error term picks, so all axes move on a
+ * straight line and finish on the same tick. Segments are queued and
+ * planned ahead so that the path keeps its speed through the corners.
+ * The axes must all be coil steppers or all step/dir, and none on an
+ * output port. While the group moves, moves of single axes are ignored
+ * and stopping any axis stops the group.
+ */
+struct motor_stepper_group {
+	struct motor_group	group;		// cdev name and flags, naxes are set by the driver
+	struct motor_stepper	*axis[MOTOR_GROUP_MAX_AXES];
+	unsigned int		pps;		// path speed
+
+	/* owned by the step engine */
+	spinlock_t		lock;
+	struct hrtimer		hrtimer;
+	struct list_head	engine_node;	// on the list of all groups, for the e-stop
+	unsigned long		pulse_ns;	// step/dir: longest pulse of the axes
+	bool			step_dir;
+	bool			running;
+	bool			step_high;	// step/dir: inside the pulses of a tick
+	struct motor_stepper_segment	cur;	// running segment
+	unsigned int		tick;
+	unsigned long		tick_ns;	// period of the current tick
+	unsigned int		delta[MOTOR_GROUP_MAX_AXES];
+	int			err[MOTOR_GROUP_MAX_AXES];
+	unsigned int		stepped;	// step/dir: axes pulsed in this tick
+	struct motor_stepper_segment	plan[MOTOR_STEPPER_PLAN];
+	unsigned int		plan_head;	// next free
+	unsigned int		plan_tail;	// next to run
+	struct motor_prog	prog;
+	bool			prog_on;	// the program moves the group
+	struct motor_stepper_group_stats	stats;
+};
+
+int motor_stepper_init(struct motor_stepper *stp);
+void motor_stepper_release(struct motor_stepper *stp);
+int motor_stepper_register(struct device *parent, struct motor_stepper *stp);
+void motor_stepper_unregister(struct motor_stepper *stp);
+
+void motor_stepper_move(struct motor_stepper *stp, int step);
+int motor_stepper_move_at(struct motor_stepper *stp, int step, ktime_t at);
+int motor_stepper_arm(struct motor_stepper *stp, int step);
+int motor_stepper_fire(ktime_t at);
+int motor_stepper_home(struct motor_stepper *stp);
+void motor_stepper_stop(struct motor_stepper *stp);
+void motor_stepper_setspeed(struct motor_stepper *stp, unsigned int pps);
+int motor_stepper_set_cpu(struct motor_stepper *stp, int cpu);
+void motor_stepper_engine_stats(struct motor_stepper_engine_stats *st, bool reset);
+ktime_t motor_stepper_sim_step(struct motor_stepper *stp, ktime_t start, ktime_t now);
+int motor_stepper_pvt_push(struct motor_stepper *stp, int pos, int vel, unsigned int dt_ns);
+int motor_stepper_ring_start(struct motor_stepper *stp);
+
+int motor_stepper_port_register(struct motor_stepper_port *port);
+void motor_stepper_port_unregister(struct motor_stepper_port *port);
+struct motor_stepper_port *motor_stepper_port_get(const char *name);
+void motor_stepper_port_put(struct motor_stepper_port *port);
+int motor_stepper_remaining(struct motor_stepper *stp);
+
+int motor_stepper_group_register(struct device *parent, struct motor_stepper_group *sg);
+void motor_stepper_group_unregister(struct motor_stepper_group *sg);
+int motor_stepper_group_move(struct motor_stepper_group *sg, const int *steps);
+int motor_stepper_group_queue(struct motor_stepper_group *sg, const int *steps);
+unsigned int motor_stepper_group_space(struct motor_stepper_group *sg);
+void motor_stepper_group_stop(struct motor_stepper_group *sg);
+void motor_stepper_group_setspeed(struct motor_stepper_group *sg, unsigned int pps);
+
+#endif
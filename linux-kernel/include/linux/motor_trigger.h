@@ -0,0 +1,91 @@
+/*
+ * 	motor_trigger.h
+ *
+ * Copyright (C) 2015 Eric Hsiao <erichsiao815@gmail.com>
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Edge triggers for motor class devices: a gpio edge (or one of the
+ * simulated lines of motor_trigger_sim) starts a preloaded move or stops
+ * the motor right from the interrupt, without a trip through userspace.
+ */
+
+#ifndef __LINUX_MOTOR_TRIGGER_H_
+#define __LINUX_MOTOR_TRIGGER_H_
+
+#include <linux/types.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/motor.h>
+
+#define MOTOR_TRIGGER_RISING		(1 << 0)
+#define MOTOR_TRIGGER_FALLING		(1 << 1)
+
+/* lines of motor_trigger_sim_edge() */
+#define MOTOR_TRIGGER_SIM_LINES		8
+
+enum motor_trigger_action {
+	MOTOR_TRIGGER_START,		// the preloaded move
+	MOTOR_TRIGGER_STOP,
+};
+
+struct motor_trigger;
+
+/*
+ * Filled by the owner of the motor. start and stop are called from the
+ * edge interrupt and must neither sleep nor wait on another cpu, as in
+ * hrtimer_cancel(); start returns -EBUSY while the motor is moving and
+ * calls motor_trigger_account() once the first step is out.
+ * load is called in process context whenever the binding or the preloaded
+ * move changes, e.g. to hold the motor energized for a fast start.
+ */
+struct motor_trigger_ops {
+	int	(*start)(struct motor_trigger *trig);
+	void	(*stop)(struct motor_trigger *trig);
+	void	(*load)(struct motor_trigger *trig);
+};
+
+struct motor_trigger_stats {
+	unsigned long	edges;
+	unsigned long	starts;
+	unsigned long	stops;
+	unsigned long	missed;			// start edges while the motor was busy
+	unsigned long	latency_samples;
+	u64		latency_ns;		// edge to first step
+	unsigned int	latency_ns_last;
+	unsigned int	latency_ns_max;
+};
+
+struct motor_trigger {
+	/* set by the owner */
+	const struct motor_trigger_ops	*ops;
+
+	/* bound through the trigger attribute */
+	struct motor_classdev	*cdev;
+	struct mutex		lock;		// binding changes
+	int			gpio;		// -1 none
+	int			irq;
+	int			sim_line;	// -1 none
+	struct list_head	node;		// on the sim line
+	unsigned int		edge;		// MOTOR_TRIGGER_RISING | FALLING
+	enum motor_trigger_action	action;
+	int			steps;		// preloaded move, negative is backward
+	ktime_t			edge_time;	// of the edge being served
+	struct motor_trigger_stats	stats;
+};
+
+static inline bool motor_trigger_bound(struct motor_trigger *trig)
+{
+	return (trig->gpio >= 0) || (trig->sim_line >= 0);
+}
+
+int motor_trigger_register(struct motor_classdev *cdev, struct motor_trigger *trig);
+void motor_trigger_unregister(struct motor_trigger *trig);
+void motor_trigger_account(struct motor_trigger *trig, ktime_t stepped);
+void motor_trigger_sim_edge(unsigned int line, bool rising, ktime_t at);
+
+#endif
@@ -0,0 +1,25 @@
+/*
+ * 	pwm_pulse_train.h
+ *
+ * Copyright (C) 2015 Eric Hsiao <erichsiao815@gmail.com>
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Step pulse trains on top of the legacy pwm api, implemented by
+ * pwm-sunxi. Used to offload constant rate step/dir motion.
+ */
+
+#ifndef __LINUX_PWM_PULSE_TRAIN_H_
+#define __LINUX_PWM_PULSE_TRAIN_H_
+
+struct pwm_device;
+
+int pwm_pulse_train(struct pwm_device *pwm, unsigned long pulse_ns, unsigned long period_ns,
+		unsigned long *actual_ns);
+unsigned long pwm_pulse_count(struct pwm_device *pwm);
+void pwm_pulse_train_stop(struct pwm_device *pwm);
+
+#endif